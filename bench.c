@@ -0,0 +1,1520 @@
+/******************************************************************************/
+/*                                                                            */
+/* Project : FAT12/16 File System                                             */
+/* File    : bench.c                                                          */
+/* Author  : Kyoungmoon Sun(msg2me@msn.com)                                   */
+/* Company : Dankook Univ. Embedded System Lab.                               */
+/* Notes   : File system benchmarks                                           */
+/* Date    : 2008/7/2                                                         */
+/*                                                                            */
+/******************************************************************************/
+
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "fat.h"
+#include "disksim.h"
+#include "diskimg.h"
+#include "disksparse.h"
+#include "diskflash.h"
+#include "diskcow.h"
+#include "threadpool.h"
+
+#define BENCH_MAX_THREADS		64
+
+/* alloc : writers appending to files of their own */
+#define ALLOC_SECTORS			65000
+#define ALLOC_SECTOR_SIZE		512
+#define ALLOC_FILE_BYTES		( 2 * 1024 * 1024 )
+#define ALLOC_WRITE_BYTES		( 16 * 1024 )
+
+/* format : largest FAT32 volume of 512 byte sectors, 2 TiB */
+#define FORMAT_SECTORS			0xFFFFFFFF
+#define FORMAT_FILE_BYTES		( 64 * 1024 * 1024 )
+
+/* limits : the 2 TiB FAT32 limit, and the smallest volume past it */
+#define LIMIT_CLUSTERS			67092481
+
+/* sector : the same volume and workload at every supported sector size */
+#define SECTOR_DISK_BYTES		( 32 * 1024 * 1024 )
+#define SECTOR_FILES			16
+#define SECTOR_FILE_BYTES		( 1024 * 1024 )
+#define SECTOR_IO_BYTES			( 64 * 1024 )
+
+/* aio : one file read back from an image file, cold, by each request engine */
+#define AIO_SECTORS				( 2 * 1024 * 1024 )		// 1 GiB, FAT32 with 4 KiB clusters
+#define AIO_FILE_BYTES			( 64 * 1024 * 1024 )
+/* device : a mixed workload charged to the disk simulator's timing models */
+#define DEVICE_SECTORS			65536		// 32 MiB of 512 byte sectors, FAT16 with 2 KiB clusters
+#define DEVICE_FILES			8
+#define DEVICE_FILE_BYTES		( 1024 * 1024 )
+#define DEVICE_IO_BYTES			( 64 * 1024 )
+#define DEVICE_RANDOM_READS		2000
+#define DEVICE_RANDOM_BYTES		4096
+/* flash : files deleted and written again on a mostly full eMMC, with and without discard */
+#define FLASH_SECTORS			131072		// 64 MiB of 512 byte sectors
+#define FLASH_FILES				48			// 3/4 of the volume
+#define FLASH_FILE_BYTES		( 1024 * 1024 )
+#define FLASH_IO_BYTES			( 64 * 1024 )
+#define FLASH_ROUNDS			400
+/* wa : files appended side by side and replaced in groups, under each allocation policy */
+#define WA_SECTORS				131072		// 64 MiB of 512 byte sectors, FAT16 with 2 KiB clusters
+#define WA_FILES				48
+#define WA_WRITERS				4			// files growing at the same time
+#define WA_FILE_BYTES			( 1024 * 1024 )
+#define WA_IO_BYTES				( 16 * 1024 )
+#define WA_ROUNDS				50
+/* snapshot : a read only snapshot mounted while the live volume is rewritten */
+#define SNAP_SECTORS			65536		// 32 MiB of 512 byte sectors, FAT16
+#define SNAP_FILES				8
+#define SNAP_FILE_BYTES			( 1024 * 1024 )
+#define SNAP_REWRITE_FILES		2			// files partly overwritten after the snapshot
+#define SNAP_REWRITE_BYTES		( 256 * 1024 )
+#define SNAP_IO_BYTES			( 64 * 1024 )
+
+#define JOURNAL_SECTORS			65536		// 32 MiB of 512 byte sectors, FAT16
+#define JOURNAL_DIRS			4
+#define JOURNAL_FILES			2000		// small files spread over the directories
+#define JOURNAL_FILE_BYTES		4096
+
+#define BATCH_SECTORS			65536		// 32 MiB of 512 byte sectors, FAT16
+#define BATCH_FILES				1000		// a bulk import into one directory
+#define BATCH_FILE_BYTES		512
+
+#define READAHEAD_SECTORS		65536		// 32 MiB of 512 byte sectors, FAT16
+#define READAHEAD_FILES			2			// read side by side like two cats
+#define READAHEAD_FILE_BYTES	( 2 * 1024 * 1024 )
+#define READAHEAD_WRITE_BYTES	( 64 * 1024 )	// written in turns, so the files alternate in runs
+#define READAHEAD_IO_BYTES		1024		// shell_cmd_cat's read size
+
+#define WRITEBACK_SECTORS		65536		// 32 MiB of 512 byte sectors, FAT16
+#define WRITEBACK_FILES			16			// log writers appending in turns
+#define WRITEBACK_APPENDS		256
+#define WRITEBACK_APPEND_BYTES	1000
+
+#define FLUSHER_SECTORS			262144		// 128 MiB of 512 byte sectors, FAT16 with a journal
+#define FLUSHER_FILES			32			// log writers appending in turns
+#define FLUSHER_APPENDS			512
+#define FLUSHER_APPEND_BYTES	4000
+#define FLUSHER_ROUND_US		200			// the writers' pace, one round of appends per this
+
+#define AIO_IO_BYTES			AIO_FILE_BYTES		// fat_read walks the chain from its start on every call
+
+typedef struct
+{
+	FAT_NODE*	root;
+	int			id;
+	UINT32		bytes;
+	UINT32		extents;
+	int			result;
+} BENCH_WRITER;
+
+double bench_now( void )
+{
+	struct timespec	now;
+
+	clock_gettime( CLOCK_MONOTONIC, &now );
+
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+void* alloc_writer( void* param )
+{
+	BENCH_WRITER*	writer = ( BENCH_WRITER* )param;
+	FAT_NODE		file;
+	char			name[16];
+	char			buffer[ALLOC_WRITE_BYTES];
+	SECTOR*			chain;
+	UINT32			offset, count;
+
+	memset( buffer, 'a' + writer->id % 26, sizeof( buffer ) );
+	sprintf( name, "W%d", writer->id );
+
+	writer->result = fat_create( writer->root, name, &file );
+	for( offset = 0; writer->result == FAT_SUCCESS && offset < writer->bytes; offset += ALLOC_WRITE_BYTES )
+	{
+		if( fat_write( &file, offset, ALLOC_WRITE_BYTES, buffer ) != ALLOC_WRITE_BYTES )
+			writer->result = FAT_ERROR;
+	}
+
+	writer->extents = 0;
+	if( read_cluster_chain( file.fs, GET_FIRST_CLUSTER( file.entry ), &chain, &count ) == FAT_SUCCESS )
+	{
+		writer->extents = count_extents( chain, count );
+		free( chain );
+	}
+	fat_remove( &file );
+
+	return NULL;
+}
+
+/* Writers append to files of their own, first through the global free list
+   only and then through per-thread magazines. The file content is never
+   read back; the figure of interest is how allocation holds up as writers
+   are added, and how contiguous each writer's file stays. Write-behind is
+   off, so every append allocates its own clusters through the allocator
+   being measured. */
+int bench_alloc( int maxThreads )
+{
+	DISK_OPERATIONS	disk;
+	FAT_FILESYSTEM	fs;
+	FAT_NODE		root;
+	BENCH_WRITER	writers[BENCH_MAX_THREADS];
+	pthread_t		threads[BENCH_MAX_THREADS];
+	DWORD			modes[2] = { FAT_MOUNT_NO_MAGAZINES, 0 };
+	char*			modeNames[2] = { "global", "magazine" };
+	UINT32			clusterSize, extents, mode;
+	int				count, i, failed;
+	double			start, seconds;
+
+	if( disksim_init( ALLOC_SECTORS, ALLOC_SECTOR_SIZE, &disk ) < 0 )
+		return -1;
+	if( fat_format( &disk, FAT16, 0, 0 ) )
+		return -1;
+
+	printf( "\n%-9s %7s %10s %14s %16s\n", "allocator", "writers", "MB/s", "clusters/s", "extents/file" );
+
+	for( mode = 0; mode < 2; mode++ )
+	{
+		for( count = 1; count <= maxThreads; count *= 2 )
+		{
+			ZeroMemory( &fs, sizeof( FAT_FILESYSTEM ) );
+			fs.disk			= &disk;
+			fs.mountFlags	= modes[mode] | FAT_MOUNT_NO_WRITE_BEHIND;
+			if( fat_read_superblock( &fs, &root ) )
+				return -1;
+
+			clusterSize = fs.bpb.bytesPerSector * fs.bpb.sectorsPerCluster;
+
+			start = bench_now( );
+			for( i = 0; i < count; i++ )
+			{
+				writers[i].root		= &root;
+				writers[i].id		= i;
+				writers[i].bytes	= ALLOC_FILE_BYTES;
+				pthread_create( &threads[i], NULL, alloc_writer, &writers[i] );
+			}
+
+			for( i = 0, failed = 0, extents = 0; i < count; i++ )
+			{
+				pthread_join( threads[i], NULL );
+				failed |= writers[i].result;
+				extents += writers[i].extents;
+			}
+			seconds = bench_now( ) - start;
+
+			printf( "%-9s %7d %10.1lf %14.0lf %16.1lf%s\n", modeNames[mode], count,
+					count * ( double )ALLOC_FILE_BYTES / seconds / ( 1024 * 1024 ),
+					count * ( double )( ALLOC_FILE_BYTES / clusterSize ) / seconds,
+					( double )extents / count, ( failed ? "  (failed)" : "" ) );
+
+			fat_umount( &fs );
+		}
+	}
+
+	disksim_uninit( &disk );
+
+	return 0;
+}
+
+/* the FAT type the shell would pick, from the size in 512 byte sectors */
+BYTE bench_fat_type( SECTOR sectors, UINT32 bytesPerSector )
+{
+	QWORD	size = ( QWORD )sectors * ( bytesPerSector / 512 );
+
+	return ( size <= 8400 ? FAT12 : ( size <= 66600 ? FAT16 : FAT32 ) );
+}
+
+long bench_resident_kb( void )
+{
+	FILE*	file = fopen( "/proc/self/statm", "r" );
+	long	size = 0, resident = 0;
+
+	if( file )
+	{
+		if( fscanf( file, "%ld %ld", &size, &resident ) != 2 )
+			resident = 0;
+		fclose( file );
+	}
+
+	return resident * ( sysconf( _SC_PAGESIZE ) / 1024 );
+}
+
+/* Full and quick format, mount, a large sequential write, fsck and umount
+   of one big volume, with the memory the image has taken after each step.
+   The default size is the FAT32 limit for 512 byte sectors. */
+int bench_format( SECTOR sectors, int threads, int sparse )
+{
+	DISK_OPERATIONS	disk;
+	FAT_FILESYSTEM	fs;
+	FAT_NODE		root, file;
+	FAT_FSCK_REPORT	report;
+	DWORD			flags[2] = { 0, FAT_FORMAT_QUICK };
+	char*			flagNames[2] = { "full format", "quick format" };
+	char*			buffer;
+	UINT32			offset, mode;
+	double			start;
+	BYTE			FATType;
+
+	FATType = bench_fat_type( sectors, 512 );
+
+	if( ( sparse ? disksparse_init( sectors, 512, &disk ) : disksim_init( sectors, 512, &disk ) ) < 0 )
+	{
+		printf( "cannot create a disk of %u sectors\n", sectors );
+		return -1;
+	}
+
+	printf( "\n%u sectors (%.2lf GiB), %u threads, %s disk\n", sectors, sectors / 2097152.0, ( threads ? ( UINT32 )threads : thread_pool_cpu_count( ) ),
+			( sparse ? "sparse" : "mmap" ) );
+	printf( "%-14s %10s %12s\n", "step", "seconds", "resident MB" );
+
+	for( mode = 0; mode < 2; mode++ )
+	{
+		start = bench_now( );
+		if( fat_format( &disk, FATType, flags[mode], threads ) )
+			return -1;
+		printf( "%-14s %10.3lf %12ld\n", flagNames[mode], bench_now( ) - start, bench_resident_kb( ) / 1024 );
+	}
+
+	ZeroMemory( &fs, sizeof( FAT_FILESYSTEM ) );
+	fs.disk = &disk;
+
+	start = bench_now( );
+	if( fat_read_superblock( &fs, &root ) )
+		return -1;
+	printf( "%-14s %10.3lf %12ld\n", "mount", bench_now( ) - start, bench_resident_kb( ) / 1024 );
+
+	buffer = ( char* )malloc( ALLOC_WRITE_BYTES );
+	memset( buffer, 'f', ALLOC_WRITE_BYTES );
+
+	start = bench_now( );
+	if( fat_create( &root, "BIG", &file ) )
+		return -1;
+	for( offset = 0; offset < FORMAT_FILE_BYTES; offset += ALLOC_WRITE_BYTES )
+	{
+		if( fat_write( &file, offset, ALLOC_WRITE_BYTES, buffer ) != ALLOC_WRITE_BYTES )
+			return -1;
+	}
+	printf( "%-14s %10.3lf %12ld\n", "write 64 MiB", bench_now( ) - start, bench_resident_kb( ) / 1024 );
+	free( buffer );
+
+	start = bench_now( );
+	fat_fsck( &root, threads, &report, NULL, NULL );
+	printf( "%-14s %10.3lf %12ld  %s\n", "fsck", bench_now( ) - start, bench_resident_kb( ) / 1024,
+			( report.crossLinks || report.badChains || report.sizeMismatches || report.lostChains ? "errors" : "clean" ) );
+
+	start = bench_now( );
+	fat_umount( &fs );
+	printf( "%-14s %10.3lf\n", "umount", bench_now( ) - start );
+
+	printf( "clusters %u of %u sectors, FAT %u sectors\n", fs.countOfClusters, fs.bpb.sectorsPerCluster, fs.FATSize );
+
+	if( sparse )
+	{
+		printf( "sparse chunks  %.1lf MiB\n", disksparse_allocated( &disk ) / ( 1024.0 * 1024.0 ) );
+		disksparse_uninit( &disk );
+	}
+	else
+		disksim_uninit( &disk );
+
+	return 0;
+}
+
+/* The test of the 2 TiB limit. The largest volume of 512 byte sectors must
+   format as FAT32 with 64 sectors per cluster, mount and check clean; one
+   sector of 1024 bytes more is past the last row of the FAT32 table and the
+   format must fail. Returns 0 only when both hold. */
+int bench_limits( void )
+{
+	SECTOR			sectors[2] = { FORMAT_SECTORS, FORMAT_SECTORS / 2 + 1 };
+	UINT32			bytesPerSector[2] = { 512, 1024 };
+	char*			caseNames[2] = { "at the limit", "one past it" };
+	DISK_OPERATIONS	disk;
+	FAT_FILESYSTEM	fs;
+	FAT_NODE		root;
+	FAT_FSCK_REPORT	report;
+	UINT32			i;
+	int				result, failed = 0;
+
+	for( i = 0; i < 2; i++ )
+	{
+		if( disksparse_init( sectors[i], bytesPerSector[i], &disk ) < 0 )
+		{
+			printf( "cannot create a disk of %u sectors\n", sectors[i] );
+			return -1;
+		}
+
+		result = fat_format( &disk, bench_fat_type( sectors[i], bytesPerSector[i] ), FAT_FORMAT_QUICK, 0 );
+		if( i == 1 )
+		{
+			printf( "%-13s %u x %u  format %s\n", caseNames[i], sectors[i], bytesPerSector[i], ( result ? "refused" : "FAILED, accepted" ) );
+			failed |= ( result == 0 );
+			disksparse_uninit( &disk );
+			continue;
+		}
+
+		ZeroMemory( &fs, sizeof( FAT_FILESYSTEM ) );
+		fs.disk = &disk;
+		if( result || fat_read_superblock( &fs, &root ) )
+		{
+			printf( "%-13s %u x %u  FAILED to format and mount\n", caseNames[i], sectors[i], bytesPerSector[i] );
+			disksparse_uninit( &disk );
+			return -1;
+		}
+
+		fat_fsck( &root, 0, &report, NULL, NULL );
+		fat_umount( &fs );
+
+		result = ( fs.FATType == FAT32 && fs.bpb.sectorsPerCluster == 64 && fs.countOfClusters == LIMIT_CLUSTERS &&
+				   !( report.crossLinks || report.badChains || report.sizeMismatches || report.lostChains ) );
+		printf( "%-13s %u x %u  FAT%s, %u clusters of %u sectors, fsck %s  %s\n", caseNames[i], sectors[i], bytesPerSector[i],
+				( fs.FATType == FAT32 ? "32" : ( fs.FATType == FAT16 ? "16" : "12" ) ), fs.countOfClusters, fs.bpb.sectorsPerCluster,
+				( report.crossLinks || report.badChains || report.sizeMismatches || report.lostChains ? "errors" : "clean" ),
+				( result ? "ok" : "FAILED" ) );
+		failed |= !result;
+		disksparse_uninit( &disk );
+	}
+
+	return ( failed ? -1 : 0 );
+}
+
+/* Writes SECTOR_FILES files in SECTOR_IO_BYTES requests and reads them back
+   on volumes of the same size built from 512 to 4096 byte sectors. The
+   cluster size follows the format tables, so it stays the same unless a
+   cluster would be smaller than one sector. */
+int bench_sector( void )
+{
+	DISK_OPERATIONS	disk;
+	FAT_FILESYSTEM	fs;
+	FAT_NODE		root, files[SECTOR_FILES];
+	UINT32			bytesPerSector, offset, i;
+	char			name[16];
+	char*			buffer;
+	double			start, writeSeconds, readSeconds;
+	double			total = ( double )SECTOR_FILES * SECTOR_FILE_BYTES / ( 1024 * 1024 );
+
+	buffer = ( char* )malloc( SECTOR_IO_BYTES );
+	if( buffer == NULL )
+		return -1;
+	memset( buffer, 's', SECTOR_IO_BYTES );
+
+	printf( "\n%-8s %-6s %8s %10s %10s\n", "sector", "type", "cluster", "write MB/s", "read MB/s" );
+
+	for( bytesPerSector = 512; bytesPerSector <= MAX_SECTOR_SIZE; bytesPerSector *= 2 )
+	{
+		if( disksim_init( SECTOR_DISK_BYTES / bytesPerSector, bytesPerSector, &disk ) < 0 )
+			return -1;
+		if( fat_format( &disk, bench_fat_type( SECTOR_DISK_BYTES / bytesPerSector, bytesPerSector ), 0, 0 ) )
+			return -1;
+
+		ZeroMemory( &fs, sizeof( FAT_FILESYSTEM ) );
+		fs.disk = &disk;
+		if( fat_read_superblock( &fs, &root ) )
+			return -1;
+
+		start = bench_now( );
+		for( i = 0; i < SECTOR_FILES; i++ )
+		{
+			sprintf( name, "S%u", i );
+			if( fat_create( &root, name, &files[i] ) )
+				return -1;
+			for( offset = 0; offset < SECTOR_FILE_BYTES; offset += SECTOR_IO_BYTES )
+			{
+				if( fat_write( &files[i], offset, SECTOR_IO_BYTES, buffer ) != SECTOR_IO_BYTES )
+					return -1;
+			}
+		}
+		writeSeconds = bench_now( ) - start;
+
+		start = bench_now( );
+		for( i = 0; i < SECTOR_FILES; i++ )
+		{
+			for( offset = 0; offset < SECTOR_FILE_BYTES; offset += SECTOR_IO_BYTES )
+			{
+				if( fat_read( &files[i], offset, SECTOR_IO_BYTES, buffer ) != SECTOR_IO_BYTES )
+					return -1;
+			}
+		}
+		readSeconds = bench_now( ) - start;
+
+		printf( "%-8u FAT%-3d %8u %10.1lf %10.1lf\n", bytesPerSector, ( fs.FATType == FAT12 ? 12 : ( fs.FATType == FAT16 ? 16 : 32 ) ),
+				bytesPerSector * fs.bpb.sectorsPerCluster, total / writeSeconds, total / readSeconds );
+
+		fat_umount( &fs );
+		disksim_uninit( &disk );
+	}
+
+	free( buffer );
+
+	return 0;
+}
+
+double bench_device_phase( DISK_OPERATIONS* disk, QWORD* seeks )
+{
+	DISKSIM_STATS	stats;
+
+	disksim_get_stats( disk, &stats );
+	disksim_reset_stats( disk );
+	*seeks += stats.seeks;
+
+	return stats.timeNs / 1000000.0;
+}
+
+/* Writes DEVICE_FILES files side by side, reads them back in order, then
+   reads random blocks, on the HDD and the SSD model. The times are virtual:
+   what the device would have spent, not what the run took. */
+int bench_device( void )
+{
+	const DISKSIM_TIMING*	models[] = { &DISKSIM_HDD, &DISKSIM_SSD };
+	const char*				names[] = { "hdd", "ssd" };
+	DISK_OPERATIONS			disk;
+	FAT_FILESYSTEM			fs;
+	FAT_NODE				root, files[DEVICE_FILES];
+	UINT32					model, offset, i;
+	char					name[16];
+	char*					buffer;
+	double					writeMs[2], readMs[2], randomMs[2];
+	QWORD					seeks[2];
+
+	buffer = ( char* )malloc( DEVICE_IO_BYTES );
+	if( buffer == NULL )
+		return -1;
+	memset( buffer, 'd', DEVICE_IO_BYTES );
+
+	for( model = 0; model < 2; model++ )
+	{
+		if( disksim_init( DEVICE_SECTORS, 512, &disk ) < 0 )
+			return -1;
+		if( fat_format( &disk, bench_fat_type( DEVICE_SECTORS, 512 ), FAT_FORMAT_QUICK, 0 ) )
+			return -1;
+
+		ZeroMemory( &fs, sizeof( FAT_FILESYSTEM ) );
+		fs.disk = &disk;
+		if( fat_read_superblock( &fs, &root ) )
+			return -1;
+
+		disksim_set_timing( &disk, models[model] );
+		seeks[model] = 0;
+
+		// 파일들을 번갈아 늘려서 서로 섞이게 씀
+		for( i = 0; i < DEVICE_FILES; i++ )
+		{
+			sprintf( name, "D%u", i );
+			if( fat_create( &root, name, &files[i] ) )
+				return -1;
+		}
+		for( offset = 0; offset < DEVICE_FILE_BYTES; offset += DEVICE_IO_BYTES )
+		{
+			for( i = 0; i < DEVICE_FILES; i++ )
+			{
+				if( fat_write( &files[i], offset, DEVICE_IO_BYTES, buffer ) != DEVICE_IO_BYTES )
+					return -1;
+			}
+		}
+		writeMs[model] = bench_device_phase( &disk, &seeks[model] );
+
+		for( i = 0; i < DEVICE_FILES; i++ )
+		{
+			for( offset = 0; offset < DEVICE_FILE_BYTES; offset += DEVICE_IO_BYTES )
+			{
+				if( fat_read( &files[i], offset, DEVICE_IO_BYTES, buffer ) != DEVICE_IO_BYTES )
+					return -1;
+			}
+		}
+		readMs[model] = bench_device_phase( &disk, &seeks[model] );
+
+		srand( 1 );
+		for( i = 0; i < DEVICE_RANDOM_READS; i++ )
+		{
+			offset = ( UINT32 )rand( ) % ( DEVICE_FILE_BYTES / DEVICE_RANDOM_BYTES ) * DEVICE_RANDOM_BYTES;
+			if( fat_read( &files[i % DEVICE_FILES], offset, DEVICE_RANDOM_BYTES, buffer ) != DEVICE_RANDOM_BYTES )
+				return -1;
+		}
+		randomMs[model] = bench_device_phase( &disk, &seeks[model] );
+
+		disksim_set_timing( &disk, NULL );
+		fat_umount( &fs );
+		disksim_uninit( &disk );
+	}
+
+	printf( "\n%-6s %12s %12s %12s %8s\n", "model", "write ms", "read ms", "random ms", "seeks" );
+	for( model = 0; model < 2; model++ )
+		printf( "%-6s %12.1lf %12.1lf %12.1lf %8llu\n", names[model], writeMs[model], readMs[model], randomMs[model], ( unsigned long long )seeks[model] );
+
+	free( buffer );
+
+	return 0;
+}
+
+int bench_flash_file( FAT_NODE* root, UINT32 id, const char* buffer )
+{
+	FAT_NODE	file;
+	UINT32		offset;
+	char		name[16];
+
+	sprintf( name, "F%u", id );
+	if( fat_create( root, name, &file ) )
+		return -1;
+
+	for( offset = 0; offset < FLASH_FILE_BYTES; offset += FLASH_IO_BYTES )
+	{
+		if( fat_write( &file, offset, FLASH_IO_BYTES, buffer ) != FLASH_IO_BYTES )
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Fills the volume to FLASH_FILES files, then replaces a random one
+   FLASH_ROUNDS times. Without discard the FTL keeps copying the pages of
+   deleted files until the clusters are written again. */
+int bench_flash( void )
+{
+	DWORD			modes[2] = { FAT_MOUNT_NO_DISCARD, 0 };
+	const char*		names[2] = { "off", "on" };
+	DISK_OPERATIONS	disk;
+	DISKFLASH_STATS	stats[2];
+	FAT_FILESYSTEM	fs;
+	FAT_NODE		root, file;
+	UINT32			mode, i, victim;
+	char			name[16];
+	char*			buffer;
+
+	buffer = ( char* )malloc( FLASH_IO_BYTES );
+	if( buffer == NULL )
+		return -1;
+	memset( buffer, 'f', FLASH_IO_BYTES );
+
+	for( mode = 0; mode < 2; mode++ )
+	{
+		if( diskflash_init( FLASH_SECTORS, 512, &DISKFLASH_EMMC, &disk ) < 0 )
+			return -1;
+		if( fat_format( &disk, bench_fat_type( FLASH_SECTORS, 512 ), FAT_FORMAT_QUICK, 0 ) )
+			return -1;
+
+		ZeroMemory( &fs, sizeof( FAT_FILESYSTEM ) );
+		fs.disk			= &disk;
+		fs.mountFlags	= modes[mode];
+		if( fat_read_superblock( &fs, &root ) )
+			return -1;
+
+		for( i = 0; i < FLASH_FILES; i++ )
+		{
+			if( bench_flash_file( &root, i, buffer ) )
+				return -1;
+		}
+
+		// 채운 뒤부터 측정
+		diskflash_reset_stats( &disk );
+
+		srand( 1 );
+		for( i = 0; i < FLASH_ROUNDS; i++ )
+		{
+			victim = ( UINT32 )rand( ) % FLASH_FILES;
+			sprintf( name, "F%u", victim );
+			if( fat_lookup( &root, name, &file ) || fat_remove( &file ) )
+				return -1;
+			if( bench_flash_file( &root, victim, buffer ) )
+				return -1;
+		}
+
+		fat_umount( &fs );
+		diskflash_get_stats( &disk, &stats[mode] );
+		diskflash_uninit( &disk );
+	}
+
+	printf( "\n%-8s %8s %10s %10s %10s %8s %12s\n", "discard", "WA", "GC copies", "erases", "max erase", "stalls", "stall ms" );
+	for( mode = 0; mode < 2; mode++ )
+	{
+		printf( "%-8s %8.2lf %10llu %10llu %10u %8llu %12.1lf\n", names[mode],
+				( double )stats[mode].pagesProgrammed * DISKFLASH_EMMC.pageSize / stats[mode].hostBytesWritten,
+				( unsigned long long )stats[mode].gcPagesCopied, ( unsigned long long )stats[mode].erases, stats[mode].maxEraseCount,
+				( unsigned long long )stats[mode].stalls, stats[mode].stallNs / 1000000.0 );
+	}
+
+	free( buffer );
+
+	return 0;
+}
+
+/* removes files ids[0..WA_WRITERS) when they exist and writes them again,
+   appending WA_IO_BYTES to each in turn */
+int bench_wa_files( FAT_NODE* root, const UINT32* ids, const char* buffer )
+{
+	FAT_NODE	files[WA_WRITERS];
+	UINT32		offset, i;
+	char		name[16];
+
+	for( i = 0; i < WA_WRITERS; i++ )
+	{
+		sprintf( name, "W%u", ids[i] );
+		if( fat_lookup( root, name, &files[i] ) == FAT_SUCCESS && fat_remove( &files[i] ) )
+			return -1;
+		if( fat_create( root, name, &files[i] ) )
+			return -1;
+	}
+
+	for( offset = 0; offset < WA_FILE_BYTES; offset += WA_IO_BYTES )
+	{
+		for( i = 0; i < WA_WRITERS; i++ )
+		{
+			if( fat_write( &files[i], offset, WA_IO_BYTES, buffer ) != WA_IO_BYTES )
+				return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Write amplification of each allocation policy on the eMMC model. The volume
+   is filled to 3/4 by writers running side by side, then WA_ROUNDS times
+   WA_WRITERS random files are deleted and written again the same way. Once
+   with every append allocated as it comes, where the policy decides how the
+   files interleave, and once with write-behind, whose flushes take a file's
+   clusters in one run under any policy. */
+int bench_wa( void )
+{
+	/* the default mount first, then each policy choosing every cluster itself */
+	BYTE			policies[] = { FAT_ALLOC_FIRST_FIT, FAT_ALLOC_FIRST_FIT, FAT_ALLOC_NEXT_FIT, FAT_ALLOC_BEST_FIT, FAT_ALLOC_ERASE_BLOCK };
+	DWORD			flags[] = { 0, FAT_MOUNT_NO_MAGAZINES, FAT_MOUNT_NO_MAGAZINES, FAT_MOUNT_NO_MAGAZINES, FAT_MOUNT_NO_MAGAZINES };
+	const char*		names[] = { "default", "first", "next", "best", "erase" };
+	DWORD			writeModes[] = { FAT_MOUNT_NO_WRITE_BEHIND, 0 };
+	const char*		writeNames[] = { "appends written as they come", "appends buffered by write-behind" };
+	DISK_OPERATIONS	disk;
+	DISKFLASH_STATS	stats[2][5];
+	FAT_FILESYSTEM	fs;
+	FAT_NODE		root;
+	UINT32			mode, policy, round, i, ids[WA_WRITERS];
+	char*			buffer;
+
+	buffer = ( char* )malloc( WA_IO_BYTES );
+	if( buffer == NULL )
+		return -1;
+	memset( buffer, 'w', WA_IO_BYTES );
+
+	for( mode = 0; mode < 2; mode++ )
+	{
+		for( policy = 0; policy < 5; policy++ )
+		{
+			if( diskflash_init( WA_SECTORS, 512, &DISKFLASH_EMMC, &disk ) < 0 )
+				return -1;
+			if( fat_format( &disk, FAT16, FAT_FORMAT_QUICK, 0 ) )
+				return -1;
+
+			ZeroMemory( &fs, sizeof( FAT_FILESYSTEM ) );
+			fs.disk				= &disk;
+			fs.mountFlags		= flags[policy] | writeModes[mode];
+			fs.allocPolicy		= policies[policy];
+			fs.eraseBlockBytes	= DISKFLASH_EMMC.pageSize * DISKFLASH_EMMC.pagesPerBlock;
+			if( fat_read_superblock( &fs, &root ) )
+				return -1;
+
+			for( i = 0; i < WA_FILES; i++ )
+			{
+				ids[i % WA_WRITERS] = i;
+				if( i % WA_WRITERS == WA_WRITERS - 1 && bench_wa_files( &root, ids, buffer ) )
+					return -1;
+			}
+
+			diskflash_reset_stats( &disk );
+
+			srand( 1 );
+			for( round = 0; round < WA_ROUNDS; round++ )
+			{
+				// 같은 파일을 두번 고르지 않도록 연속된 번호를 씀
+				ids[0] = ( UINT32 )rand( ) % WA_FILES;
+				for( i = 1; i < WA_WRITERS; i++ )
+					ids[i] = ( ids[0] + i * ( WA_FILES / WA_WRITERS ) ) % WA_FILES;
+
+				if( bench_wa_files( &root, ids, buffer ) )
+					return -1;
+			}
+
+			fat_umount( &fs );
+			diskflash_get_stats( &disk, &stats[mode][policy] );
+			diskflash_uninit( &disk );
+		}
+	}
+
+	for( mode = 0; mode < 2; mode++ )
+	{
+		printf( "\n%s\n%-8s %8s %10s %10s %8s %12s\n", writeNames[mode], "policy", "WA", "GC copies", "erases", "stalls", "stall ms" );
+		for( policy = 0; policy < 5; policy++ )
+		{
+			printf( "%-8s %8.2lf %10llu %10llu %8llu %12.1lf\n", names[policy],
+					( double )stats[mode][policy].pagesProgrammed * DISKFLASH_EMMC.pageSize / stats[mode][policy].hostBytesWritten,
+					( unsigned long long )stats[mode][policy].gcPagesCopied, ( unsigned long long )stats[mode][policy].erases,
+					( unsigned long long )stats[mode][policy].stalls, stats[mode][policy].stallNs / 1000000.0 );
+		}
+	}
+
+	free( buffer );
+
+	return 0;
+}
+
+/* non-zero when the first bytes of file aren't all fill */
+int bench_snapshot_check( FAT_NODE* root, UINT32 id, UINT32 bytes, char fill, char* buffer )
+{
+	FAT_NODE	file;
+	UINT32		offset, i;
+	char		name[16];
+
+	sprintf( name, "S%u", id );
+	if( fat_lookup( root, name, &file ) )
+		return -1;
+
+	for( offset = 0; offset < bytes; offset += SNAP_IO_BYTES )
+	{
+		if( fat_read( &file, offset, SNAP_IO_BYTES, buffer ) != SNAP_IO_BYTES )
+			return -1;
+		for( i = 0; i < SNAP_IO_BYTES; i++ )
+		{
+			if( buffer[i] != fill )
+				return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Takes a snapshot of a volume, mounts it read only and keeps writing to the
+   live volume: the snapshot must still read the old data, and the overlay
+   must only hold the sectors written since. */
+int bench_snapshot( void )
+{
+	DISK_OPERATIONS	base, live, snapshot;
+	FAT_FILESYSTEM	fs, snapFs;
+	FAT_NODE		root, snapRoot, file;
+	FAT_FSCK_REPORT	report;
+	UINT32			i, offset;
+	QWORD			overlay;
+	double			start, snapshotUs;
+	char			name[16];
+	char*			buffer;
+
+	buffer = ( char* )malloc( SNAP_IO_BYTES );
+	if( buffer == NULL )
+		return -1;
+
+	if( disksim_init( SNAP_SECTORS, 512, &base ) < 0 || diskcow_init( &base, &live ) < 0 )
+		return -1;
+	if( fat_format( &live, FAT16, FAT_FORMAT_QUICK, 0 ) )
+		return -1;
+
+	ZeroMemory( &fs, sizeof( FAT_FILESYSTEM ) );
+	fs.disk = &live;
+	if( fat_read_superblock( &fs, &root ) )
+		return -1;
+
+	memset( buffer, 'a', SNAP_IO_BYTES );
+	for( i = 0; i < SNAP_FILES; i++ )
+	{
+		sprintf( name, "S%u", i );
+		if( fat_create( &root, name, &file ) )
+			return -1;
+		for( offset = 0; offset < SNAP_FILE_BYTES; offset += SNAP_IO_BYTES )
+		{
+			if( fat_write( &file, offset, SNAP_IO_BYTES, buffer ) != SNAP_IO_BYTES )
+				return -1;
+		}
+	}
+	fat_sync( &fs );
+
+	start = bench_now( );
+	if( diskcow_snapshot( &live, &snapshot ) )
+		return -1;
+	snapshotUs = ( bench_now( ) - start ) * 1e6;
+
+	ZeroMemory( &snapFs, sizeof( FAT_FILESYSTEM ) );
+	snapFs.disk			= &snapshot;
+	snapFs.mountFlags	= FAT_MOUNT_READ_ONLY;
+	if( fat_read_superblock( &snapFs, &snapRoot ) )
+		return -1;
+
+	// snapshot을 mount한 채로 live volume을 고침
+	memset( buffer, 'b', SNAP_IO_BYTES );
+	for( i = 0; i < SNAP_REWRITE_FILES; i++ )
+	{
+		sprintf( name, "S%u", i );
+		if( fat_lookup( &root, name, &file ) )
+			return -1;
+		for( offset = 0; offset < SNAP_REWRITE_BYTES; offset += SNAP_IO_BYTES )
+		{
+			if( fat_write( &file, offset, SNAP_IO_BYTES, buffer ) != SNAP_IO_BYTES )
+				return -1;
+		}
+	}
+	sprintf( name, "S%u", SNAP_FILES - 1 );
+	if( fat_lookup( &root, name, &file ) || fat_remove( &file ) )
+		return -1;
+	overlay = diskcow_overlay_sectors( &live );
+
+	printf( "snapshot taken in     : %.1lf us\n", snapshotUs );
+	printf( "overlay after writes  : %llu of %u sectors\n", ( unsigned long long )overlay, SNAP_SECTORS );
+	printf( "read only writes      : %s\n", ( fat_create( &snapRoot, "NEW", &file ) == FAT_ERROR ? "refused" : "ACCEPTED" ) );
+
+	for( i = 0; i < SNAP_FILES; i++ )
+	{
+		if( bench_snapshot_check( &snapRoot, i, SNAP_FILE_BYTES, 'a', buffer ) )
+		{
+			printf( "snapshot file S%u has changed\n", i );
+			return -1;
+		}
+	}
+	if( fat_fsck( &snapRoot, 0, &report, NULL, NULL ) || report.crossLinks || report.badChains || report.lostChains )
+	{
+		printf( "snapshot is inconsistent\n" );
+		return -1;
+	}
+	printf( "snapshot contents     : unchanged, %u files\n", report.files );
+
+	fat_umount( &snapFs );
+	diskcow_release( &snapshot );
+
+	// snapshot을 놓으면 overlay가 base 디스크로 내려감
+	for( i = 0; i < SNAP_REWRITE_FILES; i++ )
+	{
+		if( bench_snapshot_check( &root, i, SNAP_REWRITE_BYTES, 'b', buffer ) )
+		{
+			printf( "live file S%u lost its writes\n", i );
+			return -1;
+		}
+	}
+	printf( "overlay after release : %llu sectors\n", ( unsigned long long )diskcow_overlay_sectors( &live ) );
+
+	fat_umount( &fs );
+	diskcow_uninit( &live );
+	disksim_uninit( &base );
+	free( buffer );
+
+	return 0;
+}
+
+/* drop the image from the page cache so every pass reads the device */
+/* Creates many small files over a few directories, removes every other one
+   and syncs, on the HDD model, once with every FAT and directory update
+   written in place and once through the metadata journal. */
+int bench_journal( void )
+{
+	const char*			names[] = { "in place", "journal" };
+	DWORD				formatFlags[] = { FAT_FORMAT_QUICK, FAT_FORMAT_QUICK | FAT_FORMAT_JOURNAL };
+	DISK_OPERATIONS		disk;
+	DISKSIM_STATS		stats[2];
+	FAT_JOURNAL_STATS	journal;
+	FAT_FILESYSTEM		fs;
+	FAT_NODE			root, dirs[JOURNAL_DIRS], file;
+	FAT_FSCK_REPORT		report;
+	UINT32				mode, i;
+	char				name[16];
+	char				buffer[JOURNAL_FILE_BYTES];
+	double				elapsed[2];
+
+	memset( buffer, 'j', sizeof( buffer ) );
+	ZeroMemory( &journal, sizeof( journal ) );
+
+	for( mode = 0; mode < 2; mode++ )
+	{
+		if( disksim_init( JOURNAL_SECTORS, 512, &disk ) < 0 )
+			return -1;
+		if( fat_format( &disk, FAT16, formatFlags[mode], 0 ) )
+			return -1;
+
+		ZeroMemory( &fs, sizeof( FAT_FILESYSTEM ) );
+		fs.disk = &disk;
+		if( fat_read_superblock( &fs, &root ) )
+			return -1;
+
+		disksim_set_timing( &disk, &DISKSIM_HDD );
+		elapsed[mode] = bench_now( );
+
+		for( i = 0; i < JOURNAL_DIRS; i++ )
+		{
+			sprintf( name, "J%u", i );
+			if( fat_mkdir( &root, name, &dirs[i] ) )
+				return -1;
+		}
+
+		for( i = 0; i < JOURNAL_FILES; i++ )
+		{
+			sprintf( name, "F%u", i );
+			if( fat_create( &dirs[i % JOURNAL_DIRS], name, &file ) ||
+				fat_write( &file, 0, JOURNAL_FILE_BYTES, buffer ) != JOURNAL_FILE_BYTES )
+				return -1;
+			if( i % 2 && fat_remove( &file ) )
+				return -1;
+		}
+
+		if( fat_sync( &fs ) )
+			return -1;
+
+		elapsed[mode] = bench_now( ) - elapsed[mode];
+		disksim_get_stats( &disk, &stats[mode] );
+		disksim_set_timing( &disk, NULL );
+		if( mode == 1 )
+			fat_journal_stats( &fs, &journal );
+
+		if( fat_fsck( &root, 0, &report, NULL, NULL ) || report.lostChains || report.crossLinks || report.files != JOURNAL_FILES / 2 )
+		{
+			printf( "%s : fsck found errors\n", names[mode] );
+			return -1;
+		}
+
+		fat_umount( &fs );
+		disksim_uninit( &disk );
+	}
+
+	printf( "\n%-10s %12s %10s %10s %14s %10s\n", "mode", "device ms", "writes", "seeks", "sectors written", "run ms" );
+	for( mode = 0; mode < 2; mode++ )
+		printf( "%-10s %12.1lf %10llu %10llu %14llu %10.1lf\n", names[mode], stats[mode].timeNs / 1000000.0,
+				( unsigned long long )stats[mode].writes, ( unsigned long long )stats[mode].seeks,
+				( unsigned long long )stats[mode].sectorsWritten, elapsed[mode] * 1000 );
+
+	printf( "\njournal : %llu operations in %llu transactions, %llu log sectors, %llu checkpoints writing %llu sectors home\n",
+			( unsigned long long )journal.operations, ( unsigned long long )journal.transactions,
+			( unsigned long long )journal.journalSectors, ( unsigned long long )journal.checkpoints,
+			( unsigned long long )journal.homeSectors );
+
+	return 0;
+}
+
+/* BATCH_FILES creates into one directory on the HDD model, each operation
+   writing its metadata as it goes, on a journaled volume in group commits,
+   and on a journaled volume inside one batch */
+int bench_batch( void )
+{
+	const char*			names[] = { "in place", "journal", "batch" };
+	DWORD				formatFlags[] = { FAT_FORMAT_QUICK, FAT_FORMAT_QUICK | FAT_FORMAT_JOURNAL, FAT_FORMAT_QUICK | FAT_FORMAT_JOURNAL };
+	DISK_OPERATIONS		disk;
+	DISKSIM_STATS		stats[3];
+	FAT_FILESYSTEM		fs;
+	FAT_NODE			root, dir, file;
+	FAT_FSCK_REPORT		report;
+	UINT32				mode, i;
+	char				name[16];
+	char				buffer[BATCH_FILE_BYTES];
+	double				elapsed[3];
+
+	memset( buffer, 'b', sizeof( buffer ) );
+
+	for( mode = 0; mode < 3; mode++ )
+	{
+		if( disksim_init( BATCH_SECTORS, 512, &disk ) < 0 )
+			return -1;
+		if( fat_format( &disk, FAT16, formatFlags[mode], 0 ) )
+			return -1;
+
+		ZeroMemory( &fs, sizeof( FAT_FILESYSTEM ) );
+		fs.disk = &disk;
+		if( fat_read_superblock( &fs, &root ) )
+			return -1;
+		if( fat_mkdir( &root, "IMPORT", &dir ) || fat_sync( &fs ) )
+			return -1;
+
+		disksim_reset_stats( &disk );
+		disksim_set_timing( &disk, &DISKSIM_HDD );
+		elapsed[mode] = bench_now( );
+
+		if( mode == 2 && fat_begin_batch( &fs ) )
+			return -1;
+
+		for( i = 0; i < BATCH_FILES; i++ )
+		{
+			sprintf( name, "F%u", i );
+			if( fat_create( &dir, name, &file ) ||
+				fat_write( &file, 0, BATCH_FILE_BYTES, buffer ) != BATCH_FILE_BYTES )
+				return -1;
+		}
+
+		if( mode == 2 && fat_commit_batch( &fs ) )
+			return -1;
+		if( fat_sync( &fs ) )
+			return -1;
+
+		elapsed[mode] = bench_now( ) - elapsed[mode];
+		disksim_get_stats( &disk, &stats[mode] );
+		disksim_set_timing( &disk, NULL );
+
+		if( fat_fsck( &root, 0, &report, NULL, NULL ) || report.lostChains || report.crossLinks || report.files != BATCH_FILES )
+		{
+			printf( "%s : fsck found errors\n", names[mode] );
+			return -1;
+		}
+
+		fat_umount( &fs );
+		disksim_uninit( &disk );
+	}
+
+	printf( "\n%-10s %12s %10s %10s %14s %10s\n", "mode", "device ms", "writes", "seeks", "sectors written", "run ms" );
+	for( mode = 0; mode < 3; mode++ )
+		printf( "%-10s %12.1lf %10llu %10llu %14llu %10.1lf\n", names[mode], stats[mode].timeNs / 1000000.0,
+				( unsigned long long )stats[mode].writes, ( unsigned long long )stats[mode].seeks,
+				( unsigned long long )stats[mode].sectorsWritten, elapsed[mode] * 1000 );
+
+	return 0;
+}
+
+/* READAHEAD_FILES files read in turns, READAHEAD_IO_BYTES at a time, on the
+   HDD model: without readahead, with it, and with it on the async pool */
+int bench_readahead( void )
+{
+	const char*			names[] = { "none", "readahead", "async" };
+	DWORD				flags[] = { FAT_MOUNT_NO_READAHEAD, 0, 0 };
+	DISK_OPERATIONS		disk;
+	DISKSIM_STATS		stats[3];
+	FAT_READAHEAD_STATS	readahead[3];
+	FAT_FILESYSTEM		fs;
+	FAT_NODE			root, files[READAHEAD_FILES];
+	UINT32				mode, offset, i;
+	char				name[16];
+	char*				buffer;
+	char				check[READAHEAD_IO_BYTES];
+	double				elapsed[3];
+
+	buffer = ( char* )malloc( READAHEAD_WRITE_BYTES );
+	if( buffer == NULL )
+		return -1;
+	for( i = 0; i < READAHEAD_WRITE_BYTES; i++ )
+		buffer[i] = ( char )( i * 7 + i / 512 );
+
+	for( mode = 0; mode < 3; mode++ )
+	{
+		if( disksim_init( READAHEAD_SECTORS, 512, &disk ) < 0 )
+			return -1;
+		if( fat_format( &disk, FAT16, FAT_FORMAT_QUICK, 0 ) )
+			return -1;
+
+		ZeroMemory( &fs, sizeof( FAT_FILESYSTEM ) );
+		fs.disk			= &disk;
+		fs.mountFlags	= flags[mode];
+		if( fat_read_superblock( &fs, &root ) )
+			return -1;
+		if( mode == 2 && disk_async_init( &disk, 4 ) )
+			return -1;
+
+		for( i = 0; i < READAHEAD_FILES; i++ )
+		{
+			sprintf( name, "R%u", i );
+			if( fat_create( &root, name, &files[i] ) )
+				return -1;
+		}
+		for( offset = 0; offset < READAHEAD_FILE_BYTES; offset += READAHEAD_WRITE_BYTES )
+		{
+			for( i = 0; i < READAHEAD_FILES; i++ )
+			{
+				if( fat_write( &files[i], offset, READAHEAD_WRITE_BYTES, buffer ) != READAHEAD_WRITE_BYTES )
+					return -1;
+			}
+		}
+
+		disksim_reset_stats( &disk );
+		disksim_set_timing( &disk, &DISKSIM_HDD );
+		elapsed[mode] = bench_now( );
+
+		for( offset = 0; offset < READAHEAD_FILE_BYTES; offset += READAHEAD_IO_BYTES )
+		{
+			for( i = 0; i < READAHEAD_FILES; i++ )
+			{
+				if( fat_read( &files[i], offset, READAHEAD_IO_BYTES, check ) != READAHEAD_IO_BYTES ||
+					memcmp( check, buffer + offset % READAHEAD_WRITE_BYTES, READAHEAD_IO_BYTES ) )
+				{
+					printf( "%s : wrong data at %u\n", names[mode], offset );
+					return -1;
+				}
+			}
+		}
+
+		elapsed[mode] = bench_now( ) - elapsed[mode];
+		disksim_get_stats( &disk, &stats[mode] );
+		disksim_set_timing( &disk, NULL );
+		fat_readahead_stats( &fs, &readahead[mode] );
+
+		fat_umount( &fs );
+		if( mode == 2 )
+			disk_async_release( &disk );
+		disksim_uninit( &disk );
+	}
+
+	printf( "\n%-10s %12s %10s %10s %14s %10s %8s\n", "mode", "device ms", "reads", "seeks", "sectors read", "run ms", "window" );
+	for( mode = 0; mode < 3; mode++ )
+		printf( "%-10s %12.1lf %10llu %10llu %14llu %10.1lf %8u\n", names[mode], stats[mode].timeNs / 1000000.0,
+				( unsigned long long )stats[mode].reads, ( unsigned long long )stats[mode].seeks,
+				( unsigned long long )stats[mode].sectorsRead, elapsed[mode] * 1000, readahead[mode].window );
+
+	printf( "\nasync : %llu clusters hit, %llu missed, %llu waits, %llu prefetched in %llu requests\n",
+			( unsigned long long )readahead[2].hits, ( unsigned long long )readahead[2].misses,
+			( unsigned long long )readahead[2].waits, ( unsigned long long )readahead[2].prefetched,
+			( unsigned long long )readahead[2].requests );
+
+	free( buffer );
+
+	return 0;
+}
+
+/* WRITEBACK_FILES files grown by small appends in turns on the HDD model,
+   written through and behind */
+int bench_writeback( void )
+{
+	const char*			names[] = { "through", "behind" };
+	DWORD				flags[] = { FAT_MOUNT_NO_WRITE_BEHIND, 0 };
+	DISK_OPERATIONS		disk;
+	DISKSIM_STATS		stats[2];
+	FAT_LAYOUT_STATS	layout[2];
+	FAT_WRITEBACK_STATS	writeback;
+	FAT_FILESYSTEM		fs;
+	FAT_NODE			root, files[WRITEBACK_FILES];
+	FAT_FSCK_REPORT		report;
+	UINT32				mode, append, i;
+	char				name[16];
+	char				buffer[WRITEBACK_APPEND_BYTES];
+	double				elapsed[2];
+
+	memset( buffer, 'w', sizeof( buffer ) );
+
+	for( mode = 0; mode < 2; mode++ )
+	{
+		if( disksim_init( WRITEBACK_SECTORS, 512, &disk ) < 0 )
+			return -1;
+		if( fat_format( &disk, FAT16, FAT_FORMAT_QUICK, 0 ) )
+			return -1;
+
+		ZeroMemory( &fs, sizeof( FAT_FILESYSTEM ) );
+		fs.disk			= &disk;
+		fs.mountFlags	= flags[mode];
+		if( fat_read_superblock( &fs, &root ) )
+			return -1;
+
+		for( i = 0; i < WRITEBACK_FILES; i++ )
+		{
+			sprintf( name, "L%u", i );
+			if( fat_create( &root, name, &files[i] ) )
+				return -1;
+		}
+		if( fat_sync( &fs ) )
+			return -1;
+
+		disksim_reset_stats( &disk );
+		disksim_set_timing( &disk, &DISKSIM_HDD );
+		elapsed[mode] = bench_now( );
+
+		for( append = 0; append < WRITEBACK_APPENDS; append++ )
+		{
+			for( i = 0; i < WRITEBACK_FILES; i++ )
+			{
+				if( fat_write( &files[i], append * WRITEBACK_APPEND_BYTES, WRITEBACK_APPEND_BYTES, buffer ) != WRITEBACK_APPEND_BYTES )
+					return -1;
+			}
+		}
+
+		for( i = 0; i < WRITEBACK_FILES; i++ )
+		{
+			if( fat_flush( &files[i] ) )
+				return -1;
+		}
+		if( fat_sync( &fs ) )
+			return -1;
+
+		elapsed[mode] = bench_now( ) - elapsed[mode];
+		disksim_get_stats( &disk, &stats[mode] );
+		disksim_set_timing( &disk, NULL );
+		if( mode == 1 )
+			fat_writeback_stats( &fs, &writeback );
+
+		if( fat_layout_stats( &root, &layout[mode] ) ||
+			fat_fsck( &root, 0, &report, NULL, NULL ) || report.sizeMismatches || report.lostChains || report.files != WRITEBACK_FILES )
+		{
+			printf( "%s : fsck found errors\n", names[mode] );
+			return -1;
+		}
+
+		fat_umount( &fs );
+		disksim_uninit( &disk );
+	}
+
+	printf( "\n%-8s %12s %10s %10s %14s %10s %8s\n", "mode", "device ms", "writes", "seeks", "sectors written", "run ms", "extents" );
+	for( mode = 0; mode < 2; mode++ )
+		printf( "%-8s %12.1lf %10llu %10llu %14llu %10.1lf %8llu\n", names[mode], stats[mode].timeNs / 1000000.0,
+				( unsigned long long )stats[mode].writes, ( unsigned long long )stats[mode].seeks,
+				( unsigned long long )stats[mode].sectorsWritten, elapsed[mode] * 1000,
+				( unsigned long long )layout[mode].chainExtents );
+
+	printf( "\nbehind : %llu appends buffered, %llu flushes writing %llu bytes in %llu requests\n",
+			( unsigned long long )writeback.bufferedWrites, ( unsigned long long )writeback.flushes,
+			( unsigned long long )writeback.flushedBytes, ( unsigned long long )writeback.requests );
+
+	return 0;
+}
+
+int compare_latency( const void* a, const void* b )
+{
+	double	first = *( const double* )a;
+	double	second = *( const double* )b;
+
+	return ( first < second ? -1 : first > second );
+}
+
+/* FLUSHER_FILES files appended to at a steady pace on a journaled volume,
+   without and with the flusher thread; the latency of every fat_write is
+   kept, so the flushes and checkpoints a writer had to wait for show in the
+   tail */
+int bench_flusher( void )
+{
+	const char*			names[] = { "foreground", "flusher" };
+	DWORD				flags[] = { FAT_MOUNT_NO_FLUSHER, 0 };
+	DISK_OPERATIONS		disk;
+	FAT_FLUSHER_STATS	flusher;
+	FAT_WRITEBACK_STATS	writeback;
+	FAT_JOURNAL_STATS	journal;
+	FAT_FILESYSTEM		fs;
+	FAT_NODE			root, files[FLUSHER_FILES];
+	FAT_FSCK_REPORT		report;
+	UINT32				mode, append, i, count = FLUSHER_FILES * FLUSHER_APPENDS;
+	char				name[16];
+	char				buffer[FLUSHER_APPEND_BYTES];
+	double*				latency;
+	double				start, total[2], p99[2], max[2], elapsed[2];
+	QWORD				writerFlushes[2], checkpoints[2];
+
+	latency = ( double* )malloc( count * sizeof( double ) );
+	if( latency == NULL )
+		return -1;
+	memset( buffer, 'f', sizeof( buffer ) );
+
+	for( mode = 0; mode < 2; mode++ )
+	{
+		if( disksim_init( FLUSHER_SECTORS, 512, &disk ) < 0 )
+			return -1;
+		if( fat_format( &disk, FAT16, FAT_FORMAT_QUICK | FAT_FORMAT_JOURNAL, 0 ) )
+			return -1;
+
+		ZeroMemory( &fs, sizeof( FAT_FILESYSTEM ) );
+		fs.disk			= &disk;
+		fs.mountFlags	= flags[mode];
+		if( fat_read_superblock( &fs, &root ) )
+			return -1;
+
+		for( i = 0; i < FLUSHER_FILES; i++ )
+		{
+			sprintf( name, "L%u", i );
+			if( fat_create( &root, name, &files[i] ) ||
+				fat_write( &files[i], 0, FLUSHER_APPEND_BYTES, buffer ) != FLUSHER_APPEND_BYTES )
+				return -1;
+		}
+		if( fat_sync( &fs ) )
+			return -1;
+
+		elapsed[mode] = bench_now( );
+		for( append = 1; append < FLUSHER_APPENDS; append++ )
+		{
+			for( i = 0; i < FLUSHER_FILES; i++ )
+			{
+				start = bench_now( );
+				if( fat_write( &files[i], append * FLUSHER_APPEND_BYTES, FLUSHER_APPEND_BYTES, buffer ) != FLUSHER_APPEND_BYTES )
+					return -1;
+				latency[append * FLUSHER_FILES + i] = bench_now( ) - start;
+			}
+			usleep( FLUSHER_ROUND_US );
+		}
+		elapsed[mode] = bench_now( ) - elapsed[mode];
+
+		qsort( latency + FLUSHER_FILES, count - FLUSHER_FILES, sizeof( double ), compare_latency );
+		for( total[mode] = 0, i = FLUSHER_FILES; i < count; i++ )
+			total[mode] += latency[i];
+		p99[mode] = latency[FLUSHER_FILES + ( count - FLUSHER_FILES ) * 99 / 100];
+		max[mode] = latency[count - 1];
+
+		// 나머지는 flusher가 flush, checkpoint한 것
+		fat_writeback_stats( &fs, &writeback );
+		fat_journal_stats( &fs, &journal );
+		fat_flusher_stats( &fs, &flusher );
+		writerFlushes[mode]	= writeback.flushes - flusher.files;
+		checkpoints[mode]	= journal.checkpoints - flusher.checkpoints;
+
+		if( fat_sync( &fs ) ||
+			fat_fsck( &root, 0, &report, NULL, NULL ) || report.sizeMismatches || report.lostChains || report.files != FLUSHER_FILES )
+		{
+			printf( "%s : fsck found errors\n", names[mode] );
+			return -1;
+		}
+
+		fat_umount( &fs );
+		disksim_uninit( &disk );
+	}
+	free( latency );
+
+	printf( "\n%-10s %10s %10s %10s %10s %14s %18s\n", "mode", "run ms", "write ms", "p99 us", "max us", "writer flushes", "writer checkpoints" );
+	for( mode = 0; mode < 2; mode++ )
+		printf( "%-10s %10.1lf %10.1lf %10.1lf %10.1lf %14llu %18llu\n", names[mode], elapsed[mode] * 1000, total[mode] * 1000,
+				p99[mode] * 1e6, max[mode] * 1e6, ( unsigned long long )writerFlushes[mode], ( unsigned long long )checkpoints[mode] );
+
+	printf( "\nflusher : %llu passes, %llu woken by writers, %llu files, %llu checkpoints, %llu mirror copies\n",
+			( unsigned long long )flusher.passes, ( unsigned long long )flusher.kicks, ( unsigned long long )flusher.files,
+			( unsigned long long )flusher.checkpoints, ( unsigned long long )flusher.mirrorSyncs );
+
+	return 0;
+}
+
+void bench_drop_cache( const char* path )
+{
+	int	fd = open( path, O_RDONLY );
+
+	if( fd < 0 )
+		return;
+
+	fsync( fd );
+	posix_fadvise( fd, 0, 0, POSIX_FADV_DONTNEED );
+	close( fd );
+}
+
+/* Reads one file sequentially with requests queued by io_uring, by the thread
+   pool fallback and one cluster at a time; the image is evicted from the page
+   cache before each pass */
+int bench_aio( const char* path )
+{
+	DISK_OPERATIONS	disk, native;
+	FAT_FILESYSTEM	fs;
+	FAT_NODE		root, file;
+	UINT32			offset, pass;
+	char*			buffer;
+	double			start, seconds;
+	const char*		engines[] = { "io_uring", "threads", "sync" };
+
+	buffer = ( char* )malloc( AIO_FILE_BYTES );
+	if( buffer == NULL )
+		return -1;
+	memset( buffer, 'a', AIO_FILE_BYTES );
+
+	unlink( path );
+	if( diskimg_init( path, AIO_SECTORS, 512, &disk ) < 0 )
+		return -1;
+	native = disk;
+
+	if( fat_format( &disk, bench_fat_type( AIO_SECTORS, 512 ), FAT_FORMAT_QUICK, 0 ) )
+		return -1;
+
+	ZeroMemory( &fs, sizeof( FAT_FILESYSTEM ) );
+	fs.disk = &disk;
+	if( fat_read_superblock( &fs, &root ) || fat_create( &root, "AIO", &file ) ||
+		fat_write( &file, 0, AIO_FILE_BYTES, buffer ) != AIO_FILE_BYTES )
+		return -1;
+
+	printf( "\n%-10s %10s\n", "engine", "read MB/s" );
+
+	for( pass = 0; pass < 3; pass++ )
+	{
+		// 같은 mount에서 엔진만 바꿈, 이전 엔진의 queue는 먼저 버림
+		release_read_queues( &fs );
+		disk_async_release( &disk );
+		disk.queue_init		= ( pass == 0 ? native.queue_init : NULL );
+		disk.queue_release	= ( pass == 0 ? native.queue_release : NULL );
+		disk.submit			= ( pass == 0 ? native.submit : NULL );
+		disk.reap			= ( pass == 0 ? native.reap : NULL );
+		if( pass == 0 && disk.queue_init == NULL )
+		{
+			printf( "%-10s %10s\n", engines[pass], "n/a" );
+			continue;
+		}
+		if( pass == 1 && disk_async_init( &disk, 0 ) )
+			return -1;
+
+		bench_drop_cache( path );
+
+		start = bench_now( );
+		for( offset = 0; offset < AIO_FILE_BYTES; offset += AIO_IO_BYTES )
+		{
+			if( fat_read( &file, offset, AIO_IO_BYTES, buffer + offset ) != AIO_IO_BYTES )
+				return -1;
+		}
+		seconds = bench_now( ) - start;
+
+		printf( "%-10s %10.1lf\n", engines[pass], AIO_FILE_BYTES / ( 1024.0 * 1024.0 ) / seconds );
+	}
+
+	fat_umount( &fs );
+	disk_async_release( &disk );
+	diskimg_uninit( &disk );
+	unlink( path );
+	free( buffer );
+
+	return 0;
+}
+
+int main( int argc, char* argv[] )
+{
+	int	threads = 8;
+
+	if( argc < 2 )
+	{
+		printf( "usage : %s alloc [max writers]\n", argv[0] );
+		printf( "        %s format [sectors] [threads] [sparse]\n", argv[0] );
+		printf( "        %s limits\n", argv[0] );
+		printf( "        %s sector\n", argv[0] );
+		printf( "        %s aio [image file]\n", argv[0] );
+		printf( "        %s device\n", argv[0] );
+		printf( "        %s flash\n", argv[0] );
+		printf( "        %s wa\n", argv[0] );
+		printf( "        %s snapshot\n", argv[0] );
+		printf( "        %s journal\n", argv[0] );
+		printf( "        %s batch\n", argv[0] );
+		printf( "        %s readahead\n", argv[0] );
+		printf( "        %s writeback\n", argv[0] );
+		printf( "        %s flusher\n", argv[0] );
+		return 1;
+	}
+
+	if( strcmp( argv[1], "alloc" ) == 0 )
+	{
+		if( argc > 2 )
+			threads = atoi( argv[2] );
+		if( threads < 1 || threads > BENCH_MAX_THREADS )
+			threads = 8;
+
+		return bench_alloc( threads );
+	}
+
+	if( strcmp( argv[1], "format" ) == 0 )
+		return bench_format( ( argc > 2 ? ( SECTOR )strtoul( argv[2], NULL, 0 ) : FORMAT_SECTORS ),
+							 ( argc > 3 ? atoi( argv[3] ) : 0 ),
+							 ( argc > 4 && strcmp( argv[4], "sparse" ) == 0 ) );
+
+	if( strcmp( argv[1], "limits" ) == 0 )
+		return bench_limits( );
+
+	if( strcmp( argv[1], "sector" ) == 0 )
+		return bench_sector( );
+
+	if( strcmp( argv[1], "device" ) == 0 )
+		return bench_device( );
+
+	if( strcmp( argv[1], "flash" ) == 0 )
+		return bench_flash( );
+
+	if( strcmp( argv[1], "wa" ) == 0 )
+		return bench_wa( );
+
+	if( strcmp( argv[1], "snapshot" ) == 0 )
+		return bench_snapshot( );
+
+	if( strcmp( argv[1], "journal" ) == 0 )
+		return bench_journal( );
+
+	if( strcmp( argv[1], "batch" ) == 0 )
+		return bench_batch( );
+
+	if( strcmp( argv[1], "readahead" ) == 0 )
+		return bench_readahead( );
+
+	if( strcmp( argv[1], "writeback" ) == 0 )
+		return bench_writeback( );
+
+	if( strcmp( argv[1], "flusher" ) == 0 )
+		return bench_flusher( );
+
+	if( strcmp( argv[1], "aio" ) == 0 )
+		return bench_aio( ( argc > 2 ? argv[2] : "fat_bench.img" ) );
+
+	printf( "unknown benchmark : %s\n", argv[1] );
+	return 1;
+}
@@ -23,14 +23,38 @@ int	init_cluster_list( CLUSTER_LIST* clusterList ) // Ŭ������ �
 }
 
 int	push_cluster( CLUSTER_LIST* clusterList, SECTOR cluster ) 
+{
+	return push_cluster_run( clusterList, cluster, 1 );
+}
+
+/* appends count clusters beginning at first. When the run continues the last
+   pushed run, it is merged into that run instead of taking a new slot */
+int	push_cluster_run( CLUSTER_LIST* clusterList, SECTOR first, UINT32 count )
 {
 	CLUSTER_LIST_ELEMENT*	entry;
+	CLUSTER_RUN*			last;
 
 	if( clusterList == NULL )
 		return FAT_ERROR;
 
+	if( count == 0 )
+		return FAT_SUCCESS;
+
+	entry = clusterList->last;
+	if( entry && clusterList->pushOffset > 0 &&
+		( entry != clusterList->first || clusterList->pushOffset > clusterList->popOffset ) )
+	{
+		last = &entry->runs[clusterList->pushOffset - 1];
+		if( last->count && last->first + last->count == first )
+		{
+			last->count += count;
+			clusterList->count += count;
+			return FAT_SUCCESS;
+		}
+	}
+
 	if( clusterList->first == NULL ||					/* first push or */
-		clusterList->pushOffset == CLUSTERS_PER_ELEMENT )	/* the item is full*/
+		clusterList->pushOffset == RUNS_PER_ELEMENT )	/* the item is full*/
 	{
 		entry = ( CLUSTER_LIST_ELEMENT* )malloc( sizeof( CLUSTER_LIST_ELEMENT ) );
 		if( entry == NULL )
@@ -39,7 +63,10 @@ int	push_cluster( CLUSTER_LIST* clusterList, SECTOR cluster )
 		entry->next = NULL;
 
 		if( clusterList->first == NULL ) // ����Ʈ�� �� ó���� ����
+		{
 			clusterList->first = entry;
+			clusterList->popOffset = 0;
+		}
 		if( clusterList->last ) // ������
 			clusterList->last->next = entry;
 
@@ -49,36 +76,295 @@ int	push_cluster( CLUSTER_LIST* clusterList, SECTOR cluster )
 	}
 
 	entry = clusterList->last;
-	entry->clusters[clusterList->pushOffset++] = cluster;
-	clusterList->count++;
+	entry->runs[clusterList->pushOffset].first = first;
+	entry->runs[clusterList->pushOffset].count = count;
+	clusterList->pushOffset++;
+	clusterList->count += count;
 
 	return FAT_SUCCESS;
 }
 
+/* steps over the run at popOffset, releasing the first item once it is empty */
+static void advance_pop_offset( CLUSTER_LIST* clusterList )
+{
+	CLUSTER_LIST_ELEMENT*	entry = clusterList->first;
+
+	clusterList->popOffset++;
+
+	/* the item is empty */
+	if( clusterList->popOffset == RUNS_PER_ELEMENT ||
+		( entry == clusterList->last && clusterList->popOffset == clusterList->pushOffset ) )
+	{
+		clusterList->first = entry->next;
+		if( clusterList->first == NULL )
+			clusterList->last = NULL;
+		free( entry );
+
+		clusterList->popOffset = 0;
+	}
+}
+
+/* A drained run leaves the list: the head run by moving popOffset, any other
+   by taking the last run pushed into its slot, so the finders never step
+   over empty runs */
+static void remove_cluster_run( CLUSTER_LIST* clusterList, CLUSTER_RUN* run )
+{
+	CLUSTER_LIST_ELEMENT*	entry = clusterList->last;
+	CLUSTER_LIST_ELEMENT*	previous;
+
+	if( run == &clusterList->first->runs[clusterList->popOffset] )
+	{
+		advance_pop_offset( clusterList );
+		return;
+	}
+
+	*run = entry->runs[clusterList->pushOffset - 1];
+	clusterList->pushOffset--;
+
+	/* the last item is empty; the head run is still in front of it */
+	if( clusterList->pushOffset == 0 )
+	{
+		for( previous = clusterList->first; previous->next != entry; previous = previous->next )
+			;
+		previous->next = NULL;
+		clusterList->last = previous;
+		clusterList->pushOffset = RUNS_PER_ELEMENT;
+		free( entry );
+	}
+}
+
 int pop_cluster( CLUSTER_LIST* clusterList, SECTOR* cluster )
 {
-	CLUSTER_LIST_ELEMENT*	entry;
+	CLUSTER_RUN*	run;
 
 	if( clusterList == NULL || clusterList->count == 0 )
 		return FAT_ERROR;
 
-	entry = clusterList->first;
-	if( entry == NULL )
-		return FAT_ERROR;
+	/* skip the runs that have been used up */
+	while( -1 )
+	{
+		if( clusterList->first == NULL )
+			return FAT_ERROR;
+
+		run = &clusterList->first->runs[clusterList->popOffset];
+		if( run->count )
+			break;
+
+		advance_pop_offset( clusterList );
+	}
 
-	*cluster = entry->clusters[clusterList->popOffset++];
+	*cluster = run->first++;
+	run->count--;
 	clusterList->count--;
 
-	/* the item is empty */
-	if( clusterList->popOffset == CLUSTERS_PER_ELEMENT )
+	if( run->count == 0 )
+		advance_pop_offset( clusterList );
+
+	return FAT_SUCCESS;
+}
+
+/* takes count contiguous clusters from the first run that is long enough.
+   When no run is, the whole longest run is taken instead. The number of
+   clusters handed out is stored in popped */
+int pop_cluster_run( CLUSTER_LIST* clusterList, UINT32 count, SECTOR* first, UINT32* popped )
+{
+	CLUSTER_LIST_ELEMENT*	entry;
+	CLUSTER_RUN*			run;
+	CLUSTER_RUN*			chosen = NULL;
+	UINT32					i, end;
+
+	if( clusterList == NULL || clusterList->count == 0 || count == 0 )
+		return FAT_ERROR;
+
+	for( entry = clusterList->first; entry; entry = entry->next )
 	{
-		entry = entry->next;
-		free( clusterList->first );
-		clusterList->first = entry;
+		i	= ( entry == clusterList->first ? clusterList->popOffset : 0 );
+		end	= ( entry == clusterList->last ? clusterList->pushOffset : RUNS_PER_ELEMENT );
 
-		clusterList->popOffset = 0;
+		for( ; i < end; i++ )
+		{
+			run = &entry->runs[i];
+			if( chosen == NULL || run->count > chosen->count )
+				chosen = run;
+
+			if( run->count >= count )
+				break;
+		}
+
+		if( i < end )
+			break;
+	}
+
+	if( chosen == NULL || chosen->count == 0 )
+		return FAT_ERROR;
+
+	if( chosen->count < count )
+		count = chosen->count;
+
+	*first	= chosen->first;
+	*popped	= count;
+
+	chosen->first += count;
+	chosen->count -= count;
+	clusterList->count -= count;
+
+	if( chosen->count == 0 )
+		remove_cluster_run( clusterList, chosen );
+
+	return FAT_SUCCESS;
+}
+
+/* The finders below look at every run, like pop_cluster_run, and leave the
+   list alone; take_cluster_run then removes the clusters chosen. */
+
+/* next fit : of the runs holding count clusters, the lowest one at or after
+   cursor, wrapping around to the lowest of all. The longest run if none does */
+CLUSTER_RUN* find_cluster_run_after( CLUSTER_LIST* clusterList, UINT32 count, SECTOR cursor )
+{
+	CLUSTER_LIST_ELEMENT*	entry;
+	CLUSTER_RUN*			run;
+	CLUSTER_RUN*			after = NULL;
+	CLUSTER_RUN*			lowest = NULL;
+	CLUSTER_RUN*			longest = NULL;
+	UINT32					i, end;
+
+	for( entry = clusterList->first; entry; entry = entry->next )
+	{
+		i	= ( entry == clusterList->first ? clusterList->popOffset : 0 );
+		end	= ( entry == clusterList->last ? clusterList->pushOffset : RUNS_PER_ELEMENT );
+
+		for( ; i < end; i++ )
+		{
+			run = &entry->runs[i];
+			if( run->count == 0 )
+				continue;
+			if( longest == NULL || run->count > longest->count )
+				longest = run;
+			if( run->count < count )
+				continue;
+
+			if( run->first >= cursor && ( after == NULL || run->first < after->first ) )
+				after = run;
+			if( lowest == NULL || run->first < lowest->first )
+				lowest = run;
+		}
+	}
+
+	return ( after ? after : ( lowest ? lowest : longest ) );
+}
+
+/* best fit : the shortest run holding count clusters, the longest if none does */
+CLUSTER_RUN* find_best_cluster_run( CLUSTER_LIST* clusterList, UINT32 count )
+{
+	CLUSTER_LIST_ELEMENT*	entry;
+	CLUSTER_RUN*			run;
+	CLUSTER_RUN*			best = NULL;
+	CLUSTER_RUN*			longest = NULL;
+	UINT32					i, end;
+
+	for( entry = clusterList->first; entry; entry = entry->next )
+	{
+		i	= ( entry == clusterList->first ? clusterList->popOffset : 0 );
+		end	= ( entry == clusterList->last ? clusterList->pushOffset : RUNS_PER_ELEMENT );
+
+		for( ; i < end; i++ )
+		{
+			run = &entry->runs[i];
+			if( run->count == 0 )
+				continue;
+			if( longest == NULL || run->count > longest->count )
+				longest = run;
+			if( run->count >= count && ( best == NULL || run->count < best->count ) )
+				best = run;
+
+			/* nothing fits better */
+			if( best && best->count == count )
+				return best;
+		}
 	}
 
+	return ( best ? best : longest );
+}
+
+/* the run the cluster is in, NULL when it isn't free */
+CLUSTER_RUN* find_cluster_run_of( CLUSTER_LIST* clusterList, SECTOR cluster )
+{
+	CLUSTER_LIST_ELEMENT*	entry;
+	CLUSTER_RUN*			run;
+	UINT32					i, end;
+
+	for( entry = clusterList->first; entry; entry = entry->next )
+	{
+		i	= ( entry == clusterList->first ? clusterList->popOffset : 0 );
+		end	= ( entry == clusterList->last ? clusterList->pushOffset : RUNS_PER_ELEMENT );
+
+		for( ; i < end; i++ )
+		{
+			run = &entry->runs[i];
+			if( cluster >= run->first && cluster - run->first < run->count )
+				return run;
+		}
+	}
+
+	return NULL;
+}
+
+/* The first run covering a whole group of clusters. Groups are group
+   clusters long and begin at the clusters c with ( c + phase ) % group == 0;
+   the first cluster of the group is stored in start */
+CLUSTER_RUN* find_aligned_cluster_run( CLUSTER_LIST* clusterList, UINT32 group, UINT32 phase, SECTOR* start )
+{
+	CLUSTER_LIST_ELEMENT*	entry;
+	CLUSTER_RUN*			run;
+	SECTOR					aligned;
+	UINT32					i, end;
+
+	if( group == 0 )
+		return NULL;
+
+	for( entry = clusterList->first; entry; entry = entry->next )
+	{
+		i	= ( entry == clusterList->first ? clusterList->popOffset : 0 );
+		end	= ( entry == clusterList->last ? clusterList->pushOffset : RUNS_PER_ELEMENT );
+
+		for( ; i < end; i++ )
+		{
+			run = &entry->runs[i];
+			if( run->count < group )
+				continue;
+
+			aligned = run->first + ( group - ( run->first + phase ) % group ) % group;
+			if( aligned + group <= run->first + run->count )
+			{
+				*start = aligned;
+				return run;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/* Removes count clusters from first on, which must lie inside run. The part
+   of the run in front of them is pushed as a run of its own */
+int take_cluster_run( CLUSTER_LIST* clusterList, CLUSTER_RUN* run, SECTOR first, UINT32 count )
+{
+	SECTOR	end = run->first + run->count;
+	UINT32	head = first - run->first;
+
+	if( first < run->first || count == 0 || count > end - first )
+		return FAT_ERROR;
+
+	if( head && push_cluster_run( clusterList, run->first, head ) )
+		return FAT_ERROR;
+
+	run->first	= first + count;
+	run->count	= end - run->first;
+	clusterList->count -= head + count;
+
+	if( run->count == 0 )
+		remove_cluster_run( clusterList, run );
+
 	return FAT_SUCCESS;
 }
 
@@ -14,18 +14,25 @@
 
 #include "common.h"
 
-#define CLUSTERS_PER_ELEMENT	1023
+#define RUNS_PER_ELEMENT		511
+
+/* a run of contiguous free clusters : first, first + 1, ..., first + count - 1 */
+typedef struct
+{
+	SECTOR				first;
+	UINT32				count;
+} CLUSTER_RUN;
 
 typedef struct CLUSTER_LIST_ELEMENT
 {
-	SECTOR				clusters[CLUSTERS_PER_ELEMENT]; //int(sector) Ŭ Ҵ 
+	CLUSTER_RUN			runs[RUNS_PER_ELEMENT];
 
 	struct CLUSTER_LIST_ELEMENT*	next;
 } CLUSTER_LIST_ELEMENT;
 
 typedef struct
 {
-	UINT32				count;
+	UINT32				count;		/* number of clusters, not runs */
 	UINT32				pushOffset;
 	UINT32				popOffset;
 
@@ -35,7 +42,14 @@ typedef struct
 
 int	init_cluster_list( CLUSTER_LIST* ); //Ŭ Ʈ ʱȭ
 int	push_cluster( CLUSTER_LIST*, SECTOR ); // Ŭ Ʈ 
+int	push_cluster_run( CLUSTER_LIST*, SECTOR, UINT32 );
 int pop_cluster( CLUSTER_LIST*, SECTOR* );
+int pop_cluster_run( CLUSTER_LIST*, UINT32, SECTOR*, UINT32* );
+CLUSTER_RUN* find_cluster_run_after( CLUSTER_LIST*, UINT32, SECTOR );
+CLUSTER_RUN* find_best_cluster_run( CLUSTER_LIST*, UINT32 );
+CLUSTER_RUN* find_cluster_run_of( CLUSTER_LIST*, SECTOR );
+CLUSTER_RUN* find_aligned_cluster_run( CLUSTER_LIST*, UINT32, UINT32, SECTOR* );
+int take_cluster_run( CLUSTER_LIST*, CLUSTER_RUN*, SECTOR, UINT32 );
 void	release_cluster_list( CLUSTER_LIST* );
 
 #endif
@@ -0,0 +1,228 @@
+/******************************************************************************/
+/*                                                                            */
+/* Project : FAT12/16 File System                                             */
+/* File    : disk.c                                                           */
+/* Author  : Kyoungmoon Sun(msg2me@msn.com)                                   */
+/* Company : Dankook Univ. Embedded System Lab.                               */
+/* Notes   : Disk device helpers                                              */
+/* Date    : 2008/7/2                                                         */
+/*                                                                            */
+/******************************************************************************/
+
+#include "disk.h"
+#include "threadpool.h"
+
+/* zeroes can be kept without storing them by the sparse backends */
+int is_zero_data( const char* data, QWORD length )
+{
+	return length == 0 || ( data[0] == 0 && memcmp( data, data + 1, length - 1 ) == 0 );
+}
+
+/* read count sectors, in one request when the device supports it */
+int disk_read_sectors( DISK_OPERATIONS* disk, SECTOR sector, UINT32 count, void* data )
+{
+	UINT32	i;
+
+	if( disk->read_sectors )
+		return disk->read_sectors( disk, sector, count, data );
+
+	for( i = 0; i < count; i++ )
+	{
+		if( disk->read_sector( disk, sector + i, ( char* )data + i * disk->bytesPerSector ) )
+			return -1;
+	}
+
+	return 0;
+}
+
+/* write count sectors, in one request when the device supports it */
+int disk_write_sectors( DISK_OPERATIONS* disk, SECTOR sector, UINT32 count, const void* data )
+{
+	UINT32	i;
+
+	if( disk->write_sectors )
+		return disk->write_sectors( disk, sector, count, data );
+
+	for( i = 0; i < count; i++ )
+	{
+		if( disk->write_sector( disk, sector + i, ( const char* )data + i * disk->bytesPerSector ) )
+			return -1;
+	}
+
+	return 0;
+}
+
+/* a hint only: a disk that can't discard keeps the old data */
+int disk_discard_sectors( DISK_OPERATIONS* disk, SECTOR sector, UINT32 count )
+{
+	if( disk->discard_sectors == NULL || count == 0 )
+		return 0;
+
+	return disk->discard_sectors( disk, sector, count );
+}
+
+void disk_async_job( void* param )
+{
+	DISK_REQUEST*	request = ( DISK_REQUEST* )param;
+	DISK_QUEUE*		queue = request->queue;
+
+	if( request->write )
+		request->result = disk_write_sectors( queue->disk, request->sector, request->count, request->data );
+	else
+		request->result = disk_read_sectors( queue->disk, request->sector, request->count, request->data );
+
+	pthread_mutex_lock( &queue->lock );
+	request->next = NULL;
+	if( queue->last )
+		queue->last->next = request;
+	else
+		queue->first = request;
+	queue->last = request;
+	pthread_cond_broadcast( &queue->completed );
+	pthread_mutex_unlock( &queue->lock );
+}
+
+/* Disks that can't queue requests by themselves get a pool of threads running
+   the synchronous functions; the disk must then allow concurrent requests.
+   threads == 0 starts one worker per online CPU. */
+int disk_async_init( DISK_OPERATIONS* disk, UINT32 threads )
+{
+	THREAD_POOL*	pool;
+
+	if( disk->queue_init || disk->async )
+		return 0;
+
+	pool = ( THREAD_POOL* )malloc( sizeof( THREAD_POOL ) );
+	if( pool == NULL )
+		return -1;
+
+	if( thread_pool_init( pool, threads ) )
+	{
+		free( pool );
+		return -1;
+	}
+
+	disk->async = pool;
+
+	return 0;
+}
+
+/* every queue of the disk has to be released first */
+void disk_async_release( DISK_OPERATIONS* disk )
+{
+	if( disk->async == NULL )
+		return;
+
+	thread_pool_release( ( THREAD_POOL* )disk->async );
+	free( disk->async );
+	disk->async = NULL;
+}
+
+/* fails when the disk has neither its own queues nor a thread pool */
+int disk_queue_init( DISK_OPERATIONS* disk, DISK_QUEUE* queue )
+{
+	ZeroMemory( queue, sizeof( DISK_QUEUE ) );
+	queue->disk = disk;
+
+	if( disk->queue_init )
+		return disk->queue_init( disk, queue );
+
+	if( disk->async == NULL )
+		return -1;
+
+	pthread_mutex_init( &queue->lock, NULL );
+	pthread_cond_init( &queue->completed, NULL );
+
+	return 0;
+}
+
+/* requests still in flight are waited for, but not reaped */
+void disk_queue_release( DISK_QUEUE* queue )
+{
+	DISK_REQUEST*	completed[DISK_QUEUE_DEPTH];
+
+	if( queue->disk->queue_release )
+	{
+		queue->disk->queue_release( queue );
+		return;
+	}
+
+	while( queue->inFlight )
+		disk_wait( queue, completed, 1, DISK_QUEUE_DEPTH );
+
+	pthread_cond_destroy( &queue->completed );
+	pthread_mutex_destroy( &queue->lock );
+}
+
+/* Queue requests; each one's result is set by the time it is reaped. At most
+   DISK_QUEUE_DEPTH requests may be in flight on one queue. */
+int disk_submit( DISK_QUEUE* queue, DISK_REQUEST** requests, UINT32 count )
+{
+	UINT32	i;
+
+	if( queue->inFlight + count > DISK_QUEUE_DEPTH )
+		return -1;
+
+	if( queue->disk->submit )
+	{
+		if( queue->disk->submit( queue, requests, count ) )
+			return -1;
+		queue->inFlight += count;
+		return 0;
+	}
+
+	for( i = 0; i < count; i++ )
+	{
+		requests[i]->queue = queue;
+		if( thread_pool_submit( ( THREAD_POOL* )queue->disk->async, disk_async_job, requests[i] ) )
+			return -1;
+		queue->inFlight++;
+	}
+
+	return 0;
+}
+
+/* completed requests, without blocking */
+int disk_poll( DISK_QUEUE* queue, DISK_REQUEST** completed, UINT32 max )
+{
+	return disk_wait( queue, completed, 0, max );
+}
+
+/* blocks until at least min requests have completed, returns how many were reaped */
+int disk_wait( DISK_QUEUE* queue, DISK_REQUEST** completed, UINT32 min, UINT32 max )
+{
+	int		count = 0;
+
+	if( min > queue->inFlight )
+		min = queue->inFlight;
+
+	if( queue->disk->reap )
+	{
+		count = queue->disk->reap( queue, completed, min, max );
+		if( count > 0 )
+			queue->inFlight -= count;
+		return count;
+	}
+
+	pthread_mutex_lock( &queue->lock );
+	while( ( UINT32 )count < max )
+	{
+		if( queue->first == NULL )
+		{
+			if( ( UINT32 )count >= min )
+				break;
+			pthread_cond_wait( &queue->completed, &queue->lock );
+			continue;
+		}
+
+		completed[count++] = queue->first;
+		queue->first = queue->first->next;
+		if( queue->first == NULL )
+			queue->last = NULL;
+	}
+	pthread_mutex_unlock( &queue->lock );
+
+	queue->inFlight -= count;
+
+	return count;
+}
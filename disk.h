@@ -12,19 +12,76 @@
 #ifndef _DISK_H_
 #define _DISK_H_
 
+#include <pthread.h>
 #include "common.h"
 
 // sector의 크기, 개수
 // sector 읽기, 쓰기를 지원하는 함수
 // sector로 관리되는 memory 공간
+struct DISK_OPERATIONS;
+
+// 비동기 요청 하나, 완료될 때까지 호출한 쪽이 메모리를 유지해야 함
+typedef struct DISK_REQUEST
+{
+	int						write;		// 0 : read, 1 : write
+	SECTOR					sector;
+	UINT32					count;
+	void*					data;
+	int						result;		// 완료되면 0, 실패하면 -1
+	void*					param;		// 호출한 쪽 용도
+	struct DISK_REQUEST*	next;		// 이하 내부용
+	struct DISK_QUEUE*		queue;
+} DISK_REQUEST;
+
+/* requests one queue keeps in flight at most */
+#define DISK_QUEUE_DEPTH		64
+
+// DISK_QUEUE
+// 요청을 묶어서 넣고 완료된 요청을 거두는 submission/completion queue
+// 완료는 요청을 넣은 queue에서만 거둘 수 있으므로 thread마다 따로 씀
+typedef struct DISK_QUEUE
+{
+	struct DISK_OPERATIONS*	disk;
+	void*					pdata;		// 디스크가 직접 지원하는 경우 그 상태(io_uring 등)
+	pthread_mutex_t			lock;		// 이하 thread pool로 처리할 때
+	pthread_cond_t			completed;
+	DISK_REQUEST*			first;		// 완료되어 거둘 차례를 기다리는 요청
+	DISK_REQUEST*			last;
+	UINT32					inFlight;
+} DISK_QUEUE;
+
 typedef struct DISK_OPERATIONS
 {
 	int		( *read_sector	)( struct DISK_OPERATIONS*, SECTOR, void* );
 	int		( *write_sector	)( struct DISK_OPERATIONS*, SECTOR, const void* );
+	// 연속된 여러 sector를 한번에 읽고 쓰는 함수, 지원하지 않으면 NULL
+	int		( *read_sectors	)( struct DISK_OPERATIONS*, SECTOR, UINT32, void* );
+	int		( *write_sectors)( struct DISK_OPERATIONS*, SECTOR, UINT32, const void* );
+	// 더 이상 쓰지 않는 sector를 알려줌(TRIM), 이후 읽으면 0, 지원하지 않으면 NULL
+	int		( *discard_sectors)( struct DISK_OPERATIONS*, SECTOR, UINT32 );
+	// 디스크가 직접 지원하는 비동기 queue, 지원하지 않으면 NULL
+	int		( *queue_init	)( struct DISK_OPERATIONS*, DISK_QUEUE* );
+	void	( *queue_release)( DISK_QUEUE* );
+	int		( *submit		)( DISK_QUEUE*, DISK_REQUEST**, UINT32 );
+	int		( *reap			)( DISK_QUEUE*, DISK_REQUEST**, UINT32, UINT32 );
 	SECTOR	numberOfSectors;
 	int		bytesPerSector;
 	void*	pdata;
+	void*	async;		// disk_async_init이 만든 thread pool
 } DISK_OPERATIONS;
 
+int is_zero_data( const char* data, QWORD length );
+int disk_read_sectors( DISK_OPERATIONS* disk, SECTOR sector, UINT32 count, void* data );
+int disk_write_sectors( DISK_OPERATIONS* disk, SECTOR sector, UINT32 count, const void* data );
+int disk_discard_sectors( DISK_OPERATIONS* disk, SECTOR sector, UINT32 count );
+
+int disk_async_init( DISK_OPERATIONS* disk, UINT32 threads );
+void disk_async_release( DISK_OPERATIONS* disk );
+int disk_queue_init( DISK_OPERATIONS* disk, DISK_QUEUE* queue );
+void disk_queue_release( DISK_QUEUE* queue );
+int disk_submit( DISK_QUEUE* queue, DISK_REQUEST** requests, UINT32 count );
+int disk_poll( DISK_QUEUE* queue, DISK_REQUEST** completed, UINT32 max );
+int disk_wait( DISK_QUEUE* queue, DISK_REQUEST** completed, UINT32 min, UINT32 max );
+
 #endif
 
@@ -0,0 +1,569 @@
+/******************************************************************************/
+/*                                                                            */
+/* Project : FAT12/16 File System                                             */
+/* File    : diskcow.c                                                        */
+/* Author  : Kyoungmoon Sun(msg2me@msn.com)                                   */
+/* Company : Dankook Univ. Embedded System Lab.                               */
+/* Notes   : Copy-on-write snapshot disk                                      */
+/* Date    : 2008/7/2                                                         */
+/*                                                                            */
+/******************************************************************************/
+
+#include <pthread.h>
+#include "diskcow.h"
+
+#define COW_LEAF_SECTORS		( 1 << DISKCOW_LEAF_SHIFT )
+/* map value of a sector discarded in the layer: it reads as zeroes */
+#define COW_ZERO				0xFFFFFFFF
+
+// DISKCOW_LAYER
+// snapshot 이후에 쓰인 sector들, 아래 layer와 base 디스크를 가림
+typedef struct DISKCOW_LAYER
+{
+	UINT32**	leaves;			// sector >> DISKCOW_LEAF_SHIFT, sector마다 slot + 1 또는 COW_ZERO, 0이면 없음
+	BYTE**		chunks;			// slot의 내용, chunk 하나에 DISKCOW_CHUNK_SECTORS개
+	UINT32		chunkCapacity;
+	UINT32		slots;
+	UINT32		refs;			// 이 layer까지 보는 snapshot 수
+	struct DISKCOW_LAYER*	below;
+	struct DISKCOW_LAYER*	above;
+} DISKCOW_LAYER;
+
+// DISK_COW
+// base 디스크 위에 쌓인 layer들, 쓰기는 항상 맨 위 layer로
+typedef struct
+{
+	DISK_OPERATIONS*	base;
+	DISKCOW_LAYER*		top;		// snapshot이 없으면 NULL이고 쓰기는 base로 바로
+	UINT32				baseRefs;	// base 디스크만 보는 snapshot 수
+	UINT32				leafCount;
+	pthread_rwlock_t	lock;		// 쓰기와 layer 합치기는 exclusive
+} DISK_COW;
+
+// DISKCOW_VIEW
+// snapshot 하나, layer와 그 아래를 읽기만 함
+typedef struct
+{
+	DISK_COW*		cow;
+	DISKCOW_LAYER*	layer;		// NULL이면 base 디스크만
+} DISKCOW_VIEW;
+
+UINT32 cow_lookup( const DISKCOW_LAYER* layer, SECTOR sector )
+{
+	const UINT32*	leaf = layer->leaves[sector >> DISKCOW_LEAF_SHIFT];
+
+	return ( leaf ? leaf[sector & ( COW_LEAF_SECTORS - 1 )] : 0 );
+}
+
+BYTE* cow_slot( const DISKCOW_LAYER* layer, UINT32 slot, UINT32 bytesPerSector )
+{
+	return layer->chunks[slot / DISKCOW_CHUNK_SECTORS] + ( slot % DISKCOW_CHUNK_SECTORS ) * bytesPerSector;
+}
+
+DISKCOW_LAYER* cow_new_layer( DISK_COW* cow )
+{
+	DISKCOW_LAYER*	layer = ( DISKCOW_LAYER* )calloc( 1, sizeof( DISKCOW_LAYER ) );
+
+	if( layer == NULL )
+		return NULL;
+
+	layer->leaves = ( UINT32** )calloc( cow->leafCount, sizeof( UINT32* ) );
+	if( layer->leaves == NULL )
+	{
+		free( layer );
+		return NULL;
+	}
+
+	return layer;
+}
+
+void cow_free_layer( DISK_COW* cow, DISKCOW_LAYER* layer )
+{
+	UINT32	i;
+
+	for( i = 0; i < cow->leafCount; i++ )
+		free( layer->leaves[i] );
+	for( i = 0; i < ( layer->slots + DISKCOW_CHUNK_SECTORS - 1 ) / DISKCOW_CHUNK_SECTORS; i++ )
+		free( layer->chunks[i] );
+
+	free( layer->leaves );
+	free( layer->chunks );
+	free( layer );
+}
+
+/* the map entry of sector, with its leaf allocated */
+UINT32* cow_entry( DISKCOW_LAYER* layer, SECTOR sector )
+{
+	UINT32**	leaf = &layer->leaves[sector >> DISKCOW_LEAF_SHIFT];
+
+	if( *leaf == NULL )
+	{
+		*leaf = ( UINT32* )calloc( COW_LEAF_SECTORS, sizeof( UINT32 ) );
+		if( *leaf == NULL )
+			return NULL;
+	}
+
+	return &( *leaf )[sector & ( COW_LEAF_SECTORS - 1 )];
+}
+
+/* a sector already in the layer is overwritten where it is */
+int cow_store( DISK_COW* cow, DISKCOW_LAYER* layer, SECTOR sector, const BYTE* data )
+{
+	UINT32	bytesPerSector = cow->base->bytesPerSector;
+	UINT32*	entry = cow_entry( layer, sector );
+	BYTE**	chunks;
+
+	if( entry == NULL )
+		return -1;
+
+	if( *entry == 0 || *entry == COW_ZERO )
+	{
+		if( layer->slots % DISKCOW_CHUNK_SECTORS == 0 )
+		{
+			if( layer->slots / DISKCOW_CHUNK_SECTORS == layer->chunkCapacity )
+			{
+				chunks = ( BYTE** )realloc( layer->chunks, ( layer->chunkCapacity * 2 + 8 ) * sizeof( BYTE* ) );
+				if( chunks == NULL )
+					return -1;
+				layer->chunks = chunks;
+				layer->chunkCapacity = layer->chunkCapacity * 2 + 8;
+			}
+
+			layer->chunks[layer->slots / DISKCOW_CHUNK_SECTORS] = ( BYTE* )malloc( DISKCOW_CHUNK_SECTORS * bytesPerSector );
+			if( layer->chunks[layer->slots / DISKCOW_CHUNK_SECTORS] == NULL )
+				return -1;
+		}
+
+		*entry = ++layer->slots;
+	}
+
+	memcpy( cow_slot( layer, *entry - 1, bytesPerSector ), data, bytesPerSector );
+
+	return 0;
+}
+
+int cow_store_zero( DISK_COW* cow, DISKCOW_LAYER* layer, SECTOR sector )
+{
+	UINT32*	entry = cow_entry( layer, sector );
+
+	if( entry == NULL )
+		return -1;
+
+	if( *entry && *entry != COW_ZERO )
+		memset( cow_slot( layer, *entry - 1, cow->base->bytesPerSector ), 0, cow->base->bytesPerSector );
+	else
+		*entry = COW_ZERO;
+
+	return 0;
+}
+
+/* Each sector comes from the newest layer at or below layer holding it.
+   Sectors no layer holds are read from the base disk, a run at a time. */
+int cow_read( DISK_COW* cow, DISKCOW_LAYER* layer, SECTOR sector, UINT32 count, BYTE* data )
+{
+	UINT32			bytesPerSector = cow->base->bytesPerSector;
+	DISKCOW_LAYER*	search;
+	SECTOR			runFirst = 0;
+	UINT32			i, value, runCount = 0;
+
+	if( sector >= cow->base->numberOfSectors || count > cow->base->numberOfSectors - sector )
+		return -1;
+
+	for( i = 0; i <= count; i++ )
+	{
+		value = 0;
+		search = NULL;
+		if( i < count )
+		{
+			for( search = layer; search; search = search->below )
+			{
+				value = cow_lookup( search, sector + i );
+				if( value )
+					break;
+			}
+		}
+
+		/* the base run ends where a layer covers a sector, or at the end */
+		if( ( value || i == count ) && runCount )
+		{
+			if( disk_read_sectors( cow->base, runFirst, runCount, data + ( runFirst - sector ) * bytesPerSector ) )
+				return -1;
+			runCount = 0;
+		}
+
+		if( i == count )
+			break;
+
+		if( value == COW_ZERO )
+			memset( data + i * bytesPerSector, 0, bytesPerSector );
+		else if( value )
+			memcpy( data + i * bytesPerSector, cow_slot( search, value - 1, bytesPerSector ), bytesPerSector );
+		else if( runCount++ == 0 )
+			runFirst = sector + i;
+	}
+
+	return 0;
+}
+
+/* sectors of layer the layer above doesn't hold move up; layer is freed */
+int cow_merge_up( DISK_COW* cow, DISKCOW_LAYER* layer )
+{
+	DISKCOW_LAYER*	above = layer->above;
+	SECTOR			sector;
+	UINT32			leaf, i, value;
+
+	for( leaf = 0; leaf < cow->leafCount; leaf++ )
+	{
+		if( layer->leaves[leaf] == NULL )
+			continue;
+
+		for( i = 0; i < COW_LEAF_SECTORS; i++ )
+		{
+			value	= layer->leaves[leaf][i];
+			sector	= ( ( SECTOR )leaf << DISKCOW_LEAF_SHIFT ) + i;
+			if( value == 0 || cow_lookup( above, sector ) )
+				continue;
+
+			if( value == COW_ZERO ? cow_store_zero( cow, above, sector ) : cow_store( cow, above, sector, cow_slot( layer, value - 1, cow->base->bytesPerSector ) ) )
+				return -1;
+		}
+	}
+
+	above->below = layer->below;
+	if( layer->below )
+		layer->below->above = above;
+	cow_free_layer( cow, layer );
+
+	return 0;
+}
+
+/* the sectors of the oldest layer are written to the base disk and the layer
+   is emptied */
+int cow_flush_bottom( DISK_COW* cow, DISKCOW_LAYER* layer )
+{
+	UINT32			bytesPerSector = cow->base->bytesPerSector;
+	DISKCOW_LAYER*	empty;
+	BYTE*			zero;
+	SECTOR			sector;
+	UINT32			leaf, i, value;
+
+	empty	= cow_new_layer( cow );
+	zero	= ( BYTE* )calloc( 1, bytesPerSector );
+	if( empty == NULL || zero == NULL )
+	{
+		if( empty )
+			cow_free_layer( cow, empty );
+		free( zero );
+		return -1;
+	}
+
+	for( leaf = 0; leaf < cow->leafCount; leaf++ )
+	{
+		if( layer->leaves[leaf] == NULL )
+			continue;
+
+		for( i = 0; i < COW_LEAF_SECTORS; i++ )
+		{
+			value	= layer->leaves[leaf][i];
+			sector	= ( ( SECTOR )leaf << DISKCOW_LEAF_SHIFT ) + i;
+			if( value == 0 )
+				continue;
+
+			if( disk_write_sectors( cow->base, sector, 1, ( value == COW_ZERO ? zero : cow_slot( layer, value - 1, bytesPerSector ) ) ) )
+			{
+				cow_free_layer( cow, empty );
+				free( zero );
+				return -1;
+			}
+		}
+	}
+
+	free( zero );
+
+	/* the layer keeps its place in the stack, snapshots may point at it */
+	for( i = 0; i < cow->leafCount; i++ )
+		free( layer->leaves[i] );
+	for( i = 0; i < ( layer->slots + DISKCOW_CHUNK_SECTORS - 1 ) / DISKCOW_CHUNK_SECTORS; i++ )
+		free( layer->chunks[i] );
+	free( layer->leaves );
+	free( layer->chunks );
+
+	layer->leaves			= empty->leaves;
+	layer->chunks			= NULL;
+	layer->chunkCapacity	= 0;
+	layer->slots			= 0;
+	free( empty );
+
+	return 0;
+}
+
+/* Layers no snapshot ends at any more fold into the layer above; without a
+   snapshot of the base disk the oldest layer goes down to it, and with no
+   snapshot left at all writes go straight to the base disk again. The cost
+   is the sectors written since the released snapshots were taken. */
+void cow_collapse( DISK_COW* cow )
+{
+	DISKCOW_LAYER*	layer;
+	DISKCOW_LAYER*	below;
+
+	if( cow->top == NULL )
+		return;
+
+	for( layer = cow->top->below; layer; layer = below )
+	{
+		below = layer->below;
+		if( layer->refs == 0 && cow_merge_up( cow, layer ) )
+			return;
+	}
+
+	for( layer = cow->top; layer->below; layer = layer->below )
+		;
+
+	if( cow->baseRefs == 0 && cow_flush_bottom( cow, layer ) == 0 && layer == cow->top )
+	{
+		cow_free_layer( cow, layer );
+		cow->top = NULL;
+	}
+}
+
+int diskcow_read_sectors( DISK_OPERATIONS* this, SECTOR sector, UINT32 count, void* data )
+{
+	DISK_COW*	cow = ( DISK_COW* )this->pdata;
+	int			result;
+
+	pthread_rwlock_rdlock( &cow->lock );
+	result = cow_read( cow, cow->top, sector, count, ( BYTE* )data );
+	pthread_rwlock_unlock( &cow->lock );
+
+	return result;
+}
+
+int diskcow_write_sectors( DISK_OPERATIONS* this, SECTOR sector, UINT32 count, const void* data )
+{
+	DISK_COW*	cow = ( DISK_COW* )this->pdata;
+	const BYTE*	source = ( const BYTE* )data;
+	UINT32		i;
+	int			result = 0;
+
+	if( sector >= this->numberOfSectors || count > this->numberOfSectors - sector )
+		return -1;
+
+	pthread_rwlock_wrlock( &cow->lock );
+	if( cow->top == NULL )
+		result = disk_write_sectors( cow->base, sector, count, data );
+	else
+	{
+		for( i = 0; i < count && result == 0; i++ )
+			result = cow_store( cow, cow->top, sector + i, source + i * this->bytesPerSector );
+	}
+	pthread_rwlock_unlock( &cow->lock );
+
+	return result;
+}
+
+/* under a snapshot the base keeps its data; the sectors read as zeroes above it */
+int diskcow_discard_sectors( DISK_OPERATIONS* this, SECTOR sector, UINT32 count )
+{
+	DISK_COW*	cow = ( DISK_COW* )this->pdata;
+	UINT32		i;
+	int			result = 0;
+
+	if( sector >= this->numberOfSectors || count > this->numberOfSectors - sector )
+		return -1;
+
+	pthread_rwlock_wrlock( &cow->lock );
+	if( cow->top == NULL )
+		result = disk_discard_sectors( cow->base, sector, count );
+	else
+	{
+		for( i = 0; i < count && result == 0; i++ )
+			result = cow_store_zero( cow, cow->top, sector + i );
+	}
+	pthread_rwlock_unlock( &cow->lock );
+
+	return result;
+}
+
+int diskcow_read( DISK_OPERATIONS* this, SECTOR sector, void* data )
+{
+	return diskcow_read_sectors( this, sector, 1, data );
+}
+
+int diskcow_write( DISK_OPERATIONS* this, SECTOR sector, const void* data )
+{
+	return diskcow_write_sectors( this, sector, 1, data );
+}
+
+int diskcow_view_read_sectors( DISK_OPERATIONS* this, SECTOR sector, UINT32 count, void* data )
+{
+	DISKCOW_VIEW*	view = ( DISKCOW_VIEW* )this->pdata;
+	int				result;
+
+	pthread_rwlock_rdlock( &view->cow->lock );
+	result = cow_read( view->cow, view->layer, sector, count, ( BYTE* )data );
+	pthread_rwlock_unlock( &view->cow->lock );
+
+	return result;
+}
+
+int diskcow_view_read( DISK_OPERATIONS* this, SECTOR sector, void* data )
+{
+	return diskcow_view_read_sectors( this, sector, 1, data );
+}
+
+/* snapshots are read only */
+int diskcow_view_write_sectors( DISK_OPERATIONS* this, SECTOR sector, UINT32 count, const void* data )
+{
+	( void )this;
+	( void )sector;
+	( void )count;
+	( void )data;
+	return -1;
+}
+
+int diskcow_view_write( DISK_OPERATIONS* this, SECTOR sector, const void* data )
+{
+	( void )this;
+	( void )sector;
+	( void )data;
+	return -1;
+}
+
+/* disk becomes a copy-on-write disk over base, which it uses but doesn't own */
+int diskcow_init( DISK_OPERATIONS* base, DISK_OPERATIONS* disk )
+{
+	DISK_COW*	cow;
+
+	if( base == NULL || disk == NULL || base->numberOfSectors == 0 )
+		return -1;
+
+	ZeroMemory( disk, sizeof( DISK_OPERATIONS ) );
+
+	cow = ( DISK_COW* )calloc( 1, sizeof( DISK_COW ) );
+	if( cow == NULL )
+		return -1;
+
+	cow->base		= base;
+	cow->leafCount	= ( UINT32 )( ( ( QWORD )base->numberOfSectors + COW_LEAF_SECTORS - 1 ) >> DISKCOW_LEAF_SHIFT );
+	pthread_rwlock_init( &cow->lock, NULL );
+
+	disk->read_sector		= diskcow_read;
+	disk->write_sector		= diskcow_write;
+	disk->read_sectors		= diskcow_read_sectors;
+	disk->write_sectors		= diskcow_write_sectors;
+	disk->discard_sectors	= diskcow_discard_sectors;
+	disk->numberOfSectors	= base->numberOfSectors;
+	disk->bytesPerSector	= base->bytesPerSector;
+	disk->pdata				= cow;
+
+	return 0;
+}
+
+/* Snapshots still held are dropped with the layers, and with them the writes
+   made since the oldest was taken; release them first to keep those writes.
+   The base disk is left open. */
+void diskcow_uninit( DISK_OPERATIONS* this )
+{
+	DISK_COW*		cow;
+	DISKCOW_LAYER*	below;
+
+	if( this == NULL || this->pdata == NULL )
+		return;
+
+	cow = ( DISK_COW* )this->pdata;
+	while( cow->top )
+	{
+		below = cow->top->below;
+		cow_free_layer( cow, cow->top );
+		cow->top = below;
+	}
+
+	pthread_rwlock_destroy( &cow->lock );
+	free( cow );
+	this->pdata = NULL;
+}
+
+/* The disk as it is now, read only. Taking it costs one empty layer: the
+   current layer is frozen and later writes go to the new one. */
+int diskcow_snapshot( DISK_OPERATIONS* this, DISK_OPERATIONS* snapshot )
+{
+	DISK_COW*		cow = ( DISK_COW* )this->pdata;
+	DISKCOW_VIEW*	view;
+	DISKCOW_LAYER*	layer;
+
+	view = ( DISKCOW_VIEW* )calloc( 1, sizeof( DISKCOW_VIEW ) );
+	if( view == NULL )
+		return -1;
+
+	pthread_rwlock_wrlock( &cow->lock );
+	layer = cow_new_layer( cow );
+	if( layer == NULL )
+	{
+		pthread_rwlock_unlock( &cow->lock );
+		free( view );
+		return -1;
+	}
+
+	view->cow	= cow;
+	view->layer	= cow->top;
+	if( cow->top )
+	{
+		cow->top->refs++;
+		cow->top->above = layer;
+	}
+	else
+		cow->baseRefs++;
+
+	layer->below	= cow->top;
+	cow->top		= layer;
+	pthread_rwlock_unlock( &cow->lock );
+
+	ZeroMemory( snapshot, sizeof( DISK_OPERATIONS ) );
+	snapshot->read_sector		= diskcow_view_read;
+	snapshot->write_sector		= diskcow_view_write;
+	snapshot->read_sectors		= diskcow_view_read_sectors;
+	snapshot->write_sectors		= diskcow_view_write_sectors;
+	snapshot->numberOfSectors	= this->numberOfSectors;
+	snapshot->bytesPerSector	= this->bytesPerSector;
+	snapshot->pdata				= view;
+
+	return 0;
+}
+
+void diskcow_release( DISK_OPERATIONS* snapshot )
+{
+	DISKCOW_VIEW*	view;
+	DISK_COW*		cow;
+
+	if( snapshot == NULL || snapshot->pdata == NULL )
+		return;
+
+	view	= ( DISKCOW_VIEW* )snapshot->pdata;
+	cow		= view->cow;
+
+	pthread_rwlock_wrlock( &cow->lock );
+	if( view->layer )
+		view->layer->refs--;
+	else
+		cow->baseRefs--;
+	cow_collapse( cow );
+	pthread_rwlock_unlock( &cow->lock );
+
+	free( view );
+	snapshot->pdata = NULL;
+}
+
+/* sectors held in layers, what the snapshots cost beyond the base disk */
+QWORD diskcow_overlay_sectors( DISK_OPERATIONS* this )
+{
+	DISK_COW*		cow = ( DISK_COW* )this->pdata;
+	DISKCOW_LAYER*	layer;
+	QWORD			sectors = 0;
+
+	pthread_rwlock_rdlock( &cow->lock );
+	for( layer = cow->top; layer; layer = layer->below )
+		sectors += layer->slots;
+	pthread_rwlock_unlock( &cow->lock );
+
+	return sectors;
+}
@@ -0,0 +1,27 @@
+/******************************************************************************/
+/*                                                                            */
+/* Project : FAT12/16 File System                                             */
+/* File    : diskcow.h                                                        */
+/* Author  : Kyoungmoon Sun(msg2me@msn.com)                                   */
+/* Company : Dankook Univ. Embedded System Lab.                               */
+/* Notes   : Copy-on-write snapshot disk header                               */
+/* Date    : 2008/7/2                                                         */
+/*                                                                            */
+/******************************************************************************/
+
+#ifndef _DISKCOW_H_
+#define _DISKCOW_H_
+
+#include "common.h"
+#include "disk.h"
+
+#define DISKCOW_LEAF_SHIFT		10		// 1024 sectors per map leaf
+#define DISKCOW_CHUNK_SECTORS	256		// sectors per overlay storage chunk
+
+int diskcow_init( DISK_OPERATIONS*, DISK_OPERATIONS* );
+void diskcow_uninit( DISK_OPERATIONS* );
+int diskcow_snapshot( DISK_OPERATIONS*, DISK_OPERATIONS* );
+void diskcow_release( DISK_OPERATIONS* );
+QWORD diskcow_overlay_sectors( DISK_OPERATIONS* );
+
+#endif
@@ -0,0 +1,454 @@
+/******************************************************************************/
+/*                                                                            */
+/* Project : FAT12/16 File System                                             */
+/* File    : diskflash.c                                                      */
+/* Author  : Kyoungmoon Sun(msg2me@msn.com)                                   */
+/* Company : Dankook Univ. Embedded System Lab.                               */
+/* Notes   : NAND flash simulator                                             */
+/* Date    : 2008/7/2                                                         */
+/*                                                                            */
+/******************************************************************************/
+
+#include <pthread.h>
+#include <sys/mman.h>
+#include "diskflash.h"
+
+#define FLASH_UNMAPPED			0xFFFFFFFF
+#define FLASH_NO_BLOCK			0xFFFFFFFF
+/* free blocks kept back so garbage collection always has somewhere to copy to */
+#define FLASH_GC_RESERVE		2
+
+#define FLASH_BLOCK_FULL		0
+#define FLASH_BLOCK_FREE		1
+#define FLASH_BLOCK_OPEN		2
+
+const DISKFLASH_GEOMETRY DISKFLASH_EMMC =
+{
+	4096,			// 4 KiB pages
+	128,			// 512 KiB erase blocks
+	7,
+	50000,			// 50 us read
+	300000,			// 300 us program
+	3000000			// 3 ms erase
+};
+
+const DISKFLASH_GEOMETRY DISKFLASH_SD =
+{
+	16384,			// 16 KiB pages
+	64,				// 1 MiB erase blocks
+	3,
+	100000,
+	900000,
+	5000000
+};
+
+// FLASH_STREAM
+// 쓰고 있는 block, host 쓰기와 GC 복사는 서로 다른 block에 씀
+typedef struct
+{
+	UINT32	block;
+	UINT32	next;		// block 안에서 다음에 쓸 page
+} FLASH_STREAM;
+
+// DISK_FLASH
+// page 단위 mapping FTL, 덮어쓰기는 항상 새 page에 하고 이전 page는 무효가 됨
+typedef struct
+{
+	DISKFLASH_GEOMETRY	geometry;
+	DISKFLASH_STATS		stats;
+	BYTE*				media;			// 모든 block의 page 내용
+	QWORD				mediaSize;
+	UINT32				logicalPages;
+	UINT32				blocks;
+	UINT32*				map;			// 논리 page -> 물리 page
+	UINT32*				owner;			// 물리 page -> 논리 page
+	UINT32*				valid;			// block별 유효 page 수
+	UINT32*				eraseCounts;	// block별 지운 횟수
+	BYTE*				state;			// FLASH_BLOCK_*
+	UINT32*				freeBlocks;
+	UINT32				freeCount;
+	FLASH_STREAM		host;
+	FLASH_STREAM		gc;
+	BYTE*				page;			// read-modify-write 버퍼
+	pthread_mutex_t		lock;
+} DISK_FLASH;
+
+BYTE* flash_page( DISK_FLASH* flash, UINT32 physical )
+{
+	return flash->media + ( QWORD )physical * flash->geometry.pageSize;
+}
+
+void flash_invalidate( DISK_FLASH* flash, UINT32 logical )
+{
+	UINT32	physical = flash->map[logical];
+
+	if( physical == FLASH_UNMAPPED )
+		return;
+
+	flash->owner[physical] = FLASH_UNMAPPED;
+	flash->valid[physical / flash->geometry.pagesPerBlock]--;
+	flash->map[logical] = FLASH_UNMAPPED;
+}
+
+/* program data as the new copy of a logical page, at the stream's next page */
+int flash_program( DISK_FLASH* flash, FLASH_STREAM* stream, UINT32 logical, const BYTE* data )
+{
+	UINT32	physical;
+
+	if( stream->block == FLASH_NO_BLOCK || stream->next == flash->geometry.pagesPerBlock )
+	{
+		if( stream->block != FLASH_NO_BLOCK )
+			flash->state[stream->block] = FLASH_BLOCK_FULL;
+		if( flash->freeCount == 0 )
+			return -1;
+
+		stream->block	= flash->freeBlocks[--flash->freeCount];
+		stream->next	= 0;
+		flash->state[stream->block] = FLASH_BLOCK_OPEN;
+	}
+
+	physical = stream->block * flash->geometry.pagesPerBlock + stream->next++;
+	memcpy( flash_page( flash, physical ), data, flash->geometry.pageSize );
+
+	flash_invalidate( flash, logical );
+	flash->map[logical]		= physical;
+	flash->owner[physical]	= logical;
+	flash->valid[stream->block]++;
+
+	flash->stats.pagesProgrammed++;
+	flash->stats.timeNs += flash->geometry.programNs;
+
+	return 0;
+}
+
+/* Greedy collection: the full block with the fewest valid pages has them
+   copied to the GC stream, then is erased. Returns the time it took. */
+QWORD flash_collect( DISK_FLASH* flash )
+{
+	DISKFLASH_GEOMETRY*	geometry = &flash->geometry;
+	UINT32				victim = FLASH_NO_BLOCK, block, i, physical, copied;
+	QWORD				cost;
+
+	for( block = 0; block < flash->blocks; block++ )
+	{
+		if( flash->state[block] == FLASH_BLOCK_FULL && ( victim == FLASH_NO_BLOCK || flash->valid[block] < flash->valid[victim] ) )
+			victim = block;
+	}
+
+	// 모든 page가 유효하면 지워서 얻을 것이 없음
+	if( victim == FLASH_NO_BLOCK || flash->valid[victim] == geometry->pagesPerBlock )
+		return 0;
+
+	copied	= flash->valid[victim];
+	cost	= copied * ( geometry->readNs + geometry->programNs ) + geometry->eraseNs;
+
+	for( i = 0; i < geometry->pagesPerBlock && flash->valid[victim]; i++ )
+	{
+		physical = victim * geometry->pagesPerBlock + i;
+		if( flash->owner[physical] == FLASH_UNMAPPED )
+			continue;
+
+		if( flash_program( flash, &flash->gc, flash->owner[physical], flash_page( flash, physical ) ) )
+			return 0;
+		flash->stats.gcPagesCopied++;
+	}
+
+	flash->eraseCounts[victim]++;
+	flash->state[victim] = FLASH_BLOCK_FREE;
+	flash->freeBlocks[flash->freeCount++] = victim;
+
+	flash->stats.gcRuns++;
+	flash->stats.erases++;
+	/* the programs were counted by flash_program */
+	flash->stats.timeNs += copied * geometry->readNs + geometry->eraseNs;
+
+	return cost;
+}
+
+/* a host write waits for as many collections as it takes to refill the reserve */
+int flash_write_page( DISK_FLASH* flash, UINT32 logical, const BYTE* data )
+{
+	QWORD	stall = 0, cost = 1;
+
+	while( flash->freeCount <= FLASH_GC_RESERVE && cost )
+	{
+		cost = flash_collect( flash );
+		stall += cost;
+	}
+
+	if( stall )
+	{
+		flash->stats.stalls++;
+		flash->stats.stallNs += stall;
+	}
+
+	return flash_program( flash, &flash->host, logical, data );
+}
+
+/* the current content of a logical page, zeroes when it isn't mapped */
+void flash_read_page( DISK_FLASH* flash, UINT32 logical, BYTE* data )
+{
+	if( flash->map[logical] == FLASH_UNMAPPED )
+	{
+		memset( data, 0, flash->geometry.pageSize );
+		return;
+	}
+
+	memcpy( data, flash_page( flash, flash->map[logical] ), flash->geometry.pageSize );
+	flash->stats.timeNs += flash->geometry.readNs;
+}
+
+int diskflash_read_sectors( DISK_OPERATIONS* this, SECTOR sector, UINT32 count, void* data )
+{
+	DISK_FLASH*	flash = ( DISK_FLASH* )this->pdata;
+	QWORD		offset = ( QWORD )sector * this->bytesPerSector;
+	QWORD		length = ( QWORD )count * this->bytesPerSector;
+	QWORD		piece, inPage;
+	UINT32		logical;
+	BYTE*		target = ( BYTE* )data;
+
+	if( sector >= this->numberOfSectors || count > this->numberOfSectors - sector )
+		return -1;
+
+	pthread_mutex_lock( &flash->lock );
+	for( ; length; offset += piece, target += piece, length -= piece )
+	{
+		logical	= ( UINT32 )( offset / flash->geometry.pageSize );
+		inPage	= offset % flash->geometry.pageSize;
+		piece	= flash->geometry.pageSize - inPage;
+		if( piece > length )
+			piece = length;
+
+		if( flash->map[logical] == FLASH_UNMAPPED )
+			memset( target, 0, piece );
+		else
+		{
+			memcpy( target, flash_page( flash, flash->map[logical] ) + inPage, piece );
+			flash->stats.timeNs += flash->geometry.readNs;
+		}
+		flash->stats.hostPagesRead++;
+	}
+	pthread_mutex_unlock( &flash->lock );
+
+	return 0;
+}
+
+/* Whole pages are programmed as they are; a page only partly covered is read,
+   merged and programmed again, which the write amplification includes */
+int diskflash_write_sectors( DISK_OPERATIONS* this, SECTOR sector, UINT32 count, const void* data )
+{
+	DISK_FLASH*	flash = ( DISK_FLASH* )this->pdata;
+	QWORD		offset = ( QWORD )sector * this->bytesPerSector;
+	QWORD		length = ( QWORD )count * this->bytesPerSector;
+	QWORD		piece, inPage;
+	UINT32		logical;
+	const BYTE*	source = ( const BYTE* )data;
+	int			result = 0;
+
+	if( sector >= this->numberOfSectors || count > this->numberOfSectors - sector )
+		return -1;
+
+	pthread_mutex_lock( &flash->lock );
+	flash->stats.hostBytesWritten += length;
+	for( ; length && result == 0; offset += piece, source += piece, length -= piece )
+	{
+		logical	= ( UINT32 )( offset / flash->geometry.pageSize );
+		inPage	= offset % flash->geometry.pageSize;
+		piece	= flash->geometry.pageSize - inPage;
+		if( piece > length )
+			piece = length;
+
+		if( piece == flash->geometry.pageSize )
+			result = flash_write_page( flash, logical, source );
+		else
+		{
+			flash_read_page( flash, logical, flash->page );
+			memcpy( flash->page + inPage, source, piece );
+			result = flash_write_page( flash, logical, flash->page );
+			flash->stats.partialWrites++;
+		}
+	}
+	pthread_mutex_unlock( &flash->lock );
+
+	return result;
+}
+
+/* Whole pages are unmapped, so collection no longer copies them; the part of
+   a page at either end is rewritten with zeroes if it holds data */
+int diskflash_discard_sectors( DISK_OPERATIONS* this, SECTOR sector, UINT32 count )
+{
+	DISK_FLASH*	flash = ( DISK_FLASH* )this->pdata;
+	QWORD		offset = ( QWORD )sector * this->bytesPerSector;
+	QWORD		length = ( QWORD )count * this->bytesPerSector;
+	QWORD		piece, inPage;
+	UINT32		logical;
+	int			result = 0;
+
+	if( sector >= this->numberOfSectors || count > this->numberOfSectors - sector )
+		return -1;
+
+	pthread_mutex_lock( &flash->lock );
+	for( ; length && result == 0; offset += piece, length -= piece )
+	{
+		logical	= ( UINT32 )( offset / flash->geometry.pageSize );
+		inPage	= offset % flash->geometry.pageSize;
+		piece	= flash->geometry.pageSize - inPage;
+		if( piece > length )
+			piece = length;
+
+		if( flash->map[logical] == FLASH_UNMAPPED )
+			continue;
+
+		if( piece == flash->geometry.pageSize )
+		{
+			flash_invalidate( flash, logical );
+			flash->stats.discardedPages++;
+		}
+		else
+		{
+			flash_read_page( flash, logical, flash->page );
+			memset( flash->page + inPage, 0, piece );
+			result = flash_write_page( flash, logical, flash->page );
+			flash->stats.partialWrites++;
+		}
+	}
+	pthread_mutex_unlock( &flash->lock );
+
+	return result;
+}
+
+int diskflash_read( DISK_OPERATIONS* this, SECTOR sector, void* data )
+{
+	return diskflash_read_sectors( this, sector, 1, data );
+}
+
+int diskflash_write( DISK_OPERATIONS* this, SECTOR sector, const void* data )
+{
+	return diskflash_write_sectors( this, sector, 1, data );
+}
+
+/* The media holds the logical pages plus overProvision percent, rounded up to
+   whole blocks, and the blocks kept back for collection. It is an anonymous
+   mapping, so pages never programmed cost nothing. */
+int diskflash_init( SECTOR numberOfSectors, unsigned int bytesPerSector, const DISKFLASH_GEOMETRY* geometry, DISK_OPERATIONS* disk )
+{
+	DISK_FLASH*	flash;
+	QWORD		logicalPages, physicalPages;
+	UINT32		i;
+
+	if( disk == NULL || geometry == NULL || bytesPerSector == 0 || geometry->pageSize % bytesPerSector || geometry->pagesPerBlock == 0 )
+		return -1;
+
+	logicalPages = ( ( QWORD )numberOfSectors * bytesPerSector + geometry->pageSize - 1 ) / geometry->pageSize;
+	if( logicalPages >= FLASH_UNMAPPED / 2 )
+		return -1;
+
+	ZeroMemory( disk, sizeof( DISK_OPERATIONS ) );
+
+	flash = ( DISK_FLASH* )calloc( 1, sizeof( DISK_FLASH ) );
+	if( flash == NULL )
+		return -1;
+
+	flash->geometry		= *geometry;
+	flash->logicalPages	= ( UINT32 )logicalPages;
+	flash->blocks		= ( UINT32 )( ( logicalPages * ( 100 + geometry->overProvision ) / 100 + geometry->pagesPerBlock - 1 ) / geometry->pagesPerBlock ) +
+						  FLASH_GC_RESERVE + 2;
+	physicalPages		= ( QWORD )flash->blocks * geometry->pagesPerBlock;
+	flash->mediaSize	= physicalPages * geometry->pageSize;
+
+	flash->media = ( BYTE* )mmap( NULL, flash->mediaSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0 );
+	if( flash->media == MAP_FAILED )
+		flash->media = NULL;
+
+	flash->map			= ( UINT32* )malloc( logicalPages * sizeof( UINT32 ) );
+	flash->owner		= ( UINT32* )malloc( physicalPages * sizeof( UINT32 ) );
+	flash->valid		= ( UINT32* )calloc( flash->blocks, sizeof( UINT32 ) );
+	flash->eraseCounts	= ( UINT32* )calloc( flash->blocks, sizeof( UINT32 ) );
+	flash->state		= ( BYTE* )malloc( flash->blocks );
+	flash->freeBlocks	= ( UINT32* )malloc( flash->blocks * sizeof( UINT32 ) );
+	flash->page			= ( BYTE* )malloc( geometry->pageSize );
+
+	disk->pdata = flash;
+	if( flash->media == NULL || flash->map == NULL || flash->owner == NULL || flash->valid == NULL || flash->eraseCounts == NULL ||
+		flash->state == NULL || flash->freeBlocks == NULL || flash->page == NULL )
+	{
+		diskflash_uninit( disk );
+		return -1;
+	}
+
+	memset( flash->map, 0xFF, logicalPages * sizeof( UINT32 ) );
+	memset( flash->owner, 0xFF, physicalPages * sizeof( UINT32 ) );
+	memset( flash->state, FLASH_BLOCK_FREE, flash->blocks );
+
+	// 낮은 번호의 block부터 쓰도록 거꾸로 쌓음
+	for( i = 0; i < flash->blocks; i++ )
+		flash->freeBlocks[i] = flash->blocks - 1 - i;
+	flash->freeCount = flash->blocks;
+
+	flash->host.block	= FLASH_NO_BLOCK;
+	flash->gc.block		= FLASH_NO_BLOCK;
+	pthread_mutex_init( &flash->lock, NULL );
+
+	disk->read_sector		= diskflash_read;
+	disk->write_sector		= diskflash_write;
+	disk->read_sectors		= diskflash_read_sectors;
+	disk->write_sectors		= diskflash_write_sectors;
+	disk->discard_sectors	= diskflash_discard_sectors;
+	disk->numberOfSectors	= numberOfSectors;
+	disk->bytesPerSector	= bytesPerSector;
+
+	return 0;
+}
+
+void diskflash_uninit( DISK_OPERATIONS* this )
+{
+	DISK_FLASH*	flash;
+
+	if( this == NULL || this->pdata == NULL )
+		return;
+
+	flash = ( DISK_FLASH* )this->pdata;
+	if( flash->media )
+	{
+		munmap( flash->media, flash->mediaSize );
+		pthread_mutex_destroy( &flash->lock );
+	}
+
+	free( flash->map );
+	free( flash->owner );
+	free( flash->valid );
+	free( flash->eraseCounts );
+	free( flash->state );
+	free( flash->freeBlocks );
+	free( flash->page );
+	free( flash );
+	this->pdata = NULL;
+}
+
+void diskflash_get_stats( DISK_OPERATIONS* this, DISKFLASH_STATS* stats )
+{
+	DISK_FLASH*	flash = ( DISK_FLASH* )this->pdata;
+	UINT32		block;
+
+	pthread_mutex_lock( &flash->lock );
+	*stats = flash->stats;
+	stats->minEraseCount = flash->eraseCounts[0];
+	for( block = 0; block < flash->blocks; block++ )
+	{
+		if( flash->eraseCounts[block] > stats->maxEraseCount )
+			stats->maxEraseCount = flash->eraseCounts[block];
+		if( flash->eraseCounts[block] < stats->minEraseCount )
+			stats->minEraseCount = flash->eraseCounts[block];
+	}
+	pthread_mutex_unlock( &flash->lock );
+}
+
+/* the counters start over, the wear of the blocks stays */
+void diskflash_reset_stats( DISK_OPERATIONS* this )
+{
+	DISK_FLASH*	flash = ( DISK_FLASH* )this->pdata;
+
+	pthread_mutex_lock( &flash->lock );
+	ZeroMemory( &flash->stats, sizeof( DISKFLASH_STATS ) );
+	pthread_mutex_unlock( &flash->lock );
+}
@@ -0,0 +1,56 @@
+/******************************************************************************/
+/*                                                                            */
+/* Project : FAT12/16 File System                                             */
+/* File    : diskflash.h                                                      */
+/* Author  : Kyoungmoon Sun(msg2me@msn.com)                                   */
+/* Company : Dankook Univ. Embedded System Lab.                               */
+/* Notes   : NAND flash simulator header                                      */
+/* Date    : 2008/7/2                                                         */
+/*                                                                            */
+/******************************************************************************/
+
+#ifndef _DISKFLASH_H_
+#define _DISKFLASH_H_
+
+#include "common.h"
+#include "disk.h"
+
+// DISKFLASH_GEOMETRY
+// NAND 배치와 동작 시간, 시간은 통계에만 쓰이고 실제로 기다리지 않음
+typedef struct
+{
+	UINT32	pageSize;			// 쓰기 단위, sector 크기의 배수
+	UINT32	pagesPerBlock;		// 지우기 단위
+	UINT32	overProvision;		// 논리 용량 외에 더 두는 block, 퍼센트
+	QWORD	readNs;				// page 하나
+	QWORD	programNs;
+	QWORD	eraseNs;			// block 하나
+} DISKFLASH_GEOMETRY;
+
+typedef struct
+{
+	QWORD	hostBytesWritten;	// 요청받은 양
+	QWORD	hostPagesRead;
+	QWORD	pagesProgrammed;	// 실제로 쓴 page, host + read-modify-write + GC
+	QWORD	partialWrites;		// page 일부만 덮어써서 읽고 다시 쓴 page
+	QWORD	gcRuns;				// 지운 victim block
+	QWORD	gcPagesCopied;		// GC가 옮긴 유효 page
+	QWORD	erases;
+	UINT32	maxEraseCount;		// block별 지운 횟수의 최대, 최소
+	UINT32	minEraseCount;
+	QWORD	discardedPages;
+	QWORD	stalls;				// GC를 기다려야 했던 host 쓰기
+	QWORD	stallNs;			// 그 GC에 든 시간
+	QWORD	timeNs;				// 전체 NAND 동작 시간
+} DISKFLASH_STATS;
+
+/* eMMC and SD card like media */
+extern const DISKFLASH_GEOMETRY	DISKFLASH_EMMC;
+extern const DISKFLASH_GEOMETRY	DISKFLASH_SD;
+
+int diskflash_init( SECTOR, unsigned int, const DISKFLASH_GEOMETRY*, DISK_OPERATIONS* );
+void diskflash_uninit( DISK_OPERATIONS* );
+void diskflash_get_stats( DISK_OPERATIONS*, DISKFLASH_STATS* );
+void diskflash_reset_stats( DISK_OPERATIONS* );
+
+#endif
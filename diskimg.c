@@ -0,0 +1,327 @@
+/******************************************************************************/
+/*                                                                            */
+/* Project : FAT12/16 File System                                             */
+/* File    : diskimg.c                                                        */
+/* Author  : Kyoungmoon Sun(msg2me@msn.com)                                   */
+/* Company : Dankook Univ. Embedded System Lab.                               */
+/* Notes   : Image file disk                                                  */
+/* Date    : 2008/7/2                                                         */
+/*                                                                            */
+/******************************************************************************/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "diskimg.h"
+
+#ifdef __NR_io_uring_setup
+#include <linux/io_uring.h>
+#define DISKIMG_URING
+#endif
+
+typedef struct
+{
+	int		fd;
+} DISK_IMAGE;
+
+int diskimg_read_sectors( DISK_OPERATIONS* this, SECTOR sector, UINT32 count, void* data )
+{
+	DISK_IMAGE*	image = ( DISK_IMAGE* )this->pdata;
+	size_t		length = ( size_t )count * this->bytesPerSector;
+
+	if( sector >= this->numberOfSectors || count > this->numberOfSectors - sector )
+		return -1;
+
+	return ( pread( image->fd, data, length, ( off_t )sector * this->bytesPerSector ) == ( ssize_t )length ? 0 : -1 );
+}
+
+int diskimg_write_sectors( DISK_OPERATIONS* this, SECTOR sector, UINT32 count, const void* data )
+{
+	DISK_IMAGE*	image = ( DISK_IMAGE* )this->pdata;
+	size_t		length = ( size_t )count * this->bytesPerSector;
+
+	if( sector >= this->numberOfSectors || count > this->numberOfSectors - sector )
+		return -1;
+
+	return ( pwrite( image->fd, data, length, ( off_t )sector * this->bytesPerSector ) == ( ssize_t )length ? 0 : -1 );
+}
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+/* punch a hole, the file system gives the blocks back and reads them as zeroes */
+int diskimg_discard_sectors( DISK_OPERATIONS* this, SECTOR sector, UINT32 count )
+{
+	DISK_IMAGE*	image = ( DISK_IMAGE* )this->pdata;
+
+	if( sector >= this->numberOfSectors || count > this->numberOfSectors - sector )
+		return -1;
+
+	return fallocate( image->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+					  ( off_t )sector * this->bytesPerSector, ( off_t )count * this->bytesPerSector );
+}
+#endif
+
+int diskimg_read( DISK_OPERATIONS* this, SECTOR sector, void* data )
+{
+	return diskimg_read_sectors( this, sector, 1, data );
+}
+
+int diskimg_write( DISK_OPERATIONS* this, SECTOR sector, const void* data )
+{
+	return diskimg_write_sectors( this, sector, 1, data );
+}
+
+#ifdef DISKIMG_URING
+// DISK_URING
+// queue 하나의 io_uring, ring들은 kernel과 공유하는 mmap 영역
+typedef struct
+{
+	int						fd;
+	BYTE*					sqRing;
+	BYTE*					cqRing;
+	size_t					sqRingSize;
+	size_t					cqRingSize;
+	struct io_uring_sqe*	sqes;
+	size_t					sqesSize;
+	unsigned*				sqTail;
+	unsigned*				sqMask;
+	unsigned*				sqArray;
+	unsigned*				cqHead;
+	unsigned*				cqTail;
+	unsigned*				cqMask;
+	struct io_uring_cqe*	cqes;
+} DISK_URING;
+
+void diskimg_uring_release( DISK_QUEUE* queue )
+{
+	DISK_URING*	ring = ( DISK_URING* )queue->pdata;
+
+	if( ring == NULL )
+		return;
+
+	if( ring->sqes )
+		munmap( ring->sqes, ring->sqesSize );
+	if( ring->cqRing && ring->cqRing != ring->sqRing )
+		munmap( ring->cqRing, ring->cqRingSize );
+	if( ring->sqRing )
+		munmap( ring->sqRing, ring->sqRingSize );
+	close( ring->fd );
+
+	free( ring );
+	queue->pdata = NULL;
+}
+
+int diskimg_uring_init( DISK_OPERATIONS* disk, DISK_QUEUE* queue )
+{
+	struct io_uring_params	params;
+	DISK_URING*				ring;
+
+	( void )disk;
+	ring = ( DISK_URING* )calloc( 1, sizeof( DISK_URING ) );
+	if( ring == NULL )
+		return -1;
+
+	ZeroMemory( &params, sizeof( params ) );
+	ring->fd = syscall( __NR_io_uring_setup, DISK_QUEUE_DEPTH, &params );
+	if( ring->fd < 0 )
+	{
+		free( ring );
+		return -1;
+	}
+	queue->pdata = ring;
+
+	ring->sqRingSize	= params.sq_off.array + params.sq_entries * sizeof( unsigned );
+	ring->cqRingSize	= params.cq_off.cqes + params.cq_entries * sizeof( struct io_uring_cqe );
+	ring->sqesSize		= params.sq_entries * sizeof( struct io_uring_sqe );
+	if( params.features & IORING_FEAT_SINGLE_MMAP )
+		ring->sqRingSize = ring->cqRingSize = ( ring->sqRingSize > ring->cqRingSize ? ring->sqRingSize : ring->cqRingSize );
+
+	ring->sqRing = ( BYTE* )mmap( NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING );
+	if( ring->sqRing == MAP_FAILED )
+		ring->sqRing = NULL;
+
+	if( params.features & IORING_FEAT_SINGLE_MMAP )
+		ring->cqRing = ring->sqRing;
+	else
+	{
+		ring->cqRing = ( BYTE* )mmap( NULL, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING );
+		if( ring->cqRing == MAP_FAILED )
+			ring->cqRing = NULL;
+	}
+
+	ring->sqes = ( struct io_uring_sqe* )mmap( NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES );
+	if( ring->sqes == MAP_FAILED )
+		ring->sqes = NULL;
+
+	if( ring->sqRing == NULL || ring->cqRing == NULL || ring->sqes == NULL )
+	{
+		diskimg_uring_release( queue );
+		return -1;
+	}
+
+	ring->sqTail	= ( unsigned* )( ring->sqRing + params.sq_off.tail );
+	ring->sqMask	= ( unsigned* )( ring->sqRing + params.sq_off.ring_mask );
+	ring->sqArray	= ( unsigned* )( ring->sqRing + params.sq_off.array );
+	ring->cqHead	= ( unsigned* )( ring->cqRing + params.cq_off.head );
+	ring->cqTail	= ( unsigned* )( ring->cqRing + params.cq_off.tail );
+	ring->cqMask	= ( unsigned* )( ring->cqRing + params.cq_off.ring_mask );
+	ring->cqes		= ( struct io_uring_cqe* )( ring->cqRing + params.cq_off.cqes );
+
+	return 0;
+}
+
+/* the whole batch goes to the kernel with one system call; disk_submit keeps
+   the queue within DISK_QUEUE_DEPTH, so the ring never fills */
+int diskimg_uring_submit( DISK_QUEUE* queue, DISK_REQUEST** requests, UINT32 count )
+{
+	DISK_URING*				ring = ( DISK_URING* )queue->pdata;
+	DISK_OPERATIONS*		disk = queue->disk;
+	struct io_uring_sqe*	sqe;
+	unsigned				tail = *ring->sqTail, index;
+	UINT32					i;
+	int						submitted;
+
+	for( i = 0; i < count; i++ )
+	{
+		if( requests[i]->sector >= disk->numberOfSectors || requests[i]->count > disk->numberOfSectors - requests[i]->sector )
+			return -1;
+	}
+
+	for( i = 0; i < count; i++, tail++ )
+	{
+		index	= tail & *ring->sqMask;
+		sqe		= &ring->sqes[index];
+
+		ZeroMemory( sqe, sizeof( struct io_uring_sqe ) );
+		sqe->opcode		= ( requests[i]->write ? IORING_OP_WRITE : IORING_OP_READ );
+		sqe->fd			= ( ( DISK_IMAGE* )disk->pdata )->fd;
+		sqe->off		= ( QWORD )requests[i]->sector * disk->bytesPerSector;
+		sqe->addr		= ( QWORD )( size_t )requests[i]->data;
+		sqe->len		= requests[i]->count * disk->bytesPerSector;
+		sqe->user_data	= ( QWORD )( size_t )requests[i];
+
+		ring->sqArray[index] = index;
+		requests[i]->queue = queue;
+	}
+	__atomic_store_n( ring->sqTail, tail, __ATOMIC_RELEASE );
+
+	/* once in the ring the entries can't be taken back, so keep entering
+	   until the kernel has consumed them all */
+	while( count )
+	{
+		submitted = syscall( __NR_io_uring_enter, ring->fd, count, 0, 0, NULL, 0 );
+		if( submitted < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY )
+			return -1;
+		if( submitted > 0 )
+			count -= submitted;
+	}
+
+	return 0;
+}
+
+int diskimg_uring_reap( DISK_QUEUE* queue, DISK_REQUEST** completed, UINT32 min, UINT32 max )
+{
+	DISK_URING*				ring = ( DISK_URING* )queue->pdata;
+	struct io_uring_cqe*	cqe;
+	DISK_REQUEST*			request;
+	unsigned				head = *ring->cqHead;
+	UINT32					count = 0;
+
+	while( min > 0 && syscall( __NR_io_uring_enter, ring->fd, 0, min, IORING_ENTER_GETEVENTS, NULL, 0 ) < 0 )
+	{
+		if( errno != EINTR )
+			return -1;
+	}
+
+	while( count < max && head != __atomic_load_n( ring->cqTail, __ATOMIC_ACQUIRE ) )
+	{
+		cqe		= &ring->cqes[head & *ring->cqMask];
+		request	= ( DISK_REQUEST* )( size_t )cqe->user_data;
+
+		request->result = ( cqe->res == ( int )( request->count * queue->disk->bytesPerSector ) ? 0 : -1 );
+		completed[count++] = request;
+		head++;
+	}
+	__atomic_store_n( ring->cqHead, head, __ATOMIC_RELEASE );
+
+	return count;
+}
+#endif
+
+/* The image file is created when missing and extended to the disk size; the
+   extension is a hole, so a fresh image costs no space. Requests are queued
+   with io_uring when the kernel has it, otherwise disk_async_init can give
+   the disk a thread pool. */
+int diskimg_init( const char* path, SECTOR numberOfSectors, unsigned int bytesPerSector, DISK_OPERATIONS* disk )
+{
+	DISK_IMAGE*		image;
+	struct stat		status;
+	off_t			size = ( off_t )numberOfSectors * bytesPerSector;
+
+	if( disk == NULL )
+		return -1;
+
+	ZeroMemory( disk, sizeof( DISK_OPERATIONS ) );
+
+	image = ( DISK_IMAGE* )calloc( 1, sizeof( DISK_IMAGE ) );
+	if( image == NULL )
+		return -1;
+
+	image->fd = open( path, O_RDWR | O_CREAT, 0644 );
+	if( image->fd < 0 || fstat( image->fd, &status ) || ( status.st_size < size && ftruncate( image->fd, size ) ) )
+	{
+		if( image->fd >= 0 )
+			close( image->fd );
+		free( image );
+		return -1;
+	}
+
+	disk->pdata				= image;
+	disk->read_sector		= diskimg_read;
+	disk->write_sector		= diskimg_write;
+	disk->read_sectors		= diskimg_read_sectors;
+	disk->write_sectors		= diskimg_write_sectors;
+#ifdef FALLOC_FL_PUNCH_HOLE
+	disk->discard_sectors	= diskimg_discard_sectors;
+#endif
+	disk->numberOfSectors	= numberOfSectors;
+	disk->bytesPerSector	= bytesPerSector;
+
+#ifdef DISKIMG_URING
+	{
+		DISK_QUEUE	probe;
+
+		/* a kernel without io_uring, or a sandbox denying it, fails here */
+		probe.disk = disk;
+		probe.pdata = NULL;
+		if( diskimg_uring_init( disk, &probe ) == 0 )
+		{
+			diskimg_uring_release( &probe );
+			disk->queue_init	= diskimg_uring_init;
+			disk->queue_release	= diskimg_uring_release;
+			disk->submit		= diskimg_uring_submit;
+			disk->reap			= diskimg_uring_reap;
+		}
+	}
+#endif
+
+	return 0;
+}
+
+void diskimg_uninit( DISK_OPERATIONS* this )
+{
+	DISK_IMAGE*	image;
+
+	if( this && this->pdata )
+	{
+		image = ( DISK_IMAGE* )this->pdata;
+		fsync( image->fd );
+		close( image->fd );
+
+		free( this->pdata );
+		this->pdata = NULL;
+	}
+}
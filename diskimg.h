@@ -0,0 +1,21 @@
+/******************************************************************************/
+/*                                                                            */
+/* Project : FAT12/16 File System                                             */
+/* File    : diskimg.h                                                        */
+/* Author  : Kyoungmoon Sun(msg2me@msn.com)                                   */
+/* Company : Dankook Univ. Embedded System Lab.                               */
+/* Notes   : Image file disk header                                           */
+/* Date    : 2008/7/2                                                         */
+/*                                                                            */
+/******************************************************************************/
+
+#ifndef _DISKIMG_H_
+#define _DISKIMG_H_
+
+#include "common.h"
+#include "disk.h"
+
+int diskimg_init( const char* path, SECTOR, unsigned int, DISK_OPERATIONS* );
+void diskimg_uninit( DISK_OPERATIONS* );
+
+#endif
@@ -11,6 +11,9 @@
 
 #include <stdlib.h>
 #include <memory.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <pthread.h>
 #include "fat.h"
 #include "disk.h"
 #include "disksim.h"
@@ -18,55 +21,239 @@
 typedef struct
 {
 	char*	address;
+	QWORD	size;		// 디스크 전체 byte 수
+	QWORD	pageSize;
+
+	// timing model, disksim_set_timing으로 켬
+	int				timed;
+	DISKSIM_TIMING	timing;
+	DISKSIM_STATS	stats;
+	SECTOR			head;		// 마지막 요청이 끝난 sector
+	pthread_mutex_t	lock;		// 여러 thread가 같은 virtual clock을 씀
 } DISK_MEMORY;
 
+const DISKSIM_TIMING DISKSIM_HDD =
+{
+	0,
+	50000,			// 50 us controller overhead
+	50000,
+	150000000,		// 150 MB/s media rate
+	1000000,		// 1 ms track to track
+	18000000,		// 18 ms full stroke
+	8333333			// 7200 rpm
+};
+
+const DISKSIM_TIMING DISKSIM_SSD =
+{
+	1,
+	80000,			// 80 us page read
+	25000,			// 25 us into the write cache
+	520000000,		// SATA 3
+	0,
+	0,
+	0
+};
+
 int disksim_read( DISK_OPERATIONS* this, SECTOR sector, void* data );
 int disksim_write( DISK_OPERATIONS* this, SECTOR sector, const void* data );
+int disksim_read_sectors( DISK_OPERATIONS* this, SECTOR sector, UINT32 count, void* data );
+int disksim_write_sectors( DISK_OPERATIONS* this, SECTOR sector, UINT32 count, const void* data );
+int disksim_discard_sectors( DISK_OPERATIONS* this, SECTOR sector, UINT32 count );
 
 int disksim_init( SECTOR numberOfSectors, unsigned int bytesPerSector, DISK_OPERATIONS* disk ) // 초기화
 {
+	DISK_MEMORY*	memory;
+
 	if( disk == NULL ) // 디스크 공간x
 		return -1;
 
+	ZeroMemory( disk, sizeof( DISK_OPERATIONS ) );
+
 	// 디스크 메모리를 할당받았을 때 그 메모리를 가리키는 주소를 저장하기 위한 공간을 할당받음
-	// malloc의 결과로 할당된 메모리 공간의 void pointer를 return함
 	// 디스크 공간을 가리키는 포인터를 디스크구조체가 가지고있게 됨
-	disk->pdata = malloc( sizeof( DISK_MEMORY ) ); 
+	disk->pdata = calloc( 1, sizeof( DISK_MEMORY ) ); 
 	
 	// 메모리 공간이 부족할 경우 null이 return됨
 	if( disk->pdata == NULL )
-	{
-		// 해제해줌
-		disksim_uninit( disk );
 		return -1;
-	}
 
-	// main에서 요청한 disk 크기만큼 할당해서 아까 할당받은 공간의 주소변수에 연결
-	( ( DISK_MEMORY* )disk->pdata )->address = ( char* )malloc( bytesPerSector * numberOfSectors );
+	/* The disk is an anonymous mapping reserved without swap accounting: pages
+	   are only backed by memory once written, and read as zero until then, so
+	   an image of a few TiB costs what has been written to it. Sizes and
+	   offsets are 64 bit. */
+	memory				= ( DISK_MEMORY* )disk->pdata;
+	memory->size		= ( QWORD )bytesPerSector * numberOfSectors;
+	memory->pageSize	= sysconf( _SC_PAGESIZE );
+	memory->address		= ( char* )mmap( NULL, memory->size, PROT_READ | PROT_WRITE,
+										 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0 );
 	
-	if( disk->pdata == NULL )
+	if( memory->address == MAP_FAILED )
 	{
+		memory->address = NULL;
 		disksim_uninit( disk );
 		return -1;
 	}
+	pthread_mutex_init( &memory->lock, NULL );
 
 	// main에서 사용할 DISK_OPERATIONS 구조체에 디스크 특정 함수를 등록해주고, 디스크 크기도 등록함
 	disk->read_sector	= disksim_read;
 	disk->write_sector	= disksim_write;
+	disk->read_sectors	= disksim_read_sectors;
+	disk->write_sectors	= disksim_write_sectors;
+	disk->discard_sectors	= disksim_discard_sectors;
 	disk->numberOfSectors	= numberOfSectors;
 	disk->bytesPerSector	= bytesPerSector;
 
 	return 0;
 }
 
-// 동적 할당받은 disk->pdata 해제
+// 동적 할당받은 disk->pdata와 디스크 공간 해제
 void disksim_uninit( DISK_OPERATIONS* this )
 {
-	if( this )
+	DISK_MEMORY*	memory;
+
+	if( this && this->pdata )
+	{
+		memory = ( DISK_MEMORY* )this->pdata;
+		if( memory->address )
+		{
+			munmap( memory->address, memory->size );
+			pthread_mutex_destroy( &memory->lock );
+		}
+
+		free( this->pdata );
+		this->pdata = NULL;
+	}
+}
+
+/* NULL turns the model off; the statistics start over either way */
+void disksim_set_timing( DISK_OPERATIONS* this, const DISKSIM_TIMING* timing )
+{
+	DISK_MEMORY*	memory = ( DISK_MEMORY* )this->pdata;
+
+	pthread_mutex_lock( &memory->lock );
+	memory->timed = ( timing != NULL );
+	if( timing )
+		memory->timing = *timing;
+	ZeroMemory( &memory->stats, sizeof( DISKSIM_STATS ) );
+	memory->head = 0;
+	pthread_mutex_unlock( &memory->lock );
+}
+
+void disksim_get_stats( DISK_OPERATIONS* this, DISKSIM_STATS* stats )
+{
+	DISK_MEMORY*	memory = ( DISK_MEMORY* )this->pdata;
+
+	pthread_mutex_lock( &memory->lock );
+	*stats = memory->stats;
+	pthread_mutex_unlock( &memory->lock );
+}
+
+void disksim_reset_stats( DISK_OPERATIONS* this )
+{
+	DISK_MEMORY*	memory = ( DISK_MEMORY* )this->pdata;
+
+	pthread_mutex_lock( &memory->lock );
+	ZeroMemory( &memory->stats, sizeof( DISKSIM_STATS ) );
+	pthread_mutex_unlock( &memory->lock );
+}
+
+QWORD disksim_sqrt( QWORD value )
+{
+	QWORD	root = 0, bit = ( QWORD )1 << 62;
+
+	while( bit > value )
+		bit >>= 2;
+
+	while( bit )
 	{
-		if( this->pdata )
-			free( this->pdata );
+		if( value >= root + bit )
+		{
+			value -= root + bit;
+			root = ( root >> 1 ) + bit;
+		}
+		else
+			root >>= 1;
+		bit >>= 2;
 	}
+
+	return root;
+}
+
+/* Charge one request to the virtual clock: the fixed latency, then for a disk
+   that has to move a seek growing with the square root of the distance plus
+   half a revolution, then the transfer. The device serves one request at a
+   time, so concurrent callers simply add up. */
+void disksim_account( DISK_OPERATIONS* this, SECTOR sector, UINT32 count, int write )
+{
+	DISK_MEMORY*	memory = ( DISK_MEMORY* )this->pdata;
+	DISKSIM_TIMING*	timing = &memory->timing;
+	QWORD			bytes = ( QWORD )count * this->bytesPerSector;
+	QWORD			distance, seek = 0, transfer = 0;
+
+	if( !memory->timed )
+		return;
+
+	pthread_mutex_lock( &memory->lock );
+
+	if( !timing->ssd && sector != memory->head )
+	{
+		distance = ( sector > memory->head ? sector - memory->head : memory->head - sector );
+		// sqrt( distance / numberOfSectors ) in 16 bit fixed point
+		seek = timing->seekMinNs + ( ( timing->seekMaxNs - timing->seekMinNs ) *
+			   disksim_sqrt( ( distance << 32 ) / this->numberOfSectors ) >> 16 ) + timing->rotationNs / 2;
+		memory->stats.seeks++;
+	}
+
+	if( timing->bytesPerSecond )
+		transfer = bytes / timing->bytesPerSecond * 1000000000 + bytes % timing->bytesPerSecond * 1000000000 / timing->bytesPerSecond;
+
+	memory->stats.timeNs		+= ( write ? timing->writeLatencyNs : timing->readLatencyNs ) + seek + transfer;
+	memory->stats.seekNs		+= seek;
+	memory->stats.transferNs	+= transfer;
+	if( write )
+	{
+		memory->stats.writes++;
+		memory->stats.sectorsWritten += count;
+	}
+	else
+	{
+		memory->stats.reads++;
+		memory->stats.sectorsRead += count;
+	}
+	memory->head = sector + count;
+
+	pthread_mutex_unlock( &memory->lock );
+}
+
+/* zero a range, giving the whole pages in it back */
+void disksim_zero( DISK_MEMORY* memory, QWORD offset, QWORD length )
+{
+	QWORD	first = ( offset + memory->pageSize - 1 ) / memory->pageSize * memory->pageSize;
+	QWORD	last = ( offset + length ) / memory->pageSize * memory->pageSize;
+
+	if( last <= first )
+	{
+		memset( memory->address + offset, 0, length );
+		return;
+	}
+
+	memset( memory->address + offset, 0, first - offset );
+	madvise( memory->address + first, last - first, MADV_DONTNEED );
+	memset( memory->address + last, 0, offset + length - last );
+}
+
+/* Zeroes written over whole pages give the pages back instead of being
+   copied, so formatting a large area keeps the image sparse */
+void disksim_store( DISK_MEMORY* memory, QWORD offset, const void* data, QWORD length )
+{
+	if( length >= memory->pageSize && is_zero_data( ( const char* )data, length ) )
+	{
+		disksim_zero( memory, offset, length );
+		return;
+	}
+
+	memcpy( memory->address + offset, data, length );
 }
 
 // disk의 sector위치에 있는 내용을 sector 크기만큼 요청받은 data주소에 복사
@@ -74,11 +261,12 @@ int disksim_read( DISK_OPERATIONS* this, SECTOR sector, void* data )
 {
 	char* disk = ( ( DISK_MEMORY* )this->pdata )->address; // 처리할 섹터의 데이터 주소
 
-	if( sector < 0 || sector >= this->numberOfSectors )
+	if( sector >= this->numberOfSectors )
 		return -1;
 
 	//disk의 데이터를 data에 복사(sector크기만큼)
-	memcpy( data, &disk[sector * this->bytesPerSector], this->bytesPerSector ); 
+	memcpy( data, &disk[( QWORD )sector * this->bytesPerSector], this->bytesPerSector ); 
+	disksim_account( this, sector, 1, 0 );
 
 	return 0;
 }
@@ -86,15 +274,60 @@ int disksim_read( DISK_OPERATIONS* this, SECTOR sector, void* data )
 // 요청한 data주소에 있는 내용을 disk의 sector 위치에 복사
 int disksim_write( DISK_OPERATIONS* this, SECTOR sector, const void* data )
 {
-	char* disk = ( ( DISK_MEMORY* )this->pdata )->address; // 처리할 디스크 주소
-
-	// 섹터 번호가 0보다 작거나 지정된 크기보다 크면 에러
-	if( sector < 0 || sector >= this->numberOfSectors )
+	// 섹터 번호가 지정된 크기보다 크면 에러
+	if( sector >= this->numberOfSectors )
 		return -1;
 
 	// 해당 섹터 주소에 data가 가리키는 곳부터 섹터크기만큼을 복사해줌
-	memcpy( &disk[sector * this->bytesPerSector], data, this->bytesPerSector ); // data를 디스크에 쓰기
+	disksim_store( ( DISK_MEMORY* )this->pdata, ( QWORD )sector * this->bytesPerSector, data, this->bytesPerSector ); // data를 디스크에 쓰기
+	disksim_account( this, sector, 1, 1 );
 
 	return 0;
 }
 
+// sector부터 count개의 sector를 한번의 복사로 읽음
+int disksim_read_sectors( DISK_OPERATIONS* this, SECTOR sector, UINT32 count, void* data )
+{
+	char* disk = ( ( DISK_MEMORY* )this->pdata )->address;
+
+	if( sector >= this->numberOfSectors || count > this->numberOfSectors - sector )
+		return -1;
+
+	memcpy( data, &disk[( QWORD )sector * this->bytesPerSector], ( QWORD )count * this->bytesPerSector );
+	disksim_account( this, sector, count, 0 );
+
+	return 0;
+}
+
+// sector부터 count개의 sector를 한번의 복사로 씀
+int disksim_write_sectors( DISK_OPERATIONS* this, SECTOR sector, UINT32 count, const void* data )
+{
+	if( sector >= this->numberOfSectors || count > this->numberOfSectors - sector )
+		return -1;
+
+	disksim_store( ( DISK_MEMORY* )this->pdata, ( QWORD )sector * this->bytesPerSector, data, ( QWORD )count * this->bytesPerSector );
+	disksim_account( this, sector, count, 1 );
+
+	return 0;
+}
+
+
+// 해제된 sector들, 메모리를 돌려주고 0으로 읽히게 함
+int disksim_discard_sectors( DISK_OPERATIONS* this, SECTOR sector, UINT32 count )
+{
+	DISK_MEMORY*	memory = ( DISK_MEMORY* )this->pdata;
+
+	if( sector >= this->numberOfSectors || count > this->numberOfSectors - sector )
+		return -1;
+
+	disksim_zero( memory, ( QWORD )sector * this->bytesPerSector, ( QWORD )count * this->bytesPerSector );
+	if( memory->timed )
+	{
+		pthread_mutex_lock( &memory->lock );
+		memory->stats.discards++;
+		memory->stats.sectorsDiscarded += count;
+		pthread_mutex_unlock( &memory->lock );
+	}
+
+	return 0;
+}
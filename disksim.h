@@ -14,7 +14,41 @@
 
 #include "common.h"
 
+// DISKSIM_TIMING
+// optional device model, charged to a virtual clock instead of sleeping
+typedef struct
+{
+	int		ssd;				// 1 : no seek or rotation, only latency and transfer
+	QWORD	readLatencyNs;		// fixed cost of every read request
+	QWORD	writeLatencyNs;		// fixed cost of every write request
+	QWORD	bytesPerSecond;		// transfer rate, 0 for unlimited
+	QWORD	seekMinNs;			// track to track, the shortest non sequential move
+	QWORD	seekMaxNs;			// full stroke, grows with the square root of the distance
+	QWORD	rotationNs;			// one revolution, half of it is waited after a seek
+} DISKSIM_TIMING;
+
+typedef struct
+{
+	QWORD	timeNs;				// virtual time the device has been busy
+	QWORD	reads;				// requests
+	QWORD	writes;
+	QWORD	sectorsRead;
+	QWORD	sectorsWritten;
+	QWORD	discards;			// discard requests, free of time
+	QWORD	sectorsDiscarded;
+	QWORD	seeks;				// requests that did not continue the previous one
+	QWORD	seekNs;				// seek and rotation share of timeNs
+	QWORD	transferNs;			// transfer share of timeNs
+} DISKSIM_STATS;
+
+/* 7200 rpm disk and SATA SSD defaults */
+extern const DISKSIM_TIMING	DISKSIM_HDD;
+extern const DISKSIM_TIMING	DISKSIM_SSD;
+
 int disksim_init( SECTOR, unsigned int, DISK_OPERATIONS* );
 void disksim_uninit( DISK_OPERATIONS* );
+void disksim_set_timing( DISK_OPERATIONS*, const DISKSIM_TIMING* );
+void disksim_get_stats( DISK_OPERATIONS*, DISKSIM_STATS* );
+void disksim_reset_stats( DISK_OPERATIONS* );
 
 #endif
@@ -0,0 +1,268 @@
+/******************************************************************************/
+/*                                                                            */
+/* Project : FAT12/16 File System                                             */
+/* File    : disksparse.c                                                     */
+/* Author  : Kyoungmoon Sun(msg2me@msn.com)                                   */
+/* Company : Dankook Univ. Embedded System Lab.                               */
+/* Notes   : Thin provisioned disk simulator                                  */
+/* Date    : 2008/7/2                                                         */
+/*                                                                            */
+/******************************************************************************/
+
+#include <pthread.h>
+#include "disksparse.h"
+
+#define CHUNK_SIZE		( ( QWORD )1 << DISKSPARSE_CHUNK_SHIFT )
+#define LEAF_ENTRIES	( ( QWORD )1 << DISKSPARSE_LEAF_SHIFT )
+
+// DISK_SPARSE
+// chunk 번호의 상위 bit는 directory, 하위 DISKSPARSE_LEAF_SHIFT bit는 leaf table의 index
+// 한번도 쓰지 않은 chunk와 leaf table은 NULL이고 0으로 읽힘
+typedef struct
+{
+	BYTE***			directory;
+	QWORD			leafCount;
+	QWORD			size;			// 디스크 전체 byte 수
+	QWORD			chunks;			// 할당된 chunk 수
+	pthread_mutex_t	lock;			// 할당과 해제, 찾는 쪽은 lock 없이 읽음
+} DISK_SPARSE;
+
+/* NULL when the chunk was never written and create is 0 */
+BYTE* disksparse_chunk( DISK_SPARSE* sparse, QWORD index, int create )
+{
+	BYTE***	leaf = &sparse->directory[index >> DISKSPARSE_LEAF_SHIFT];
+	BYTE**	chunk;
+	BYTE*	data;
+
+	if( __atomic_load_n( leaf, __ATOMIC_ACQUIRE ) == NULL )
+	{
+		if( !create )
+			return NULL;
+
+		pthread_mutex_lock( &sparse->lock );
+		if( *leaf == NULL )
+			__atomic_store_n( leaf, ( BYTE** )calloc( LEAF_ENTRIES, sizeof( BYTE* ) ), __ATOMIC_RELEASE );
+		pthread_mutex_unlock( &sparse->lock );
+
+		if( *leaf == NULL )
+			return NULL;
+	}
+
+	chunk	= &( *leaf )[index & ( LEAF_ENTRIES - 1 )];
+	data	= __atomic_load_n( chunk, __ATOMIC_ACQUIRE );
+	if( data || !create )
+		return data;
+
+	pthread_mutex_lock( &sparse->lock );
+	if( *chunk == NULL )
+	{
+		data = ( BYTE* )calloc( 1, CHUNK_SIZE );
+		if( data )
+			sparse->chunks++;
+		__atomic_store_n( chunk, data, __ATOMIC_RELEASE );
+	}
+	data = *chunk;
+	pthread_mutex_unlock( &sparse->lock );
+
+	return data;
+}
+
+/* a chunk overwritten with zeroes as a whole goes back to never written */
+void disksparse_drop_chunk( DISK_SPARSE* sparse, QWORD index )
+{
+	BYTE**	leaf = sparse->directory[index >> DISKSPARSE_LEAF_SHIFT];
+	BYTE*	data;
+
+	if( leaf == NULL )
+		return;
+
+	pthread_mutex_lock( &sparse->lock );
+	data = leaf[index & ( LEAF_ENTRIES - 1 )];
+	if( data )
+	{
+		__atomic_store_n( &leaf[index & ( LEAF_ENTRIES - 1 )], ( BYTE* )NULL, __ATOMIC_RELEASE );
+		sparse->chunks--;
+	}
+	pthread_mutex_unlock( &sparse->lock );
+
+	free( data );
+}
+
+int disksparse_read_sectors( DISK_OPERATIONS* this, SECTOR sector, UINT32 count, void* data )
+{
+	DISK_SPARSE*	sparse = ( DISK_SPARSE* )this->pdata;
+	QWORD			offset = ( QWORD )sector * this->bytesPerSector;
+	QWORD			length = ( QWORD )count * this->bytesPerSector;
+	QWORD			piece;
+	BYTE*			chunk;
+	BYTE*			target = ( BYTE* )data;
+
+	if( sector >= this->numberOfSectors || count > this->numberOfSectors - sector )
+		return -1;
+
+	for( ; length; offset += piece, target += piece, length -= piece )
+	{
+		piece = CHUNK_SIZE - ( offset & ( CHUNK_SIZE - 1 ) );
+		if( piece > length )
+			piece = length;
+
+		chunk = disksparse_chunk( sparse, offset >> DISKSPARSE_CHUNK_SHIFT, 0 );
+		if( chunk )
+			memcpy( target, chunk + ( offset & ( CHUNK_SIZE - 1 ) ), piece );
+		else
+			memset( target, 0, piece );
+	}
+
+	return 0;
+}
+
+/* zeroes never allocate, and free a chunk they cover completely */
+int disksparse_write_sectors( DISK_OPERATIONS* this, SECTOR sector, UINT32 count, const void* data )
+{
+	DISK_SPARSE*	sparse = ( DISK_SPARSE* )this->pdata;
+	QWORD			offset = ( QWORD )sector * this->bytesPerSector;
+	QWORD			length = ( QWORD )count * this->bytesPerSector;
+	QWORD			piece;
+	BYTE*			chunk;
+	const BYTE*		source = ( const BYTE* )data;
+	int				zero;
+
+	if( sector >= this->numberOfSectors || count > this->numberOfSectors - sector )
+		return -1;
+
+	for( ; length; offset += piece, source += piece, length -= piece )
+	{
+		piece = CHUNK_SIZE - ( offset & ( CHUNK_SIZE - 1 ) );
+		if( piece > length )
+			piece = length;
+
+		zero = is_zero_data( ( const char* )source, piece );
+		if( zero && piece == CHUNK_SIZE )
+		{
+			disksparse_drop_chunk( sparse, offset >> DISKSPARSE_CHUNK_SHIFT );
+			continue;
+		}
+
+		chunk = disksparse_chunk( sparse, offset >> DISKSPARSE_CHUNK_SHIFT, !zero );
+		if( chunk )
+			memcpy( chunk + ( offset & ( CHUNK_SIZE - 1 ) ), source, piece );
+		else if( !zero )
+			return -1;
+	}
+
+	return 0;
+}
+
+/* whole chunks are freed, the ends of the range are zeroed in place */
+int disksparse_discard_sectors( DISK_OPERATIONS* this, SECTOR sector, UINT32 count )
+{
+	DISK_SPARSE*	sparse = ( DISK_SPARSE* )this->pdata;
+	QWORD			offset = ( QWORD )sector * this->bytesPerSector;
+	QWORD			length = ( QWORD )count * this->bytesPerSector;
+	QWORD			piece;
+	BYTE*			chunk;
+
+	if( sector >= this->numberOfSectors || count > this->numberOfSectors - sector )
+		return -1;
+
+	for( ; length; offset += piece, length -= piece )
+	{
+		piece = CHUNK_SIZE - ( offset & ( CHUNK_SIZE - 1 ) );
+		if( piece > length )
+			piece = length;
+
+		if( piece == CHUNK_SIZE )
+			disksparse_drop_chunk( sparse, offset >> DISKSPARSE_CHUNK_SHIFT );
+		else if( ( chunk = disksparse_chunk( sparse, offset >> DISKSPARSE_CHUNK_SHIFT, 0 ) ) != NULL )
+			memset( chunk + ( offset & ( CHUNK_SIZE - 1 ) ), 0, piece );
+	}
+
+	return 0;
+}
+
+int disksparse_read( DISK_OPERATIONS* this, SECTOR sector, void* data )
+{
+	return disksparse_read_sectors( this, sector, 1, data );
+}
+
+int disksparse_write( DISK_OPERATIONS* this, SECTOR sector, const void* data )
+{
+	return disksparse_write_sectors( this, sector, 1, data );
+}
+
+/* Only the directory is allocated up front, one pointer per 64 MiB; leaf
+   tables and chunks come with the first write that isn't all zeroes, so a
+   volume of hundreds of GiB costs about what has been written to it. Sector
+   sizes divide the chunk size, so a sector never straddles two chunks. */
+int disksparse_init( SECTOR numberOfSectors, unsigned int bytesPerSector, DISK_OPERATIONS* disk )
+{
+	DISK_SPARSE*	sparse;
+
+	if( disk == NULL || bytesPerSector == 0 || CHUNK_SIZE % bytesPerSector )
+		return -1;
+
+	ZeroMemory( disk, sizeof( DISK_OPERATIONS ) );
+
+	sparse = ( DISK_SPARSE* )calloc( 1, sizeof( DISK_SPARSE ) );
+	if( sparse == NULL )
+		return -1;
+
+	sparse->size		= ( QWORD )numberOfSectors * bytesPerSector;
+	sparse->leafCount	= ( ( sparse->size + CHUNK_SIZE - 1 ) / CHUNK_SIZE + LEAF_ENTRIES - 1 ) / LEAF_ENTRIES;
+	sparse->directory	= ( BYTE*** )calloc( sparse->leafCount ? sparse->leafCount : 1, sizeof( BYTE** ) );
+	if( sparse->directory == NULL )
+	{
+		free( sparse );
+		return -1;
+	}
+	pthread_mutex_init( &sparse->lock, NULL );
+
+	disk->pdata				= sparse;
+	disk->read_sector		= disksparse_read;
+	disk->write_sector		= disksparse_write;
+	disk->read_sectors		= disksparse_read_sectors;
+	disk->write_sectors		= disksparse_write_sectors;
+	disk->discard_sectors	= disksparse_discard_sectors;
+	disk->numberOfSectors	= numberOfSectors;
+	disk->bytesPerSector	= bytesPerSector;
+
+	return 0;
+}
+
+void disksparse_uninit( DISK_OPERATIONS* this )
+{
+	DISK_SPARSE*	sparse;
+	QWORD			i, j;
+
+	if( this == NULL || this->pdata == NULL )
+		return;
+
+	sparse = ( DISK_SPARSE* )this->pdata;
+	for( i = 0; i < sparse->leafCount; i++ )
+	{
+		if( sparse->directory[i] == NULL )
+			continue;
+
+		for( j = 0; j < LEAF_ENTRIES; j++ )
+			free( sparse->directory[i][j] );
+		free( sparse->directory[i] );
+	}
+
+	pthread_mutex_destroy( &sparse->lock );
+	free( sparse->directory );
+	free( sparse );
+	this->pdata = NULL;
+}
+
+/* bytes of chunks holding data */
+QWORD disksparse_allocated( DISK_OPERATIONS* this )
+{
+	DISK_SPARSE*	sparse = ( DISK_SPARSE* )this->pdata;
+	QWORD			chunks;
+
+	pthread_mutex_lock( &sparse->lock );
+	chunks = sparse->chunks;
+	pthread_mutex_unlock( &sparse->lock );
+
+	return chunks * CHUNK_SIZE;
+}
@@ -0,0 +1,25 @@
+/******************************************************************************/
+/*                                                                            */
+/* Project : FAT12/16 File System                                             */
+/* File    : disksparse.h                                                     */
+/* Author  : Kyoungmoon Sun(msg2me@msn.com)                                   */
+/* Company : Dankook Univ. Embedded System Lab.                               */
+/* Notes   : Thin provisioned disk simulator header                           */
+/* Date    : 2008/7/2                                                         */
+/*                                                                            */
+/******************************************************************************/
+
+#ifndef _DISKSPARSE_H_
+#define _DISKSPARSE_H_
+
+#include "common.h"
+#include "disk.h"
+
+#define DISKSPARSE_CHUNK_SHIFT		16		// 64 KiB chunks
+#define DISKSPARSE_LEAF_SHIFT		10		// 1024 chunks, 64 MiB, per leaf table
+
+int disksparse_init( SECTOR, unsigned int, DISK_OPERATIONS* );
+void disksparse_uninit( DISK_OPERATIONS* );
+QWORD disksparse_allocated( DISK_OPERATIONS* );
+
+#endif
@@ -11,6 +11,7 @@
 
 #include "fat.h"
 #include "clusterlist.h"
+#include "threadpool.h"
 
 #define MIN( a, b )					( ( a ) < ( b ) ? ( a ) : ( b ) )
 #define MAX( a, b )					( ( a ) > ( b ) ? ( a ) : ( b ) )
@@ -20,21 +21,47 @@ unsigned char toupper( unsigned char ch );
 int isalpha( unsigned char ch );
 int isdigit( unsigned char ch );
 
-/* calculate the 'sectors per cluster' by some conditions */
+/* 512, 1024, 2048 and 4096 byte sectors are supported */
+int is_valid_sector_size( UINT32 bytesPerSector )
+{
+	return bytesPerSector >= MIN_SECTOR_SIZE && bytesPerSector <= MAX_SECTOR_SIZE &&
+		   ( bytesPerSector & ( bytesPerSector - 1 ) ) == 0;
+}
+
+/* calculate the 'sectors per cluster' by some conditions; both columns of the
+   tables count 512 byte sectors, so the cluster size in bytes is kept for
+   larger sectors, a cluster never being smaller than one sector */
 DWORD get_sector_per_clusterN( DWORD diskTable[][2], UINT64 diskSize, UINT32 bytesPerSector )
 {
 	int i = 0;
 
 	do
 	{
-		if( ( ( UINT64 )( diskTable[i][0] * 512 ) ) >= diskSize )
-			return diskTable[i][1] / ( bytesPerSector / 512 );
+		if( ( UINT64 )diskTable[i][0] * 512 >= diskSize )
+			return ( diskTable[i][1] == 0 ? 0 : MAX( diskTable[i][1] * 512 / bytesPerSector, 1 ) );
 	}
 	while( diskTable[i++][0] < 0xFFFFFFFF );
 
 	return 0;
 }
 
+/* the smallest cluster that keeps a FAT12 volume under 4085 clusters */
+DWORD get_sector_per_cluster12( UINT64 diskSize, UINT32 bytesPerSector )
+{
+	/* less the boot sector, the 512 entry root and two FATs for 4085 clusters */
+	UINT64	sectors = diskSize / bytesPerSector - 1 - ( 512 * 32 ) / bytesPerSector - 2 * ( ( 4085 * 3 / 2 + bytesPerSector - 1 ) / bytesPerSector );
+	DWORD	sectorsPerCluster = 1;
+
+	while( sectors / sectorsPerCluster >= 4085 )
+	{
+		sectorsPerCluster *= 2;
+		if( sectorsPerCluster * bytesPerSector > 32768 )
+			return 0;
+	}
+
+	return sectorsPerCluster;
+}
+
 DWORD get_sector_per_cluster16( UINT64 diskSize, UINT32 bytesPerSector )
 {
 	DWORD	diskTableFAT16[][2] =
@@ -75,7 +102,7 @@ DWORD get_sector_per_cluster( BYTE FATType, UINT64 diskSize, UINT32 bytesPerSect
 	switch( FATType )
 	{
 		case 0:		/* FAT12 */
-			return 1;
+			return get_sector_per_cluster12( diskSize, bytesPerSector );
 		case 1:		/* FAT16 */
 			return get_sector_per_cluster16( diskSize, bytesPerSector );
 		case 2:		/* FAT32 */
@@ -92,15 +119,15 @@ void fill_fat_size( FAT_BPB* bpb, BYTE FATType )
 	UINT32	diskSize = ( bpb->totalSectors32 == 0 ? bpb->totalSectors : bpb->totalSectors32 );
 	UINT32	rootDirSectors = ( ( bpb->rootEntryCount * 32 ) + (bpb->bytesPerSector - 1) ) / bpb->bytesPerSector;
 	UINT32	tmpVal1 = diskSize - ( bpb->reservedSectorCount + rootDirSectors );
-	UINT32	tmpVal2 = ( 256 * bpb->sectorsPerCluster ) + bpb->numberOfFATs;
+	UINT32	tmpVal2 = ( ( bpb->bytesPerSector / 2 ) * bpb->sectorsPerCluster ) + bpb->numberOfFATs;
 	UINT32	FATSize;
 
 	if( FATType == FAT32 )
 		tmpVal2 = tmpVal2 / 2;
 
-	FATSize = ( tmpVal1 + ( tmpVal2 - 1 ) ) / tmpVal2;
+	FATSize = ( UINT32 )( ( ( UINT64 )tmpVal1 + ( tmpVal2 - 1 ) ) / tmpVal2 );
 
-	if( FATType == 32 )
+	if( FATType == FAT32 )
 	{
 		bpb->FATSize16 = 0;
 		bpb->BPB32.FATSize32 = FATSize;
@@ -112,9 +139,10 @@ void fill_fat_size( FAT_BPB* bpb, BYTE FATType )
 // FAT 버전에 따라서 BPB에 디스크의 모든 하드웨어적인 정보 등을 등록
 // 파일시스템 버전에 따라서 부트 파라미터 블록의 내용이 달라지기 때문에
 // 커널에서 사용자에게 원하는 파일시스템을 입력받고 그에맞는 내용으로 채워서 디스크에 써줌
-int fill_bpb( FAT_BPB* bpb, BYTE FATType, SECTOR numberOfSectors, UINT32 bytesPerSector )
+// journalSectors : 예약 영역 끝에 journal로 더 잡을 sector 수
+int fill_bpb( FAT_BPB* bpb, BYTE FATType, SECTOR numberOfSectors, UINT32 bytesPerSector, UINT32 journalSectors )
 {
-	QWORD diskSize = numberOfSectors * bytesPerSector; 
+	QWORD diskSize = ( QWORD )numberOfSectors * bytesPerSector;
 	
 	/*typedef struct
 	{
@@ -133,6 +161,12 @@ int fill_bpb( FAT_BPB* bpb, BYTE FATType, SECTOR numberOfSectors, UINT32 bytesPe
 	if( FATType > 2 )
 		return FAT_ERROR;
 
+	if( !is_valid_sector_size( bytesPerSector ) )
+	{
+		WARNING( "The sector size %u is not supported\n", bytesPerSector );
+		return FAT_ERROR;
+	}
+
 	// #define ZeroMemory( a, b )      memset( a, 0, b )
 	// void* memset(void*ptr, int value, size_t num); >> ptr(포인터)부터 num(바이트)만큼 value로 채움
 	ZeroMemory( bpb, sizeof( FAT_BPB ) ); // bpb부터 FAT_BPB의 크기만큼 0으로 채움 -> FAT_BPB구조체인 bpb가 0으로 채워짐
@@ -156,28 +190,28 @@ int fill_bpb( FAT_BPB* bpb, BYTE FATType, SECTOR numberOfSectors, UINT32 bytesPe
 	// 여러가지 디스크의 하드웨어적인 정보를 setting
 	bpb->bytesPerSector			= bytesPerSector;
 	bpb->sectorsPerCluster		= sectorsPerCluster;
-	bpb->reservedSectorCount	= ( FATType == FAT32 ? 32 : 1 );
-	bpb->numberOfFATs			= 1;
+	bpb->reservedSectorCount	= ( FATType == FAT32 ? 32 : 1 ) + journalSectors;
+	bpb->numberOfFATs			= 2;
 	bpb->rootEntryCount			= ( FATType == FAT32 ? 0 : 512 );
 	bpb->totalSectors			= ( numberOfSectors < 0x10000 ? ( UINT16 ) numberOfSectors : 0 );
+	bpb->totalSectors32			= ( numberOfSectors >= 0x10000 ? numberOfSectors : 0 );
 
 	bpb->media					= 0xF8;
-	fill_fat_size( bpb, FATType ); // fat 크기 구해서 bpb에 넣어주는 함수
+	fill_fat_size( bpb, FATType ); // fat 크기 구해서 bpb에 넣어주는 함수, total sector 수가 먼저 필요
 	bpb->sectorsPerTrack		= 0;
 	bpb->numberOfHeads			= 0;
-	bpb->totalSectors32			= ( numberOfSectors >= 0x10000 ? numberOfSectors : 0 );
 
 	// FAT32에만 들어가는것들 처리
 	if( FATType == FAT32 )
 	{
-		bpb->BPB32.extFlags		= 0x0081;	/* active FAT : 1, only one FAT is active */
+		bpb->BPB32.extFlags		= 0x0000;	/* FAT is mirrored to all FATs at runtime */
 		bpb->BPB32.FSVersion	= 0;
-//		bpb->BPB32.rootCluster	= 2;
+		// rootCluster : root 디렉터리 chain의 첫 cluster, 데이터 영역의 첫 cluster를 사용
+		bpb->BPB32.rootCluster	= 2;
 		// FSInfo : FSInfo가 위치하는 sector offset. 일반적으로 pbr 바로 뒤에 위치하므로 1의 값을 가짐
 		bpb->BPB32.FSInfo		= 1;
-		// backupBootSector : BPB의 Backup 영역이 존재하는 sector offset. 일반적으로 0의 값을 가짐
+		// backupBootSector : BPB의 Backup 영역이 존재하는 sector offset, FSInfo의 사본이 그 다음 sector에 위치
 		bpb->BPB32.backupBootSectors	= 6;
-		bpb->BPB32.backupBootSectors	= 0;
 		// reserved : 예약된 영역. 무조건 0으로 설정
 		ZeroMemory( bpb->BPB32.reserved, 12 );
 	}
@@ -205,12 +239,21 @@ int fill_bpb( FAT_BPB* bpb, BYTE FATType, SECTOR numberOfSectors, UINT32 bytesPe
 	memcpy( bs->volumeLabel, VOLUME_LABEL, 11 );
 	memcpy( bs->filesystemType, filesystemType[FATType], 8 );
 
+	// cluster 번호는 28bit, 큰 sector로 만든 큰 디스크는 cluster 수가 넘칠 수 있음
+	// FAT 종류는 cluster 수로 정해지므로 요청한 종류와 달라지면 mount할 수 없음
+	if( get_count_of_clusters( bpb ) > 0x0FFFFFF4 || get_fat_type( bpb ) != FATType )
+	{
+		WARNING( "The number of cluster is out of range\n" );
+		return FAT_ERROR;
+	}
+
 	return FAT_SUCCESS;
 }
 
-int get_fat_type( FAT_BPB* bpb )
+/* number of data clusters, which decides the FAT type */
+DWORD get_count_of_clusters( FAT_BPB* bpb )
 {
-	UINT32	totalSectors, dataSector, rootSector, countOfClusters, FATSize;
+	UINT32	totalSectors, dataSector, rootSector, FATSize;
 
 	rootSector = ( ( bpb->rootEntryCount * 32 ) + ( bpb->bytesPerSector - 1 ) ) / bpb->bytesPerSector;
 
@@ -225,7 +268,15 @@ int get_fat_type( FAT_BPB* bpb )
 		totalSectors = bpb->totalSectors32;
 
 	dataSector = totalSectors - ( bpb->reservedSectorCount + ( bpb->numberOfFATs * FATSize ) + rootSector );
-	countOfClusters = dataSector / bpb->sectorsPerCluster;
+
+	return dataSector / bpb->sectorsPerCluster;
+}
+
+int get_fat_type( FAT_BPB* bpb )
+{
+	UINT32	countOfClusters;
+
+	countOfClusters = get_count_of_clusters( bpb );
 
 	if( countOfClusters < 4085 )
 		return FAT12;
@@ -252,7 +303,6 @@ FAT_ENTRY_LOCATION get_entry_location( const FAT_DIR_ENTRY* entry )
 int fill_reserved_fat( FAT_BPB* bpb, BYTE* sector )
 {
 	BYTE	FATType;
-	DWORD*	shutErrBit12;
 	WORD*	shutBit16;
 	WORD*	errBit16;
 	DWORD*	shutBit32;
@@ -261,16 +311,15 @@ int fill_reserved_fat( FAT_BPB* bpb, BYTE* sector )
 	FATType = get_fat_type( bpb );
 	if( FATType == FAT12 )
 	{
-		shutErrBit12 = ( DWORD* )sector;
-
-		*shutErrBit12 = 0xFF0 << 20;
-		*shutErrBit12 |= ( ( DWORD )bpb->media & 0x0F ) << 20;
-		*shutErrBit12 |= MS_EOC12 << 8;
+		/* cluster 0 = 0xF00 | media, cluster 1 = EOC, packed into three bytes */
+		sector[0] = bpb->media;
+		sector[1] = 0x0F | ( ( MS_EOC12 & 0x0F ) << 4 );
+		sector[2] = ( BYTE )( MS_EOC12 >> 4 );
 	}
 	else if( FATType == FAT16 )
 	{
 		shutBit16 = ( WORD* )sector;
-		errBit16 = ( WORD* )sector + sizeof( WORD );
+		errBit16 = ( WORD* )sector + 1;
 
 		*shutBit16 = 0xFFF0 | bpb->media;
 		*errBit16 = MS_EOC16;
@@ -278,32 +327,150 @@ int fill_reserved_fat( FAT_BPB* bpb, BYTE* sector )
 	else
 	{
 		shutBit32 = ( DWORD* )sector;
-		errBit32 = ( DWORD* )sector + sizeof( DWORD );
+		errBit32 = ( DWORD* )sector + 1;
 
 		*shutBit32 = 0x0FFFFFF0 | bpb->media;
 		*errBit32 = MS_EOC32;
+
+		/* the root directory starts as a chain of one cluster */
+		( ( DWORD* )sector )[bpb->BPB32.rootCluster] = MS_EOC32;
+	}
+
+	return FAT_SUCCESS;
+}
+
+/* regions zeroed by one format: reserved area, FAT copies and root */
+#define FORMAT_REGIONS			3
+
+typedef struct
+{
+	DISK_OPERATIONS*	disk;
+	const BYTE*			zero;		// FAT_FORMAT_WRITE_SECTORS 크기의 0 버퍼
+	SECTOR				first;
+	UINT32				count;
+	volatile int*		result;
+} FAT_ZERO_JOB;
+
+typedef struct
+{
+	THREAD_POOL			pool;
+	DISK_OPERATIONS*	disk;
+	BYTE*				zero;
+	FAT_ZERO_JOB*		jobs;
+	UINT32				jobCount;
+	UINT32				maxJobs;
+	volatile int		result;
+} FAT_FORMAT_CONTEXT;
+
+void zero_sectors_job( void* param )
+{
+	FAT_ZERO_JOB*	job = ( FAT_ZERO_JOB* )param;
+	UINT32			done, count;
+
+	for( done = 0; done < job->count && *job->result == FAT_SUCCESS; done += count )
+	{
+		count = MIN( job->count - done, FAT_FORMAT_WRITE_SECTORS );
+		if( disk_write_sectors( job->disk, job->first + done, count, job->zero ) )
+			*job->result = FAT_ERROR;
+	}
+}
+
+int init_format_context( FAT_FORMAT_CONTEXT* context, DISK_OPERATIONS* disk, UINT32 threads )
+{
+	ZeroMemory( context, sizeof( FAT_FORMAT_CONTEXT ) );
+
+	if( thread_pool_init( &context->pool, threads ) )
+		return FAT_ERROR;
+
+	context->disk		= disk;
+	context->result		= FAT_SUCCESS;
+	context->maxJobs	= FORMAT_REGIONS * context->pool.threadCount;
+	context->zero		= ( BYTE* )calloc( FAT_FORMAT_WRITE_SECTORS, disk->bytesPerSector );
+	context->jobs		= ( FAT_ZERO_JOB* )malloc( context->maxJobs * sizeof( FAT_ZERO_JOB ) );
+
+	if( context->zero == NULL || context->jobs == NULL )
+	{
+		thread_pool_release( &context->pool );
+		free( context->zero );
+		free( context->jobs );
+		return FAT_ERROR;
+	}
+
+	return FAT_SUCCESS;
+}
+
+/* waits for the zeroing still in flight */
+int release_format_context( FAT_FORMAT_CONTEXT* context )
+{
+	thread_pool_release( &context->pool );
+	free( context->zero );
+	free( context->jobs );
+
+	return context->result;
+}
+
+/* Split count sectors from first into one slice per worker, each slice
+   being written in requests of FAT_FORMAT_WRITE_SECTORS sectors */
+int zero_region( FAT_FORMAT_CONTEXT* context, SECTOR first, UINT32 count )
+{
+	UINT32	slices, slice, i;
+
+	slices = MIN( context->pool.threadCount, ( count + FAT_FORMAT_WRITE_SECTORS - 1 ) / FAT_FORMAT_WRITE_SECTORS );
+	slices = MIN( slices, context->maxJobs - context->jobCount );
+	if( slices == 0 )
+		return ( count == 0 ? FAT_SUCCESS : FAT_ERROR );
+
+	slice = ( count + slices - 1 ) / slices;
+
+	for( i = 0; i < slices && count > 0; i++ )
+	{
+		FAT_ZERO_JOB*	job = &context->jobs[context->jobCount++];
+
+		job->disk	= context->disk;
+		job->zero	= context->zero;
+		job->first	= first;
+		job->count	= MIN( slice, count );
+		job->result	= &context->result;
+
+		first += job->count;
+		count -= job->count;
+
+		if( thread_pool_submit( &context->pool, zero_sectors_job, job ) )
+			return FAT_ERROR;
 	}
 
 	return FAT_SUCCESS;
 }
 
+/* first sector and length of the root directory: the fixed region on
+   FAT12/16 and the first cluster of the root chain on FAT32 */
+void get_root_region( FAT_BPB* bpb, SECTOR* first, UINT32* count )
+{
+	UINT32	FATSize = ( bpb->FATSize16 != 0 ? bpb->FATSize16 : bpb->BPB32.FATSize32 );
+
+	*first = bpb->reservedSectorCount + ( bpb->numberOfFATs * FATSize );
+
+	if( bpb->FATSize16 == 0 )
+	{
+		*count = ( bpb->BPB32.rootCluster >= 2 ? bpb->sectorsPerCluster : 0 );
+		*first += ( bpb->BPB32.rootCluster - 2 ) * bpb->sectorsPerCluster;
+	}
+	else
+		*count = ( ( bpb->rootEntryCount * sizeof( FAT_DIR_ENTRY ) ) + ( bpb->bytesPerSector - 1 ) ) / bpb->bytesPerSector;
+}
+
 // FAT 테이블 영역을 초기화하는 함수
-int clear_fat( DISK_OPERATIONS* disk, FAT_BPB* bpb )
+/* All FAT copies are zeroed by the format workers; once every zeroing
+   request is done, the entries of cluster 0 and 1 are written to the first
+   sector of each copy. */
+int clear_fat( FAT_FORMAT_CONTEXT* context, FAT_BPB* bpb )
 {
-	UINT32	i, end;
+	UINT32	i;
 	UINT32	FATSize;
 	SECTOR	fatSector;
-	
-	// sector array의 역할은 sector단위 read, write를 위한 응용프로그램에서의(실제로는 커널) sector크기의 버퍼 
 	BYTE	sector[MAX_SECTOR_SIZE];
 
-	// sector부터 sector 크기만큼을 0으로 채움
-	ZeroMemory( sector, sizeof( sector ) );
-	
-	// bpb->reservedSectorCount는 주어진 디스크에서 앞에서부터 0번으로 시작하여
-	// 몇번 섹터까지 메타데이터를 위한 섹터로 사용이 되었고,
-	// 그래서 지금 몇번째 섹터에 메타데이터가 들어갈 수 있는지를 의미함
-	// -> FAT영역이 이곳에 저장됨
+	// FAT영역은 reserved 영역 바로 뒤에 위치
 	fatSector = bpb->reservedSectorCount;
 
 	// FATSize16 : FAT영역의 섹터 수를 저장한는 부분으로, FAT32에서는 0으로 채워진다.
@@ -313,25 +480,22 @@ int clear_fat( DISK_OPERATIONS* disk, FAT_BPB* bpb )
 	else
 		FATSize = bpb->BPB32.FATSize32;
 
-	// numberofFATs : 해당 볼륨에 존재하는 FAT영역의 개수 --> end는 결국 그 FAT파일시스템의 끝 섹터번호 가리킴
-	end = fatSector + ( FATSize * bpb->numberOfFATs );
+	if( zero_region( context, fatSector, FATSize * bpb->numberOfFATs ) )
+		return FAT_ERROR;
 
-	// 이 부분부터 이 함수의 끝까지 FAT영역을 초기화하는 코드
-	/* (FAT 테이블을 위해 사용될 공간은 모두 0으로 초기화되어 사용가능 상태를 나타내야 한다.)
-		단, 클러스터 0,1에 대응하는 FAT링크의 경우 FAT버전에 따라 특별한 값을 가지게 되고
-		그 부분을 제외한 나머지만 0으로 초기화해야하기 때문에 0으로 초기화시킨 섹터버퍼를 
-		fill_reserved_fat으로 넘겨서 처리, 그리고 나머지 FAT영역의 섹터들은 모두 0으로 아래 for문에서 처리한다.*/
-	fill_reserved_fat( bpb, sector );
-	
-	// fatSector번 섹터에 sector배열 내용 씀
-	disk->write_sector( disk, fatSector, sector );
+	thread_pool_wait( &context->pool );
+	if( context->result != FAT_SUCCESS )
+		return FAT_ERROR;
 
-	// 섹터를 섹터크기만큼 0으로 채움
+	// 각 FAT 사본의 첫 섹터에는 cluster 0, 1에 대응하는 예약값을 기록
 	ZeroMemory( sector, sizeof( sector ) );
+	fill_reserved_fat( bpb, sector );
 
-	// 이 for문 안에서 나머지 FAT영역의 섹터들을 0으로 채움
-	for( i = fatSector + 1; i < end; i++ )
-		disk->write_sector( disk, i, sector );
+	for( i = 0; i < bpb->numberOfFATs; i++ )
+	{
+		if( context->disk->write_sector( context->disk, fatSector + i * FATSize, sector ) )
+			return FAT_ERROR;
+	}
 
 	return FAT_SUCCESS;
 }
@@ -340,7 +504,8 @@ int clear_fat( DISK_OPERATIONS* disk, FAT_BPB* bpb )
 int create_root( DISK_OPERATIONS* disk, FAT_BPB* bpb )
 {
 	BYTE	sector[MAX_SECTOR_SIZE]; // sector버퍼
-	SECTOR	rootSector = 0;
+	SECTOR	rootSector;
+	UINT32	rootSectors;
 	FAT_DIR_ENTRY*	entry;
 
 	// sector버퍼 0으로 초기화
@@ -362,18 +527,35 @@ int create_root( DISK_OPERATIONS* disk, FAT_BPB* bpb )
 	entry->name[0] = DIR_ENTRY_NO_MORE;
 
 	// 루트 디렉터리 엔트리를 몇번 섹터에 위치시킬지 정하고, 그 위치의 섹터에 write하는 과정
-	// (위치하게 되는곳이 fat의 버전마다 다름)
-	if( get_fat_type( bpb ) == FAT32 )
-	{
-		/* Not implemented yet */
-	}
-	else
-		// bpb->FATSize16은 FAT16버전에서 FAT하나를 위해서 필요한 섹터가 몇개인지를 나타냄
-		// 결국 아래코드는 Reserved영역과 FAT영역까지의 섹터수를 합해서 다음 사용가능한 섹터수를 구하는 코드
-		rootSector = bpb->reservedSectorCount + ( bpb->numberOfFATs * bpb->FATSize16 );
+	// (FAT12/16은 FAT영역 바로 뒤의 고정 영역, FAT32는 rootCluster의 첫 섹터)
+	get_root_region( bpb, &rootSector, &rootSectors );
+	if( rootSectors == 0 )
+		return FAT_ERROR;
 
 	// 그 섹터에 sector버퍼의 내용 씀
-	disk->write_sector( disk, rootSector, sector );
+	return disk->write_sector( disk, rootSector, sector );
+}
+
+/* The FSInfo sector and its copy next to the backup boot sector; freeCount
+   and nextFree are hints only, 0xFFFFFFFF meaning unknown */
+int write_fsinfo( DISK_OPERATIONS* disk, FAT_BPB* bpb, UINT32 freeCount, UINT32 nextFree )
+{
+	BYTE		sector[MAX_SECTOR_SIZE];
+	FAT_FSINFO*	fsInfo = ( FAT_FSINFO* )sector;
+
+	ZeroMemory( sector, sizeof( sector ) );
+	fsInfo->leadSignature	= 0x41615252;
+	fsInfo->structSignature	= 0x61417272;
+	fsInfo->freeCount		= freeCount;
+	fsInfo->nextFree		= nextFree;
+	fsInfo->trailSignature	= 0xAA550000;
+
+	if( disk->write_sector( disk, bpb->BPB32.FSInfo, sector ) )
+		return FAT_ERROR;
+
+	if( bpb->BPB32.backupBootSectors != 0 &&
+		disk->write_sector( disk, bpb->BPB32.backupBootSectors + bpb->BPB32.FSInfo, sector ) )
+		return FAT_ERROR;
 
 	return FAT_SUCCESS;
 }
@@ -400,8 +582,8 @@ int get_fat_sector( FAT_FILESYSTEM* fs, SECTOR cluster, SECTOR* fatSector, DWORD
 		break;
 	}
 
-	// 몇 번째 sector인지
-	*fatSector		= fs->bpb.reservedSectorCount + ( fatOffset / fs->bpb.bytesPerSector );
+	// 몇 번째 sector인지 (현재 사용중인 active FAT 기준)
+	*fatSector		= fs->bpb.reservedSectorCount + ( fs->activeFAT * fs->FATSize ) + ( fatOffset / fs->bpb.bytesPerSector );
 	
 	// sector 내에서의 오프셋?
 	*fatEntryOffset	= fatOffset % fs->bpb.bytesPerSector;
@@ -409,35 +591,186 @@ int get_fat_sector( FAT_FILESYSTEM* fs, SECTOR cluster, SECTOR* fatSector, DWORD
 	return FAT_SUCCESS;
 }
 
+/* a FAT12 entry starting at the last byte of a sector spans two sectors */
+UINT32 get_fat_entry_sectors( FAT_FILESYSTEM* fs, DWORD fatEntryOffset )
+{
+	return ( fs->FATType == FAT12 && fatEntryOffset == ( DWORD )fs->bpb.bytesPerSector - 1 ) ? 2 : 1;
+}
+
+/******************************************************************************/
+/* Locks                                                                      */
+/******************************************************************************/
+/* FAT sectors, directory sectors and directories are guarded by striped locks
+   picked by sector or cluster number; the allocator has one lock of its own.
+   Data clusters are not locked, so reads of different files never meet. */
+void init_fat_locks( FAT_FILESYSTEM* fs )
+{
+	UINT32	i;
+
+	pthread_mutex_init( &fs->allocLock, NULL );
+	for( i = 0; i < FAT_SECTOR_LOCKS; i++ )
+		pthread_rwlock_init( &fs->FATLocks[i], NULL );
+	for( i = 0; i < FAT_DIR_LOCKS; i++ )
+		pthread_rwlock_init( &fs->dirLocks[i], NULL );
+	for( i = 0; i < FAT_ENTRY_LOCKS; i++ )
+		pthread_mutex_init( &fs->entryLocks[i], NULL );
+	pthread_mutex_init( &fs->readQueueLock, NULL );
+}
+
+void release_fat_locks( FAT_FILESYSTEM* fs )
+{
+	UINT32	i;
+
+	pthread_mutex_destroy( &fs->allocLock );
+	for( i = 0; i < FAT_SECTOR_LOCKS; i++ )
+		pthread_rwlock_destroy( &fs->FATLocks[i] );
+	for( i = 0; i < FAT_DIR_LOCKS; i++ )
+		pthread_rwlock_destroy( &fs->dirLocks[i] );
+	for( i = 0; i < FAT_ENTRY_LOCKS; i++ )
+		pthread_mutex_destroy( &fs->entryLocks[i] );
+	pthread_mutex_destroy( &fs->readQueueLock );
+}
+
+/* lock the one or two FAT sectors of an entry, lower stripe first */
+void lock_fat_sectors( FAT_FILESYSTEM* fs, SECTOR fatSector, UINT32 count, int exclusive )
+{
+	UINT32	first = fatSector % FAT_SECTOR_LOCKS;
+	UINT32	last = ( fatSector + count - 1 ) % FAT_SECTOR_LOCKS;
+	UINT32	stripes[2], i;
+
+	stripes[0] = ( first < last ? first : last );
+	stripes[1] = ( first < last ? last : first );
+
+	for( i = 0; i < ( first == last ? 1u : 2u ); i++ )
+	{
+		if( exclusive )
+			pthread_rwlock_wrlock( &fs->FATLocks[stripes[i]] );
+		else
+			pthread_rwlock_rdlock( &fs->FATLocks[stripes[i]] );
+	}
+}
+
+void unlock_fat_sectors( FAT_FILESYSTEM* fs, SECTOR fatSector, UINT32 count )
+{
+	UINT32	first = fatSector % FAT_SECTOR_LOCKS;
+	UINT32	last = ( fatSector + count - 1 ) % FAT_SECTOR_LOCKS;
+
+	pthread_rwlock_unlock( &fs->FATLocks[first] );
+	if( last != first )
+		pthread_rwlock_unlock( &fs->FATLocks[last] );
+}
+
+/* readers of a directory (lookup, read_dir) share it, inserting takes it alone */
+void lock_directory( FAT_FILESYSTEM* fs, DWORD firstCluster, int exclusive )
+{
+	if( exclusive )
+		pthread_rwlock_wrlock( &fs->dirLocks[firstCluster % FAT_DIR_LOCKS] );
+	else
+		pthread_rwlock_rdlock( &fs->dirLocks[firstCluster % FAT_DIR_LOCKS] );
+}
+
+void unlock_directory( FAT_FILESYSTEM* fs, DWORD firstCluster )
+{
+	pthread_rwlock_unlock( &fs->dirLocks[firstCluster % FAT_DIR_LOCKS] );
+}
+
+/* FAT sectors are read from and written to the active FAT only. Writes mark the
+   sector in the dirty map; sync_fat_mirrors() copies dirty sectors to the other
+   FATs in one pass at sync points instead of on every update. With a journal
+   the write stays in its overlay until it is committed. */
+int read_fat_sector( FAT_FILESYSTEM* fs, SECTOR fatSector, BYTE* sector )
+{
+	return fs->disk->read_sector( fs->disk, fatSector, sector );
+}
+
+int write_fat_sector( FAT_FILESYSTEM* fs, SECTOR fatSector, const BYTE* sector )
+{
+	DWORD	index;
+
+	if( fs->FATDirtyMap )
+	{
+		index = fatSector - ( fs->bpb.reservedSectorCount + fs->activeFAT * fs->FATSize );
+		__sync_fetch_and_or( &fs->FATDirtyMap[index / 8], ( BYTE )( 1 << ( index % 8 ) ) );
+	}
+
+	return journal_write_sector( fs, fatSector, sector );
+}
+
+/* bring every mirror FAT up to date with the dirty sectors of the active FAT,
+   contiguous dirty sectors in one request per mirror */
+int sync_fat_mirrors( FAT_FILESYSTEM* fs )
+{
+	BYTE*	buffer;
+	SECTOR	activeBase, mirrorBase;
+	DWORD	i, count, copy;
+	int		result = FAT_SUCCESS;
+
+	if( fs->FATDirtyMap == NULL )
+		return FAT_SUCCESS;
+
+	buffer = ( BYTE* )malloc( FAT_MIRROR_RUN_SECTORS * fs->bpb.bytesPerSector );
+	if( buffer == NULL )
+		return FAT_ERROR;
+
+	activeBase = fs->bpb.reservedSectorCount + fs->activeFAT * fs->FATSize;
+
+	for( i = 0; result == FAT_SUCCESS && i < fs->FATSize; i += ( count ? count : 1 ) )
+	{
+		if( ( i % 8 ) == 0 && __atomic_load_n( &fs->FATDirtyMap[i / 8], __ATOMIC_RELAXED ) == 0 )
+		{
+			count = 8;
+			continue;
+		}
+
+		for( count = 0; count < FAT_MIRROR_RUN_SECTORS && i + count < fs->FATSize &&
+			 ( __atomic_load_n( &fs->FATDirtyMap[( i + count ) / 8], __ATOMIC_RELAXED ) & ( 1 << ( ( i + count ) % 8 ) ) ); count++ )
+		{
+			/* clear first: a write racing with the copy dirties the sector again */
+			__sync_fetch_and_and( &fs->FATDirtyMap[( i + count ) / 8], ( BYTE )~( 1 << ( ( i + count ) % 8 ) ) );
+
+			lock_fat_sectors( fs, activeBase + i + count, 1, 0 );
+			if( fs->disk->read_sector( fs->disk, activeBase + i + count, buffer + count * fs->bpb.bytesPerSector ) )
+				result = FAT_ERROR;
+			unlock_fat_sectors( fs, activeBase + i + count, 1 );
+			if( result )
+				break;
+		}
+
+		for( copy = 0; result == FAT_SUCCESS && count && copy < fs->bpb.numberOfFATs; copy++ )
+		{
+			if( copy == fs->activeFAT )
+				continue;
+
+			mirrorBase = fs->bpb.reservedSectorCount + copy * fs->FATSize;
+			if( disk_write_sectors( fs->disk, mirrorBase + i, count, buffer ) )
+				result = FAT_ERROR;
+		}
+	}
+
+	free( buffer );
+
+	return result;
+}
+
 // cluster가 존재하는 fat영역 내의 sector를 읽음
 // offset을 수정해서 sector를 읽었을 경우 이를 알리기 위해 1을 리턴???????????
 int prepare_fat_sector( FAT_FILESYSTEM* fs, SECTOR cluster, SECTOR* fatSector, DWORD* fatEntryOffset, BYTE* sector )
 {
 	get_fat_sector( fs, cluster, fatSector, fatEntryOffset );
-	fs->disk->read_sector( fs->disk, *fatSector, sector );
+	read_fat_sector( fs, *fatSector, sector );
 
 	if( fs->FATType == FAT12 && *fatEntryOffset == fs->bpb.bytesPerSector - 1 )
 	{
-		fs->disk->read_sector( fs->disk, *fatSector + 1, &sector[fs->bpb.bytesPerSector] );
+		read_fat_sector( fs, *fatSector + 1, &sector[fs->bpb.bytesPerSector] );
 		return 1;
 	}
 
 	return 0;
 }
 
-/* Read a FAT entry from FAT Table */
-// FAT 영역에서 cluster 번호에 해당하는 정보를 읽어옴(엔트리)
-DWORD get_fat( FAT_FILESYSTEM* fs, SECTOR cluster )
+/* Extract the FAT entry of a cluster from a buffer holding its FAT sector */
+DWORD decode_fat_entry( FAT_FILESYSTEM* fs, SECTOR cluster, const BYTE* sector, DWORD fatEntryOffset )
 {
-	BYTE	sector[MAX_SECTOR_SIZE * 2];
-	SECTOR	fatSector;
-	DWORD	fatEntryOffset;
-
-	// cluster가 존재하는 fat영역 내의 sector를 읽음
-	// sector에 해당 섹터 데이터가 들어감
-	prepare_fat_sector( fs, cluster, &fatSector, &fatEntryOffset, sector );
-
-	// 해당 sector에서 cluster의 정보(entry)를 읽음
 	// FAT버전에 따라서 FAT table entry의 크기가 다르기 때문에 하나의 entry를 추출해서 return하는 방식은 모두 다름
 	switch( fs->FATType )
 	{
@@ -455,18 +788,9 @@ DWORD get_fat( FAT_FILESYSTEM* fs, SECTOR cluster )
 	return FAT_ERROR;
 }
 
-/* Write a FAT entry to FAT Table */
-// FAT 영역에 cluster 정보 추가(첫 cluster에 파일 끝을 나타내는 value setting)
-int set_fat( FAT_FILESYSTEM* fs, SECTOR cluster, DWORD value )
+/* Store a value into the FAT entry of a cluster inside a FAT sector buffer */
+void encode_fat_entry( FAT_FILESYSTEM* fs, SECTOR cluster, BYTE* sector, DWORD fatEntryOffset, DWORD value )
 {
-	BYTE	sector[MAX_SECTOR_SIZE * 2];
-	SECTOR	fatSector;
-	DWORD	fatEntryOffset;
-	int		result;
-
-	// cluster가 존재하는 fat영역 내의 sector를 읽음
-	result = prepare_fat_sector( fs, cluster, &fatSector, &fatEntryOffset, sector );
-
 	switch( fs->FATType )
 	{
 	case FAT32:
@@ -491,57 +815,390 @@ int set_fat( FAT_FILESYSTEM* fs, SECTOR cluster, DWORD value )
 		*( ( WORD* )&sector[fatEntryOffset] ) |= ( WORD )value;
 		break;
 	}
+}
+
+/* Read a FAT entry from FAT Table */
+// FAT 영역에서 cluster 번호에 해당하는 정보를 읽어옴(엔트리)
+DWORD get_fat( FAT_FILESYSTEM* fs, SECTOR cluster )
+{
+	BYTE	sector[MAX_SECTOR_SIZE * 2];
+	SECTOR	fatSector;
+	DWORD	fatEntryOffset;
+
+	UINT32	count;
+
+	get_fat_sector( fs, cluster, &fatSector, &fatEntryOffset );
+	count = get_fat_entry_sectors( fs, fatEntryOffset );
+
+	// cluster가 존재하는 fat영역 내의 sector를 읽음
+	// sector에 해당 섹터 데이터가 들어감
+	lock_fat_sectors( fs, fatSector, count, 0 );
+	prepare_fat_sector( fs, cluster, &fatSector, &fatEntryOffset, sector );
+	unlock_fat_sectors( fs, fatSector, count );
+
+	// 해당 sector에서 cluster의 정보(entry)를 읽음
+	return decode_fat_entry( fs, cluster, sector, fatEntryOffset );
+}
+
+/* Write a FAT entry to FAT Table */
+// FAT 영역에 cluster 정보 추가(첫 cluster에 파일 끝을 나타내는 value setting)
+int set_fat( FAT_FILESYSTEM* fs, SECTOR cluster, DWORD value )
+{
+	BYTE	sector[MAX_SECTOR_SIZE * 2];
+	SECTOR	fatSector;
+	DWORD	fatEntryOffset;
+	int		result;
+	UINT32	count;
+
+	get_fat_sector( fs, cluster, &fatSector, &fatEntryOffset );
+	count = get_fat_entry_sectors( fs, fatEntryOffset );
+
+	// read-modify-write 동안 다른 thread가 같은 sector를 바꾸지 못하게 함
+	lock_fat_sectors( fs, fatSector, count, 1 );
+
+	// cluster가 존재하는 fat영역 내의 sector를 읽음
+	result = prepare_fat_sector( fs, cluster, &fatSector, &fatEntryOffset, sector );
+
+	encode_fat_entry( fs, cluster, sector, fatEntryOffset, value );
 
 	// fatSector번 섹터에 sector버퍼의 내용 씀
-	fs->disk->write_sector( fs->disk, fatSector, sector ); 
+	write_fat_sector( fs, fatSector, sector ); 
 
 	if( result )
-		fs->disk->write_sector( fs->disk, fatSector + 1, &sector[fs->bpb.bytesPerSector] );
+		write_fat_sector( fs, fatSector + 1, &sector[fs->bpb.bytesPerSector] );
+
+	unlock_fat_sectors( fs, fatSector, count );
 
 	return FAT_SUCCESS;
 }
 
 /******************************************************************************/
-/* Format disk as a specified file system                                     */
+/* FAT sector window                                                          */
 /******************************************************************************/
-
-// BPB, FAT, Root directory영역을 모두 초기화한다. 디스크가 정상적으로 사용될 수 있도록 필요한 정보 등록하고 초기화한다.
-int fat_format( DISK_OPERATIONS* disk, BYTE FATType )
+/* A window keeps the last FAT sector (two sectors when a FAT12 entry spans
+   them) in memory, so walking or updating clusters in ascending order costs
+   one read and at most one write per FAT sector instead of one per cluster. */
+void init_fat_window( FAT_SECTOR_WINDOW* window )
 {
-	FAT_BPB bpb; // 부트 파라미터 블록(BIOS parameter block)
-
-	// bpb를 채워주는 함수, 성공하면 FAT_SUCCESS리턴해줌
-	if( fill_bpb( &bpb, FATType, disk->numberOfSectors, disk->bytesPerSector ) != FAT_SUCCESS ) // bpb 초기화
-		return FAT_ERROR;
+	window->fatSector	= 0;
+	window->count		= 0;
+	window->dirty[0]	= 0;
+	window->dirty[1]	= 0;
+	window->exclusive	= 0;
+	window->locked		= 0;
+}
 
-	// disk의 0번섹터에 BPB내용 써줌
-	disk->write_sector( disk, 0, &bpb );
+int flush_fat_window( FAT_FILESYSTEM* fs, FAT_SECTOR_WINDOW* window )
+{
+	UINT32	i;
 
-	// 출력
-	PRINTF( "bytes per sector       : %u\n", bpb.bytesPerSector );
-	PRINTF( "sectors per cluster    : %u\n", bpb.sectorsPerCluster );
-	PRINTF( "number of FATs         : %u\n", bpb.numberOfFATs );
-	PRINTF( "root entry count       : %u\n", bpb.rootEntryCount );
-	PRINTF( "total sectors          : %u\n", ( bpb.totalSectors ? bpb.totalSectors : bpb.totalSectors32 ) );
-	PRINTF( "\n" );
+	for( i = 0; i < window->count; i++ )
+	{
+		if( !window->dirty[i] )
+			continue;
 
-	// FAT 테이블 초기화
-	clear_fat( disk, &bpb ); 
+		if( write_fat_sector( fs, window->fatSector + i, &window->buffer[i * fs->bpb.bytesPerSector] ) )
+			return FAT_ERROR;
 
-	// root 디렉터리 생성 + 초기화
-	create_root( disk, &bpb ); 
+		window->dirty[i] = 0;
+	}
 
 	return FAT_SUCCESS;
 }
 
-int validate_bpb( FAT_BPB* bpb )
+/* write back and give up the sectors; the window may be loaded again */
+int release_fat_window( FAT_FILESYSTEM* fs, FAT_SECTOR_WINDOW* window )
 {
-	int FATType;
+	int		result;
 
-	if( !( bpb->jmpBoot[0] == 0xEB && bpb->jmpBoot[2] == 0x90 ) &&
+	result = flush_fat_window( fs, window );
+
+	if( window->locked )
+	{
+		unlock_fat_sectors( fs, window->fatSector, window->locked );
+		window->locked = 0;
+	}
+	window->count = 0;
+
+	return result;
+}
+
+/* read one FAT sector into slot index of the window; an exclusive window
+   already holds the lock */
+int read_fat_window( FAT_FILESYSTEM* fs, FAT_SECTOR_WINDOW* window, SECTOR fatSector, UINT32 index )
+{
+	int		result;
+
+	if( !window->exclusive )
+		lock_fat_sectors( fs, fatSector, 1, 0 );
+
+	result = read_fat_sector( fs, fatSector, &window->buffer[index * fs->bpb.bytesPerSector] );
+
+	if( !window->exclusive )
+		unlock_fat_sectors( fs, fatSector, 1 );
+
+	return result;
+}
+
+/* make the FAT sector(s) holding the entry of cluster resident in the window */
+int load_fat_window( FAT_FILESYSTEM* fs, FAT_SECTOR_WINDOW* window, SECTOR cluster, DWORD* fatEntryOffset )
+{
+	SECTOR	fatSector;
+	UINT32	bytesPerSector = fs->bpb.bytesPerSector;
+	UINT32	needed, i;
+
+	get_fat_sector( fs, cluster, &fatSector, fatEntryOffset );
+	needed = get_fat_entry_sectors( fs, *fatEntryOffset );
+
+	/* An exclusive window holds the write locks of its sectors from the read
+	   to the write-back, so updates of other threads can't be lost in between */
+	if( window->exclusive )
+	{
+		if( window->count && fatSector == window->fatSector && needed <= window->count )
+			return FAT_SUCCESS;
+
+		if( release_fat_window( fs, window ) )
+			return FAT_ERROR;
+
+		lock_fat_sectors( fs, fatSector, needed, 1 );
+		window->fatSector	= fatSector;
+		window->locked		= needed;
+
+		for( i = 0; i < needed; i++ )
+		{
+			if( read_fat_window( fs, window, fatSector + i, i ) )
+				return FAT_ERROR;
+			window->dirty[i] = 0;
+		}
+		window->count = needed;
+
+		return FAT_SUCCESS;
+	}
+
+	/* slide forward when the next sector is already held in the upper half */
+	if( window->count == 2 && fatSector == window->fatSector + 1 )
+	{
+		if( window->dirty[0] && write_fat_sector( fs, window->fatSector, window->buffer ) )
+			return FAT_ERROR;
+
+		memmove( window->buffer, &window->buffer[bytesPerSector], bytesPerSector );
+		window->fatSector	= fatSector;
+		window->count		= 1;
+		window->dirty[0]	= window->dirty[1];
+		window->dirty[1]	= 0;
+	}
+
+	if( window->count == 0 || fatSector != window->fatSector )
+	{
+		if( flush_fat_window( fs, window ) )
+			return FAT_ERROR;
+
+		window->count = 0;
+		if( read_fat_window( fs, window, fatSector, 0 ) )
+			return FAT_ERROR;
+
+		window->fatSector	= fatSector;
+		window->count		= 1;
+	}
+
+	if( needed == 2 && window->count == 1 )
+	{
+		if( read_fat_window( fs, window, fatSector + 1, 1 ) )
+			return FAT_ERROR;
+
+		window->count		= 2;
+		window->dirty[1]	= 0;
+	}
+
+	return FAT_SUCCESS;
+}
+
+DWORD get_fat_window( FAT_FILESYSTEM* fs, FAT_SECTOR_WINDOW* window, SECTOR cluster )
+{
+	DWORD	fatEntryOffset;
+
+	if( load_fat_window( fs, window, cluster, &fatEntryOffset ) )
+		return FAT_ERROR;
+
+	return decode_fat_entry( fs, cluster, window->buffer, fatEntryOffset );
+}
+
+/* updates must go through an exclusive window when other threads use the volume */
+int set_fat_window( FAT_FILESYSTEM* fs, FAT_SECTOR_WINDOW* window, SECTOR cluster, DWORD value )
+{
+	DWORD	fatEntryOffset;
+
+	if( load_fat_window( fs, window, cluster, &fatEntryOffset ) )
+		return FAT_ERROR;
+
+	encode_fat_entry( fs, cluster, window->buffer, fatEntryOffset, value );
+
+	window->dirty[0] = 1;
+	if( get_fat_entry_sectors( fs, fatEntryOffset ) == 2 )
+		window->dirty[1] = 1;
+
+	return FAT_SUCCESS;
+}
+
+int compare_fat_update( const void* a, const void* b )
+{
+	SECTOR	ca = ( ( const FAT_UPDATE* )a )->cluster;
+	SECTOR	cb = ( ( const FAT_UPDATE* )b )->cluster;
+
+	return ( ca > cb ) - ( ca < cb );
+}
+
+/* Apply many FAT updates with one read-modify-write per FAT sector.
+   The updates array is sorted by cluster number in place. */
+int set_fat_batch( FAT_FILESYSTEM* fs, FAT_UPDATE* updates, UINT32 count )
+{
+	FAT_SECTOR_WINDOW	window;
+	UINT32				i;
+
+	qsort( updates, count, sizeof( FAT_UPDATE ), compare_fat_update );
+
+	init_fat_window( &window );
+	window.exclusive = 1;
+
+	for( i = 0; i < count; i++ )
+	{
+		if( set_fat_window( fs, &window, updates[i].cluster, updates[i].value ) )
+		{
+			release_fat_window( fs, &window );
+			return FAT_ERROR;
+		}
+	}
+
+	return release_fat_window( fs, &window );
+}
+
+/* Collect the clusters of a chain into a newly allocated array.
+   The caller frees *chain. A chain longer than the volume is cut off. */
+int read_cluster_chain( FAT_FILESYSTEM* fs, DWORD firstCluster, SECTOR** chain, UINT32* count )
+{
+	FAT_SECTOR_WINDOW	window;
+	SECTOR*				clusters = NULL;
+	SECTOR*				grown;
+	UINT32				capacity = 0, number = 0;
+	DWORD				currentCluster = firstCluster;
+
+	init_fat_window( &window );
+
+	while( !is_EOC( fs->FATType, currentCluster ) && currentCluster != FREE_CLUSTER &&
+		   currentCluster < fs->countOfClusters + 2 && number < fs->countOfClusters )
+	{
+		if( number == capacity )
+		{
+			capacity = ( capacity ? capacity * 2 : 64 );
+			grown = ( SECTOR* )realloc( clusters, capacity * sizeof( SECTOR ) );
+			if( grown == NULL )
+			{
+				free( clusters );
+				return FAT_ERROR;
+			}
+			clusters = grown;
+		}
+
+		clusters[number++] = currentCluster;
+		currentCluster = get_fat_window( fs, &window, currentCluster );
+	}
+
+	*chain = clusters;
+	*count = number;
+
+	return FAT_SUCCESS;
+}
+
+/******************************************************************************/
+/* Format disk as a specified file system                                     */
+/******************************************************************************/
+
+// BPB, FAT, Root directory영역을 모두 초기화한다. 디스크가 정상적으로 사용될 수 있도록 필요한 정보 등록하고 초기화한다.
+/* A full format zeroes the reserved area, every FAT copy and the whole root
+   region; FAT_FORMAT_QUICK zeroes only the FAT copies, which mount scans for
+   free clusters, and relies on the end mark in the first root sector. The
+   zeroing is split across threads workers (0 : one per CPU) in large
+   multi-sector writes; the boot sector is written last. */
+int fat_format( DISK_OPERATIONS* disk, BYTE FATType, DWORD formatFlags, UINT32 threads )
+{
+	FAT_BPB				bpb; // 부트 파라미터 블록(BIOS parameter block)
+	FAT_FORMAT_CONTEXT	context;
+	BYTE				sector[MAX_SECTOR_SIZE];
+	SECTOR				rootSector;
+	UINT32				rootSectors, journalSectors = 0;
+	int					result = FAT_SUCCESS;
+
+	if( formatFlags & FAT_FORMAT_JOURNAL )
+		journalSectors = journal_sectors( disk->numberOfSectors, disk->bytesPerSector );
+
+	// bpb를 채워주는 함수, 성공하면 FAT_SUCCESS리턴해줌
+	if( fill_bpb( &bpb, FATType, disk->numberOfSectors, disk->bytesPerSector, journalSectors ) != FAT_SUCCESS ) // bpb 초기화
+		return FAT_ERROR;
+
+	// 출력
+	PRINTF( "bytes per sector       : %u\n", bpb.bytesPerSector );
+	PRINTF( "sectors per cluster    : %u\n", bpb.sectorsPerCluster );
+	PRINTF( "number of FATs         : %u\n", bpb.numberOfFATs );
+	PRINTF( "root entry count       : %u\n", bpb.rootEntryCount );
+	PRINTF( "total sectors          : %u\n", ( bpb.totalSectors ? bpb.totalSectors : bpb.totalSectors32 ) );
+	if( journalSectors )
+		PRINTF( "journal sectors        : %u\n", journalSectors );
+	PRINTF( "\n" );
+
+	if( init_format_context( &context, disk, threads ) )
+		return FAT_ERROR;
+
+	if( !( formatFlags & FAT_FORMAT_QUICK ) )
+	{
+		get_root_region( &bpb, &rootSector, &rootSectors );
+
+		result = zero_region( &context, 1, bpb.reservedSectorCount - 1 );
+		if( result == FAT_SUCCESS )
+			result = zero_region( &context, rootSector, rootSectors );
+	}
+
+	// FAT 테이블 초기화
+	if( result == FAT_SUCCESS )
+		result = clear_fat( &context, &bpb );
+
+	if( release_format_context( &context ) || result )
+		return FAT_ERROR;
+
+	// root 디렉터리 생성 + 초기화
+	if( create_root( disk, &bpb ) )
+		return FAT_ERROR;
+
+	// journal은 예약 영역의 마지막 journalSectors개
+	if( journalSectors && journal_format( disk, bpb.reservedSectorCount - journalSectors, journalSectors ) )
+		return FAT_ERROR;
+
+	// disk의 0번섹터에 BPB내용 써줌
+	ZeroMemory( sector, sizeof( sector ) );
+	memcpy( sector, &bpb, sizeof( FAT_BPB ) );
+
+	// FAT32는 FSInfo와 boot sector 사본을 먼저 기록, root가 cluster 하나를 사용
+	if( FATType == FAT32 )
+	{
+		if( write_fsinfo( disk, &bpb, get_count_of_clusters( &bpb ) - 1, bpb.BPB32.rootCluster + 1 ) )
+			return FAT_ERROR;
+		if( disk->write_sector( disk, bpb.BPB32.backupBootSectors, sector ) )
+			return FAT_ERROR;
+	}
+
+	return disk->write_sector( disk, 0, sector );
+}
+
+int validate_bpb( FAT_BPB* bpb )
+{
+	int FATType;
+
+	if( !( bpb->jmpBoot[0] == 0xEB && bpb->jmpBoot[2] == 0x90 ) &&
 		!( bpb->jmpBoot[0] == 0xE9 ) )
 		return FAT_ERROR;
 
+	if( !is_valid_sector_size( bpb->bytesPerSector ) || bpb->sectorsPerCluster == 0 )
+		return FAT_ERROR;
+
 	FATType = get_fat_type( bpb );
 
 	if( FATType < 0 )
@@ -550,23 +1207,52 @@ int validate_bpb( FAT_BPB* bpb )
 	return FAT_SUCCESS;
 }
 
-/* when FAT type is FAT12 or FAT16 */
+/* physical sector of the sectorNumber-th root directory sector: in the fixed
+   region on FAT12/16, found by following the root chain on FAT32 */
+int get_root_sector( FAT_FILESYSTEM* fs, SECTOR sectorNumber, SECTOR* rootSector )
+{
+	DWORD	cluster = fs->bpb.BPB32.rootCluster;
+	SECTOR	skip;
+
+	if( fs->FATType != FAT32 )
+	{
+		*rootSector = fs->bpb.reservedSectorCount + ( fs->bpb.numberOfFATs * fs->bpb.FATSize16 ) + sectorNumber;
+		return FAT_SUCCESS;
+	}
+
+	for( skip = sectorNumber / fs->bpb.sectorsPerCluster; skip > 0; skip-- )
+	{
+		if( cluster < 2 || cluster >= fs->countOfClusters + 2 )
+			return FAT_ERROR;
+		cluster = get_fat( fs, cluster );
+	}
+
+	if( cluster < 2 || cluster >= fs->countOfClusters + 2 )
+		return FAT_ERROR;
+
+	*rootSector = calc_physical_sector( fs, cluster, sectorNumber % fs->bpb.sectorsPerCluster );
+
+	return FAT_SUCCESS;
+}
+
 int read_root_sector( FAT_FILESYSTEM* fs, SECTOR sectorNumber, BYTE* sector )
 {
 	SECTOR	rootSector;
 
-	rootSector = fs->bpb.reservedSectorCount + ( fs->bpb.numberOfFATs * fs->bpb.FATSize16 );
+	if( get_root_sector( fs, sectorNumber, &rootSector ) )
+		return FAT_ERROR;
 
-	return fs->disk->read_sector( fs->disk, rootSector + sectorNumber, sector );
+	return fs->disk->read_sector( fs->disk, rootSector, sector );
 }
 
 int write_root_sector( FAT_FILESYSTEM* fs, SECTOR sectorNumber, const BYTE* sector )
 {
 	SECTOR	rootSector;
 
-	rootSector = fs->bpb.reservedSectorCount + ( fs->bpb.numberOfFATs * fs->bpb.FATSize16 );
+	if( get_root_sector( fs, sectorNumber, &rootSector ) )
+		return FAT_ERROR;
 
-	return fs->disk->write_sector( fs->disk, rootSector + sectorNumber, sector );
+	return journal_write_sector( fs, rootSector, sector );
 }
 
 /* Translate logical cluster and sector numbers to a physical sector number */
@@ -590,40 +1276,90 @@ int read_data_sector( FAT_FILESYSTEM* fs, SECTOR clusterNumber, SECTOR sectorNum
 
 int write_data_sector( FAT_FILESYSTEM* fs, SECTOR clusterNumber, SECTOR sectorNumber, const BYTE* sector )
 {
-	return fs->disk->write_sector( fs->disk, calc_physical_sector( fs, clusterNumber, sectorNumber ), sector );
+	int	result;
+
+	result = fs->disk->write_sector( fs->disk, calc_physical_sector( fs, clusterNumber, sectorNumber ), sector );
+	// 쓴 뒤에 지워야 그 사이에 미리 읽은 옛 내용이 남지 않음
+	readahead_invalidate( fs, clusterNumber, 1, 0 );
+
+	return result;
 }
 
-/* search free clusters from FAT and add to free cluster list */
-int search_free_clusters( FAT_FILESYSTEM* fs )
+/* physical sector of a directory sector; cluster 0 is the FAT12/16 root region */
+SECTOR get_entry_sector( FAT_FILESYSTEM* fs, SECTOR clusterNumber, SECTOR sectorNumber )
 {
-	UINT32	totalSectors, dataSector, rootSector, countOfClusters, FATSize;
-	UINT32	i, cluster;
+	if( clusterNumber == 0 && ( fs->FATType == FAT12 || fs->FATType == FAT16 ) )
+		return fs->bpb.reservedSectorCount + ( fs->bpb.numberOfFATs * fs->bpb.FATSize16 ) + sectorNumber;
 
-	rootSector = ( ( fs->bpb.rootEntryCount * 32 ) + ( fs->bpb.bytesPerSector - 1 ) ) / fs->bpb.bytesPerSector;
+	return calc_physical_sector( fs, clusterNumber, sectorNumber );
+}
 
-	if( fs->bpb.FATSize16 != 0 )
-		FATSize = fs->bpb.FATSize16;
-	else
-		FATSize = fs->bpb.BPB32.FATSize32;
+/* directory sectors are read under the lock set_entry() updates them with,
+   so a reader never sees an entry half written */
+int read_entry_sector( FAT_FILESYSTEM* fs, SECTOR clusterNumber, SECTOR sectorNumber, BYTE* sector )
+{
+	SECTOR	physical = get_entry_sector( fs, clusterNumber, sectorNumber );
+	int		result;
 
-	if( fs->bpb.totalSectors != 0 )
-		totalSectors = fs->bpb.totalSectors;
-	else
-		totalSectors = fs->bpb.totalSectors32;
+	pthread_mutex_lock( &fs->entryLocks[physical % FAT_ENTRY_LOCKS] );
+	result = fs->disk->read_sector( fs->disk, physical, sector );
+	pthread_mutex_unlock( &fs->entryLocks[physical % FAT_ENTRY_LOCKS] );
+
+	return result;
+}
 
-	dataSector = totalSectors - ( fs->bpb.reservedSectorCount + ( fs->bpb.numberOfFATs * FATSize ) + rootSector );
-	countOfClusters = dataSector / fs->bpb.sectorsPerCluster;
+/* search free clusters from FAT and add to free cluster list */
+int search_free_clusters( FAT_FILESYSTEM* fs )
+{
+	FAT_SECTOR_WINDOW	window;
+	UINT32	i, cluster;
+	UINT32	runFirst = 0, runCount = 0;
 
-	for( i = 2; i < countOfClusters; i++ )
+	// FAT 영역을 sector 단위로 한번씩만 읽으면서 연속된 free cluster들을 run으로 묶어 추가
+	// mount 중에는 다른 thread가 없으므로 magazine을 거치지 않고 global list로
+	init_fat_window( &window );
+	for( i = 2; i < fs->countOfClusters + 2; i++ )
 	{
-		cluster = get_fat( fs, i );
+		cluster = get_fat_window( fs, &window, i );
 		if( cluster == FREE_CLUSTER )
-			add_free_cluster( fs, i );
+		{
+			if( runCount == 0 )
+				runFirst = i;
+			runCount++;
+		}
+		else if( runCount )
+		{
+			push_cluster_run( &fs->freeClusterList, runFirst, runCount );
+			runCount = 0;
+		}
 	}
 
+	if( runCount )
+		push_cluster_run( &fs->freeClusterList, runFirst, runCount );
+
 	return FAT_SUCCESS;
 }
 
+/* a mount that failed part way releases what it had set up, in the order
+   of fat_umount() and without writing anything; returns FAT_ERROR */
+int abort_mount( FAT_FILESYSTEM* fs )
+{
+	release_flusher( fs );
+	release_writeback( fs );
+	release_magazines( fs );
+	release_read_queues( fs );
+	release_readahead( fs );
+	release_cluster_list( &fs->freeClusterList );
+
+	free( fs->FATDirtyMap );
+	fs->FATDirtyMap = NULL;
+
+	journal_release( fs );
+	release_fat_locks( fs );
+
+	return FAT_ERROR;
+}
+
 // root 전달인자에 루트 디렉터리 정보가 저장되는 함수
 int fat_read_superblock( FAT_FILESYSTEM* fs, FAT_NODE* root )
 {
@@ -637,33 +1373,72 @@ int fat_read_superblock( FAT_FILESYSTEM* fs, FAT_NODE* root )
 		return FAT_ERROR;
 	}
 
+	// 실패했을 때 정리할 것들, 아래 init 함수들이 차례로 채움
+	fs->journal		= NULL;
+	fs->readahead	= NULL;
+	fs->writeback	= NULL;
+	fs->flusher		= NULL;
+	fs->readQueues	= NULL;
+	fs->FATDirtyMap	= NULL;
+	init_cluster_list( &fs->freeClusterList );
+
+	init_fat_locks( fs );
+	/* erase block groups are kept per file, a per thread reserve would mix them */
+	if( fs->allocPolicy == FAT_ALLOC_ERASE_BLOCK )
+		fs->mountFlags |= FAT_MOUNT_NO_MAGAZINES;
+	init_magazines( fs );
+
 	// disk의 첫번째 sector(BPB가 저장되어있는 sector)를 읽어서 fs->bpb에 저장
-	if( fs->disk->read_sector( fs->disk, 0, &fs->bpb ) )
-		return FAT_ERROR;
+	if( !is_valid_sector_size( fs->disk->bytesPerSector ) || fs->disk->read_sector( fs->disk, 0, sector ) )
+		return abort_mount( fs );
+	memcpy( &fs->bpb, sector, sizeof( FAT_BPB ) );
 		
-	// super block 유효검사 (bpb)
+	// super block 유효검사 (bpb), sector 크기는 디스크와 같아야 함
 	result = validate_bpb( &fs->bpb );
+	if( fs->bpb.bytesPerSector != fs->disk->bytesPerSector )
+		result = FAT_ERROR;
 
 	if( result )
 	{
 		WARNING( "BPB validation is failed\n" );
-		return FAT_ERROR;
+		return abort_mount( fs );
 	}
 
+	// journal이 있으면 commit된 transaction을 다시 적용, 이후 읽기는 journal을 거침
+	if( journal_mount( fs ) )
+		return abort_mount( fs );
+
 	fs->FATType = get_fat_type( &fs->bpb );
 
 	// FAT타입 유효검사 : FAT12, 16, 32
 	if( fs->FATType > FAT32 )
-		return FAT_ERROR;
+		return abort_mount( fs );
 
-	// root directory sector 읽어서 섹터버퍼에 저장
-	if( read_root_sector( fs, 0, sector ) ) 
-		return FAT_ERROR;
+	/* FAT버전에 따라서 FATsize를 저장하기 위한 멤버가 다름
+	   FAT32인 경우 bpb.FATSize16을 0으로 하고 FATSize32에 값을 기록함
+	   FAT16, 12의 경우 bpb.FATSize16만 사용한다
+	   bpb에 있는 데이터를 fs구조체 멤버(fs->FATSize)에 복사하고 나면 
+	   FAT버전에 관계없이 fs->FATSize로 사용할 수 있음*/
+	if( fs->bpb.FATSize16 != 0 )
+		fs->FATSize = fs->bpb.FATSize16;
+	else
+		fs->FATSize = fs->bpb.BPB32.FATSize32;
 
-	// 전달받은 root디렉터리 노드정보 setting
-	ZeroMemory( root, sizeof( FAT_NODE ) );
-	memcpy( &root->entry, sector, sizeof( FAT_DIR_ENTRY ) );
-	root->fs = fs;
+	// FAT32에서 extFlags의 bit 7이 set되어 있으면 mirroring 없이 bit 0-3의 FAT 하나만 사용
+	fs->activeFAT = 0;
+	if( fs->FATType == FAT32 && ( fs->bpb.BPB32.extFlags & 0x80 ) )
+	{
+		fs->activeFAT = fs->bpb.BPB32.extFlags & 0x0F;
+		if( fs->activeFAT >= fs->bpb.numberOfFATs )
+			return abort_mount( fs );
+	}
+	// mirroring할 FAT이 있으면 active FAT의 변경된 sector를 기록할 dirty map 할당
+	else if( fs->bpb.numberOfFATs > 1 )
+	{
+		fs->FATDirtyMap = ( BYTE* )calloc( ( fs->FATSize + 7 ) / 8, 1 );
+		if( fs->FATDirtyMap == NULL )
+			return abort_mount( fs );
+	}
 
 	// FAT 파일시스템의 경우 FAT 테이블에서 EOC(end of cluster)를 나타내는 비트열이 모두 다른데
 	// 이것이 버전에 맞게 설정되었는지 확인하는 코드
@@ -676,50 +1451,102 @@ int fat_read_superblock( FAT_FILESYSTEM* fs, FAT_NODE* root )
 	// 버전에 따라 확인
 	if( fs->FATType == 2 )
 	{
-		if( fs->EOCMark & SHUT_BIT_MASK32 ) 
+		/* the bits are set while the volume is clean and free of errors */
+		if( !( fs->EOCMark & SHUT_BIT_MASK32 ) )
 			WARNING( "disk drive did not dismount correctly\n" );
-		if( fs->EOCMark & ERR_BIT_MASK32 )
+		if( !( fs->EOCMark & ERR_BIT_MASK32 ) )
 			WARNING( "disk drive has error\n" );
 	}
 	else
 	{
 		if( fs->FATType == 1)
 		{
-			if( fs->EOCMark & SHUT_BIT_MASK16 )
+			if( !( fs->EOCMark & SHUT_BIT_MASK16 ) )
 				PRINTF( "disk drive did not dismounted\n" );
-			if( fs->EOCMark & ERR_BIT_MASK16 )
+			if( !( fs->EOCMark & ERR_BIT_MASK16 ) )
 				PRINTF( "disk drive has error\n" );
 		}
 	}
 
-	/* FAT버전에 따라서 FATsize를 저장하기 위한 멤버가 다름
-	   FAT32인 경우 bpb.FATSize16을 0으로 하고 FATSize32에 값을 기록함
-	   FAT16, 12의 경우 bpb.FATSize16만 사용한다
-	   bpb에 있는 데이터를 fs구조체 멤버(fs->FATSize)에 복사하고 나면 
-	   FAT버전에 관계없이 fs->FATSize로 사용할 수 있음*/
-	if( fs->bpb.FATSize16 != 0 )
-		fs->FATSize = fs->bpb.FATSize16;
-	else
-		fs->FATSize = fs->bpb.BPB32.FATSize32;
+	fs->countOfClusters = get_count_of_clusters( &fs->bpb );
+	init_alloc_policy( fs );
+	if( init_readahead( fs ) || init_writeback( fs ) )
+		return abort_mount( fs );
 
-	// fs구조체가 가리키는 freeClusterList를 0으로 초기화
-	init_cluster_list( &fs->freeClusterList );
+	// root directory sector 읽어서 섹터버퍼에 저장, FAT32는 rootCluster부터 시작하는 chain
+	if( read_root_sector( fs, 0, sector ) ) 
+		return abort_mount( fs );
+
+	// 전달받은 root디렉터리 노드정보 setting
+	ZeroMemory( root, sizeof( FAT_NODE ) );
+	memcpy( &root->entry, sector, sizeof( FAT_DIR_ENTRY ) );
+	root->fs = fs;
+	if( fs->FATType == FAT32 )
+		SET_FIRST_CLUSTER( root->entry, fs->bpb.BPB32.rootCluster );
 
 	// free cluster를 찾고 freeClusterList에 추가
 	search_free_clusters( fs );
 
+	// free cluster를 다 찾은 뒤에 flusher thread 시작
+	if( init_flusher( fs ) )
+		return abort_mount( fs );
+
 	// 전달받은 root의 entry의 name에 0x20(공백) 11바이트 채움
 	memset( root->entry.name, 0x20, 11 );
 	return FAT_SUCCESS;
 }
 
-/******************************************************************************/
-/* On unmount file system                                                     */
-/******************************************************************************/
-void fat_umount( FAT_FILESYSTEM* fs )
-{
-	// free cluster_list 해제
-	release_cluster_list( &fs->freeClusterList );
+/******************************************************************************/
+/* On unmount file system                                                     */
+/******************************************************************************/
+void fat_umount( FAT_FILESYSTEM* fs )
+{
+	release_flusher( fs );
+	fat_sync( fs );
+
+	release_writeback( fs );
+	release_magazines( fs );
+	release_read_queues( fs );
+	release_readahead( fs );
+
+	// free cluster_list 해제
+	release_cluster_list( &fs->freeClusterList );
+
+	if( fs->FATDirtyMap )
+	{
+		free( fs->FATDirtyMap );
+		fs->FATDirtyMap = NULL;
+	}
+
+	journal_release( fs );
+	release_fat_locks( fs );
+}
+
+/******************************************************************************/
+/* Write back deferred metadata                                               */
+/******************************************************************************/
+int fat_sync( FAT_FILESYSTEM* fs )
+{
+	// read only로 mount했으면 기록할 것이 없음
+	if( fs->mountFlags & FAT_MOUNT_READ_ONLY )
+		return FAT_SUCCESS;
+
+	// 모아둔 append를 먼저 써야 그 FAT, directory 변경도 함께 기록됨
+	if( writeback_flush_all( fs ) )
+		return FAT_ERROR;
+
+	// journal의 FAT, directory sector를 먼저 제자리에 기록, mirror는 그 내용을 복사
+	if( journal_checkpoint( fs ) )
+		return FAT_ERROR;
+
+	if( sync_fat_mirrors( fs ) )
+		return FAT_ERROR;
+
+	// FAT32는 FSInfo의 free cluster 개수를 갱신, 다음 free cluster는 알 수 없음으로 기록
+	if( fs->FATType == FAT32 )
+		return write_fsinfo( fs->disk, &fs->bpb, count_free_clusters( fs ), 0xFFFFFFFF );
+
+	return FAT_SUCCESS;
 }
 
 // sector단위에 저장되어있는 dir_entry들을 읽음
@@ -751,6 +1578,7 @@ int read_dir_from_sector( FAT_FILESYSTEM* fs, FAT_ENTRY_LOCATION* location, BYTE
 			node.location = *location; // cluster, sector정보
 			node.location.number = i; // number에는 지금sector에서 현재 엔트리 offset
 			node.entry = *dir; // 해당 순서의 디렉터리 엔트리
+			writeback_patch_size( &node ); // 아직 쓰지 않은 append까지 포함한 크기
 			adder( list, &node ); // fat_node를 shell_entry로해서 list에 추가
 		}
 
@@ -813,6 +1641,8 @@ int fat_read_dir( FAT_NODE* dir, FAT_NODE_ADD adder, void* list )
 	SECTOR	i, j, rootEntryCount;
 	FAT_ENTRY_LOCATION location;
 
+	lock_directory( dir->fs, GET_FIRST_CLUSTER( dir->entry ), 0 );
+
 	// 전달받은 fat_node의 entry가 루트 디렉터리일때
 	if( IS_POINT_ROOT_ENTRY( dir->entry ) && ( dir->fs->FATType == FAT12 || dir->fs->FATType == FAT16 ) )
 	{
@@ -824,7 +1654,7 @@ int fat_read_dir( FAT_NODE* dir, FAT_NODE_ADD adder, void* list )
 		for( i = 0; i < rootEntryCount; i++ )
 		{
 			// i번째 섹터를 sector버퍼에 읽어옴
-			read_root_sector( dir->fs, i, sector );
+			read_entry_sector( dir->fs, 0, i, sector );
 			location.cluster = 0; // 클러스터 위치는 0으로 고정
 			location.sector = i; // 섹터만 변경
 			location.number = 0;
@@ -847,7 +1677,7 @@ int fat_read_dir( FAT_NODE* dir, FAT_NODE_ADD adder, void* list )
 			for( j = 0; j < dir->fs->bpb.sectorsPerCluster; j++ )
 			{
 				// j번째 섹터를 sector버퍼에 읽어옴
-				read_data_sector( dir->fs, i, j, sector );
+				read_entry_sector( dir->fs, i, j, sector );
 				location.cluster = i;
 				location.sector = j;
 				location.number = 0;
@@ -863,29 +1693,558 @@ int fat_read_dir( FAT_NODE* dir, FAT_NODE_ADD adder, void* list )
 		} while( !is_EOC( dir->fs->FATType, i ) && i != 0 );
 	}
 
+	unlock_directory( dir->fs, GET_FIRST_CLUSTER( dir->entry ) );
+
+	return FAT_SUCCESS;
+}
+
+/******************************************************************************/
+/* Walk the directory tree                                                    */
+/******************************************************************************/
+typedef struct
+{
+	FAT_NODE*	nodes;
+	UINT32		count;
+	UINT32		capacity;
+} FAT_NODE_ARRAY;
+
+int add_node_array( void* list, FAT_NODE* node )
+{
+	FAT_NODE_ARRAY*	array = ( FAT_NODE_ARRAY* )list;
+	FAT_NODE*		grown;
+
+	/* '.' and '..' point back into the tree */
+	if( node->entry.name[0] == '.' )
+		return FAT_SUCCESS;
+
+	if( array->count == array->capacity )
+	{
+		array->capacity = ( array->capacity ? array->capacity * 2 : 16 );
+		grown = ( FAT_NODE* )realloc( array->nodes, array->capacity * sizeof( FAT_NODE ) );
+		if( grown == NULL )
+			return FAT_ERROR;
+		array->nodes = grown;
+	}
+
+	array->nodes[array->count++] = *node;
+
+	return FAT_SUCCESS;
+}
+
+/* Calls visitor for every file and directory below dir, parents before their
+   children. The entries of a directory are read before any of them is visited,
+   so the visitor may rewrite entries; a directory is descended with the node
+   as the visitor left it. */
+int fat_walk_tree( FAT_NODE* dir, FAT_NODE_VISIT visitor, void* param )
+{
+	FAT_NODE_ARRAY	children = { NULL, 0, 0 };
+	UINT32			i;
+	int				result = FAT_SUCCESS;
+
+	fat_read_dir( dir, add_node_array, &children );
+
+	for( i = 0; i < children.count && result == FAT_SUCCESS; i++ )
+	{
+		result = visitor( param, dir, &children.nodes[i] );
+
+		if( result == FAT_SUCCESS && ( children.nodes[i].entry.attribute & ATTR_DIRECTORY ) )
+			result = fat_walk_tree( &children.nodes[i], visitor, param );
+	}
+
+	free( children.nodes );
+
+	return result;
+}
+
+/******************************************************************************/
+/* Free cluster allocator                                                     */
+/******************************************************************************/
+/* allocPolicy picks the run a request is served from whenever the global list
+   is used: refilling a magazine, or a request a magazine can't serve.
+   FAT_ALLOC_ERASE_BLOCK gives each new chain an aligned group of its own and
+   keeps extending a chain inside its group, so a file rewritten or deleted
+   later invalidates whole flash erase blocks instead of a few pages of many.
+   That pays when appends are allocated as they come; write-behind already
+   takes a file's clusters in one run, and then the policies come out even. */
+
+/* groups are eraseBlockBytes of the disk, aligned to the start of the disk */
+void init_alloc_policy( FAT_FILESYSTEM* fs )
+{
+	UINT32	clusterBytes = fs->bpb.bytesPerSector * fs->bpb.sectorsPerCluster;
+	UINT32	bytes = ( fs->eraseBlockBytes ? fs->eraseBlockBytes : FAT_ERASE_BLOCK_BYTES );
+	SECTOR	firstData = calc_physical_sector( fs, 2, 0 ) / fs->bpb.sectorsPerCluster;
+
+	fs->groupClusters = ( bytes > clusterBytes ? bytes / clusterBytes : 1 );
+	fs->groupPhase = ( firstData % fs->groupClusters + fs->groupClusters - 2 % fs->groupClusters ) % fs->groupClusters;
+	fs->allocCursor = 2;
+}
+
+/* take up to count clusters from the global list as allocPolicy says;
+   the caller holds allocLock */
+int pop_policy_run( FAT_FILESYSTEM* fs, SECTOR previous, UINT32 count, SECTOR* first, UINT32* allocated )
+{
+	CLUSTER_LIST*	list = &fs->freeClusterList;
+	CLUSTER_RUN*	run = NULL;
+	SECTOR			start = 0, next = previous + 1;
+	UINT32			limit;
+
+	switch( fs->allocPolicy )
+	{
+	case FAT_ALLOC_NEXT_FIT:
+		run = find_cluster_run_after( list, count, fs->allocCursor );
+		break;
+
+	case FAT_ALLOC_BEST_FIT:
+		run = find_best_cluster_run( list, count );
+		break;
+
+	case FAT_ALLOC_ERASE_BLOCK:
+		/* the rest of the group the chain is in, if the next cluster is free */
+		if( previous && ( next + fs->groupPhase ) % fs->groupClusters )
+		{
+			run = find_cluster_run_of( list, next );
+			if( run )
+			{
+				start = next;
+				limit = fs->groupClusters - ( next + fs->groupPhase ) % fs->groupClusters;
+				if( count > limit )
+					count = limit;
+			}
+		}
+		if( run == NULL )
+			run = find_aligned_cluster_run( list, fs->groupClusters, fs->groupPhase, &start );
+		/* no whole group is left; fill the gaps */
+		if( run == NULL )
+			run = find_best_cluster_run( list, count );
+		break;
+
+	default:
+		return pop_cluster_run( list, count, first, allocated );
+	}
+
+	if( run == NULL || run->count == 0 )
+		return FAT_ERROR;
+
+	if( start == 0 )
+		start = run->first;
+	if( count > run->first + run->count - start )
+		count = run->first + run->count - start;
+
+	if( take_cluster_run( list, run, start, count ) )
+		return FAT_ERROR;
+
+	*first		= start;
+	*allocated	= count;
+	fs->allocCursor = start + count;
+
 	return FAT_SUCCESS;
 }
 
+/* Every thread allocating from a volume keeps a magazine of a few free runs.
+   Allocations and small frees are served from it under the magazine's own
+   lock, which only its thread takes but for a reclaim, not under allocLock;
+   it is refilled with FAT_MAGAZINE_REFILL contiguous clusters at a time and
+   spills back to the global list in one locked batch. Writers thus rarely
+   meet on the lock, and a file written by one thread grows inside that
+   thread's run. A refill continues the file right after its last cluster
+   when that is free; otherwise, while another writer holds a run, it starts
+   in the middle of the longest free run, so each file has room to grow.
+   Clusters sitting in a magazine are still free in the FAT. */
+
+/* hand all runs except the newest keep ones back to the global list;
+   the caller holds allocLock and the magazine's lock */
+void spill_magazine( FAT_FILESYSTEM* fs, FAT_MAGAZINE* magazine, UINT32 keep )
+{
+	UINT32	spill, i;
+
+	if( magazine->runCount <= keep )
+		return;
+
+	spill = magazine->runCount - keep;
+	for( i = 0; i < spill; i++ )
+	{
+		push_cluster_run( &fs->freeClusterList, magazine->runs[i].first, magazine->runs[i].count );
+		magazine->clusters -= magazine->runs[i].count;
+	}
+
+	memmove( magazine->runs, &magazine->runs[spill], keep * sizeof( CLUSTER_RUN ) );
+	magazine->runCount = keep;
+}
+
+/* the global list ran dry: what the other threads hold in reserve is still
+   free, take it all back before reporting the volume full; the caller holds
+   allocLock */
+void reclaim_magazines( FAT_FILESYSTEM* fs )
+{
+	FAT_MAGAZINE*	magazine;
+
+	for( magazine = fs->magazines; magazine; magazine = magazine->next )
+	{
+		pthread_mutex_lock( &magazine->lock );
+		spill_magazine( fs, magazine, 0 );
+		pthread_mutex_unlock( &magazine->lock );
+	}
+}
+
+/* thread exit */
+void drop_magazine( void* param )
+{
+	FAT_MAGAZINE*	magazine = ( FAT_MAGAZINE* )param;
+	FAT_FILESYSTEM*	fs = magazine->fs;
+	FAT_MAGAZINE**	link;
+
+	pthread_mutex_lock( &fs->allocLock );
+	pthread_mutex_lock( &magazine->lock );
+	spill_magazine( fs, magazine, 0 );
+	pthread_mutex_unlock( &magazine->lock );
+	for( link = &fs->magazines; *link; link = &( *link )->next )
+	{
+		if( *link == magazine )
+		{
+			*link = magazine->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock( &fs->allocLock );
+
+	pthread_mutex_destroy( &magazine->lock );
+	free( magazine );
+}
+
+void init_magazines( FAT_FILESYSTEM* fs )
+{
+	fs->magazines = NULL;
+	if( pthread_key_create( &fs->magazineKey, drop_magazine ) )
+		fs->mountFlags |= FAT_MOUNT_NO_MAGAZINES;
+}
+
+/* the clusters in the magazines are free on disk already, nothing to write */
+void release_magazines( FAT_FILESYSTEM* fs )
+{
+	FAT_MAGAZINE*	magazine;
+
+	if( fs->mountFlags & FAT_MOUNT_NO_MAGAZINES )
+		return;
+
+	pthread_setspecific( fs->magazineKey, NULL );
+	pthread_key_delete( fs->magazineKey );
+
+	while( fs->magazines )
+	{
+		magazine = fs->magazines;
+		fs->magazines = magazine->next;
+		pthread_mutex_destroy( &magazine->lock );
+		free( magazine );
+	}
+}
+
+/* NULL when the volume was mounted without magazines */
+FAT_MAGAZINE* get_magazine( FAT_FILESYSTEM* fs )
+{
+	FAT_MAGAZINE*	magazine;
+
+	if( fs->mountFlags & FAT_MOUNT_NO_MAGAZINES )
+		return NULL;
+
+	magazine = ( FAT_MAGAZINE* )pthread_getspecific( fs->magazineKey );
+	if( magazine )
+		return magazine;
+
+	magazine = ( FAT_MAGAZINE* )calloc( 1, sizeof( FAT_MAGAZINE ) );
+	if( magazine == NULL )
+		return NULL;
+	magazine->fs = fs;
+	pthread_mutex_init( &magazine->lock, NULL );
+
+	pthread_mutex_lock( &fs->allocLock );
+	magazine->next = fs->magazines;
+	fs->magazines = magazine;
+	pthread_mutex_unlock( &fs->allocLock );
+
+	pthread_setspecific( fs->magazineKey, magazine );
+
+	return magazine;
+}
+
+/* whether a thread other than magazine's holds free runs; the caller holds
+   allocLock */
+int other_magazines_active( FAT_FILESYSTEM* fs, FAT_MAGAZINE* magazine )
+{
+	FAT_MAGAZINE*	other;
+	int				active = 0;
+
+	for( other = fs->magazines; other && !active; other = other->next )
+	{
+		if( other == magazine )
+			continue;
+		pthread_mutex_lock( &other->lock );
+		active = ( other->runCount != 0 );
+		pthread_mutex_unlock( &other->lock );
+	}
+
+	return active;
+}
+
+/* previous is the last cluster of the chain being extended, 0 for a new one */
+int refill_magazine( FAT_FILESYSTEM* fs, FAT_MAGAZINE* magazine, SECTOR previous )
+{
+	CLUSTER_LIST*	list = &fs->freeClusterList;
+	CLUSTER_RUN*	run;
+	SECTOR			first = 0;
+	UINT32			count;
+	int				result;
+
+	pthread_mutex_lock( &fs->allocLock );
+	run = ( previous ? find_cluster_run_of( list, previous + 1 ) : NULL );
+	if( run )
+		first = previous + 1;
+	else if( fs->allocPolicy == FAT_ALLOC_FIRST_FIT && other_magazines_active( fs, magazine ) )
+	{
+		/* no run holds more than every cluster, so this is the longest */
+		run = find_best_cluster_run( list, fs->countOfClusters + 1 );
+		if( run )
+			first = run->first + ( run->count > 2 * FAT_MAGAZINE_REFILL ? run->count / 2 : 0 );
+	}
+
+	if( run && run->count )
+	{
+		count	= MIN( FAT_MAGAZINE_REFILL, run->first + run->count - first );
+		result	= take_cluster_run( list, run, first, count );
+	}
+	else
+		result = pop_policy_run( fs, 0, FAT_MAGAZINE_REFILL, &first, &count );
+	if( result == FAT_SUCCESS )
+	{
+		/* only this thread adds runs, the magazine is still empty */
+		pthread_mutex_lock( &magazine->lock );
+		magazine->runs[0].first	= first;
+		magazine->runs[0].count	= count;
+		magazine->runCount		= 1;
+		magazine->clusters		= count;
+		pthread_mutex_unlock( &magazine->lock );
+	}
+	pthread_mutex_unlock( &fs->allocLock );
+
+	return result;
+}
+
+/* grow the active (last) run by a run adjacent to it; the caller holds the
+   magazine's lock */
+int merge_magazine_run( FAT_MAGAZINE* magazine, SECTOR first, UINT32 count )
+{
+	CLUSTER_RUN*	active;
+
+	if( magazine->runCount == 0 )
+		return 0;
+
+	active = &magazine->runs[magazine->runCount - 1];
+	if( first + count == active->first )
+		active->first = first;
+	else if( active->first + active->count != first )
+		return 0;
+
+	active->count += count;
+	magazine->clusters += count;
+
+	return 1;
+}
+
+/* a free run slot is left; the caller holds the magazine's lock */
+void insert_magazine_run( FAT_MAGAZINE* magazine, SECTOR first, UINT32 count )
+{
+	UINT32	slot;
+
+	slot = ( magazine->runCount ? magazine->runCount - 1 : 0 );
+	memmove( &magazine->runs[slot + 1], &magazine->runs[slot], ( magazine->runCount - slot ) * sizeof( CLUSTER_RUN ) );
+	magazine->runs[slot].first	= first;
+	magazine->runs[slot].count	= count;
+	magazine->runCount++;
+	magazine->clusters += count;
+}
+
+/* freed clusters go in front of the active (last) run so the writer keeps
+   extending its file contiguously */
+void put_magazine( FAT_FILESYSTEM* fs, FAT_MAGAZINE* magazine, SECTOR first, UINT32 count )
+{
+	pthread_mutex_lock( &magazine->lock );
+	if( merge_magazine_run( magazine, first, count ) )
+	{
+		pthread_mutex_unlock( &magazine->lock );
+		return;
+	}
+	if( magazine->clusters + count <= FAT_MAGAZINE_LIMIT && magazine->runCount < FAT_MAGAZINE_RUNS )
+	{
+		insert_magazine_run( magazine, first, count );
+		pthread_mutex_unlock( &magazine->lock );
+		return;
+	}
+	pthread_mutex_unlock( &magazine->lock );
+
+	/* something goes back to the global list, allocLock is taken first */
+	pthread_mutex_lock( &fs->allocLock );
+	pthread_mutex_lock( &magazine->lock );
+	if( magazine->clusters + count > FAT_MAGAZINE_LIMIT )
+	{
+		/* too much in reserve: keep the active run, the rest goes back */
+		push_cluster_run( &fs->freeClusterList, first, count );
+		spill_magazine( fs, magazine, ( magazine->runCount ? 1 : 0 ) );
+	}
+	else
+	{
+		if( magazine->runCount == FAT_MAGAZINE_RUNS )
+			spill_magazine( fs, magazine, 1 );
+		insert_magazine_run( magazine, first, count );
+	}
+	pthread_mutex_unlock( &magazine->lock );
+	pthread_mutex_unlock( &fs->allocLock );
+}
+
 int add_free_cluster( FAT_FILESYSTEM* fs, SECTOR cluster )
 {
-	return push_cluster( &fs->freeClusterList, cluster );
+	return add_free_cluster_run( fs, cluster, 1 );
+}
+
+/* A run freed from a chain. Under a journal it waits for the commit of the
+   transaction freeing it, see journal_free_run() */
+int free_cluster_run( FAT_FILESYSTEM* fs, SECTOR first, UINT32 count )
+{
+	if( fs->journal )
+		return journal_free_run( fs, first, count );
+
+	return release_cluster_run( fs, first, count );
+}
+
+/* its sectors are discarded before the clusters can be handed out again, so
+   a discard never races a new owner's writes */
+int release_cluster_run( FAT_FILESYSTEM* fs, SECTOR first, UINT32 count )
+{
+	if( !( fs->mountFlags & FAT_MOUNT_NO_DISCARD ) )
+		disk_discard_sectors( fs->disk, calc_physical_sector( fs, first, 0 ), count * fs->bpb.sectorsPerCluster );
+	readahead_invalidate( fs, first, count, 1 );
+
+	return add_free_cluster_run( fs, first, count );
+}
+
+int add_free_cluster_run( FAT_FILESYSTEM* fs, SECTOR first, UINT32 count )
+{
+	FAT_MAGAZINE*	magazine;
+	int				result;
+
+	/* large runs are of no use to one writer; share them right away */
+	magazine = ( count < FAT_MAGAZINE_REFILL ? get_magazine( fs ) : NULL );
+	if( magazine )
+	{
+		put_magazine( fs, magazine, first, count );
+		return FAT_SUCCESS;
+	}
+
+	pthread_mutex_lock( &fs->allocLock );
+	result = push_cluster_run( &fs->freeClusterList, first, count );
+	pthread_mutex_unlock( &fs->allocLock );
+
+	return result;
 }
 
 SECTOR alloc_free_cluster( FAT_FILESYSTEM* fs )
 {
-	SECTOR	cluster;
+	UINT32	allocated;
+
+	return alloc_free_cluster_run( fs, 1, &allocated );
+}
+
+/* allocate up to count contiguous clusters; *allocated receives how many */
+SECTOR alloc_free_cluster_run( FAT_FILESYSTEM* fs, UINT32 count, UINT32* allocated )
+{
+	return alloc_cluster_run_after( fs, 0, count, allocated );
+}
+
+/* the same for a chain ending in previous, 0 for a new chain */
+SECTOR alloc_cluster_run_after( FAT_FILESYSTEM* fs, SECTOR previous, UINT32 count, UINT32* allocated )
+{
+	FAT_MAGAZINE*	magazine = get_magazine( fs );
+	CLUSTER_RUN*	active;
+	SECTOR			cluster;
+	int				result;
+
+	if( magazine && count < FAT_MAGAZINE_REFILL )
+	{
+		pthread_mutex_lock( &magazine->lock );
+		if( magazine->runCount == 0 )
+		{
+			pthread_mutex_unlock( &magazine->lock );
+			refill_magazine( fs, magazine, previous );
+			pthread_mutex_lock( &magazine->lock );
+		}
+
+		/* a run request the active run can't cover whole is better served
+		   by the first fit of the global list */
+		active = ( magazine->runCount ? &magazine->runs[magazine->runCount - 1] : NULL );
+		if( active && active->count >= count )
+		{
+			cluster		= active->first;
+			*allocated	= count;
+
+			active->first		+= *allocated;
+			active->count		-= *allocated;
+			magazine->clusters	-= *allocated;
+			if( active->count == 0 )
+				magazine->runCount--;
+
+			pthread_mutex_unlock( &magazine->lock );
+			return cluster;
+		}
+		pthread_mutex_unlock( &magazine->lock );
+	}
+
+	pthread_mutex_lock( &fs->allocLock );
+	result = pop_policy_run( fs, previous, count, &cluster, allocated );
+
+	if( result == FAT_ERROR && fs->magazines )
+	{
+		reclaim_magazines( fs );
+		result = pop_policy_run( fs, previous, count, &cluster, allocated );
+	}
+	pthread_mutex_unlock( &fs->allocLock );
 
-	if( pop_cluster( &fs->freeClusterList, &cluster ) == FAT_ERROR )
+	if( result == FAT_ERROR )
 		return 0;
 
 	return cluster;
 }
 
+/* clusters held in magazines are counted as free */
+UINT32 count_free_clusters( FAT_FILESYSTEM* fs )
+{
+	FAT_MAGAZINE*	magazine;
+	UINT32			count;
+
+	pthread_mutex_lock( &fs->allocLock );
+	count = fs->freeClusterList.count;
+	for( magazine = fs->magazines; magazine; magazine = magazine->next )
+	{
+		pthread_mutex_lock( &magazine->lock );
+		count += magazine->clusters;
+		pthread_mutex_unlock( &magazine->lock );
+	}
+	pthread_mutex_unlock( &fs->allocLock );
+
+	return count;
+}
+
+/* whether a cluster can be taken without touching the ones promised to
+   buffered appends */
+int cluster_available( FAT_FILESYSTEM* fs )
+{
+	UINT32	reserved = writeback_reserved( fs );
+
+	return ( reserved == 0 || count_free_clusters( fs ) > reserved );
+}
+
 SECTOR span_cluster_chain( FAT_FILESYSTEM* fs, SECTOR clusterNumber )
 {
-	UINT32	nextCluster;
+	UINT32	nextCluster, allocated;
 
-	nextCluster = alloc_free_cluster( fs );
+	nextCluster = alloc_cluster_run_after( fs, clusterNumber, 1, &allocated );
 
 	if( nextCluster )
 	{
@@ -962,7 +2321,7 @@ int find_entry_on_root( FAT_FILESYSTEM* fs, const FAT_ENTRY_LOCATION* first, con
 	for( i = first->sector; i <= lastSector; i++ )
 	{
 		// root sector중에서 i번째 sector를 sector버퍼에 write
-		read_root_sector( fs, i, sector );
+		read_entry_sector( fs, 0, i, sector );
 
 		// 읽어온 sector의 첫번째 FAT_DIR_ENTRY를 entry에 연결
 		entry = ( FAT_DIR_ENTRY* )sector;
@@ -1028,7 +2387,7 @@ int find_entry_on_data( FAT_FILESYSTEM* fs, const FAT_ENTRY_LOCATION* first, con
 		for( i = first->sector; i < fs->bpb.sectorsPerCluster; i++ )
 		{
 			// currentCluster로 cluster에 접근하고 i로 sector에 접근해서 sector버퍼에 저장
-			read_data_sector( fs, currentCluster, i, sector );
+			read_entry_sector( fs, currentCluster, i, sector );
 			entry = ( FAT_DIR_ENTRY* )sector;
 
 			// 섹터 내부검사
@@ -1095,34 +2454,31 @@ int lookup_entry( FAT_FILESYSTEM* fs, const FAT_ENTRY_LOCATION* first, const BYT
 int set_entry( FAT_FILESYSTEM* fs, const FAT_ENTRY_LOCATION* location, const FAT_DIR_ENTRY* value )
 {
 	BYTE	sector[MAX_SECTOR_SIZE];
+	SECTOR	physical;
+	int		result;
 	FAT_DIR_ENTRY*	entry;
 
-	// location이 root디렉터리 영역인 경우
-	if( location->cluster == 0 && ( fs->FATType == FAT12 || fs->FATType == FAT16 ) )
-	{
-		// 해당 섹터에 대한 내용을 sector버퍼에 써줌
-		read_root_sector( fs, location->sector, sector );
+	// location이 root디렉터리 영역이면 root sector, 아니면 data cluster의 sector
+	physical = get_entry_sector( fs, location->cluster, location->sector );
 
-		// 그 섹터의 해당 위치(number번째) 엔트리에 value 연결
-		entry = ( FAT_DIR_ENTRY* )sector;
-		entry[location->number] = *value;
+	// 같은 sector의 다른 entry를 바꾸는 thread와 read-modify-write가 섞이지 않게 함
+	pthread_mutex_lock( &fs->entryLocks[physical % FAT_ENTRY_LOCKS] );
 
-		// sector버퍼의 내용을 디스크의 해당 섹터에 써줌
-		write_root_sector( fs, location->sector, sector );
-	}
-	// location이 root디렉터리가 아닌경우
-	else
+	// 해당 섹터에 대한 내용을 sector버퍼에 읽어옴
+	result = fs->disk->read_sector( fs->disk, physical, sector );
+	if( result == 0 )
 	{
-		// 위의 read_root_sector와 다른점 : 0이 아닌cluster로 접근함
-		read_data_sector( fs, location->cluster, location->sector, sector );
-
+		// 그 섹터의 해당 위치(number번째) 엔트리에 value 연결
 		entry = ( FAT_DIR_ENTRY* )sector;
 		entry[location->number] = *value;
 
-		write_data_sector( fs, location->cluster, location->sector, sector );
+		// sector버퍼의 내용을 디스크의 해당 섹터에 써줌, journal이 있으면 journal에
+		result = journal_write_sector( fs, physical, sector );
 	}
 
-	return FAT_ERROR;
+	pthread_mutex_unlock( &fs->entryLocks[physical % FAT_ENTRY_LOCKS] );
+
+	return ( result ? FAT_ERROR : FAT_SUCCESS );
 }
 
 // 부모 디렉터리에 새로운 dir_entry 추가
@@ -1245,6 +2601,8 @@ int format_name( FAT_FILESYSTEM* fs, char* name )
 	UINT32	extenderCurrent = 8;
 	BYTE	regularName[MAX_ENTRY_NAME_LENGTH];
 
+	// FAT 종류와 관계없이 8.3 이름, fs는 쓰지 않음
+	( void )fs;
 	// regularName 주소부터 sizeof(regularName)바이트를 0x20으로 채움
 	memset( regularName, 0x20, sizeof( regularName ) );
 	length = strlen( name );
@@ -1266,53 +2624,47 @@ int format_name( FAT_FILESYSTEM* fs, char* name )
 	}
 
 	// hidden directory는 아닌경우
-	if( fs->FATType == FAT32 )
-	{
-	}
-	// FATType이 FAT32가 아니면
-	else
+	/* long names are not supported, so every FAT type takes the same 8.3 short name */
+	// name의 모든 문자를 대문자로 변경
+	upper_string( name, MAX_ENTRY_NAME_LENGTH );
+
+	// name문자열의 길이만큼 반복
+	for( i = 0; i < length; i++ )
 	{
-		// name의 모든 문자를 대문자로 변경
-		upper_string( name, MAX_ENTRY_NAME_LENGTH );
+		// name 문자열 중에 '.', 숫자, 알파벳을 제외한 문자가 있으면 에러
+		if( name[i] != '.' && !isdigit( name[i] ) && !isalpha( name[i] ) )
+			return FAT_ERROR;
 
-		// name문자열의 길이만큼 반복
-		for( i = 0; i < length; i++ )
+		// extender은 위에서 0으로 초기화했었음
+		// '.'은 파일명 문자열에서 두개 이상일 수 없음(하나까지만 가능)
+		if( name[i] == '.' )
 		{
-			// name 문자열 중에 '.', 숫자, 알파벳을 제외한 문자가 있으면 에러
-			if( name[i] != '.' && !isdigit( name[i] ) && !isalpha( name[i] ) )
-				return FAT_ERROR;
-
-			// extender은 위에서 0으로 초기화했었음
-			// '.'은 파일명 문자열에서 두개 이상일 수 없음(하나까지만 가능)
-			if( name[i] == '.' )
-			{
-				if( extender )
-					return FAT_ERROR;		/* dot character is allowed only once */
-				extender = 1;
-			}
+			if( extender )
+				return FAT_ERROR;		/* dot character is allowed only once */
+			extender = 1;
+		}
 
-			// 파일명과 확장자를 구분하는 코드
-			else if( isdigit( name[i] ) || isalpha( name[i] ) )
-			{
-				// .이 하나 나와서 extender가 1이 된 경우
-				/* ex) "abc.txt"에서 txt부분. 위에서 UINT32 extenderCurrent = 8;이므로
-				   확장자는 언제나 8번 위치부터 시작. 이름의 끝부터 8번 위치 전까지는 
-				   초기 memset(regularname, 0x20, sizeof(regularname))으로 모두 공백으로 차있음*/
-				if( extender )
-					regularName[extenderCurrent++] = name[i];
-				
-				// 파일명 부분, .을 만나기 전
-				else
-					regularName[nameLength++] = name[i];
-			}
+		// 파일명과 확장자를 구분하는 코드
+		else if( isdigit( name[i] ) || isalpha( name[i] ) )
+		{
+			// .이 하나 나와서 extender가 1이 된 경우
+			/* ex) "abc.txt"에서 txt부분. 위에서 UINT32 extenderCurrent = 8;이므로
+			   확장자는 언제나 8번 위치부터 시작. 이름의 끝부터 8번 위치 전까지는 
+			   초기 memset(regularname, 0x20, sizeof(regularname))으로 모두 공백으로 차있음*/
+			if( extender )
+				regularName[extenderCurrent++] = name[i];
+			
+			// 파일명 부분, .을 만나기 전
 			else
-				return FAT_ERROR;			/* non-ascii name is not allowed */
+				regularName[nameLength++] = name[i];
 		}
-
-		if( nameLength > 8 || nameLength == 0 || extenderCurrent > 11 )
-			return FAT_ERROR;
+		else
+			return FAT_ERROR;			/* non-ascii name is not allowed */
 	}
 
+	if( nameLength > 8 || nameLength == 0 || extenderCurrent > 11 )
+		return FAT_ERROR;
+
 	// regularName을 name으로 복사
 	memcpy( name, regularName, sizeof( regularName ) );
 	return FAT_SUCCESS;
@@ -1321,16 +2673,19 @@ int format_name( FAT_FILESYSTEM* fs, char* name )
 /******************************************************************************/
 /* Create new directory                                                       */
 /******************************************************************************/
-int fat_mkdir( const FAT_NODE* parent, const char* entryName, FAT_NODE* ret )
+int make_directory( const FAT_NODE* parent, const char* entryName, FAT_NODE* ret )
 {
 	FAT_NODE		dotNode, dotdotNode;
-	DWORD			firstCluster;
+	DWORD			firstCluster, parentCluster;
 	BYTE			name[MAX_NAME_LENGTH];
 	int				result;
 
 	// entryName을 name에 copy
 	strncpy( name, entryName, MAX_NAME_LENGTH );
 
+	if( parent->fs->mountFlags & FAT_MOUNT_READ_ONLY )
+		return FAT_ERROR;
+
 	// name 형식 맞춰줌
 	if( format_name( parent->fs, name ) )
 		return FAT_ERROR;
@@ -1361,11 +2716,7 @@ int fat_mkdir( const FAT_NODE* parent, const char* entryName, FAT_NODE* ret )
 	// dir_entry에 할당받은 첫 cluster setting
 	SET_FIRST_CLUSTER( ret->entry, firstCluster );
 
-	// 부모 디렉터리에 새로운 dir_entry 추가
-	result = insert_entry( parent, ret, 0 );
-	if( result )
-		return FAT_ERROR;
-
+	// '.', '..'를 먼저 써서 부모에 보이는 순간부터 완성된 디렉터리가 되게 함
 	ret->fs = parent->fs;
 
 	/* dotEntry "." */
@@ -1386,26 +2737,90 @@ int fat_mkdir( const FAT_NODE* parent, const char* entryName, FAT_NODE* ret )
 	dotdotNode.entry.attribute = ATTR_DIRECTORY;
 
 	// 부모 디렉터리가 시작되는 cluster로 setting
-	SET_FIRST_CLUSTER( dotdotNode.entry, GET_FIRST_CLUSTER( parent->entry ) ); 
+	// 부모가 root면 FAT 종류와 관계없이 0
+	parentCluster = GET_FIRST_CLUSTER( parent->entry );
+	if( parent->fs->FATType == FAT32 && parentCluster == parent->fs->bpb.BPB32.rootCluster )
+		parentCluster = 0;
+	SET_FIRST_CLUSTER( dotdotNode.entry, parentCluster );
 	insert_entry( ret, &dotdotNode, 0 ); // overwrite X
 
+	// 부모 디렉터리에 새로운 dir_entry 추가
+	lock_directory( parent->fs, GET_FIRST_CLUSTER( parent->entry ), 1 );
+	result = insert_entry( parent, ret, 0 );
+	unlock_directory( parent->fs, GET_FIRST_CLUSTER( parent->entry ) );
+
+	if( result )
+	{
+		free_cluster_chain( parent->fs, firstCluster );
+		return FAT_ERROR;
+	}
+
 	return FAT_SUCCESS;
 }
 
+int fat_mkdir( const FAT_NODE* parent, const char* entryName, FAT_NODE* ret )
+{
+	int	result;
+
+	journal_begin( parent->fs );
+	result = make_directory( parent, entryName, ret );
+	journal_end( parent->fs );
+
+	return result;
+}
+
+/* The chain is gathered first and its FAT entries are cleared in cluster order,
+   so every FAT sector is read and written once however long the chain is */
 int free_cluster_chain( FAT_FILESYSTEM* fs, DWORD firstCluster )
 {
-	DWORD	currentCluster = firstCluster;
-	DWORD	nextCluster;
+	SECTOR*		chain;
+	UINT32		count;
+	int			result;
+
+	if( read_cluster_chain( fs, firstCluster, &chain, &count ) )
+		return FAT_ERROR;
+
+	result = release_clusters( fs, chain, count );
+	free( chain );
+
+	return result;
+}
+
+/* mark the given clusters free with one batched FAT update */
+int release_clusters( FAT_FILESYSTEM* fs, const SECTOR* clusters, UINT32 count )
+{
+	FAT_UPDATE*	updates;
+	UINT32		i, runStart;
+	int			result;
+
+	if( count == 0 )
+		return FAT_SUCCESS;
+
+	updates = ( FAT_UPDATE* )malloc( count * sizeof( FAT_UPDATE ) );
+	if( updates == NULL )
+		return FAT_ERROR;
 
-	while( !is_EOC( fs->FATType, currentCluster ) && currentCluster != FREE_CLUSTER )
+	for( i = 0; i < count; i++ )
 	{
-		nextCluster = get_fat( fs, currentCluster );
-		set_fat( fs, currentCluster, FREE_CLUSTER );
-		add_free_cluster( fs, currentCluster );
-		currentCluster = nextCluster;
+		updates[i].cluster	= clusters[i];
+		updates[i].value	= FREE_CLUSTER;
 	}
 
-	return FAT_SUCCESS;
+	result = set_fat_batch( fs, updates, count );
+
+	/* updates are sorted now; give the clusters back as contiguous runs */
+	for( runStart = 0, i = 1; i <= count; i++ )
+	{
+		if( i == count || updates[i].cluster != updates[i - 1].cluster + 1 )
+		{
+			free_cluster_run( fs, updates[runStart].cluster, i - runStart );
+			runStart = i;
+		}
+	}
+
+	free( updates );
+
+	return result;
 }
 
 int has_sub_entries( FAT_FILESYSTEM* fs, const FAT_DIR_ENTRY* entry )
@@ -1425,21 +2840,41 @@ int has_sub_entries( FAT_FILESYSTEM* fs, const FAT_DIR_ENTRY* entry )
 /******************************************************************************/
 /* Remove directory                                                           */
 /******************************************************************************/
-int fat_rmdir( FAT_NODE* dir )
+int remove_directory( FAT_NODE* dir )
 {
-	if( has_sub_entries( dir->fs, &dir->entry ) )
+	if( !( dir->entry.attribute & ATTR_DIRECTORY ) || ( dir->fs->mountFlags & FAT_MOUNT_READ_ONLY ) )		/* Is directory? */
 		return FAT_ERROR;
 
-	if( !( dir->entry.attribute & ATTR_DIRECTORY ) )		/* Is directory? */
+	/* nothing may be created in dir between the emptiness check and the removal */
+	lock_directory( dir->fs, GET_FIRST_CLUSTER( dir->entry ), 1 );
+
+	if( has_sub_entries( dir->fs, &dir->entry ) )
+	{
+		unlock_directory( dir->fs, GET_FIRST_CLUSTER( dir->entry ) );
 		return FAT_ERROR;
+	}
 
 	dir->entry.name[0] = DIR_ENTRY_FREE;
 	set_entry( dir->fs, &dir->location, &dir->entry );
+
+	unlock_directory( dir->fs, GET_FIRST_CLUSTER( dir->entry ) );
+
 	free_cluster_chain( dir->fs, GET_FIRST_CLUSTER( dir->entry ) );
 
 	return FAT_SUCCESS;
 }
 
+int fat_rmdir( FAT_NODE* dir )
+{
+	int	result;
+
+	journal_begin( dir->fs );
+	result = remove_directory( dir );
+	journal_end( dir->fs );
+
+	return result;
+}
+
 /******************************************************************************/
 /* Lookup entry(file or directory)                                            */
 /******************************************************************************/
@@ -1447,6 +2882,7 @@ int fat_lookup( FAT_NODE* parent, const char* entryName, FAT_NODE* retEntry )
 {
 	FAT_ENTRY_LOCATION	begin;
 	BYTE	formattedName[MAX_NAME_LENGTH] = { 0, };
+	int		result;
 
 	// cluster의 위치를 parent의 첫 cluster로 set
 	begin.cluster = GET_FIRST_CLUSTER( parent->entry );
@@ -1460,19 +2896,33 @@ int fat_lookup( FAT_NODE* parent, const char* entryName, FAT_NODE* retEntry )
 	if( format_name( parent->fs, formattedName ) )
 		return FAT_ERROR;
 
-	// parent entry가 부모디렉터리면
-	if( IS_POINT_ROOT_ENTRY( parent->entry ) )
-		begin.cluster = 0; // cluster는 0
+	// parent entry가 FAT12/16의 root면 cluster는 0 (고정 root 영역)
+	if( IS_POINT_ROOT_ENTRY( parent->entry ) && ( parent->fs->FATType == FAT12 || parent->fs->FATType == FAT16 ) )
+		begin.cluster = 0;
 
 	/* lookup_entry : 찾고자 하는 entryName이 존재하는 경우 FAT_SUCCESS를 반환하고
    찾은 ENTRY로 FAT_NODE* ret이 가리키는 부분을 초기화시켜줌. 없으면 FAT_ERROR반환*/
-	return lookup_entry( parent->fs, &begin, formattedName, retEntry );
+	lock_directory( parent->fs, GET_FIRST_CLUSTER( parent->entry ), 0 );
+	result = lookup_entry( parent->fs, &begin, formattedName, retEntry );
+	unlock_directory( parent->fs, GET_FIRST_CLUSTER( parent->entry ) );
+
+	// 아직 쓰지 않은 append까지 포함한 크기
+	if( result == FAT_SUCCESS )
+		writeback_patch_size( retEntry );
+
+	/* '..' of a directory under the root holds cluster 0; on FAT32 the root
+	   is the chain at rootCluster */
+	if( result == FAT_SUCCESS && parent->fs->FATType == FAT32 &&
+		( retEntry->entry.attribute & ATTR_DIRECTORY ) && GET_FIRST_CLUSTER( retEntry->entry ) == 0 )
+		SET_FIRST_CLUSTER( retEntry->entry, parent->fs->bpb.BPB32.rootCluster );
+
+	return result;
 }
 
 /******************************************************************************/
 /* Create new file                                                            */
 /******************************************************************************/
-int fat_create( FAT_NODE* parent, const char* entryName, FAT_NODE* retEntry )
+int create_file( FAT_NODE* parent, const char* entryName, FAT_NODE* retEntry )
 {
 	FAT_ENTRY_LOCATION	first;
 	BYTE				name[MAX_NAME_LENGTH] = { 0, };
@@ -1482,6 +2932,9 @@ int fat_create( FAT_NODE* parent, const char* entryName, FAT_NODE* retEntry )
 	strncpy( name, entryName, MAX_NAME_LENGTH );
 
 
+	if( parent->fs->mountFlags & FAT_MOUNT_READ_ONLY )
+		return FAT_ERROR;
+
 	// name 지정되어 옴
 	if( format_name( parent->fs, name ) )
 		return FAT_ERROR;
@@ -1492,25 +2945,216 @@ int fat_create( FAT_NODE* parent, const char* entryName, FAT_NODE* retEntry )
 	memcpy( retEntry->entry.name, name, MAX_ENTRY_NAME_LENGTH );
 
 	// 검색할 디렉터리의 location정보 setting
-	first.cluster = parent->entry.firstClusterLO;
+	first.cluster = GET_FIRST_CLUSTER( parent->entry );
 	first.sector = 0;
 	first.number = 0;
 
+	// 확인과 추가 사이에 다른 thread가 같은 이름을 넣지 못하게 parent를 독점
+	lock_directory( parent->fs, GET_FIRST_CLUSTER( parent->entry ), 1 );
+
 	// entryName을 가지는 file이 parent 디렉터리에 있는지 확인, 있으면 에러
 	if( lookup_entry( parent->fs, &first, name, retEntry ) == FAT_SUCCESS )
+	{
+		unlock_directory( parent->fs, GET_FIRST_CLUSTER( parent->entry ) );
 		return FAT_ERROR;
+	}
 
 	retEntry->fs = parent->fs;
 	result = insert_entry( parent, retEntry, 0 );
+
+	unlock_directory( parent->fs, GET_FIRST_CLUSTER( parent->entry ) );
+
 	if( result )
 		return FAT_ERROR;
 
 	return FAT_SUCCESS;
 }
 
+int fat_create( FAT_NODE* parent, const char* entryName, FAT_NODE* retEntry )
+{
+	int	result;
+
+	journal_begin( parent->fs );
+	result = create_file( parent, entryName, retEntry );
+	journal_end( parent->fs );
+
+	return result;
+}
+
 /******************************************************************************/
 /* Read file                                                                  */
 /******************************************************************************/
+// FAT_READ_QUEUE
+// 비동기 디스크 queue와 cluster 크기의 bounce buffer FAT_READ_CLUSTERS개
+typedef struct FAT_READ_QUEUE
+{
+	DISK_QUEUE				queue;
+	BYTE*					buffers;
+	struct FAT_READ_QUEUE*	next;
+} FAT_READ_QUEUE;
+
+/* a queue no other thread is using, NULL when the disk can't queue requests */
+FAT_READ_QUEUE* get_read_queue( FAT_FILESYSTEM* fs )
+{
+	FAT_READ_QUEUE*	readQueue;
+
+	if( fs->disk->queue_init == NULL && fs->disk->async == NULL )
+		return NULL;
+
+	pthread_mutex_lock( &fs->readQueueLock );
+	readQueue = fs->readQueues;
+	if( readQueue )
+		fs->readQueues = readQueue->next;
+	pthread_mutex_unlock( &fs->readQueueLock );
+
+	if( readQueue )
+		return readQueue;
+
+	readQueue = ( FAT_READ_QUEUE* )calloc( 1, sizeof( FAT_READ_QUEUE ) );
+	if( readQueue == NULL )
+		return NULL;
+
+	readQueue->buffers = ( BYTE* )malloc( FAT_READ_CLUSTERS * fs->bpb.sectorsPerCluster * fs->bpb.bytesPerSector );
+	if( readQueue->buffers == NULL || disk_queue_init( fs->disk, &readQueue->queue ) )
+	{
+		free( readQueue->buffers );
+		free( readQueue );
+		return NULL;
+	}
+
+	return readQueue;
+}
+
+void put_read_queue( FAT_FILESYSTEM* fs, FAT_READ_QUEUE* readQueue )
+{
+	pthread_mutex_lock( &fs->readQueueLock );
+	readQueue->next = fs->readQueues;
+	fs->readQueues = readQueue;
+	pthread_mutex_unlock( &fs->readQueueLock );
+}
+
+void release_read_queues( FAT_FILESYSTEM* fs )
+{
+	FAT_READ_QUEUE*	readQueue;
+
+	while( fs->readQueues )
+	{
+		readQueue = fs->readQueues;
+		fs->readQueues = readQueue->next;
+
+		disk_queue_release( &readQueue->queue );
+		free( readQueue->buffers );
+		free( readQueue );
+	}
+}
+
+/* Read [offset, readEnd) keeping up to FAT_READ_CLUSTERS requests in flight,
+   so the chain walk and the copies overlap the disk. Whole sectors go
+   straight to buffer, and physically contiguous clusters join one request of
+   up to FAT_READ_REQUEST_BYTES; a partial sector at either end is read alone
+   through a cluster sized bounce buffer.
+   Completions come back in any order; the result is the length read without
+   a gap from offset, or -1 when the queue itself failed and may still write
+   to buffer. */
+int read_clusters_queued( FAT_NODE* file, FAT_READ_QUEUE* readQueue, DWORD offset, DWORD readEnd, char* buffer )
+{
+	FAT_FILESYSTEM*	fs = file->fs;
+	DWORD			bytesPerSector = fs->bpb.bytesPerSector;
+	DWORD			clusterSize = bytesPerSector * fs->bpb.sectorsPerCluster;
+	DISK_REQUEST	requests[FAT_READ_CLUSTERS];
+	DISK_REQUEST*	batch[FAT_READ_CLUSTERS];
+	DWORD			starts[FAT_READ_CLUSTERS], ends[FAT_READ_CLUSTERS];
+	UINT32			freeSlots[FAT_READ_CLUSTERS], freeCount, batchCount, slot;
+	DWORD			cluster, clusterStart = 0, next = offset, end = readEnd, pieceEnd;
+	DWORD			firstCluster, firstClusterStart;
+	int				completed, i;
+
+	for( freeCount = 0; freeCount < FAT_READ_CLUSTERS; freeCount++ )
+		freeSlots[freeCount] = freeCount;
+
+	// cluster는 항상 next가 들어있는 cluster
+	cluster = GET_FIRST_CLUSTER( file->entry );
+	while( clusterStart + clusterSize <= offset )
+	{
+		cluster = get_fat( fs, cluster );
+		clusterStart += clusterSize;
+	}
+
+	while( next < end || readQueue->queue.inFlight )
+	{
+		for( batchCount = 0; next < end && freeCount; batchCount++ )
+		{
+			if( next == clusterStart + clusterSize )
+			{
+				cluster = get_fat( fs, cluster );
+				clusterStart += clusterSize;
+			}
+
+			// 깨진 chain은 그 앞까지만 읽은 것으로
+			if( cluster < 2 || cluster >= fs->countOfClusters + 2 )
+			{
+				end = next;
+				break;
+			}
+
+			firstCluster		= cluster;
+			firstClusterStart	= clusterStart;
+			pieceEnd			= MIN( clusterStart + clusterSize, end );
+
+			// sector 단위로 끝나는 동안 다음 cluster가 바로 뒤에 있으면 같은 요청에
+			while( next % bytesPerSector == 0 && pieceEnd == clusterStart + clusterSize && pieceEnd < end &&
+				   pieceEnd - next < FAT_READ_REQUEST_BYTES && ( end - pieceEnd >= clusterSize || end % bytesPerSector == 0 ) &&
+				   cluster + 1 < fs->countOfClusters + 2 && get_fat( fs, cluster ) == cluster + 1 )
+			{
+				cluster++;
+				clusterStart += clusterSize;
+				pieceEnd = MIN( clusterStart + clusterSize, end );
+			}
+
+			slot = freeSlots[--freeCount];
+
+			starts[slot]				= next;
+			ends[slot]					= pieceEnd;
+			requests[slot].write		= 0;
+			requests[slot].sector		= calc_physical_sector( fs, firstCluster, ( next - firstClusterStart ) / bytesPerSector );
+			requests[slot].count		= ( pieceEnd - 1 ) / bytesPerSector - next / bytesPerSector + 1;
+			requests[slot].param		= ( void* )( size_t )slot;
+			if( next % bytesPerSector == 0 && pieceEnd % bytesPerSector == 0 )
+				requests[slot].data = buffer + ( next - offset );
+			else
+				requests[slot].data = readQueue->buffers + slot * clusterSize;
+			batch[batchCount] = &requests[slot];
+
+			next = pieceEnd;
+		}
+
+		// 넣지 못한 요청은 그 앞까지만 읽은 것으로, 일부가 들어갔을 수 있으므로 slot은 완료될 때 돌려받음
+		if( batchCount && disk_submit( &readQueue->queue, batch, batchCount ) )
+			end = starts[( size_t )batch[0]->param];
+
+		if( readQueue->queue.inFlight == 0 )
+			break;
+
+		completed = disk_wait( &readQueue->queue, batch, 1, FAT_READ_CLUSTERS );
+		if( completed <= 0 )
+			return -1;
+
+		for( i = 0; i < completed; i++ )
+		{
+			slot = ( UINT32 )( size_t )batch[i]->param;
+
+			if( batch[i]->result )
+				end = MIN( end, starts[slot] );
+			else if( batch[i]->data != buffer + ( starts[slot] - offset ) )
+				memcpy( buffer + ( starts[slot] - offset ), ( BYTE* )batch[i]->data + starts[slot] % bytesPerSector, ends[slot] - starts[slot] );
+
+			freeSlots[freeCount++] = slot;
+		}
+	}
+
+	return MIN( end, next ) - offset;
+}
+
 int fat_read( FAT_NODE* file, unsigned long offset, unsigned long length, char* buffer )
 {
 	BYTE	sector[MAX_SECTOR_SIZE];
@@ -1519,12 +3163,37 @@ int fat_read( FAT_NODE* file, unsigned long offset, unsigned long length, char*
 	DWORD	readEnd;
 	DWORD	clusterSize, clusterOffset = 0;
 
+	FAT_READ_QUEUE*	readQueue;
+	int				result;
+
+	// 아직 쓰지 않은 append가 있으면 먼저 기록, 빈 파일이었으면 첫 cluster도 여기서 정해짐
+	if( writeback_flush( file ) )
+		return FAT_ERROR;
+
 	currentCluster = GET_FIRST_CLUSTER( file->entry );
 	readEnd = MIN( offset + length, file->entry.fileSize );
 
 	currentOffset = offset;
 
 	clusterSize = ( file->fs->bpb.bytesPerSector * file->fs->bpb.sectorsPerCluster );
+
+	// 작은 순차 읽기는 미리 읽은 cluster에서
+	if( offset < readEnd && ( result = readahead_read( file, offset, readEnd, buffer ) ) >= 0 )
+		return result;
+
+	// 여러 cluster에 걸치면 디스크가 지원할 때 한꺼번에 요청
+	if( offset < readEnd && offset / clusterSize != ( readEnd - 1 ) / clusterSize &&
+		( readQueue = get_read_queue( file->fs ) ) != NULL )
+	{
+		result = read_clusters_queued( file, readQueue, offset, readEnd, buffer );
+
+		// 실패한 queue는 아직 buffer에 쓸 수 있는 요청이 있을 수 있으므로 돌려놓지 않음
+		if( result >= 0 )
+			put_read_queue( file->fs, readQueue );
+
+		return ( result >= 0 ? result : 0 );
+	}
+
 	clusterOffset = clusterSize;
 	while( offset > clusterOffset )
 	{
@@ -1565,13 +3234,16 @@ int fat_read( FAT_NODE* file, unsigned long offset, unsigned long length, char*
 /******************************************************************************/
 /* Write file                                                                 */
 /******************************************************************************/
-int fat_write( FAT_NODE* file, unsigned long offset, unsigned long length, const char* buffer )
+int write_file( FAT_NODE* file, unsigned long offset, unsigned long length, const char* buffer )
 {
 	BYTE	sector[MAX_SECTOR_SIZE];
 	DWORD	currentOffset, currentCluster, clusterSeq = 0;
 	DWORD	clusterNumber, sectorNumber, sectorOffset;
 	DWORD	readEnd;
-	DWORD	clusterSize;
+	DWORD	clusterSize, clusterOffset;
+
+	if( file->fs->mountFlags & FAT_MOUNT_READ_ONLY )
+		return FAT_ERROR;
 
 	currentCluster = GET_FIRST_CLUSTER( file->entry );
 	readEnd = offset + length;
@@ -1579,10 +3251,11 @@ int fat_write( FAT_NODE* file, unsigned long offset, unsigned long length, const
 	currentOffset = offset;
 
 	clusterSize = ( file->fs->bpb.bytesPerSector * file->fs->bpb.sectorsPerCluster );
-	while( offset > clusterSize )
+	clusterOffset = clusterSize;
+	while( offset > clusterOffset )
 	{
 		currentCluster = get_fat( file->fs, currentCluster );
-		clusterSize += clusterSize;
+		clusterOffset += clusterSize;
 		clusterSeq++;
 	}
 
@@ -1594,7 +3267,7 @@ int fat_write( FAT_NODE* file, unsigned long offset, unsigned long length, const
 
 		if( currentCluster == 0 )
 		{
-			currentCluster = alloc_free_cluster( file->fs );
+			currentCluster = ( cluster_available( file->fs ) ? alloc_free_cluster( file->fs ) : 0 );
 			if( currentCluster == 0 )
 			{
 				NO_MORE_CLUSER();
@@ -1613,7 +3286,7 @@ int fat_write( FAT_NODE* file, unsigned long offset, unsigned long length, const
 			nextCluster = get_fat( file->fs, currentCluster );
 			if( is_EOC( file->fs->FATType, nextCluster ) )
 			{
-				nextCluster = span_cluster_chain( file->fs, currentCluster );
+				nextCluster = ( cluster_available( file->fs ) ? span_cluster_chain( file->fs, currentCluster ) : 0 );
 
 				if( nextCluster == 0 )
 				{
@@ -1651,12 +3324,267 @@ int fat_write( FAT_NODE* file, unsigned long offset, unsigned long length, const
 	return currentOffset - offset;
 }
 
+int fat_write( FAT_NODE* file, unsigned long offset, unsigned long length, const char* buffer )
+{
+	int	result;
+
+	// 파일 끝에 붙이는 쓰기는 모아두었다가 flush할 때 한번에 할당
+	result = writeback_write( file, offset, length, buffer );
+	if( result >= 0 )
+		return result;
+	// 먼저 기록해야 할 append를 쓰지 못했음
+	if( result == -2 )
+		return FAT_ERROR;
+
+	journal_begin( file->fs );
+	result = write_file( file, offset, length, buffer );
+	journal_end( file->fs );
+
+	return result;
+}
+
+/******************************************************************************/
+/* Reserve file space                                                         */
+/******************************************************************************/
+/* Reserves clusters for the first length bytes of the file. The missing
+   clusters are taken as contiguous runs and linked with one batched FAT update.
+   fileSize is left alone unless FAT_FALLOC_EXTEND_SIZE is given. */
+int reserve_file_space( FAT_NODE* file, unsigned long length, int flags )
+{
+	FAT_FILESYSTEM*	fs = file->fs;
+	SECTOR*			chain;
+	FAT_UPDATE*		updates;
+	CLUSTER_RUN*	runs;
+	UINT32			clusterSize, needed, count, updateCount = 0, runCount = 0;
+	UINT32			i, allocated;
+	SECTOR			first, previous;
+	int				result = FAT_SUCCESS;
+
+	if( ( file->entry.attribute & ATTR_DIRECTORY ) || ( fs->mountFlags & FAT_MOUNT_READ_ONLY ) )
+		return FAT_ERROR;
+
+	clusterSize	= fs->bpb.bytesPerSector * fs->bpb.sectorsPerCluster;
+	needed		= ( length + clusterSize - 1 ) / clusterSize;
+
+	if( read_cluster_chain( fs, GET_FIRST_CLUSTER( file->entry ), &chain, &count ) )
+		return FAT_ERROR;
+
+	previous = ( count ? chain[count - 1] : 0 );
+	free( chain );
+
+	if( needed > count )
+	{
+		needed -= count;
+		// 모아둔 append에 약속한 cluster는 남겨둠
+		if( needed + writeback_reserved( fs ) > count_free_clusters( fs ) )
+		{
+			NO_MORE_CLUSER();
+			return FAT_ERROR;
+		}
+
+		updates	= ( FAT_UPDATE* )malloc( ( needed + 1 ) * sizeof( FAT_UPDATE ) );
+		runs	= ( CLUSTER_RUN* )malloc( needed * sizeof( CLUSTER_RUN ) );
+		if( updates == NULL || runs == NULL )
+		{
+			free( updates );
+			free( runs );
+			return FAT_ERROR;
+		}
+
+		while( needed )
+		{
+			first = alloc_cluster_run_after( fs, previous, needed, &allocated );
+			if( first == 0 )
+			{
+				/* give back what was taken; the FAT has not been touched yet */
+				for( i = 0; i < runCount; i++ )
+					add_free_cluster_run( fs, runs[i].first, runs[i].count );
+
+				free( updates );
+				free( runs );
+				NO_MORE_CLUSER();
+				return FAT_ERROR;
+			}
+
+			runs[runCount].first	= first;
+			runs[runCount].count	= allocated;
+			runCount++;
+
+			for( i = 0; i < allocated; i++ )
+			{
+				if( previous )
+				{
+					updates[updateCount].cluster	= previous;
+					updates[updateCount].value		= first + i;
+					updateCount++;
+				}
+				else
+					SET_FIRST_CLUSTER( file->entry, first + i );
+
+				previous = first + i;
+			}
+
+			needed -= allocated;
+		}
+
+		updates[updateCount].cluster	= previous;
+		updates[updateCount].value		= get_MS_EOC( fs->FATType );
+		updateCount++;
+
+		result = set_fat_batch( fs, updates, updateCount );
+
+		free( updates );
+		free( runs );
+	}
+
+	if( ( flags & FAT_FALLOC_EXTEND_SIZE ) && length > file->entry.fileSize )
+		file->entry.fileSize = length;
+
+	set_entry( fs, &file->location, &file->entry );
+
+	return result;
+}
+
+int fat_fallocate( FAT_NODE* file, unsigned long length, int flags )
+{
+	int	result;
+
+	if( writeback_flush( file ) )
+		return FAT_ERROR;
+
+	journal_begin( file->fs );
+	result = reserve_file_space( file, length, flags );
+	journal_end( file->fs );
+
+	return result;
+}
+
+/******************************************************************************/
+/* Truncate or extend file                                                    */
+/******************************************************************************/
+/* Shrinking walks the chain once, ends it at the new last cluster and frees
+   the tail in the same batched FAT update. Growing reserves the clusters with
+   fat_fallocate() and zero fills the bytes between the old and new size on
+   disk, past the write-behind buffers. */
+int truncate_file( FAT_NODE* file, unsigned long length )
+{
+	FAT_FILESYSTEM*	fs = file->fs;
+	SECTOR*			chain;
+	FAT_UPDATE*		updates;
+	BYTE*			zero;
+	UINT32			clusterSize, keep, count, updateCount = 0;
+	UINT32			i, runStart;
+	unsigned long	offset;
+	int				result = FAT_SUCCESS;
+
+	if( ( file->entry.attribute & ATTR_DIRECTORY ) || ( fs->mountFlags & FAT_MOUNT_READ_ONLY ) )
+		return FAT_ERROR;
+
+	clusterSize = fs->bpb.bytesPerSector * fs->bpb.sectorsPerCluster;
+
+	if( length > file->entry.fileSize )
+	{
+		if( fat_fallocate( file, length, 0 ) )
+			return FAT_ERROR;
+
+		zero = ( BYTE* )calloc( clusterSize, 1 );
+		if( zero == NULL )
+			return FAT_ERROR;
+
+		for( offset = file->entry.fileSize; offset < length; )
+		{
+			UINT32	writeLength = MIN( clusterSize - ( offset % clusterSize ), length - offset );
+
+			if( write_file( file, offset, writeLength, ( char* )zero ) != ( int )writeLength )
+			{
+				result = FAT_ERROR;
+				break;
+			}
+			offset += writeLength;
+		}
+
+		free( zero );
+		return result;
+	}
+
+	keep = ( length + clusterSize - 1 ) / clusterSize;
+
+	if( read_cluster_chain( fs, GET_FIRST_CLUSTER( file->entry ), &chain, &count ) )
+		return FAT_ERROR;
+
+	if( keep < count )
+	{
+		updates = ( FAT_UPDATE* )malloc( ( count - keep + 1 ) * sizeof( FAT_UPDATE ) );
+		if( updates == NULL )
+		{
+			free( chain );
+			return FAT_ERROR;
+		}
+
+		for( i = keep; i < count; i++ )
+		{
+			updates[updateCount].cluster	= chain[i];
+			updates[updateCount].value		= FREE_CLUSTER;
+			updateCount++;
+		}
+
+		if( keep )
+		{
+			updates[updateCount].cluster	= chain[keep - 1];
+			updates[updateCount].value		= get_MS_EOC( fs->FATType );
+			updateCount++;
+		}
+		else
+			SET_FIRST_CLUSTER( file->entry, 0 );
+
+		result = set_fat_batch( fs, updates, updateCount );
+
+		/* return the freed tail, sorted by set_fat_batch, as contiguous runs */
+		for( runStart = 0, i = 1; i <= updateCount; i++ )
+		{
+			if( updates[i - 1].value != FREE_CLUSTER )
+			{
+				runStart = i;
+				continue;
+			}
+
+			if( i == updateCount || updates[i].value != FREE_CLUSTER || updates[i].cluster != updates[i - 1].cluster + 1 )
+			{
+				free_cluster_run( fs, updates[runStart].cluster, i - runStart );
+				runStart = i;
+			}
+		}
+
+		free( updates );
+	}
+	free( chain );
+
+	file->entry.fileSize = length;
+	set_entry( fs, &file->location, &file->entry );
+
+	return result;
+}
+
+int fat_truncate( FAT_NODE* file, unsigned long length )
+{
+	int	result;
+
+	if( writeback_flush( file ) )
+		return FAT_ERROR;
+
+	journal_begin( file->fs );
+	result = truncate_file( file, length );
+	journal_end( file->fs );
+
+	return result;
+}
+
 /******************************************************************************/
 /* Remove file                                                                */
 /******************************************************************************/
-int fat_remove( FAT_NODE* file )
+int remove_file( FAT_NODE* file )
 {
-	if( file->entry.attribute & ATTR_DIRECTORY )		/* Is directory? */
+	if( ( file->entry.attribute & ATTR_DIRECTORY ) || ( file->fs->mountFlags & FAT_MOUNT_READ_ONLY ) )		/* Is directory? */
 		return FAT_ERROR;
 
 	file->entry.name[0] = DIR_ENTRY_FREE;
@@ -1666,6 +3594,20 @@ int fat_remove( FAT_NODE* file )
 	return FAT_SUCCESS;
 }
 
+int fat_remove( FAT_NODE* file )
+{
+	int	result;
+
+	// 지울 파일의 append는 쓸 필요가 없음
+	writeback_discard( file );
+
+	journal_begin( file->fs );
+	result = remove_file( file );
+	journal_end( file->fs );
+
+	return result;
+}
+
 /******************************************************************************/
 /* Disk free spaces                                                           */
 /******************************************************************************/
@@ -1676,7 +3618,7 @@ int fat_df( FAT_FILESYSTEM* fs, UINT32* totalSectors, UINT32* usedSectors )
 	else
 		*totalSectors = fs->bpb.totalSectors32;
 
-	*usedSectors = *totalSectors - ( fs->freeClusterList.count * fs->bpb.sectorsPerCluster );
+	*usedSectors = *totalSectors - ( count_free_clusters( fs ) * fs->bpb.sectorsPerCluster );
 
 	return FAT_SUCCESS;
 }
@@ -12,6 +12,7 @@
 #ifndef _FAT_H_
 #define _FAT_H_
 
+#include <pthread.h>
 #include "common.h"
 #include "disk.h"
 #include "clusterlist.h"
@@ -20,7 +21,8 @@
 #define FAT16					1
 #define FAT32					2
 
-#define MAX_SECTOR_SIZE			512
+#define MIN_SECTOR_SIZE			512
+#define MAX_SECTOR_SIZE			4096	// sector 버퍼는 이 크기로 잡음
 #define MAX_NAME_LENGTH			256
 #define MAX_ENTRY_NAME_LENGTH	11
 
@@ -37,6 +39,57 @@
 #define DIR_ENTRY_NO_MORE		0x00
 #define DIR_ENTRY_OVERWRITE		1
 
+#define FAT_FALLOC_EXTEND_SIZE	0x01
+
+#define FAT_MOUNT_NO_MAGAZINES	0x01	// 모든 할당을 global freeClusterList에서 직접
+#define FAT_MOUNT_NO_DISCARD	0x02	// 해제한 cluster를 디스크에 discard하지 않음
+#define FAT_MOUNT_READ_ONLY		0x04	// 변경하는 함수는 모두 실패, snapshot처럼 쓸 수 없는 디스크를 mount할 때
+#define FAT_MOUNT_NO_READAHEAD	0x08	// fat_read가 다음 cluster를 미리 읽지 않음
+#define FAT_MOUNT_NO_WRITE_BEHIND	0x10	// fat_write가 append를 모아두지 않고 바로 씀
+#define FAT_MOUNT_NO_FLUSHER	0x20	// background thread 없이 dirty data와 metadata는 fat_sync()가 씀
+
+#define FAT_ALLOC_FIRST_FIT		0		// list에서 처음으로 충분히 긴 run (기본)
+#define FAT_ALLOC_NEXT_FIT		1		// 마지막으로 할당한 cluster 다음부터
+#define FAT_ALLOC_BEST_FIT		2		// 요청을 채우는 가장 짧은 run
+#define FAT_ALLOC_ERASE_BLOCK	3		// 파일마다 erase block 크기의 정렬된 group을 채움
+#define FAT_ERASE_BLOCK_BYTES	( 512 * 1024 )	// eraseBlockBytes가 0일 때
+
+#define FAT_FORMAT_QUICK		0x01	// mount에 필요한 FAT 영역만 0으로 초기화
+#define FAT_FORMAT_JOURNAL		0x02	// 예약 영역 끝에 metadata journal을 만듦
+#define FAT_FORMAT_WRITE_SECTORS	256	// format이 0을 쓰는 요청 하나의 섹터 수
+
+#define FAT_JOURNAL_MIN_BYTES	( 256 * 1024 )		// journal은 volume의 1/64, 이 범위 안에서
+#define FAT_JOURNAL_MAX_BYTES	( 4 * 1024 * 1024 )
+#define FAT_JOURNAL_GROUP_SECTORS	128		// commit되지 않은 sector가 이만큼 되면 commit
+#define FAT_JOURNAL_GROUP_OPS	256			// 또는 operation이 이만큼 끝나면
+
+#define FAT_MAGAZINE_RUNS		8
+#define FAT_MAGAZINE_REFILL		64		// 한번에 global list에서 가져오는 연속 cluster 수
+#define FAT_MAGAZINE_LIMIT		256		// 이보다 많이 쌓이면 global list로 돌려줌
+
+#define FAT_READ_CLUSTERS		8		// 비동기 디스크에서 fat_read 하나가 동시에 넣어두는 요청 수
+#define FAT_READ_REQUEST_BYTES	( 64 * 1024 )	// 연속된 cluster를 묶은 요청 하나의 최대 크기
+
+#define FAT_READAHEAD_BYTES		( 1024 * 1024 )	// 미리 읽은 cluster를 두는 cache 크기
+#define FAT_READAHEAD_MIN_CLUSTERS	4		// 순차 읽기가 시작될 때의 window
+#define FAT_READAHEAD_MAX_BYTES	( 256 * 1024 )	// window는 두 배씩 이만큼까지
+#define FAT_READAHEAD_STREAMS	16		// 순차 읽기를 추적하는 파일 수
+
+#define FAT_WRITEBACK_BYTES		( 4 * 1024 * 1024 )	// 모아둔 append가 이보다 많으면 오래된 파일부터 flush
+#define FAT_WRITEBACK_FILE_BYTES	( 1024 * 1024 )		// 파일 하나의 buffer가 이만큼 되면 flush
+#define FAT_WRITEBACK_FILES		64		// buffer를 가진 파일 수의 한도
+#define FAT_WRITEBACK_AGE_MS	5000	// 이보다 오래된 append는 다음 쓰기에서 flush
+
+#define FAT_FLUSHER_INTERVAL_MS	500		// flusher thread가 깨어나는 주기
+#define FAT_FLUSHER_AGE_MS		2000	// 이보다 오래 dirty였던 data, metadata는 flusher가 씀
+#define FAT_FLUSHER_DIRTY_RATIO	50		// append buffer나 journal log가 한도의 이 %를 넘으면 flusher가 씀
+
+#define FAT_MIRROR_RUN_SECTORS	64		// mirror FAT에 한 요청으로 복사하는 최대 sector 수
+
+#define FAT_SECTOR_LOCKS		256
+#define FAT_ENTRY_LOCKS			64
+#define FAT_DIR_LOCKS			64
+
 #define SHUT_BIT_MASK16			0x8000
 #define ERR_BIT_MASK16			0x4000
 
@@ -48,6 +101,10 @@
 #define EOC32					0x0FFFFFF8
 #define FREE_CLUSTER			0x00
 
+#define BAD12					0x0FF7
+#define BAD16					0xFFF7
+#define BAD32					0x0FFFFFF7
+
 #define MS_EOC12				0x0FFF
 #define MS_EOC16				0xFFFF
 #define MS_EOC32				0x0FFFFFFF
@@ -170,10 +227,36 @@ typedef struct
 	BYTE			FATType;
 	DWORD			FATSize;
 	DWORD			EOCMark;
+	DWORD			countOfClusters;
+	DWORD			mountFlags;		// FAT_MOUNT_*, fat_read_superblock() 전에 설정
+	BYTE			allocPolicy;	// FAT_ALLOC_*, fat_read_superblock() 전에 설정
+	UINT32			eraseBlockBytes;	// FAT_ALLOC_ERASE_BLOCK의 group 크기, fat_read_superblock() 전에 설정
+	UINT32			groupClusters;	// group 하나의 cluster 수
+	UINT32			groupPhase;		// ( cluster + groupPhase ) % groupClusters == 0 이면 group의 시작
+	SECTOR			allocCursor;	// FAT_ALLOC_NEXT_FIT이 다음에 찾기 시작할 cluster, allocLock으로 보호
+	BYTE			activeFAT;		// 읽기/쓰기에 사용하는 FAT 번호
+	BYTE*			FATDirtyMap;	// mirror FAT에 아직 복사되지 않은 active FAT sector bitmap
 	FAT_BPB			bpb;
 	CLUSTER_LIST	freeClusterList;
 	DISK_OPERATIONS*	disk;
 
+	// 여러 thread에서 같은 volume을 사용하기 위한 lock
+	pthread_mutex_t		allocLock;						// freeClusterList
+	pthread_rwlock_t	FATLocks[FAT_SECTOR_LOCKS];		// FAT sector 번호 % FAT_SECTOR_LOCKS
+	pthread_rwlock_t	dirLocks[FAT_DIR_LOCKS];		// 디렉터리 첫 cluster % FAT_DIR_LOCKS, lookup과 insert 사이
+	pthread_mutex_t		entryLocks[FAT_ENTRY_LOCKS];	// directory sector 물리 번호 % FAT_ENTRY_LOCKS, entry read-modify-write
+
+	pthread_key_t			magazineKey;	// thread별 FAT_MAGAZINE
+	struct FAT_MAGAZINE*	magazines;		// 모든 thread의 magazine, allocLock으로 보호
+
+	struct FAT_JOURNAL*		journal;		// journal이 있는 volume, disk는 journal을 거치는 디스크
+
+	pthread_mutex_t			readQueueLock;
+	struct FAT_READ_QUEUE*	readQueues;		// fat_read가 쓰고 돌려놓은 비동기 queue
+	struct FAT_READAHEAD*	readahead;		// 순차 읽기의 다음 cluster들, FAT_MOUNT_NO_READAHEAD면 NULL
+	struct FAT_WRITEBACK*	writeback;		// 아직 쓰지 않은 append, FAT_MOUNT_NO_WRITE_BEHIND면 NULL
+	struct FAT_FLUSHER*		flusher;		// background writeback thread, FAT_MOUNT_NO_FLUSHER면 NULL
+
 	union
 	{
 		FAT_FSINFO	info32;
@@ -186,6 +269,19 @@ typedef struct
 } FAT_FILESYSTEM;
 
 
+// FAT_MAGAZINE
+// thread 하나가 미리 확보해 둔 free cluster run, 마지막 run에서 차례로 할당
+typedef struct FAT_MAGAZINE
+{
+	FAT_FILESYSTEM*			fs;
+	pthread_mutex_t			lock;		// 이하 runs, runCount, clusters, allocLock 다음에 잡음
+	CLUSTER_RUN				runs[FAT_MAGAZINE_RUNS];
+	UINT32					runCount;
+	UINT32					clusters;
+	struct FAT_MAGAZINE*	next;
+} FAT_MAGAZINE;
+
+
 // FAT_FILETIME
 typedef struct
 {
@@ -212,8 +308,146 @@ typedef struct
 } FAT_NODE;
 
 typedef int ( *FAT_NODE_ADD )( void*, FAT_NODE* );
+typedef int ( *FAT_NODE_VISIT )( void* param, FAT_NODE* parent, FAT_NODE* node );
 
+// FAT_DEFRAG_REPORT
+// fat_defrag() 수행 결과, extent는 chain에서 cluster가 연속된 한 구간
+typedef struct
+{
+	UINT32	files;				// 검사한 파일, 디렉터리 수
+	UINT32	fragmentedBefore;	// extent가 2개 이상이었던 파일 수
+	UINT32	fragmentedAfter;
+	UINT32	extentsBefore;
+	UINT32	extentsAfter;
+	UINT32	clustersMoved;
+	UINT32	skipped;			// 연속된 free cluster가 부족해서 옮기지 못한 파일 수
+} FAT_DEFRAG_REPORT;
+
+typedef void ( *FAT_DEFRAG_PROGRESS )( void* param, const FAT_NODE* node, UINT32 clusters, UINT32 extentsBefore, UINT32 extentsAfter );
+
+// FAT_FSCK_REPORT
+// fat_fsck() 검사 결과
+typedef struct
+{
+	UINT32	directories;
+	UINT32	files;
+	UINT32	usedClusters;		// directory tree에서 참조하는 cluster 수
+	UINT32	crossLinks;			// 다른 chain에 이미 속한 cluster를 가리키는 chain 수
+	UINT32	badChains;			// free, bad, 범위 밖 cluster로 이어지거나 순환하는 chain 수
+	UINT32	sizeMismatches;		// chain이 fileSize보다 짧은 파일 수
+	UINT32	badDotEntries;		// '.' 또는 '..' entry가 잘못된 디렉터리 수
+	UINT32	lostChains;			// 어떤 entry에서도 참조하지 않는 chain 수
+	UINT32	lostClusters;
+} FAT_FSCK_REPORT;
+
+typedef void ( *FAT_FSCK_MESSAGE )( void* param, const char* path, const char* message );
+
+#define FAT_LAYOUT_BUCKETS		32
+
+// FAT_LAYOUT_STATS
+// fat_layout_stats() 결과, histogram의 i번 칸은 값이 2^i 이상 2^(i+1) 미만인 개수
+typedef struct
+{
+	UINT32	totalClusters;
+	UINT32	freeClusters;
+	UINT32	freeExtents;		// 연속된 free cluster 구간 수
+	UINT32	largestFreeRun;		// 한번에 연속으로 할당할 수 있는 최대 cluster 수
+	UINT32	freeExtentHistogram[FAT_LAYOUT_BUCKETS];
+
+	UINT32	files;
+	UINT32	directories;
+	UINT32	fragmentedChains;	// extent가 2개 이상인 chain 수
+	UINT32	maxExtents;
+	UINT32	extentHistogram[FAT_LAYOUT_BUCKETS];	// chain별 extent 수
+	UINT64	chainClusters;
+	UINT64	chainExtents;
+	UINT64	links;				// chain 안의 cluster 사이 연결 수
+	UINT64	contiguousLinks;	// 그 중 바로 다음 cluster로 이어지는 수
+
+	UINT32	liveEntries;
+	UINT32	tombstones;			// 삭제 표시(0xE5)된 directory entry 수
+	UINT32	worstTombstonePercent;
+	UINT32	sparseDirectories;	// entry의 절반 이상이 tombstone인 디렉터리 수
+} FAT_LAYOUT_STATS;
+
+// FAT_JOURNAL_STATS
+// fat_journal_stats() 결과
+typedef struct
+{
+	UINT32	logSectors;			// descriptor와 sector image를 쓰는 log 크기
+	UINT32	replayed;			// mount할 때 다시 적용한 transaction 수
+	UINT32	overlaySectors;		// 아직 제자리에 쓰지 않은 FAT, directory sector 수
+	QWORD	operations;			// commit된 operation 수
+	QWORD	transactions;
+	QWORD	journalSectors;		// log에 쓴 sector 수
+	QWORD	checkpoints;
+	QWORD	homeSectors;		// checkpoint가 제자리에 쓴 sector 수
+} FAT_JOURNAL_STATS;
+
+// FAT_READAHEAD_STATS
+// fat_readahead_stats() 결과, 단위는 cluster
+typedef struct
+{
+	UINT32	window;				// 가장 커졌던 window
+	UINT32	cachedClusters;
+	QWORD	hits;				// 읽을 때 이미 cache에 있거나 읽히는 중이던 cluster
+	QWORD	misses;
+	QWORD	waits;				// 미리 읽는 중인 cluster를 기다린 횟수
+	QWORD	prefetched;
+	QWORD	requests;			// 디스크 요청 수
+} FAT_READAHEAD_STATS;
+
+// FAT_WRITEBACK_STATS
+// fat_writeback_stats() 결과
+typedef struct
+{
+	UINT32	dirtyFiles;			// 지금 buffer를 가진 파일 수
+	QWORD	dirtyBytes;
+	QWORD	bufferedWrites;		// buffer에 넣은 fat_write 수
+	QWORD	bufferedBytes;
+	QWORD	flushes;
+	QWORD	flushedBytes;
+	QWORD	requests;			// flush가 넣은 data 쓰기 요청 수
+	QWORD	pressureFlushes;	// 크기 한도로 flush한 파일 수
+	QWORD	ageFlushes;			// 오래되어 flush한 파일 수
+} FAT_WRITEBACK_STATS;
+
+// FAT_FLUSHER_STATS
+// fat_flusher_stats() 결과
+typedef struct
+{
+	QWORD	passes;
+	QWORD	kicks;				// 주기를 기다리지 않고 writer가 깨운 횟수
+	QWORD	files;				// flush한 파일 수
+	QWORD	checkpoints;		// journal을 home에 쓴 횟수
+	QWORD	mirrorSyncs;		// mirror FAT에 복사한 횟수
+	QWORD	errors;
+} FAT_FLUSHER_STATS;
+
+// FAT_UPDATE
+// set_fat_batch()로 한번에 적용할 FAT entry 변경 하나
+typedef struct
+{
+	SECTOR	cluster;
+	DWORD	value;
+} FAT_UPDATE;
+
+// FAT_SECTOR_WINDOW
+// 마지막으로 접근한 FAT sector를 메모리에 유지(FAT12 entry가 sector 경계에 걸치면 2개)
+// exclusive window는 읽은 sector의 write lock을 release_fat_window()까지 유지
+typedef struct
+{
+	SECTOR	fatSector;
+	UINT32	count;
+	BYTE	dirty[2];
+	BYTE	exclusive;
+	BYTE	locked;			// lock을 잡고 있는 sector 수
+	BYTE	buffer[MAX_SECTOR_SIZE * 2];
+} FAT_SECTOR_WINDOW;
+
+int fat_format( DISK_OPERATIONS* disk, BYTE FATType, DWORD formatFlags, UINT32 threads );
 void fat_umount( FAT_FILESYSTEM* fs );
+int fat_sync( FAT_FILESYSTEM* fs );
 int fat_read_superblock( FAT_FILESYSTEM* fs, FAT_NODE* root );
 int fat_read_dir( FAT_NODE* dir, FAT_NODE_ADD adder, void* list );
 int fat_mkdir( const FAT_NODE* parent, const char* entryName, FAT_NODE* retEntry );
@@ -223,7 +457,98 @@ int fat_create( FAT_NODE* parent, const char* entryName, FAT_NODE* retEntry );
 int fat_read( FAT_NODE* file, unsigned long offset, unsigned long length, char* buffer );
 int fat_write( FAT_NODE* file, unsigned long offset, unsigned long length, const char* buffer );
 int fat_remove( FAT_NODE* file );
+int fat_fallocate( FAT_NODE* file, unsigned long length, int flags );
+int fat_truncate( FAT_NODE* file, unsigned long length );
+int fat_walk_tree( FAT_NODE* dir, FAT_NODE_VISIT visitor, void* param );
+int fat_defrag( FAT_NODE* root, FAT_DEFRAG_REPORT* report, FAT_DEFRAG_PROGRESS progress, void* param );
+int fat_fsck( FAT_NODE* root, UINT32 threads, FAT_FSCK_REPORT* report, FAT_FSCK_MESSAGE message, void* param );
+int fat_layout_stats( FAT_NODE* root, FAT_LAYOUT_STATS* stats );
 int fat_df( FAT_FILESYSTEM* fs, UINT32* totalSectors, UINT32* usedSectors );
+int fat_journal_stats( FAT_FILESYSTEM* fs, FAT_JOURNAL_STATS* stats );
+int fat_begin_batch( FAT_FILESYSTEM* fs );
+int fat_commit_batch( FAT_FILESYSTEM* fs );
+int fat_readahead_stats( FAT_FILESYSTEM* fs, FAT_READAHEAD_STATS* stats );
+int fat_flush( FAT_NODE* file );
+int fat_writeback_stats( FAT_FILESYSTEM* fs, FAT_WRITEBACK_STATS* stats );
+int fat_flusher_stats( FAT_FILESYSTEM* fs, FAT_FLUSHER_STATS* stats );
+
+/* FAT table helpers shared by the FAT modules */
+DWORD get_fat( FAT_FILESYSTEM* fs, SECTOR cluster );
+int set_fat( FAT_FILESYSTEM* fs, SECTOR cluster, DWORD value );
+int set_fat_batch( FAT_FILESYSTEM* fs, FAT_UPDATE* updates, UINT32 count );
+DWORD get_count_of_clusters( FAT_BPB* bpb );
+int get_fat_type( FAT_BPB* bpb );
+DWORD decode_fat_entry( FAT_FILESYSTEM* fs, SECTOR cluster, const BYTE* sector, DWORD fatEntryOffset );
+void init_fat_window( FAT_SECTOR_WINDOW* window );
+int flush_fat_window( FAT_FILESYSTEM* fs, FAT_SECTOR_WINDOW* window );
+int release_fat_window( FAT_FILESYSTEM* fs, FAT_SECTOR_WINDOW* window );
+DWORD get_fat_window( FAT_FILESYSTEM* fs, FAT_SECTOR_WINDOW* window, SECTOR cluster );
+int set_fat_window( FAT_FILESYSTEM* fs, FAT_SECTOR_WINDOW* window, SECTOR cluster, DWORD value );
+int read_cluster_chain( FAT_FILESYSTEM* fs, DWORD firstCluster, SECTOR** chain, UINT32* count );
+int reserve_file_space( FAT_NODE* file, unsigned long length, int flags );
+int free_cluster_chain( FAT_FILESYSTEM* fs, DWORD firstCluster );
+int release_clusters( FAT_FILESYSTEM* fs, const SECTOR* clusters, UINT32 count );
+UINT32 count_extents( const SECTOR* chain, UINT32 count );
+int set_entry( FAT_FILESYSTEM* fs, const FAT_ENTRY_LOCATION* location, const FAT_DIR_ENTRY* value );
+int read_entry_sector( FAT_FILESYSTEM* fs, SECTOR clusterNumber, SECTOR sectorNumber, BYTE* sector );
+int read_root_sector( FAT_FILESYSTEM* fs, SECTOR sectorNumber, BYTE* sector );
+int read_data_sector( FAT_FILESYSTEM* fs, SECTOR clusterNumber, SECTOR sectorNumber, BYTE* sector );
+int write_data_sector( FAT_FILESYSTEM* fs, SECTOR clusterNumber, SECTOR sectorNumber, const BYTE* sector );
+SECTOR calc_physical_sector( FAT_FILESYSTEM* fs, SECTOR clusterNumber, SECTOR sectorNumber );
+int add_free_cluster( FAT_FILESYSTEM* fs, SECTOR cluster );
+int add_free_cluster_run( FAT_FILESYSTEM* fs, SECTOR first, UINT32 count );
+int free_cluster_run( FAT_FILESYSTEM* fs, SECTOR first, UINT32 count );
+int release_cluster_run( FAT_FILESYSTEM* fs, SECTOR first, UINT32 count );
+SECTOR alloc_free_cluster( FAT_FILESYSTEM* fs );
+SECTOR alloc_free_cluster_run( FAT_FILESYSTEM* fs, UINT32 count, UINT32* allocated );
+SECTOR alloc_cluster_run_after( FAT_FILESYSTEM* fs, SECTOR previous, UINT32 count, UINT32* allocated );
+void init_alloc_policy( FAT_FILESYSTEM* fs );
+void init_magazines( FAT_FILESYSTEM* fs );
+void release_magazines( FAT_FILESYSTEM* fs );
+void release_read_queues( FAT_FILESYSTEM* fs );
+UINT32 count_free_clusters( FAT_FILESYSTEM* fs );
+void lock_directory( FAT_FILESYSTEM* fs, DWORD firstCluster, int exclusive );
+void unlock_directory( FAT_FILESYSTEM* fs, DWORD firstCluster );
+int sync_fat_mirrors( FAT_FILESYSTEM* fs );
+DWORD get_MS_EOC( BYTE FATType );
+
+/* metadata journal, fat_journal.c */
+UINT32 journal_sectors( SECTOR numberOfSectors, UINT32 bytesPerSector );
+int journal_format( DISK_OPERATIONS* disk, SECTOR first, UINT32 sectors );
+int journal_mount( FAT_FILESYSTEM* fs );
+void journal_release( FAT_FILESYSTEM* fs );
+int journal_checkpoint( FAT_FILESYSTEM* fs );
+void journal_begin( FAT_FILESYSTEM* fs );
+void journal_end( FAT_FILESYSTEM* fs );
+int journal_write_sector( FAT_FILESYSTEM* fs, SECTOR sector, const BYTE* data );
+int journal_free_run( FAT_FILESYSTEM* fs, SECTOR first, UINT32 count );
+int journal_backlog( FAT_FILESYSTEM* fs, UINT32* sectors, UINT32* percent );
+int journal_background_checkpoint( FAT_FILESYSTEM* fs );
+
+/* sequential readahead, fat_readahead.c */
+int init_readahead( FAT_FILESYSTEM* fs );
+void release_readahead( FAT_FILESYSTEM* fs );
+int readahead_read( FAT_NODE* file, DWORD offset, DWORD readEnd, char* buffer );
+void readahead_invalidate( FAT_FILESYSTEM* fs, SECTOR cluster, UINT32 count, int freed );
+void readahead_drain( FAT_FILESYSTEM* fs );
+
+/* delayed allocation for appends, fat_writeback.c */
+int init_writeback( FAT_FILESYSTEM* fs );
+void release_writeback( FAT_FILESYSTEM* fs );
+int writeback_write( FAT_NODE* node, DWORD offset, DWORD length, const char* buffer );
+int writeback_flush( FAT_NODE* node );
+void writeback_discard( FAT_NODE* node );
+int writeback_flush_all( FAT_FILESYSTEM* fs );
+void writeback_patch_size( FAT_NODE* node );
+int writeback_background( FAT_FILESYSTEM* fs, QWORD age, UINT32 ratio );
+UINT32 writeback_reserved( FAT_FILESYSTEM* fs );
+QWORD writeback_now( void );
+
+/* background writeback thread, fat_flusher.c */
+int init_flusher( FAT_FILESYSTEM* fs );
+void release_flusher( FAT_FILESYSTEM* fs );
+void flusher_kick( FAT_FILESYSTEM* fs );
+int is_EOC( BYTE FATType, SECTOR clusterNumber );
 
 #endif
 
@@ -0,0 +1,314 @@
+/******************************************************************************/
+/*                                                                            */
+/* Project : FAT12/16 File System                                             */
+/* File    : fat_defrag.c                                                     */
+/* Author  : Kyoungmoon Sun(msg2me@msn.com)                                   */
+/* Company : Dankook Univ. Embedded System Lab.                               */
+/* Notes   : Offline defragmenter                                             */
+/* Date    : 2008/7/2                                                         */
+/*                                                                            */
+/******************************************************************************/
+
+#include "fat.h"
+
+/* clusters copied by one multi-sector read and write */
+#define DEFRAG_COPY_CLUSTERS		64
+
+typedef struct
+{
+	FAT_DEFRAG_REPORT*		report;
+	FAT_DEFRAG_PROGRESS		progress;
+	void*					param;
+	BYTE*					buffer;
+	UINT32					bufferClusters;
+} FAT_DEFRAG_CONTEXT;
+
+/* the directory whose sub directories get their '..' fixed */
+typedef struct
+{
+	FAT_NODE*				dir;
+	int						result;		// 하나라도 실패하면 FAT_ERROR
+} FAT_DOTDOT_CONTEXT;
+
+/* number of contiguous pieces the chain is made of */
+UINT32 count_extents( const SECTOR* chain, UINT32 count )
+{
+	UINT32	i, extents = ( count ? 1 : 0 );
+
+	for( i = 1; i < count; i++ )
+	{
+		if( chain[i] != chain[i - 1] + 1 )
+			extents++;
+	}
+
+	return extents;
+}
+
+/* copy the clusters of chain, extent by extent, to the run starting at target */
+int copy_chain_data( FAT_FILESYSTEM* fs, FAT_DEFRAG_CONTEXT* context, const SECTOR* chain, UINT32 count, SECTOR target )
+{
+	UINT32	i = 0, length, sectors;
+
+	while( i < count )
+	{
+		/* the longest piece that is contiguous at the source and fits the buffer */
+		length = 1;
+		while( i + length < count && length < context->bufferClusters &&
+			   chain[i + length] == chain[i + length - 1] + 1 )
+			length++;
+
+		sectors = length * fs->bpb.sectorsPerCluster;
+
+		if( disk_read_sectors( fs->disk, calc_physical_sector( fs, chain[i], 0 ), sectors, context->buffer ) )
+			return FAT_ERROR;
+		if( disk_write_sectors( fs->disk, calc_physical_sector( fs, target + i, 0 ), sectors, context->buffer ) )
+			return FAT_ERROR;
+
+		i += length;
+	}
+
+	return FAT_SUCCESS;
+}
+
+/* '..' of every sub directory of dir has to follow dir to its new first cluster */
+int fix_dotdot_entries( FAT_NODE* dir );
+
+int fix_dotdot_entry( void* list, FAT_NODE* node )
+{
+	FAT_DOTDOT_CONTEXT*	context = ( FAT_DOTDOT_CONTEXT* )list;
+	FAT_NODE*			dir = context->dir;
+	FAT_ENTRY_LOCATION	location;
+	BYTE				sector[MAX_SECTOR_SIZE];
+	FAT_DIR_ENTRY*		entry;
+
+	if( !( node->entry.attribute & ATTR_DIRECTORY ) || node->entry.name[0] == '.' )
+		return FAT_SUCCESS;
+
+	/* '..' is the second entry of the first sector of the sub directory */
+	location.cluster	= GET_FIRST_CLUSTER( node->entry );
+	location.sector		= 0;
+	location.number		= 1;
+
+	if( read_data_sector( dir->fs, location.cluster, 0, sector ) )
+	{
+		context->result = FAT_ERROR;
+		return FAT_ERROR;
+	}
+
+	entry = &( ( FAT_DIR_ENTRY* )sector )[1];
+	if( memcmp( entry->name, "..         ", MAX_ENTRY_NAME_LENGTH ) != 0 )
+		return FAT_SUCCESS;
+
+	SET_FIRST_CLUSTER( *entry, GET_FIRST_CLUSTER( dir->entry ) );
+
+	if( set_entry( dir->fs, &location, entry ) )
+	{
+		context->result = FAT_ERROR;
+		return FAT_ERROR;
+	}
+
+	return FAT_SUCCESS;
+}
+
+/* fat_read_dir() doesn't look at what the callback returns; the context does */
+int fix_dotdot_entries( FAT_NODE* dir )
+{
+	FAT_DOTDOT_CONTEXT	context;
+
+	context.dir		= dir;
+	context.result	= FAT_SUCCESS;
+	if( fat_read_dir( dir, fix_dotdot_entry, &context ) )
+		return FAT_ERROR;
+
+	return context.result;
+}
+
+/* A move that failed part way: the entry goes back to the old chain, which
+   was never released, and the new run is unlinked and freed. When the entry
+   can't be put back the run stays allocated, since it may be in use. */
+void undo_chain_move( FAT_FILESYSTEM* fs, FAT_NODE* node, FAT_UPDATE* updates, SECTOR oldFirst, SECTOR target, UINT32 count, int entryMoved )
+{
+	UINT32	i;
+
+	if( entryMoved )
+	{
+		SET_FIRST_CLUSTER( node->entry, oldFirst );
+		if( set_entry( fs, &node->location, &node->entry ) )
+			return;
+		if( ( node->entry.attribute & ATTR_DIRECTORY ) && fix_dotdot_entries( node ) )
+			return;
+	}
+
+	for( i = 0; i < count; i++ )
+	{
+		updates[i].cluster	= target + i;
+		updates[i].value	= FREE_CLUSTER;
+	}
+	if( set_fat_batch( fs, updates, count ) == FAT_SUCCESS )
+		add_free_cluster_run( fs, target, count );
+}
+
+/* move one chain into a contiguous run when it is fragmented */
+int defrag_node( void* param, FAT_NODE* parent, FAT_NODE* node )
+{
+	FAT_DEFRAG_CONTEXT*	context = ( FAT_DEFRAG_CONTEXT* )param;
+	FAT_FILESYSTEM*		fs = node->fs;
+	FAT_DEFRAG_REPORT*	report = context->report;
+	FAT_UPDATE*			updates;
+	FAT_DIR_ENTRY		dotEntry;
+	FAT_ENTRY_LOCATION	dotLocation;
+	SECTOR*				chain;
+	SECTOR				target;
+	UINT32				count, extents, allocated, i;
+	int					result;
+
+	( void )parent;
+	if( read_cluster_chain( fs, GET_FIRST_CLUSTER( node->entry ), &chain, &count ) )
+		return FAT_ERROR;
+
+	extents = count_extents( chain, count );
+
+	report->files++;
+	report->extentsBefore += extents;
+	if( extents > 1 )
+		report->fragmentedBefore++;
+
+	if( extents <= 1 )
+	{
+		report->extentsAfter += extents;
+		free( chain );
+		return FAT_SUCCESS;
+	}
+
+	/* only a run long enough for the whole chain makes it contiguous */
+	target = alloc_free_cluster_run( fs, count, &allocated );
+	if( target != 0 && allocated < count )
+	{
+		add_free_cluster_run( fs, target, allocated );
+		target = 0;
+	}
+
+	if( target == 0 )
+	{
+		report->skipped++;
+		report->fragmentedAfter++;
+		report->extentsAfter += extents;
+		if( context->progress )
+			context->progress( context->param, node, count, extents, extents );
+
+		free( chain );
+		return FAT_SUCCESS;
+	}
+
+	updates = ( FAT_UPDATE* )malloc( count * sizeof( FAT_UPDATE ) );
+	if( updates == NULL )
+	{
+		add_free_cluster_run( fs, target, count );
+		free( chain );
+		return FAT_ERROR;
+	}
+
+	/* data first, then the new chain, then the entry; the old chain is
+	   released last so an interrupted run never loses data */
+	result = copy_chain_data( fs, context, chain, count, target );
+
+	if( result == FAT_SUCCESS )
+	{
+		for( i = 0; i < count; i++ )
+		{
+			updates[i].cluster	= target + i;
+			updates[i].value	= ( i + 1 < count ? target + i + 1 : get_MS_EOC( fs->FATType ) );
+		}
+		result = set_fat_batch( fs, updates, count );
+	}
+
+	// FAT에 일부만 link되었을 수 있음
+	if( result != FAT_SUCCESS )
+	{
+		undo_chain_move( fs, node, updates, chain[0], target, count, 0 );
+		free( updates );
+		free( chain );
+		return FAT_ERROR;
+	}
+
+	SET_FIRST_CLUSTER( node->entry, target );
+	result = set_entry( fs, &node->location, &node->entry );
+
+	if( result == FAT_SUCCESS && ( node->entry.attribute & ATTR_DIRECTORY ) )
+	{
+		/* '.' is the first entry of the moved directory itself */
+		dotLocation.cluster	= target;
+		dotLocation.sector	= 0;
+		dotLocation.number	= 0;
+
+		result = read_data_sector( fs, target, 0, ( BYTE* )context->buffer );
+		dotEntry = ( ( FAT_DIR_ENTRY* )context->buffer )[0];
+		if( result == FAT_SUCCESS && dotEntry.name[0] == '.' && dotEntry.name[1] == ' ' )
+		{
+			SET_FIRST_CLUSTER( dotEntry, target );
+			result = set_entry( fs, &dotLocation, &dotEntry );
+		}
+
+		if( result == FAT_SUCCESS )
+			result = fix_dotdot_entries( node );
+	}
+
+	// entry가 아직 old chain을 가리킬 수 있으므로 old chain은 해제하지 않음
+	if( result != FAT_SUCCESS )
+	{
+		undo_chain_move( fs, node, updates, chain[0], target, count, 1 );
+		free( updates );
+		free( chain );
+		return FAT_ERROR;
+	}
+
+	release_clusters( fs, chain, count );
+
+	report->clustersMoved += count;
+	report->extentsAfter++;
+	if( context->progress )
+		context->progress( context->param, node, count, extents, 1 );
+
+	free( updates );
+	free( chain );
+
+	return FAT_SUCCESS;
+}
+
+/******************************************************************************/
+/* Defragment the whole volume                                                */
+/******************************************************************************/
+/* Every chain under root that is split into several extents is copied into a
+   contiguous free run with multi-sector transfers, then the FAT links and the
+   first cluster of its directory entry are rewritten. Chains for which no run
+   is long enough are left as they are and counted as skipped. Nothing else
+   may use the volume while this runs; on a journaled volume the whole pass
+   is one operation. */
+int fat_defrag( FAT_NODE* root, FAT_DEFRAG_REPORT* report, FAT_DEFRAG_PROGRESS progress, void* param )
+{
+	FAT_DEFRAG_CONTEXT	context;
+	int					result;
+
+	ZeroMemory( report, sizeof( FAT_DEFRAG_REPORT ) );
+	if( root->fs->mountFlags & FAT_MOUNT_READ_ONLY )
+		return FAT_ERROR;
+
+	context.report			= report;
+	context.progress		= progress;
+	context.param			= param;
+	context.bufferClusters	= DEFRAG_COPY_CLUSTERS;
+	context.buffer			= ( BYTE* )malloc( DEFRAG_COPY_CLUSTERS * root->fs->bpb.sectorsPerCluster * root->fs->bpb.bytesPerSector );
+	if( context.buffer == NULL )
+		return FAT_ERROR;
+
+	// 옮길 chain이 모아둔 append로 바뀌지 않도록
+	writeback_flush_all( root->fs );
+
+	journal_begin( root->fs );
+	result = fat_walk_tree( root, defrag_node, &context );
+	journal_end( root->fs );
+
+	free( context.buffer );
+
+	return result;
+}
@@ -0,0 +1,247 @@
+/******************************************************************************/
+/*                                                                            */
+/* Project : FAT12/16 File System                                             */
+/* File    : fat_flusher.c                                                    */
+/* Author  : Kyoungmoon Sun(msg2me@msn.com)                                   */
+/* Company : Dankook Univ. Embedded System Lab.                               */
+/* Notes   : Background writeback of dirty data and metadata                  */
+/* Date    : 2008/7/2                                                         */
+/*                                                                            */
+/******************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "fat.h"
+
+/*
+   One thread per mounted volume writes out what the foreground left dirty,
+   so that a writer seldom has to wait for a flush it did not ask for. It
+   wakes every FAT_FLUSHER_INTERVAL_MS, or at once when a writer finds the
+   buffers past the ratio, and
+
+   - flushes the appends buffered longer than FAT_FLUSHER_AGE_MS, and the
+     oldest ones while the buffers hold more than FAT_FLUSHER_DIRTY_RATIO
+     percent of their limits, in first cluster order;
+   - checkpoints the journal when the log is FAT_FLUSHER_DIRTY_RATIO percent
+     full or has held sectors for FAT_FLUSHER_AGE_MS: the FAT and directory
+     sectors go home sorted, contiguous ones in one request;
+   - copies the active FAT sectors dirty for FAT_FLUSHER_AGE_MS to the
+     mirrors, contiguous ones in one request.
+
+   Nothing of an open batch is written home. fat_sync() still writes
+   everything at once; fat_umount() stops the thread before it does.
+*/
+
+typedef struct FAT_FLUSHER
+{
+	pthread_t			thread;
+	pthread_mutex_t		lock;		// 이하 stop, kicked, flusher_kick()은 lock 없이 atomic으로 읽음
+	pthread_cond_t		wake;
+	int					stop;
+	int					kicked;
+
+	pthread_mutex_t		passLock;	// pass 하나 동안, stats도 보호
+	QWORD				journalSince;	// home에 쓰지 않은 journal sector를 처음 본 때, ms
+	QWORD				mirrorSince;	// mirror에 복사하지 않은 FAT sector를 처음 본 때
+
+	FAT_FLUSHER_STATS	stats;
+} FAT_FLUSHER;
+
+int mirrors_dirty( FAT_FILESYSTEM* fs )
+{
+	DWORD	i;
+
+	if( fs->FATDirtyMap == NULL )
+		return 0;
+
+	for( i = 0; i < ( fs->FATSize + 7 ) / 8; i++ )
+	{
+		if( __atomic_load_n( &fs->FATDirtyMap[i], __ATOMIC_RELAXED ) )
+			return 1;
+	}
+
+	return 0;
+}
+
+/* how long something has been dirty, since is 0 while it is clean */
+QWORD dirty_age( QWORD* since, int dirty, QWORD now )
+{
+	if( !dirty )
+	{
+		*since = 0;
+		return 0;
+	}
+
+	if( *since == 0 )
+		*since = now;
+
+	return now - *since;
+}
+
+void flusher_pass( FAT_FILESYSTEM* fs, FAT_FLUSHER* flusher, int kicked )
+{
+	QWORD	now;
+	UINT32	sectors, percent;
+	int		files;
+
+	pthread_mutex_lock( &flusher->passLock );
+	flusher->stats.passes++;
+	if( kicked )
+		flusher->stats.kicks++;
+
+	files = writeback_background( fs, FAT_FLUSHER_AGE_MS, FAT_FLUSHER_DIRTY_RATIO );
+	if( files > 0 )
+		flusher->stats.files += files;
+	else if( files < 0 )
+		flusher->stats.errors++;
+
+	// batch가 열려 있으면 FAT, directory sector는 그대로 둠
+	now = writeback_now( );
+	if( journal_backlog( fs, &sectors, &percent ) == FAT_SUCCESS )
+	{
+		if( percent >= FAT_FLUSHER_DIRTY_RATIO || dirty_age( &flusher->journalSince, sectors != 0, now ) >= FAT_FLUSHER_AGE_MS )
+		{
+			if( journal_background_checkpoint( fs ) )
+				flusher->stats.errors++;
+			else
+				flusher->stats.checkpoints++;
+			flusher->journalSince = 0;
+		}
+
+		if( dirty_age( &flusher->mirrorSince, mirrors_dirty( fs ), now ) >= FAT_FLUSHER_AGE_MS )
+		{
+			if( sync_fat_mirrors( fs ) )
+				flusher->stats.errors++;
+			else
+				flusher->stats.mirrorSyncs++;
+			flusher->mirrorSince = 0;
+		}
+	}
+
+	pthread_mutex_unlock( &flusher->passLock );
+}
+
+void* flusher_thread( void* param )
+{
+	FAT_FILESYSTEM*	fs = ( FAT_FILESYSTEM* )param;
+	FAT_FLUSHER*	flusher = fs->flusher;
+	struct timespec	deadline;
+	int				kicked;
+
+	pthread_mutex_lock( &flusher->lock );
+	while( !flusher->stop )
+	{
+		if( !flusher->kicked )
+		{
+			clock_gettime( CLOCK_MONOTONIC, &deadline );
+			deadline.tv_sec		+= FAT_FLUSHER_INTERVAL_MS / 1000;
+			deadline.tv_nsec	+= ( FAT_FLUSHER_INTERVAL_MS % 1000 ) * 1000000L;
+			if( deadline.tv_nsec >= 1000000000L )
+			{
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000L;
+			}
+			pthread_cond_timedwait( &flusher->wake, &flusher->lock, &deadline );
+			if( flusher->stop )
+				break;
+		}
+
+		kicked = flusher->kicked;
+		__atomic_store_n( &flusher->kicked, 0, __ATOMIC_RELAXED );
+		pthread_mutex_unlock( &flusher->lock );
+
+		flusher_pass( fs, flusher, kicked );
+
+		pthread_mutex_lock( &flusher->lock );
+	}
+	pthread_mutex_unlock( &flusher->lock );
+
+	return NULL;
+}
+
+/* wake the thread now, a writer found the buffers past the ratio */
+void flusher_kick( FAT_FILESYSTEM* fs )
+{
+	FAT_FLUSHER*	flusher = fs->flusher;
+
+	// 이미 깨웠으면 lock을 잡지 않음
+	if( flusher == NULL || __atomic_load_n( &flusher->kicked, __ATOMIC_RELAXED ) )
+		return;
+
+	pthread_mutex_lock( &flusher->lock );
+	__atomic_store_n( &flusher->kicked, 1, __ATOMIC_RELAXED );
+	pthread_cond_signal( &flusher->wake );
+	pthread_mutex_unlock( &flusher->lock );
+}
+
+/* the last step of a mount, nothing fails after the thread runs */
+int init_flusher( FAT_FILESYSTEM* fs )
+{
+	FAT_FLUSHER*		flusher;
+	pthread_condattr_t	attr;
+
+	fs->flusher = NULL;
+	if( fs->mountFlags & ( FAT_MOUNT_NO_FLUSHER | FAT_MOUNT_READ_ONLY ) )
+		return FAT_SUCCESS;
+
+	flusher = ( FAT_FLUSHER* )calloc( 1, sizeof( FAT_FLUSHER ) );
+	if( flusher == NULL )
+		return FAT_ERROR;
+
+	pthread_condattr_init( &attr );
+	pthread_condattr_setclock( &attr, CLOCK_MONOTONIC );
+	pthread_cond_init( &flusher->wake, &attr );
+	pthread_condattr_destroy( &attr );
+	pthread_mutex_init( &flusher->lock, NULL );
+	pthread_mutex_init( &flusher->passLock, NULL );
+
+	fs->flusher = flusher;
+	if( pthread_create( &flusher->thread, NULL, flusher_thread, fs ) )
+	{
+		fs->flusher = NULL;
+		pthread_cond_destroy( &flusher->wake );
+		pthread_mutex_destroy( &flusher->lock );
+		pthread_mutex_destroy( &flusher->passLock );
+		free( flusher );
+		return FAT_ERROR;
+	}
+
+	return FAT_SUCCESS;
+}
+
+/* stop the thread; what it left dirty is written by the fat_sync() after */
+void release_flusher( FAT_FILESYSTEM* fs )
+{
+	FAT_FLUSHER*	flusher = fs->flusher;
+
+	if( flusher == NULL )
+		return;
+
+	pthread_mutex_lock( &flusher->lock );
+	flusher->stop = 1;
+	pthread_cond_signal( &flusher->wake );
+	pthread_mutex_unlock( &flusher->lock );
+	pthread_join( flusher->thread, NULL );
+
+	fs->flusher = NULL;
+	pthread_cond_destroy( &flusher->wake );
+	pthread_mutex_destroy( &flusher->lock );
+	pthread_mutex_destroy( &flusher->passLock );
+	free( flusher );
+}
+
+int fat_flusher_stats( FAT_FILESYSTEM* fs, FAT_FLUSHER_STATS* stats )
+{
+	FAT_FLUSHER*	flusher = fs->flusher;
+
+	ZeroMemory( stats, sizeof( FAT_FLUSHER_STATS ) );
+	if( flusher == NULL )
+		return FAT_ERROR;
+
+	pthread_mutex_lock( &flusher->passLock );
+	memcpy( stats, &flusher->stats, sizeof( FAT_FLUSHER_STATS ) );
+	pthread_mutex_unlock( &flusher->passLock );
+
+	return FAT_SUCCESS;
+}
@@ -0,0 +1,495 @@
+/******************************************************************************/
+/*                                                                            */
+/* Project : FAT12/16 File System                                             */
+/* File    : fat_fsck.c                                                       */
+/* Author  : Kyoungmoon Sun(msg2me@msn.com)                                   */
+/* Company : Dankook Univ. Embedded System Lab.                               */
+/* Notes   : Parallel consistency checker                                     */
+/* Date    : 2008/7/2                                                         */
+/*                                                                            */
+/******************************************************************************/
+
+#include <stdarg.h>
+#include <string.h>
+#include "fat.h"
+#include "threadpool.h"
+
+#define FSCK_MAX_PATH			1024
+#define FSCK_MAX_MESSAGE		256
+
+#define FSCK_CHAIN_OK			0
+#define FSCK_CHAIN_BROKEN		1
+
+#define FSCK_COUNT( a, b )		__sync_fetch_and_add( &( a ), ( b ) )
+
+typedef struct
+{
+	FAT_FILESYSTEM*		fs;
+	FAT_FSCK_REPORT*	report;
+	FAT_FSCK_MESSAGE	message;
+	void*				param;
+	UINT32*				owned;			// cluster마다 1 bit, 처음 참조한 chain이 set
+	THREAD_POOL			pool;
+	pthread_mutex_t		messageLock;
+	volatile int		failed;
+} FAT_FSCK_CONTEXT;
+
+// 디렉터리 하나를 검사하는 작업
+typedef struct
+{
+	FAT_FSCK_CONTEXT*	context;
+	FAT_NODE			dir;
+	int					isRoot;
+	DWORD				parentCluster;	// '..'가 가리켜야 하는 cluster, 부모가 root면 0
+	char				path[FSCK_MAX_PATH];
+} FAT_FSCK_JOB;
+
+typedef struct
+{
+	FAT_NODE*	nodes;
+	UINT32		count;
+	UINT32		capacity;
+} FAT_FSCK_ENTRIES;
+
+void fsck_message( FAT_FSCK_CONTEXT* context, const char* path, const char* format, ... )
+{
+	char	message[FSCK_MAX_MESSAGE];
+	va_list	args;
+
+	if( context->message == NULL )
+		return;
+
+	va_start( args, format );
+	vsnprintf( message, sizeof( message ), format, args );
+	va_end( args );
+
+	/* workers report concurrently; keep each line whole */
+	pthread_mutex_lock( &context->messageLock );
+	context->message( context->param, path, message );
+	pthread_mutex_unlock( &context->messageLock );
+}
+
+/* returns non-zero when another chain had already taken the cluster */
+int claim_cluster( FAT_FSCK_CONTEXT* context, SECTOR cluster )
+{
+	UINT32	bit = 1u << ( cluster & 31 );
+
+	return ( __sync_fetch_and_or( &context->owned[cluster >> 5], bit ) & bit ) != 0;
+}
+
+int is_owned_cluster( const UINT32* bitmap, SECTOR cluster )
+{
+	return ( bitmap[cluster >> 5] >> ( cluster & 31 ) ) & 1;
+}
+
+void set_bitmap( UINT32* bitmap, SECTOR cluster )
+{
+	bitmap[cluster >> 5] |= 1u << ( cluster & 31 );
+}
+
+int is_bad_cluster( BYTE FATType, DWORD value )
+{
+	switch( FATType )
+	{
+	case FAT12:
+		return value == BAD12;
+	case FAT16:
+		return value == BAD16;
+	case FAT32:
+		return ( value & 0x0FFFFFFF ) == BAD32;
+	}
+
+	return 0;
+}
+
+int is_valid_cluster( FAT_FILESYSTEM* fs, DWORD cluster )
+{
+	return cluster >= 2 && cluster < fs->countOfClusters + 2;
+}
+
+/* Follow a chain and take ownership of its clusters. A chain that reaches a
+   cluster taken before is either looping on itself or cross-linked with
+   another chain; either way the walk stops there. */
+int check_chain( FAT_FSCK_CONTEXT* context, const char* path, DWORD firstCluster, UINT32* count )
+{
+	FAT_FILESYSTEM*		fs = context->fs;
+	FAT_SECTOR_WINDOW	window;
+	SECTOR*				chain = NULL;
+	SECTOR*				grown;
+	UINT32				capacity = 0, number = 0, i;
+	DWORD				cluster = firstCluster, next;
+	int					result = FSCK_CHAIN_OK;
+
+	*count = 0;
+	if( firstCluster == 0 )
+		return FSCK_CHAIN_OK;
+
+	init_fat_window( &window );
+
+	for( ;; )
+	{
+		if( !is_valid_cluster( fs, cluster ) )
+		{
+			fsck_message( context, path, "chain points to invalid cluster %u", cluster );
+			FSCK_COUNT( context->report->badChains, 1 );
+			result = FSCK_CHAIN_BROKEN;
+			break;
+		}
+
+		if( claim_cluster( context, cluster ) )
+		{
+			for( i = 0; i < number && chain[i] != cluster; i++ )
+				;
+
+			if( i < number )
+			{
+				fsck_message( context, path, "chain loops back to cluster %u", cluster );
+				FSCK_COUNT( context->report->badChains, 1 );
+			}
+			else
+			{
+				fsck_message( context, path, "cluster %u is cross-linked", cluster );
+				FSCK_COUNT( context->report->crossLinks, 1 );
+			}
+			result = FSCK_CHAIN_BROKEN;
+			break;
+		}
+
+		if( number == capacity )
+		{
+			capacity = ( capacity ? capacity * 2 : 64 );
+			grown = ( SECTOR* )realloc( chain, capacity * sizeof( SECTOR ) );
+			if( grown == NULL )
+			{
+				context->failed = 1;
+				result = FSCK_CHAIN_BROKEN;
+				break;
+			}
+			chain = grown;
+		}
+		chain[number++] = cluster;
+
+		next = get_fat_window( fs, &window, cluster );
+		if( is_EOC( fs->FATType, next ) )
+			break;
+
+		if( next == FREE_CLUSTER || is_bad_cluster( fs->FATType, next ) )
+		{
+			fsck_message( context, path, "cluster %u links to %s cluster", cluster,
+						  next == FREE_CLUSTER ? "a free" : "a bad" );
+			FSCK_COUNT( context->report->badChains, 1 );
+			result = FSCK_CHAIN_BROKEN;
+			break;
+		}
+
+		cluster = next;
+	}
+
+	FSCK_COUNT( context->report->usedClusters, number );
+
+	free( chain );
+	*count = number;
+
+	return result;
+}
+
+int add_fsck_entry( void* list, FAT_NODE* node )
+{
+	FAT_FSCK_ENTRIES*	entries = ( FAT_FSCK_ENTRIES* )list;
+	FAT_NODE*			grown;
+
+	if( entries->count == entries->capacity )
+	{
+		entries->capacity = ( entries->capacity ? entries->capacity * 2 : 16 );
+		grown = ( FAT_NODE* )realloc( entries->nodes, entries->capacity * sizeof( FAT_NODE ) );
+		if( grown == NULL )
+			return FAT_ERROR;
+		entries->nodes = grown;
+	}
+
+	entries->nodes[entries->count++] = *node;
+
+	return FAT_SUCCESS;
+}
+
+/* "NAME    EXT" -> "NAME.EXT" appended to the path of the parent */
+void make_child_path( const char* parent, const FAT_DIR_ENTRY* entry, char* path )
+{
+	char	name[13];
+	int		i, length = 0;
+
+	for( i = 0; i < 8 && entry->name[i] != 0x20; i++ )
+		name[length++] = entry->name[i];
+
+	if( entry->name[8] != 0x20 )
+	{
+		name[length++] = '.';
+		for( i = 8; i < 11 && entry->name[i] != 0x20; i++ )
+			name[length++] = entry->name[i];
+	}
+	name[length] = '\0';
+
+	snprintf( path, FSCK_MAX_PATH, "%s/%s", strcmp( parent, "/" ) ? parent : "", name );
+}
+
+int is_dot_entry( const FAT_NODE* node, int dots )
+{
+	return memcmp( node->entry.name, dots == 1 ? ".          " : "..         ", MAX_ENTRY_NAME_LENGTH ) == 0;
+}
+
+/* '.' and '..' are the first two entries of every sub directory */
+void check_dot_entries( FAT_FSCK_JOB* job, FAT_FSCK_ENTRIES* entries )
+{
+	FAT_FSCK_CONTEXT*	context = job->context;
+	DWORD				self = GET_FIRST_CLUSTER( job->dir.entry );
+
+	if( entries->count < 2 || !is_dot_entry( &entries->nodes[0], 1 ) || !is_dot_entry( &entries->nodes[1], 2 ) )
+	{
+		fsck_message( context, job->path, "'.' or '..' entry is missing" );
+		FSCK_COUNT( context->report->badDotEntries, 1 );
+		return;
+	}
+
+	if( GET_FIRST_CLUSTER( entries->nodes[0].entry ) != self )
+	{
+		fsck_message( context, job->path, "'.' points to cluster %u instead of %u",
+					  GET_FIRST_CLUSTER( entries->nodes[0].entry ), self );
+		FSCK_COUNT( context->report->badDotEntries, 1 );
+	}
+	else if( GET_FIRST_CLUSTER( entries->nodes[1].entry ) != job->parentCluster )
+	{
+		fsck_message( context, job->path, "'..' points to cluster %u instead of %u",
+					  GET_FIRST_CLUSTER( entries->nodes[1].entry ), job->parentCluster );
+		FSCK_COUNT( context->report->badDotEntries, 1 );
+	}
+}
+
+void check_file( FAT_FSCK_CONTEXT* context, const char* path, const FAT_NODE* node )
+{
+	UINT32	clusterSize = context->fs->bpb.bytesPerSector * context->fs->bpb.sectorsPerCluster;
+	UINT32	expected = ( node->entry.fileSize + clusterSize - 1 ) / clusterSize;
+	UINT32	count;
+
+	if( check_chain( context, path, GET_FIRST_CLUSTER( node->entry ), &count ) != FSCK_CHAIN_OK )
+		return;
+
+	/* a chain longer than the size is space preallocated with KEEP_SIZE */
+	if( count < expected )
+	{
+		fsck_message( context, path, "size %u needs %u clusters but the chain has %u",
+					  node->entry.fileSize, expected, count );
+		FSCK_COUNT( context->report->sizeMismatches, 1 );
+	}
+}
+
+void check_directory_job( void* param );
+
+int submit_directory( FAT_FSCK_CONTEXT* context, const FAT_NODE* dir, int isRoot, DWORD parentCluster, const char* path )
+{
+	FAT_FSCK_JOB*	job;
+
+	job = ( FAT_FSCK_JOB* )malloc( sizeof( FAT_FSCK_JOB ) );
+	if( job == NULL )
+		return FAT_ERROR;
+
+	job->context		= context;
+	job->dir			= *dir;
+	job->isRoot			= isRoot;
+	job->parentCluster	= parentCluster;
+	strncpy( job->path, path, FSCK_MAX_PATH - 1 );
+	job->path[FSCK_MAX_PATH - 1] = '\0';
+
+	if( thread_pool_submit( &context->pool, check_directory_job, job ) )
+	{
+		free( job );
+		return FAT_ERROR;
+	}
+
+	return FAT_SUCCESS;
+}
+
+/* Check every entry of one directory; sub directories whose chain is sound
+   become jobs of their own, so independent subtrees run on different workers */
+void check_directory_job( void* param )
+{
+	FAT_FSCK_JOB*		job = ( FAT_FSCK_JOB* )param;
+	FAT_FSCK_CONTEXT*	context = job->context;
+	FAT_FSCK_ENTRIES	entries = { NULL, 0, 0 };
+	FAT_NODE*			node;
+	char				path[FSCK_MAX_PATH];
+	DWORD				self = ( job->isRoot ? 0 : GET_FIRST_CLUSTER( job->dir.entry ) );
+	UINT32				i, count;
+
+	fat_read_dir( &job->dir, add_fsck_entry, &entries );
+
+	if( !job->isRoot )
+		check_dot_entries( job, &entries );
+
+	for( i = 0; i < entries.count; i++ )
+	{
+		node = &entries.nodes[i];
+		if( node->entry.name[0] == '.' )
+			continue;
+
+		make_child_path( job->path, &node->entry, path );
+
+		if( node->entry.attribute & ATTR_DIRECTORY )
+		{
+			FSCK_COUNT( context->report->directories, 1 );
+
+			if( GET_FIRST_CLUSTER( node->entry ) == 0 )
+			{
+				fsck_message( context, path, "directory has no cluster" );
+				FSCK_COUNT( context->report->badChains, 1 );
+				continue;
+			}
+
+			/* a broken directory chain is not descended; its sectors can't be trusted */
+			if( check_chain( context, path, GET_FIRST_CLUSTER( node->entry ), &count ) != FSCK_CHAIN_OK )
+				continue;
+
+			if( submit_directory( context, node, 0, self, path ) )
+				context->failed = 1;
+		}
+		else
+		{
+			FSCK_COUNT( context->report->files, 1 );
+			check_file( context, path, node );
+		}
+	}
+
+	free( entries.nodes );
+	free( job );
+}
+
+/* Clusters in use by the FAT but owned by no entry. A lost chain is counted
+   at its head, the lost cluster that no other lost cluster links to. */
+int find_lost_chains( FAT_FSCK_CONTEXT* context )
+{
+	FAT_FILESYSTEM*		fs = context->fs;
+	FAT_FSCK_REPORT*	report = context->report;
+	FAT_SECTOR_WINDOW	window;
+	UINT32*				lost;
+	UINT32*				linked;
+	UINT32				words = ( fs->countOfClusters + 2 + 31 ) / 32;
+	UINT32				length;
+	SECTOR				cluster;
+	DWORD				value;
+
+	lost	= ( UINT32* )calloc( words, sizeof( UINT32 ) );
+	linked	= ( UINT32* )calloc( words, sizeof( UINT32 ) );
+	if( lost == NULL || linked == NULL )
+	{
+		free( lost );
+		free( linked );
+		return FAT_ERROR;
+	}
+
+	init_fat_window( &window );
+	for( cluster = 2; cluster < fs->countOfClusters + 2; cluster++ )
+	{
+		value = get_fat_window( fs, &window, cluster );
+		if( value == FREE_CLUSTER || is_bad_cluster( fs->FATType, value ) || is_owned_cluster( context->owned, cluster ) )
+			continue;
+
+		set_bitmap( lost, cluster );
+		report->lostClusters++;
+	}
+
+	init_fat_window( &window );
+	for( cluster = 2; cluster < fs->countOfClusters + 2; cluster++ )
+	{
+		if( !is_owned_cluster( lost, cluster ) )
+			continue;
+
+		value = get_fat_window( fs, &window, cluster );
+		if( is_valid_cluster( fs, value ) && is_owned_cluster( lost, value ) )
+			set_bitmap( linked, value );
+	}
+
+	for( cluster = 2; cluster < fs->countOfClusters + 2; cluster++ )
+	{
+		if( !is_owned_cluster( lost, cluster ) || is_owned_cluster( linked, cluster ) )
+			continue;
+
+		length = 0;
+		value = cluster;
+		do
+		{
+			length++;
+			value = get_fat( fs, value );
+		} while( is_valid_cluster( fs, value ) && is_owned_cluster( lost, value ) && length < report->lostClusters );
+
+		fsck_message( context, "", "lost chain of %u clusters at cluster %u", length, cluster );
+		report->lostChains++;
+	}
+
+	/* lost clusters that only link to each other in a circle have no head */
+	if( report->lostClusters && report->lostChains == 0 )
+	{
+		fsck_message( context, "", "%u lost clusters form a loop", report->lostClusters );
+		report->lostChains++;
+	}
+
+	free( linked );
+	free( lost );
+
+	return FAT_SUCCESS;
+}
+
+/******************************************************************************/
+/* Check the consistency of the volume                                        */
+/******************************************************************************/
+/* Cross-references the FAT with the directory tree without changing either.
+   Directory subtrees are checked on a pool of threads (0 for one per CPU);
+   every chain claims its clusters in a shared ownership bitmap, so a cluster
+   reached twice is reported as cross-linked and clusters in use that no
+   chain reached are reported as lost. Problems are passed to message as
+   they are found and counted in report. */
+int fat_fsck( FAT_NODE* root, UINT32 threads, FAT_FSCK_REPORT* report, FAT_FSCK_MESSAGE message, void* param )
+{
+	FAT_FSCK_CONTEXT	context;
+	FAT_FILESYSTEM*		fs = root->fs;
+	UINT32				count;
+	int					result = FAT_SUCCESS;
+
+	ZeroMemory( report, sizeof( FAT_FSCK_REPORT ) );
+	ZeroMemory( &context, sizeof( FAT_FSCK_CONTEXT ) );
+
+	/* sizes and chains are compared as they are on disk, buffered appends first */
+	if( writeback_flush_all( fs ) )
+		return FAT_ERROR;
+
+	context.fs		= fs;
+	context.report	= report;
+	context.message	= message;
+	context.param	= param;
+	context.owned	= ( UINT32* )calloc( ( fs->countOfClusters + 2 + 31 ) / 32, sizeof( UINT32 ) );
+	if( context.owned == NULL )
+		return FAT_ERROR;
+
+	if( thread_pool_init( &context.pool, threads ) )
+	{
+		free( context.owned );
+		return FAT_ERROR;
+	}
+	pthread_mutex_init( &context.messageLock, NULL );
+
+	/* a FAT32 root lives in a cluster chain of its own */
+	if( check_chain( &context, "/", GET_FIRST_CLUSTER( root->entry ), &count ) == FSCK_CHAIN_OK )
+	{
+		if( submit_directory( &context, root, 1, 0, "/" ) )
+			context.failed = 1;
+	}
+
+	thread_pool_wait( &context.pool );
+	thread_pool_release( &context.pool );
+
+	if( context.failed || find_lost_chains( &context ) )
+		result = FAT_ERROR;
+
+	pthread_mutex_destroy( &context.messageLock );
+	free( context.owned );
+
+	return result;
+}
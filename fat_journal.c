@@ -0,0 +1,1012 @@
+/******************************************************************************/
+/*                                                                            */
+/* Project : FAT12/16 File System                                             */
+/* File    : fat_journal.c                                                    */
+/* Author  : Kyoungmoon Sun(msg2me@msn.com)                                   */
+/* Company : Dankook Univ. Embedded System Lab.                               */
+/* Notes   : Metadata write-ahead journal                                     */
+/* Date    : 2008/7/2                                                         */
+/*                                                                            */
+/******************************************************************************/
+
+#include <time.h>
+#include "fat.h"
+
+/*
+   The journal lives in the last sectors of the reserved region, where other
+   FAT drivers never look: a log followed by one header sector.
+
+   FAT and directory sector updates are kept in memory (the overlay) instead
+   of being written in place. A commit writes every sector changed since the
+   last commit to the log as one transaction, a descriptor with the home
+   sector numbers followed by the sector images, in one sequential request.
+   Only finished operations are committed, so a transaction never holds half
+   of one. When the log is full the committed images are written to their
+   home sectors (checkpoint) and the log starts over.
+
+   fs->disk is replaced by a disk that reads through the overlay, so every
+   reader of the volume (fsck, layout, defrag, file reads) sees the newest
+   metadata. Data written to a sector that is still in the overlay, a freed
+   directory cluster reused by a file, goes through the journal too, so an
+   older image in the log can never be replayed over it.
+
+   Data clusters are written in place before the operation ends, which is
+   before its metadata is committed. After a crash the FAT and directories
+   are those of the last commit. Clusters an operation frees are held back,
+   neither discarded nor handed out again, until the transaction freeing
+   them is committed, so a chain that comes back after a crash still holds
+   its data. An operation that frees clusters while fewer than that are left
+   free commits at its end, so a volume being emptied doesn't look full.
+*/
+
+#define JOURNAL_SIGNATURE		"FATJRNL1"
+#define JOURNAL_MAGIC			0x58544A46		// "FJTX"
+#define JOURNAL_BUCKETS			1024
+
+// JOURNAL_HEADER
+// 예약 영역 마지막 sector, log의 위치와 처음 transaction 번호
+typedef struct
+{
+	BYTE	signature[8];
+	DWORD	journalID;		// format마다 다름, 예전 journal의 log를 구별
+	DWORD	sequence;		// log의 처음에 있어야 할 transaction 번호
+	DWORD	logStart;
+	DWORD	logSectors;
+} JOURNAL_HEADER;
+
+// JOURNAL_DESCRIPTOR
+// transaction의 첫 sector, 뒤에 home sector 번호 count개가 이어지고
+// descriptor sector들 다음에 sector image count개
+typedef struct
+{
+	DWORD	magic;
+	DWORD	journalID;
+	DWORD	sequence;
+	DWORD	count;
+	DWORD	checksum;		// home sector 번호들과 image들
+	DWORD	reserved;
+} JOURNAL_DESCRIPTOR;
+
+// JOURNAL_BLOCK
+// overlay에 있는 sector 하나
+typedef struct JOURNAL_BLOCK
+{
+	SECTOR	sector;
+	BYTE	dirty;			// 아직 commit되지 않은 변경이 있음
+	BYTE	logged;			// committed가 log에 있음, checkpoint에서 home에 씀
+	BYTE*	data;			// 최신 내용, 읽기는 이것을 봄
+	BYTE*	committed;		// 마지막으로 commit한 내용
+	struct JOURNAL_BLOCK*	next;
+} JOURNAL_BLOCK;
+
+typedef struct FAT_JOURNAL
+{
+	DISK_OPERATIONS		disk;		// fs->disk가 되는 디스크
+	DISK_OPERATIONS*	base;
+	FAT_FILESYSTEM*		fs;
+	JOURNAL_HEADER		header;
+	SECTOR				headerSector;
+	UINT32				head;		// 다음 transaction을 쓸 log 안의 위치
+	DWORD				sequence;	// 다음 transaction 번호
+	BYTE*				buffer;		// commit과 checkpoint가 사용
+	UINT32				bufferSectors;	// log 크기
+
+	pthread_rwlock_t	lock;		// 이하 overlay
+	JOURNAL_BLOCK*		buckets[JOURNAL_BUCKETS];
+	UINT32				blocks;		// blocks, dirtyBlocks, lowest, highest는 lock 없이도 atomic으로 읽음
+	UINT32				dirtyBlocks;
+	SECTOR				lowest;		// overlay에 있는 sector 범위
+	SECTOR				highest;
+
+	pthread_mutex_t		gateLock;	// 진행중인 operation과 commit 사이
+	pthread_cond_t		gate;
+	UINT32				active;
+	UINT32				pendingOps;	// 마지막 commit 이후 끝난 operation
+	UINT32				batches;	// 열린 batch 수, 0이 될 때까지 group commit 하지 않음
+	int					committing;
+	CLUSTER_LIST		freed;		// free했지만 commit 전이라 할당하지 않는 cluster run
+	pthread_key_t		depthKey;	// thread별 operation 중첩 깊이
+
+	FAT_JOURNAL_STATS	stats;
+} FAT_JOURNAL;
+
+/* journal size for a volume: 1/64 of it within the limits, at most 1/8 */
+UINT32 journal_sectors( SECTOR numberOfSectors, UINT32 bytesPerSector )
+{
+	QWORD	bytes = ( QWORD )numberOfSectors * bytesPerSector / 64;
+
+	if( bytes < FAT_JOURNAL_MIN_BYTES )
+		bytes = FAT_JOURNAL_MIN_BYTES;
+	if( bytes > FAT_JOURNAL_MAX_BYTES )
+		bytes = FAT_JOURNAL_MAX_BYTES;
+	if( bytes > ( QWORD )numberOfSectors * bytesPerSector / 8 )
+		bytes = ( QWORD )numberOfSectors * bytesPerSector / 8;
+
+	return ( UINT32 )( bytes / bytesPerSector );
+}
+
+/* an empty log in sectors [first, first + sectors - 1), the header after it */
+int journal_format( DISK_OPERATIONS* disk, SECTOR first, UINT32 sectors )
+{
+	BYTE			sector[MAX_SECTOR_SIZE];
+	JOURNAL_HEADER*	header = ( JOURNAL_HEADER* )sector;
+
+	ZeroMemory( sector, sizeof( sector ) );
+	memcpy( header->signature, JOURNAL_SIGNATURE, 8 );
+	header->journalID	= ( DWORD )time( NULL ) ^ ( ( DWORD )clock( ) << 16 ) ^ ( DWORD )( size_t )disk;
+	header->sequence	= 1;
+	header->logStart	= first;
+	header->logSectors	= sectors - 1;
+
+	return disk->write_sector( disk, first + sectors - 1, sector );
+}
+
+UINT32 journal_descriptor_sectors( FAT_JOURNAL* journal, UINT32 count )
+{
+	return ( sizeof( JOURNAL_DESCRIPTOR ) + count * sizeof( DWORD ) + journal->base->bytesPerSector - 1 ) / journal->base->bytesPerSector;
+}
+
+/* FNV-1a */
+DWORD journal_checksum( DWORD hash, const BYTE* data, UINT32 length )
+{
+	UINT32	i;
+
+	for( i = 0; i < length; i++ )
+		hash = ( hash ^ data[i] ) * 16777619;
+
+	return hash;
+}
+
+/******************************************************************************/
+/* Overlay                                                                    */
+/******************************************************************************/
+JOURNAL_BLOCK* find_journal_block( FAT_JOURNAL* journal, SECTOR sector )
+{
+	JOURNAL_BLOCK*	block;
+
+	for( block = journal->buckets[sector % JOURNAL_BUCKETS]; block; block = block->next )
+	{
+		if( block->sector == sector )
+			return block;
+	}
+
+	return NULL;
+}
+
+/* the block of sector, added when missing; the overlay lock is held exclusively */
+JOURNAL_BLOCK* get_journal_block( FAT_JOURNAL* journal, SECTOR sector )
+{
+	JOURNAL_BLOCK*	block = find_journal_block( journal, sector );
+	UINT32			bytesPerSector = journal->base->bytesPerSector;
+
+	if( block )
+		return block;
+
+	block = ( JOURNAL_BLOCK* )malloc( sizeof( JOURNAL_BLOCK ) + bytesPerSector * 2 );
+	if( block == NULL )
+		return NULL;
+
+	block->sector		= sector;
+	block->dirty		= 0;
+	block->logged		= 0;
+	block->data			= ( BYTE* )( block + 1 );
+	block->committed	= block->data + bytesPerSector;
+	block->next			= journal->buckets[sector % JOURNAL_BUCKETS];
+	journal->buckets[sector % JOURNAL_BUCKETS] = block;
+
+	/* the range first, readers that see the new count see it too */
+	if( journal->blocks == 0 || sector < journal->lowest )
+		__atomic_store_n( &journal->lowest, sector, __ATOMIC_RELAXED );
+	if( journal->blocks == 0 || sector > journal->highest )
+		__atomic_store_n( &journal->highest, sector, __ATOMIC_RELAXED );
+	__atomic_store_n( &journal->blocks, journal->blocks + 1, __ATOMIC_RELEASE );
+
+	return block;
+}
+
+/* drop the blocks with nothing left to commit; the overlay lock is held exclusively */
+void trim_journal_blocks( FAT_JOURNAL* journal )
+{
+	JOURNAL_BLOCK**	link;
+	JOURNAL_BLOCK*	block;
+	SECTOR			lowest = 0, highest = 0;
+	UINT32			i, blocks = 0;
+
+	for( i = 0; i < JOURNAL_BUCKETS; i++ )
+	{
+		for( link = &journal->buckets[i]; ( block = *link ) != NULL; )
+		{
+			if( block->dirty )
+			{
+				block->logged = 0;
+				if( blocks == 0 || block->sector < lowest )
+					lowest = block->sector;
+				if( blocks == 0 || block->sector > highest )
+					highest = block->sector;
+				blocks++;
+				link = &block->next;
+				continue;
+			}
+
+			*link = block->next;
+			free( block );
+		}
+	}
+
+	/* readers skip the lock when a request is out of range; narrow it last */
+	__atomic_store_n( &journal->lowest, lowest, __ATOMIC_RELAXED );
+	__atomic_store_n( &journal->highest, highest, __ATOMIC_RELAXED );
+	__atomic_store_n( &journal->blocks, blocks, __ATOMIC_RELEASE );
+}
+
+/* whether a request may touch the overlay, without the lock */
+int journal_covers( FAT_JOURNAL* journal, SECTOR sector, UINT32 count )
+{
+	if( __atomic_load_n( &journal->blocks, __ATOMIC_ACQUIRE ) == 0 )
+		return 0;
+
+	return ( sector <= __atomic_load_n( &journal->highest, __ATOMIC_RELAXED ) &&
+			 sector + count > __atomic_load_n( &journal->lowest, __ATOMIC_RELAXED ) );
+}
+
+/* a block turned dirty; the overlay lock is held exclusively */
+void mark_journal_block( FAT_JOURNAL* journal, JOURNAL_BLOCK* block )
+{
+	if( block->dirty )
+		return;
+
+	block->dirty = 1;
+	__atomic_add_fetch( &journal->dirtyBlocks, 1, __ATOMIC_RELAXED );
+}
+
+/* blocks picked by dirty or logged, in sector order */
+JOURNAL_BLOCK** collect_journal_blocks( FAT_JOURNAL* journal, int logged, UINT32* count )
+{
+	JOURNAL_BLOCK**	list;
+	JOURNAL_BLOCK*	block;
+	UINT32			i, j, n = 0;
+
+	list = ( JOURNAL_BLOCK** )malloc( ( journal->blocks + 1 ) * sizeof( JOURNAL_BLOCK* ) );
+	if( list == NULL )
+		return NULL;
+
+	for( i = 0; i < JOURNAL_BUCKETS; i++ )
+	{
+		for( block = journal->buckets[i]; block; block = block->next )
+		{
+			if( logged ? block->logged : block->dirty )
+				list[n++] = block;
+		}
+	}
+
+	/* insertion sort; a bucket walk is already close to sector order */
+	for( i = 1; i < n; i++ )
+	{
+		block = list[i];
+		for( j = i; j > 0 && list[j - 1]->sector > block->sector; j-- )
+			list[j] = list[j - 1];
+		list[j] = block;
+	}
+
+	*count = n;
+	return list;
+}
+
+/******************************************************************************/
+/* Disk reading through the overlay                                           */
+/******************************************************************************/
+int journal_disk_read_sectors( DISK_OPERATIONS* disk, SECTOR sector, UINT32 count, void* data )
+{
+	FAT_JOURNAL*	journal = ( FAT_JOURNAL* )disk->pdata;
+	JOURNAL_BLOCK*	block;
+	UINT32			i, runStart;
+	int				result = 0;
+
+	if( !journal_covers( journal, sector, count ) )
+		return disk_read_sectors( journal->base, sector, count, data );
+
+	/* sectors in the overlay are copied, the runs between them read in one
+	   request each; a checkpoint can't move a block home meanwhile */
+	pthread_rwlock_rdlock( &journal->lock );
+	for( runStart = 0, i = 0; result == 0 && i <= count; i++ )
+	{
+		block = ( i < count ? find_journal_block( journal, sector + i ) : NULL );
+		if( i < count && block == NULL )
+			continue;
+
+		if( i > runStart )
+			result = disk_read_sectors( journal->base, sector + runStart, i - runStart, ( BYTE* )data + runStart * disk->bytesPerSector );
+		runStart = i + 1;
+
+		if( block )
+			memcpy( ( BYTE* )data + i * disk->bytesPerSector, block->data, disk->bytesPerSector );
+	}
+	pthread_rwlock_unlock( &journal->lock );
+
+	return result;
+}
+
+/* sectors in the overlay are updated there, the others written in place */
+int journal_disk_write_sectors( DISK_OPERATIONS* disk, SECTOR sector, UINT32 count, const void* data )
+{
+	FAT_JOURNAL*	journal = ( FAT_JOURNAL* )disk->pdata;
+	JOURNAL_BLOCK*	block;
+	UINT32			i, runStart;
+	int				result = 0;
+
+	if( !journal_covers( journal, sector, count ) )
+		return disk_write_sectors( journal->base, sector, count, data );
+
+	pthread_rwlock_wrlock( &journal->lock );
+	for( runStart = 0, i = 0; result == 0 && i <= count; i++ )
+	{
+		block = ( i < count ? find_journal_block( journal, sector + i ) : NULL );
+		if( i < count && block == NULL )
+			continue;
+
+		if( i > runStart )
+			result = disk_write_sectors( journal->base, sector + runStart, i - runStart, ( const BYTE* )data + runStart * disk->bytesPerSector );
+		runStart = i + 1;
+
+		if( block )
+		{
+			memcpy( block->data, ( const BYTE* )data + i * disk->bytesPerSector, disk->bytesPerSector );
+			mark_journal_block( journal, block );
+		}
+	}
+	pthread_rwlock_unlock( &journal->lock );
+
+	return result;
+}
+
+int journal_disk_read_sector( DISK_OPERATIONS* disk, SECTOR sector, void* data )
+{
+	return journal_disk_read_sectors( disk, sector, 1, data );
+}
+
+int journal_disk_write_sector( DISK_OPERATIONS* disk, SECTOR sector, const void* data )
+{
+	return journal_disk_write_sectors( disk, sector, 1, data );
+}
+
+int journal_disk_discard_sectors( DISK_OPERATIONS* disk, SECTOR sector, UINT32 count )
+{
+	return disk_discard_sectors( ( ( FAT_JOURNAL* )disk->pdata )->base, sector, count );
+}
+
+/* a FAT or directory sector update, kept in the overlay until it is committed */
+int journal_write_sector( FAT_FILESYSTEM* fs, SECTOR sector, const BYTE* data )
+{
+	FAT_JOURNAL*	journal = fs->journal;
+	JOURNAL_BLOCK*	block;
+
+	if( journal == NULL )
+		return fs->disk->write_sector( fs->disk, sector, data );
+
+	pthread_rwlock_wrlock( &journal->lock );
+	block = get_journal_block( journal, sector );
+	if( block )
+	{
+		memcpy( block->data, data, journal->base->bytesPerSector );
+		mark_journal_block( journal, block );
+	}
+	pthread_rwlock_unlock( &journal->lock );
+
+	return ( block ? 0 : -1 );
+}
+
+/******************************************************************************/
+/* Commit and checkpoint                                                      */
+/******************************************************************************/
+int write_journal_header( FAT_JOURNAL* journal )
+{
+	BYTE	sector[MAX_SECTOR_SIZE];
+
+	ZeroMemory( sector, sizeof( sector ) );
+	journal->header.sequence = journal->sequence;
+	memcpy( sector, &journal->header, sizeof( JOURNAL_HEADER ) );
+
+	return journal->base->write_sector( journal->base, journal->headerSector, sector );
+}
+
+/* write blocks sorted by sector home, contiguous ones in one request */
+int write_journal_blocks( FAT_JOURNAL* journal, JOURNAL_BLOCK** list, UINT32 count, int committed )
+{
+	UINT32	bytesPerSector = journal->base->bytesPerSector;
+	UINT32	i, runStart;
+	int		result = 0;
+
+	for( runStart = 0, i = 0; result == 0 && i < count; i++ )
+	{
+		memcpy( journal->buffer + ( i - runStart ) * bytesPerSector, ( committed ? list[i]->committed : list[i]->data ), bytesPerSector );
+
+		if( i + 1 == count || list[i + 1]->sector != list[i]->sector + 1 || i + 1 - runStart == journal->bufferSectors )
+		{
+			result = disk_write_sectors( journal->base, list[runStart]->sector, i + 1 - runStart, journal->buffer );
+			runStart = i + 1;
+		}
+	}
+
+	return result;
+}
+
+/* Write the committed images home, then move the log start past them. No
+   operation may be running. */
+int checkpoint_journal( FAT_JOURNAL* journal )
+{
+	JOURNAL_BLOCK**	list;
+	UINT32			count;
+	int				result;
+
+	pthread_rwlock_rdlock( &journal->lock );
+	list = collect_journal_blocks( journal, 1, &count );
+	pthread_rwlock_unlock( &journal->lock );
+	if( list == NULL )
+		return -1;
+
+	result = write_journal_blocks( journal, list, count, 1 );
+	free( list );
+
+	if( result == 0 && count )
+	{
+		journal->stats.checkpoints++;
+		journal->stats.homeSectors += count;
+	}
+
+	/* once the header moves on, nothing in the log is replayed */
+	if( result == 0 && journal->head )
+		result = write_journal_header( journal );
+
+	if( result == 0 )
+	{
+		__atomic_store_n( &journal->head, 0, __ATOMIC_RELAXED );
+		pthread_rwlock_wrlock( &journal->lock );
+		trim_journal_blocks( journal );
+		pthread_rwlock_unlock( &journal->lock );
+	}
+
+	return result;
+}
+
+/* one transaction of count blocks at the log head, in a single request */
+int write_journal_transaction( FAT_JOURNAL* journal, JOURNAL_BLOCK** list, UINT32 count )
+{
+	JOURNAL_DESCRIPTOR*	descriptor = ( JOURNAL_DESCRIPTOR* )journal->buffer;
+	DWORD*				homes = ( DWORD* )( descriptor + 1 );
+	UINT32				bytesPerSector = journal->base->bytesPerSector;
+	UINT32				descriptorSectors = journal_descriptor_sectors( journal, count );
+	BYTE*				images = journal->buffer + descriptorSectors * bytesPerSector;
+	UINT32				i;
+
+	if( journal->head + descriptorSectors + count > journal->header.logSectors )
+	{
+		if( checkpoint_journal( journal ) )
+			return -1;
+	}
+
+	ZeroMemory( journal->buffer, descriptorSectors * bytesPerSector );
+	for( i = 0; i < count; i++ )
+	{
+		homes[i] = list[i]->sector;
+		memcpy( images + i * bytesPerSector, list[i]->data, bytesPerSector );
+	}
+
+	descriptor->magic		= JOURNAL_MAGIC;
+	descriptor->journalID	= journal->header.journalID;
+	descriptor->sequence	= journal->sequence;
+	descriptor->count		= count;
+	descriptor->checksum	= journal_checksum( journal_checksum( 2166136261u, ( BYTE* )homes, count * sizeof( DWORD ) ), images, count * bytesPerSector );
+
+	if( disk_write_sectors( journal->base, journal->header.logStart + journal->head, descriptorSectors + count, journal->buffer ) )
+		return -1;
+
+	pthread_rwlock_wrlock( &journal->lock );
+	for( i = 0; i < count; i++ )
+	{
+		memcpy( list[i]->committed, images + i * bytesPerSector, bytesPerSector );
+		list[i]->logged	= 1;
+		list[i]->dirty	= 0;
+	}
+	__atomic_sub_fetch( &journal->dirtyBlocks, count, __ATOMIC_RELAXED );
+	pthread_rwlock_unlock( &journal->lock );
+
+	__atomic_store_n( &journal->head, journal->head + descriptorSectors + count, __ATOMIC_RELAXED );
+	journal->sequence++;
+	journal->stats.transactions++;
+	journal->stats.journalSectors += descriptorSectors + count;
+
+	return 0;
+}
+
+/* the runs freed by the operations committed now go to the allocator */
+void release_freed_runs( FAT_JOURNAL* journal )
+{
+	CLUSTER_LIST			freed;
+	CLUSTER_LIST_ELEMENT*	entry;
+	UINT32					i, end;
+
+	pthread_mutex_lock( &journal->gateLock );
+	freed = journal->freed;
+	init_cluster_list( &journal->freed );
+	pthread_mutex_unlock( &journal->gateLock );
+
+	for( entry = freed.first; entry; entry = entry->next )
+	{
+		i	= ( entry == freed.first ? freed.popOffset : 0 );
+		end	= ( entry == freed.last ? freed.pushOffset : RUNS_PER_ELEMENT );
+
+		for( ; i < end; i++ )
+		{
+			if( entry->runs[i].count )
+				release_cluster_run( journal->fs, entry->runs[i].first, entry->runs[i].count );
+		}
+	}
+
+	release_cluster_list( &freed );
+}
+
+/* Commit every dirty block. No operation may be running, so no block changes
+   underneath; readers go on through the overlay. A change set larger than the
+   whole log is split over several transactions. */
+int commit_journal( FAT_JOURNAL* journal )
+{
+	JOURNAL_BLOCK**	list;
+	UINT32			count, done, chunk, maxChunk;
+	int				result = 0;
+
+	if( __atomic_load_n( &journal->dirtyBlocks, __ATOMIC_RELAXED ) == 0 )
+	{
+		release_freed_runs( journal );
+		return 0;
+	}
+
+	pthread_rwlock_rdlock( &journal->lock );
+	list = collect_journal_blocks( journal, 0, &count );
+	pthread_rwlock_unlock( &journal->lock );
+	if( list == NULL )
+		return -1;
+
+	maxChunk = journal->header.logSectors - journal_descriptor_sectors( journal, journal->header.logSectors );
+
+	for( done = 0; result == 0 && done < count; done += chunk )
+	{
+		chunk = ( count - done < maxChunk ? count - done : maxChunk );
+		result = write_journal_transaction( journal, list + done, chunk );
+	}
+	free( list );
+
+	if( result == 0 )
+	{
+		pthread_mutex_lock( &journal->gateLock );
+		journal->stats.operations += journal->pendingOps;
+		journal->pendingOps = 0;
+		pthread_mutex_unlock( &journal->gateLock );
+		release_freed_runs( journal );
+	}
+
+	return result;
+}
+
+/* wait until no operation runs and keep new ones out; the caller is in none */
+void close_journal_gate( FAT_JOURNAL* journal )
+{
+	pthread_mutex_lock( &journal->gateLock );
+	while( journal->committing )
+		pthread_cond_wait( &journal->gate, &journal->gateLock );
+	journal->committing = 1;
+	while( journal->active )
+		pthread_cond_wait( &journal->gate, &journal->gateLock );
+	pthread_mutex_unlock( &journal->gateLock );
+}
+
+void open_journal_gate( FAT_JOURNAL* journal )
+{
+	pthread_mutex_lock( &journal->gateLock );
+	journal->committing = 0;
+	pthread_cond_broadcast( &journal->gate );
+	pthread_mutex_unlock( &journal->gateLock );
+}
+
+/******************************************************************************/
+/* Operations                                                                 */
+/******************************************************************************/
+/* Every operation that changes metadata runs between journal_begin() and
+   journal_end(); nested calls of the same thread count as one operation. */
+void journal_begin( FAT_FILESYSTEM* fs )
+{
+	FAT_JOURNAL*	journal = fs->journal;
+	size_t			depth;
+
+	if( journal == NULL )
+		return;
+
+	depth = ( size_t )pthread_getspecific( journal->depthKey );
+	if( depth == 0 )
+	{
+		pthread_mutex_lock( &journal->gateLock );
+		while( journal->committing )
+			pthread_cond_wait( &journal->gate, &journal->gateLock );
+		journal->active++;
+		pthread_mutex_unlock( &journal->gateLock );
+	}
+	pthread_setspecific( journal->depthKey, ( void* )( depth + 1 ) );
+}
+
+/* whether the finished operations make a group worth committing; the
+   caller holds gateLock */
+int journal_group_full( FAT_JOURNAL* journal )
+{
+	return ( journal->batches == 0 && ( __atomic_load_n( &journal->dirtyBlocks, __ATOMIC_RELAXED ) >= FAT_JOURNAL_GROUP_SECTORS ||
+										journal->pendingOps >= FAT_JOURNAL_GROUP_OPS ) );
+}
+
+/* A run an operation frees; the clusters stay taken until its transaction is
+   committed, a crash before that gives them back to their chain. */
+int journal_free_run( FAT_FILESYSTEM* fs, SECTOR first, UINT32 count )
+{
+	FAT_JOURNAL*	journal = fs->journal;
+	int				result;
+
+	pthread_mutex_lock( &journal->gateLock );
+	result = push_cluster_run( &journal->freed, first, count );
+	pthread_mutex_unlock( &journal->gateLock );
+
+	return result;
+}
+
+/* the operation that fills a group commits it, as does one that leaves more
+   clusters waiting for the commit than there are free */
+void journal_end( FAT_FILESYSTEM* fs )
+{
+	FAT_JOURNAL*	journal = fs->journal;
+	size_t			depth;
+	UINT32			freed;
+	int				full;
+
+	if( journal == NULL )
+		return;
+
+	depth = ( size_t )pthread_getspecific( journal->depthKey ) - 1;
+	pthread_setspecific( journal->depthKey, ( void* )depth );
+	if( depth )
+		return;
+
+	pthread_mutex_lock( &journal->gateLock );
+	journal->active--;
+	journal->pendingOps++;
+	full = journal_group_full( journal );
+	freed = ( journal->batches == 0 ? journal->freed.count : 0 );
+	if( journal->active == 0 )
+		pthread_cond_broadcast( &journal->gate );
+	pthread_mutex_unlock( &journal->gateLock );
+
+	if( !full && freed )
+		full = ( count_free_clusters( fs ) < freed );
+
+	if( !full )
+		return;
+
+	close_journal_gate( journal );
+	/* another thread may have committed the group while this one waited */
+	pthread_mutex_lock( &journal->gateLock );
+	full = ( journal_group_full( journal ) || ( journal->batches == 0 && journal->freed.count ) );
+	pthread_mutex_unlock( &journal->gateLock );
+	if( full )
+		commit_journal( journal );
+	open_journal_gate( journal );
+
+	// log가 차서 이 thread가 checkpoint하기 전에
+	if( journal->header.logSectors && ( QWORD )__atomic_load_n( &journal->head, __ATOMIC_RELAXED ) * 100 >= ( QWORD )journal->header.logSectors * FAT_FLUSHER_DIRTY_RATIO )
+		flusher_kick( fs );
+}
+
+/* commit what the finished operations changed and write it all home */
+int journal_checkpoint( FAT_FILESYSTEM* fs )
+{
+	FAT_JOURNAL*	journal = fs->journal;
+	int				result;
+
+	if( journal == NULL )
+		return FAT_SUCCESS;
+
+	close_journal_gate( journal );
+	result = commit_journal( journal );
+	if( result == 0 )
+		result = checkpoint_journal( journal );
+	open_journal_gate( journal );
+
+	return ( result ? FAT_ERROR : FAT_SUCCESS );
+}
+
+/* For the flusher: the sectors not home yet and how full the log is, in
+   percent. Fails while a batch is open, its sectors stay where they are. */
+int journal_backlog( FAT_FILESYSTEM* fs, UINT32* sectors, UINT32* percent )
+{
+	FAT_JOURNAL*	journal = fs->journal;
+	UINT32			batches;
+
+	*sectors = 0;
+	*percent = 0;
+	if( journal == NULL )
+		return FAT_SUCCESS;
+
+	pthread_mutex_lock( &journal->gateLock );
+	batches = journal->batches;
+	pthread_mutex_unlock( &journal->gateLock );
+	if( batches )
+		return FAT_ERROR;
+
+	*sectors = __atomic_load_n( &journal->blocks, __ATOMIC_RELAXED );
+	if( journal->header.logSectors )
+		*percent = ( UINT32 )( ( QWORD )__atomic_load_n( &journal->head, __ATOMIC_RELAXED ) * 100 / journal->header.logSectors );
+
+	return FAT_SUCCESS;
+}
+
+/* journal_checkpoint() of the flusher, which skips it when a batch opened
+   in the meantime */
+int journal_background_checkpoint( FAT_FILESYSTEM* fs )
+{
+	FAT_JOURNAL*	journal = fs->journal;
+	UINT32			batches;
+	int				result = 0;
+
+	if( journal == NULL )
+		return FAT_SUCCESS;
+
+	close_journal_gate( journal );
+	pthread_mutex_lock( &journal->gateLock );
+	batches = journal->batches;
+	pthread_mutex_unlock( &journal->gateLock );
+	if( batches == 0 )
+	{
+		result = commit_journal( journal );
+		if( result == 0 )
+			result = checkpoint_journal( journal );
+	}
+	open_journal_gate( journal );
+
+	return ( result ? FAT_ERROR : FAT_SUCCESS );
+}
+
+/******************************************************************************/
+/* Mount                                                                      */
+/******************************************************************************/
+/* Load the transactions found in order from the log start into the overlay;
+   the first one that doesn't follow or doesn't match its checksum ends it. */
+UINT32 replay_journal( FAT_JOURNAL* journal )
+{
+	JOURNAL_DESCRIPTOR*	descriptor = ( JOURNAL_DESCRIPTOR* )journal->buffer;
+	DWORD*				homes = ( DWORD* )( descriptor + 1 );
+	UINT32				bytesPerSector = journal->base->bytesPerSector;
+	UINT32				descriptorSectors, i, replayed = 0;
+	BYTE*				images;
+	JOURNAL_BLOCK*		block;
+
+	while( journal->head < journal->header.logSectors )
+	{
+		if( journal->base->read_sector( journal->base, journal->header.logStart + journal->head, journal->buffer ) )
+			break;
+
+		if( descriptor->magic != JOURNAL_MAGIC || descriptor->journalID != journal->header.journalID ||
+			descriptor->sequence != journal->sequence || descriptor->count == 0 ||
+			descriptor->count > journal->header.logSectors )
+			break;
+
+		descriptorSectors = journal_descriptor_sectors( journal, descriptor->count );
+		if( journal->head + descriptorSectors + descriptor->count > journal->header.logSectors )
+			break;
+
+		if( disk_read_sectors( journal->base, journal->header.logStart + journal->head, descriptorSectors + descriptor->count, journal->buffer ) )
+			break;
+
+		images = journal->buffer + descriptorSectors * bytesPerSector;
+		if( descriptor->checksum != journal_checksum( journal_checksum( 2166136261u, ( BYTE* )homes, descriptor->count * sizeof( DWORD ) ), images, descriptor->count * bytesPerSector ) )
+			break;
+
+		for( i = 0; i < descriptor->count; i++ )
+		{
+			if( homes[i] >= journal->header.logStart && homes[i] <= journal->headerSector )
+				continue;
+			if( homes[i] >= journal->base->numberOfSectors )
+				continue;
+
+			block = get_journal_block( journal, homes[i] );
+			if( block == NULL )
+				return replayed;
+			memcpy( block->data, images + i * bytesPerSector, bytesPerSector );
+			memcpy( block->committed, block->data, bytesPerSector );
+			block->logged = 1;
+		}
+
+		journal->head += descriptorSectors + descriptor->count;
+		journal->sequence++;
+		replayed++;
+	}
+
+	return replayed;
+}
+
+/* the overlay and its disk in front of fs->disk */
+FAT_JOURNAL* create_journal( FAT_FILESYSTEM* fs, const JOURNAL_HEADER* header, SECTOR headerSector )
+{
+	FAT_JOURNAL*	journal;
+
+	journal = ( FAT_JOURNAL* )calloc( 1, sizeof( FAT_JOURNAL ) );
+	if( journal == NULL )
+		return NULL;
+
+	journal->bufferSectors = header->logSectors;
+	journal->buffer = ( BYTE* )malloc( journal->bufferSectors * fs->disk->bytesPerSector );
+	if( journal->buffer == NULL || pthread_key_create( &journal->depthKey, NULL ) )
+	{
+		free( journal->buffer );
+		free( journal );
+		return NULL;
+	}
+
+	memcpy( &journal->header, header, sizeof( JOURNAL_HEADER ) );
+	journal->headerSector	= headerSector;
+	journal->sequence		= header->sequence;
+	journal->base = fs->disk;
+	journal->fs = fs;
+	init_cluster_list( &journal->freed );
+	pthread_rwlock_init( &journal->lock, NULL );
+	pthread_mutex_init( &journal->gateLock, NULL );
+	pthread_cond_init( &journal->gate, NULL );
+
+	journal->disk.read_sector		= journal_disk_read_sector;
+	journal->disk.write_sector		= journal_disk_write_sector;
+	journal->disk.read_sectors		= journal_disk_read_sectors;
+	journal->disk.write_sectors		= journal_disk_write_sectors;
+	journal->disk.discard_sectors	= ( fs->disk->discard_sectors ? journal_disk_discard_sectors : NULL );
+	journal->disk.numberOfSectors	= fs->disk->numberOfSectors;
+	journal->disk.bytesPerSector	= fs->disk->bytesPerSector;
+	journal->disk.pdata				= journal;
+	/* queued reads must see the overlay too; the pool runs them through it */
+	journal->disk.async				= fs->disk->async;
+
+	journal->stats.logSectors = journal->header.logSectors;
+
+	return journal;
+}
+
+/* Find the journal of a volume formatted with one, replay what its log holds
+   and put the overlay disk in front of fs->disk. A volume without a journal
+   mounts as before. Read only mounts keep the replayed sectors in memory. */
+int journal_mount( FAT_FILESYSTEM* fs )
+{
+	BYTE			sector[MAX_SECTOR_SIZE];
+	FAT_JOURNAL*	journal;
+	JOURNAL_HEADER*	header = ( JOURNAL_HEADER* )sector;
+	SECTOR			headerSector = fs->bpb.reservedSectorCount - 1;
+
+	fs->journal = NULL;
+	if( fs->bpb.reservedSectorCount < 2 || fs->disk->read_sector( fs->disk, headerSector, sector ) )
+		return FAT_SUCCESS;
+
+	if( memcmp( header->signature, JOURNAL_SIGNATURE, 8 ) != 0 )
+		return FAT_SUCCESS;
+
+	if( header->logSectors < 2 || header->logStart == 0 || header->logStart + header->logSectors != headerSector )
+	{
+		WARNING( "journal header is broken\n" );
+		return FAT_ERROR;
+	}
+
+	journal = create_journal( fs, header, headerSector );
+	if( journal == NULL )
+		return FAT_ERROR;
+
+	journal->stats.replayed = replay_journal( journal );
+	if( journal->stats.replayed )
+		PRINTF( "journal : %u transactions replayed\n", journal->stats.replayed );
+
+	fs->journal	= journal;
+	fs->disk	= &journal->disk;
+
+	if( !( fs->mountFlags & FAT_MOUNT_READ_ONLY ) && checkpoint_journal( journal ) )
+	{
+		journal_release( fs );
+		return FAT_ERROR;
+	}
+
+	return FAT_SUCCESS;
+}
+
+/* the overlay is dropped as it is; fat_sync() has written it home before */
+void journal_release( FAT_FILESYSTEM* fs )
+{
+	FAT_JOURNAL*	journal = fs->journal;
+	JOURNAL_BLOCK*	block;
+	UINT32			i;
+
+	if( journal == NULL )
+		return;
+
+	for( i = 0; i < JOURNAL_BUCKETS; i++ )
+	{
+		while( ( block = journal->buckets[i] ) != NULL )
+		{
+			journal->buckets[i] = block->next;
+			free( block );
+		}
+	}
+
+	/* runs still held belong to a commit that failed; they are not free on
+	   disk and stay unused until the next mount */
+	release_cluster_list( &journal->freed );
+
+	fs->disk	= journal->base;
+	fs->journal	= NULL;
+
+	pthread_key_delete( journal->depthKey );
+	pthread_cond_destroy( &journal->gate );
+	pthread_mutex_destroy( &journal->gateLock );
+	pthread_rwlock_destroy( &journal->lock );
+	free( journal->buffer );
+	free( journal );
+}
+
+/******************************************************************************/
+/* Batches                                                                    */
+/******************************************************************************/
+/* Until the matching fat_commit_batch() no FAT or directory sector is written:
+   every change stays in the overlay, however often the same sector changes.
+   Only a journaled volume has the overlay; a volume without one writes every
+   update in place, with no point at which other threads' operations could be
+   held off, and can't open a batch. Clusters freed in a batch are reused only
+   after it commits. Batches nest; the outermost commit writes. */
+int fat_begin_batch( FAT_FILESYSTEM* fs )
+{
+	if( fs->journal == NULL || ( fs->mountFlags & FAT_MOUNT_READ_ONLY ) )
+		return FAT_ERROR;
+
+	pthread_mutex_lock( &fs->journal->gateLock );
+	fs->journal->batches++;
+	pthread_mutex_unlock( &fs->journal->gateLock );
+
+	return FAT_SUCCESS;
+}
+
+/* Every sector the batch changed goes out once, as one transaction through
+   the journal when the log holds it. */
+int fat_commit_batch( FAT_FILESYSTEM* fs )
+{
+	FAT_JOURNAL*	journal = fs->journal;
+	UINT32			batches;
+	int				result;
+
+	if( journal == NULL )
+		return FAT_ERROR;
+
+	pthread_mutex_lock( &journal->gateLock );
+	batches = journal->batches;
+	if( batches )
+		journal->batches--;
+	pthread_mutex_unlock( &journal->gateLock );
+	if( batches != 1 )
+		return ( batches ? FAT_SUCCESS : FAT_ERROR );
+
+	close_journal_gate( journal );
+	result = commit_journal( journal );
+	open_journal_gate( journal );
+
+	return ( result ? FAT_ERROR : FAT_SUCCESS );
+}
+
+int fat_journal_stats( FAT_FILESYSTEM* fs, FAT_JOURNAL_STATS* stats )
+{
+	FAT_JOURNAL*	journal = fs->journal;
+
+	if( journal == NULL )
+		return FAT_ERROR;
+
+	/* commits and checkpoints update the counters with the gate closed */
+	close_journal_gate( journal );
+	*stats = journal->stats;
+	stats->overlaySectors = journal->blocks;
+	open_journal_gate( journal );
+
+	return FAT_SUCCESS;
+}
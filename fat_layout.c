@@ -0,0 +1,284 @@
+/******************************************************************************/
+/*                                                                            */
+/* Project : FAT12/16 File System                                             */
+/* File    : fat_layout.c                                                     */
+/* Author  : Kyoungmoon Sun(msg2me@msn.com)                                   */
+/* Company : Dankook Univ. Embedded System Lab.                               */
+/* Notes   : Fragmentation and layout statistics                              */
+/* Date    : 2008/7/2                                                         */
+/*                                                                            */
+/******************************************************************************/
+
+#include "fat.h"
+
+/* FAT sectors read by one multi-sector request */
+#define LAYOUT_READ_SECTORS		64
+/* deeper trees are taken for a directory cycle */
+#define LAYOUT_MAX_DEPTH		256
+
+typedef struct
+{
+	FAT_FILESYSTEM*		fs;
+	FAT_LAYOUT_STATS*	stats;
+	BYTE*				table;		// active FAT 전체 사본
+} FAT_LAYOUT_CONTEXT;
+
+/* index of the power of two bucket holding value: [2^i, 2^(i+1)) */
+UINT32 layout_bucket( UINT32 value )
+{
+	UINT32	bucket = 0;
+
+	while( value >>= 1 )
+		bucket++;
+
+	return ( bucket < FAT_LAYOUT_BUCKETS ? bucket : FAT_LAYOUT_BUCKETS - 1 );
+}
+
+DWORD layout_next_cluster( FAT_LAYOUT_CONTEXT* context, SECTOR cluster )
+{
+	DWORD	fatOffset;
+
+	switch( context->fs->FATType )
+	{
+	case FAT32:
+		fatOffset = cluster * 4;
+		break;
+	case FAT16:
+		fatOffset = cluster * 2;
+		break;
+	default:
+		fatOffset = cluster + ( cluster / 2 );
+		break;
+	}
+
+	return decode_fat_entry( context->fs, cluster, context->table, fatOffset );
+}
+
+void add_free_extent( FAT_LAYOUT_STATS* stats, UINT32 length )
+{
+	if( length == 0 )
+		return;
+
+	stats->freeExtents++;
+	stats->freeExtentHistogram[layout_bucket( length )]++;
+	if( length > stats->largestFreeRun )
+		stats->largestFreeRun = length;
+}
+
+/* Read the active FAT once, front to back, keeping a copy for the chain walks
+   and collecting the free extents on the way */
+int scan_fat( FAT_LAYOUT_CONTEXT* context )
+{
+	FAT_FILESYSTEM*		fs = context->fs;
+	FAT_LAYOUT_STATS*	stats = context->stats;
+	SECTOR				base = fs->bpb.reservedSectorCount + fs->activeFAT * fs->FATSize;
+	UINT32				done, count, run = 0;
+	SECTOR				cluster;
+
+	/* one spare sector so a FAT12 entry at the very end can be decoded */
+	context->table = ( BYTE* )calloc( fs->FATSize + 1, fs->bpb.bytesPerSector );
+	if( context->table == NULL )
+		return FAT_ERROR;
+
+	for( done = 0; done < fs->FATSize; done += count )
+	{
+		count = fs->FATSize - done;
+		if( count > LAYOUT_READ_SECTORS )
+			count = LAYOUT_READ_SECTORS;
+
+		if( disk_read_sectors( fs->disk, base + done, count, &context->table[done * fs->bpb.bytesPerSector] ) )
+			return FAT_ERROR;
+	}
+
+	stats->totalClusters = fs->countOfClusters;
+
+	for( cluster = 2; cluster < fs->countOfClusters + 2; cluster++ )
+	{
+		if( layout_next_cluster( context, cluster ) == FREE_CLUSTER )
+		{
+			stats->freeClusters++;
+			run++;
+		}
+		else
+		{
+			add_free_extent( stats, run );
+			run = 0;
+		}
+	}
+	add_free_extent( stats, run );
+
+	return FAT_SUCCESS;
+}
+
+/* extents of one chain, walked in the in-memory FAT */
+void add_chain( FAT_LAYOUT_CONTEXT* context, DWORD firstCluster )
+{
+	FAT_FILESYSTEM*		fs = context->fs;
+	FAT_LAYOUT_STATS*	stats = context->stats;
+	UINT32				clusters = 0, extents = 0;
+	DWORD				cluster = firstCluster, next;
+
+	if( firstCluster < 2 || firstCluster >= fs->countOfClusters + 2 )
+		return;
+
+	while( clusters < fs->countOfClusters )
+	{
+		clusters++;
+
+		next = layout_next_cluster( context, cluster );
+		if( is_EOC( fs->FATType, next ) || next < 2 || next >= fs->countOfClusters + 2 )
+			break;
+
+		stats->links++;
+		if( next == cluster + 1 )
+			stats->contiguousLinks++;
+		else
+			extents++;
+
+		cluster = next;
+	}
+	extents++;
+
+	stats->chainClusters += clusters;
+	stats->chainExtents += extents;
+	stats->extentHistogram[layout_bucket( extents )]++;
+	if( extents > 1 )
+		stats->fragmentedChains++;
+	if( extents > stats->maxExtents )
+		stats->maxExtents = extents;
+}
+
+/* tombstone share of one directory, in percent */
+void add_directory( FAT_LAYOUT_STATS* stats, UINT32 live, UINT32 tombstones )
+{
+	UINT32	percent;
+
+	stats->directories++;
+	stats->liveEntries += live;
+	stats->tombstones += tombstones;
+
+	if( live + tombstones == 0 )
+		return;
+
+	percent = tombstones * 100 / ( live + tombstones );
+	if( percent > stats->worstTombstonePercent )
+		stats->worstTombstonePercent = percent;
+	if( percent >= 50 )
+		stats->sparseDirectories++;
+}
+
+int scan_directory( FAT_LAYOUT_CONTEXT* context, DWORD firstCluster, UINT32 depth );
+
+/* Returns non-zero at the end-of-directory mark. Sub directories are
+   descended as soon as they are met, so every directory sector is read once. */
+int scan_directory_sector( FAT_LAYOUT_CONTEXT* context, const BYTE* sector, UINT32 depth, UINT32* live, UINT32* tombstones )
+{
+	const FAT_DIR_ENTRY*	entry = ( const FAT_DIR_ENTRY* )sector;
+	UINT32					i, entriesPerSector = context->fs->bpb.bytesPerSector / sizeof( FAT_DIR_ENTRY );
+
+	for( i = 0; i < entriesPerSector; i++, entry++ )
+	{
+		if( entry->name[0] == DIR_ENTRY_NO_MORE )
+			return 1;
+
+		if( entry->name[0] == DIR_ENTRY_FREE )
+		{
+			( *tombstones )++;
+			continue;
+		}
+
+		if( entry->attribute & ATTR_VOLUME_ID )
+			continue;
+
+		( *live )++;
+		if( entry->name[0] == '.' )
+			continue;
+
+		add_chain( context, GET_FIRST_CLUSTER( *entry ) );
+
+		if( entry->attribute & ATTR_DIRECTORY )
+			scan_directory( context, GET_FIRST_CLUSTER( *entry ), depth + 1 );
+		else
+			context->stats->files++;
+	}
+
+	return 0;
+}
+
+/* firstCluster 0 is the fixed root region of FAT12/16 */
+int scan_directory( FAT_LAYOUT_CONTEXT* context, DWORD firstCluster, UINT32 depth )
+{
+	FAT_FILESYSTEM*	fs = context->fs;
+	BYTE			sector[MAX_SECTOR_SIZE];
+	UINT32			live = 0, tombstones = 0, i, rootSectors, clusters = 0;
+	DWORD			cluster = firstCluster;
+	int				end = 0;
+
+	if( depth > LAYOUT_MAX_DEPTH )
+		return FAT_ERROR;
+
+	if( firstCluster == 0 )
+	{
+		rootSectors = ( fs->bpb.rootEntryCount * sizeof( FAT_DIR_ENTRY ) + fs->bpb.bytesPerSector - 1 ) / fs->bpb.bytesPerSector;
+		for( i = 0; i < rootSectors && !end; i++ )
+		{
+			if( read_root_sector( fs, i, sector ) )
+				return FAT_ERROR;
+			end = scan_directory_sector( context, sector, depth, &live, &tombstones );
+		}
+	}
+	else
+	{
+		while( !end && cluster >= 2 && cluster < fs->countOfClusters + 2 && clusters++ < fs->countOfClusters )
+		{
+			for( i = 0; i < fs->bpb.sectorsPerCluster && !end; i++ )
+			{
+				if( read_data_sector( fs, cluster, i, sector ) )
+					return FAT_ERROR;
+				end = scan_directory_sector( context, sector, depth, &live, &tombstones );
+			}
+
+			cluster = layout_next_cluster( context, cluster );
+		}
+	}
+
+	add_directory( context->stats, live, tombstones );
+
+	return FAT_SUCCESS;
+}
+
+/******************************************************************************/
+/* Collect fragmentation and layout statistics                                */
+/******************************************************************************/
+/* The active FAT is read once in large sequential requests and every directory
+   sector once, in tree order; chains are followed in the in-memory copy of the
+   FAT. Files and directories both count as chains. */
+int fat_layout_stats( FAT_NODE* root, FAT_LAYOUT_STATS* stats )
+{
+	FAT_LAYOUT_CONTEXT	context;
+	DWORD				rootCluster = GET_FIRST_CLUSTER( root->entry );
+	int					result;
+
+	ZeroMemory( stats, sizeof( FAT_LAYOUT_STATS ) );
+
+	/* buffered appends have no clusters until they are flushed */
+	if( writeback_flush_all( root->fs ) )
+		return FAT_ERROR;
+
+	context.fs		= root->fs;
+	context.stats	= stats;
+	context.table	= NULL;
+
+	result = scan_fat( &context );
+
+	if( result == FAT_SUCCESS )
+	{
+		if( rootCluster != 0 )
+			add_chain( &context, rootCluster );
+		result = scan_directory( &context, rootCluster, 0 );
+	}
+
+	free( context.table );
+
+	return result;
+}
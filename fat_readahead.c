@@ -0,0 +1,654 @@
+/******************************************************************************/
+/*                                                                            */
+/* Project : FAT12/16 File System                                             */
+/* File    : fat_readahead.c                                                  */
+/* Author  : Kyoungmoon Sun(msg2me@msn.com)                                   */
+/* Company : Dankook Univ. Embedded System Lab.                               */
+/* Notes   : Sequential readahead for file reads                              */
+/* Date    : 2008/7/2                                                         */
+/*                                                                            */
+/******************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include "fat.h"
+
+/*
+   Small reads (the shell's cat reads 1 KiB at a time) are served from a
+   cache of whole clusters. There is no open file handle, so a file is known
+   by its first cluster: a read that starts where the last read of the same
+   file ended is sequential, and its stream fetches the next clusters of the
+   chain before they are asked for. The window starts at
+   FAT_READAHEAD_MIN_CLUSTERS and doubles each time it is topped up, until
+   FAT_READAHEAD_MAX_BYTES; a read anywhere else resets it.
+
+   When the disk can queue requests the prefetches stay in flight while the
+   reader copies what already arrived; otherwise physically contiguous
+   clusters are read in one request.
+
+   Written sectors drop their cluster from the cache, and freed clusters drop
+   theirs and every chain position the streams remember.
+*/
+
+#define READAHEAD_BUCKETS		256
+
+#define RA_READING				1		// 요청이 디스크에 있음
+#define RA_VALID				2
+
+// RA_BLOCK
+// cache에 있는 cluster 하나
+typedef struct RA_BLOCK
+{
+	SECTOR				cluster;
+	BYTE				state;		// 0 : 비어 있음, RA_READING, RA_VALID
+	BYTE				stale;		// 읽는 동안 쓰이거나 해제됨, 완료되면 버림
+	BYTE*				data;
+	DISK_REQUEST		request;
+	struct RA_BLOCK*	next;		// hash chain
+	struct RA_BLOCK*	older;		// RA_VALID는 LRU list, 비어 있으면 free list(older만)
+	struct RA_BLOCK*	newer;
+} RA_BLOCK;
+
+// RA_CURSOR
+// chain 안의 위치 하나, index번째 cluster가 cluster
+typedef struct
+{
+	DWORD	index;
+	DWORD	cluster;
+} RA_CURSOR;
+
+// RA_STREAM
+// 파일 하나의 순차 읽기
+typedef struct
+{
+	DWORD		firstCluster;	// 0이면 빈 stream
+	DWORD		nextOffset;		// 순차 읽기라면 다음 읽기가 시작할 위치
+	DWORD		window;			// 읽는 위치보다 앞서 읽어둘 cluster 수, 0이면 순차가 아님
+	DWORD		aheadIndex;		// 아직 요청하지 않은 첫 cluster index
+	RA_CURSOR	readCursor;
+	RA_CURSOR	aheadCursor;
+	DWORD		epoch;			// cursor를 만든 때의 chainEpoch
+	UINT32		lastUse;
+} RA_STREAM;
+
+typedef struct FAT_READAHEAD
+{
+	pthread_mutex_t		lock;
+	DWORD				clusterSize;
+	UINT32				blockCount;
+	UINT32				maxWindow;
+	RA_BLOCK*			blocks;
+	BYTE*				buffers;
+	BYTE*				staging;	// 동기 디스크에서 연속된 cluster를 한번에 읽는 buffer, maxWindow개
+	RA_BLOCK*			buckets[READAHEAD_BUCKETS];
+	RA_BLOCK*			freeBlocks;
+	RA_BLOCK*			oldest;		// LRU list
+	RA_BLOCK*			newest;
+	UINT32				used;		// 비어 있지 않은 block 수, lock 없이 읽음
+	volatile DWORD		chainEpoch;	// cluster가 해제될 때마다 증가
+
+	DISK_QUEUE			queue;
+	int					hasQueue;
+	UINT32				inFlight;
+
+	RA_STREAM			streams[FAT_READAHEAD_STREAMS];
+	UINT32				clock;
+
+	FAT_READAHEAD_STATS	stats;
+} FAT_READAHEAD;
+
+/******************************************************************************/
+/* Cache                                                                      */
+/******************************************************************************/
+RA_BLOCK* find_readahead_block( FAT_READAHEAD* ra, SECTOR cluster )
+{
+	RA_BLOCK*	block;
+
+	for( block = ra->buckets[cluster % READAHEAD_BUCKETS]; block; block = block->next )
+	{
+		if( block->cluster == cluster && !block->stale )
+			return block;
+	}
+
+	return NULL;
+}
+
+void unlink_readahead_lru( FAT_READAHEAD* ra, RA_BLOCK* block )
+{
+	if( block->older )
+		block->older->newer = block->newer;
+	else
+		ra->oldest = block->newer;
+
+	if( block->newer )
+		block->newer->older = block->older;
+	else
+		ra->newest = block->older;
+
+	block->older = block->newer = NULL;
+}
+
+void link_readahead_lru( FAT_READAHEAD* ra, RA_BLOCK* block )
+{
+	block->older = ra->newest;
+	block->newer = NULL;
+
+	if( ra->newest )
+		ra->newest->newer = block;
+	else
+		ra->oldest = block;
+	ra->newest = block;
+}
+
+/* take the block out of the hash and the LRU list and make it free */
+void drop_readahead_block( FAT_READAHEAD* ra, RA_BLOCK* block )
+{
+	RA_BLOCK**	link;
+
+	for( link = &ra->buckets[block->cluster % READAHEAD_BUCKETS]; *link != block; link = &( *link )->next )
+		;
+	*link = block->next;
+
+	if( block->state == RA_VALID )
+		unlink_readahead_lru( ra, block );
+
+	block->state	= 0;
+	block->stale	= 0;
+	block->older	= ra->freeBlocks;
+	ra->freeBlocks	= block;
+	ra->used--;
+}
+
+/* a free block, or the least recently used cluster; NULL while every block
+   is still being read */
+RA_BLOCK* alloc_readahead_block( FAT_READAHEAD* ra, SECTOR cluster, BYTE state )
+{
+	RA_BLOCK*	block = ra->freeBlocks;
+
+	if( block )
+		ra->freeBlocks = block->older;
+	else if( ( block = ra->oldest ) != NULL )
+	{
+		drop_readahead_block( ra, block );
+		ra->freeBlocks = block->older;
+	}
+	else
+		return NULL;
+
+	block->cluster	= cluster;
+	block->state	= state;
+	block->stale	= 0;
+	block->older	= block->newer = NULL;
+	block->next		= ra->buckets[cluster % READAHEAD_BUCKETS];
+	ra->buckets[cluster % READAHEAD_BUCKETS] = block;
+	if( state == RA_VALID )
+		link_readahead_lru( ra, block );
+	ra->used++;
+
+	return block;
+}
+
+void complete_readahead_block( FAT_READAHEAD* ra, RA_BLOCK* block, int result )
+{
+	if( result || block->stale )
+	{
+		drop_readahead_block( ra, block );
+		return;
+	}
+
+	block->state = RA_VALID;
+	link_readahead_lru( ra, block );
+}
+
+/******************************************************************************/
+/* Disk                                                                       */
+/******************************************************************************/
+/* handle finished prefetches; wait for at least one when wait is set */
+void reap_readahead( FAT_READAHEAD* ra, int wait )
+{
+	DISK_REQUEST*	completed[DISK_QUEUE_DEPTH];
+	int				count, i;
+
+	if( ra->inFlight == 0 )
+		return;
+
+	count = disk_wait( &ra->queue, completed, ( wait ? 1 : 0 ), DISK_QUEUE_DEPTH );
+	for( i = 0; i < count; i++ )
+	{
+		complete_readahead_block( ra, ( RA_BLOCK* )completed[i]->param, completed[i]->result );
+		ra->inFlight--;
+	}
+}
+
+void drain_readahead_queue( FAT_READAHEAD* ra )
+{
+	while( ra->inFlight )
+		reap_readahead( ra, 1 );
+
+	if( ra->hasQueue )
+	{
+		disk_queue_release( &ra->queue );
+		ra->hasQueue = 0;
+	}
+}
+
+/* the queue follows fs->disk, which the journal may replace */
+int get_readahead_queue( FAT_FILESYSTEM* fs, FAT_READAHEAD* ra )
+{
+	if( ra->hasQueue && ra->queue.disk != fs->disk )
+		drain_readahead_queue( ra );
+
+	if( !ra->hasQueue && ( fs->disk->queue_init || fs->disk->async ) && disk_queue_init( fs->disk, &ra->queue ) == 0 )
+		ra->hasQueue = 1;
+
+	return ra->hasQueue;
+}
+
+/* Start reading blocks, sorted by chain order. Queued, every cluster is a
+   request of its own that stays in flight; otherwise contiguous clusters are
+   read in one request and the blocks are valid on return. */
+void start_readahead( FAT_FILESYSTEM* fs, FAT_READAHEAD* ra, RA_BLOCK** list, UINT32 count )
+{
+	DISK_REQUEST*	request;
+	UINT32			sectorsPerCluster = fs->bpb.sectorsPerCluster;
+	UINT32			i, j, runStart;
+	int				result;
+
+	if( count == 0 )
+		return;
+
+	ra->stats.prefetched += count;
+
+	if( get_readahead_queue( fs, ra ) )
+	{
+		for( i = 0; i < count; i++ )
+		{
+			request			= &list[i]->request;
+			request->write	= 0;
+			request->sector	= calc_physical_sector( fs, list[i]->cluster, 0 );
+			request->count	= sectorsPerCluster;
+			request->data	= list[i]->data;
+			request->param	= list[i];
+
+			if( disk_submit( &ra->queue, &request, 1 ) )
+				break;
+			ra->inFlight++;
+			ra->stats.requests++;
+		}
+
+		// 넣지 못한 block은 버림
+		for( ; i < count; i++ )
+			drop_readahead_block( ra, list[i] );
+		return;
+	}
+
+	for( runStart = 0, i = 0; i < count; i++ )
+	{
+		if( i + 1 < count && list[i + 1]->cluster == list[i]->cluster + 1 )
+			continue;
+
+		result = disk_read_sectors( fs->disk, calc_physical_sector( fs, list[runStart]->cluster, 0 ),
+									( i + 1 - runStart ) * sectorsPerCluster, ra->staging );
+		ra->stats.requests++;
+
+		for( j = runStart; j <= i; j++ )
+		{
+			if( result == 0 )
+				memcpy( list[j]->data, ra->staging + ( j - runStart ) * ra->clusterSize, ra->clusterSize );
+			complete_readahead_block( ra, list[j], result );
+		}
+		runStart = i + 1;
+	}
+}
+
+/******************************************************************************/
+/* Streams                                                                    */
+/******************************************************************************/
+RA_STREAM* get_readahead_stream( FAT_READAHEAD* ra, DWORD firstCluster )
+{
+	RA_STREAM*	stream = &ra->streams[0];
+	UINT32		i;
+
+	for( i = 0; i < FAT_READAHEAD_STREAMS; i++ )
+	{
+		if( ra->streams[i].firstCluster == firstCluster )
+		{
+			stream = &ra->streams[i];
+			break;
+		}
+		if( ra->streams[i].lastUse < stream->lastUse )
+			stream = &ra->streams[i];
+	}
+
+	if( stream->firstCluster != firstCluster )
+	{
+		ZeroMemory( stream, sizeof( RA_STREAM ) );
+		stream->firstCluster = firstCluster;
+	}
+
+	if( stream->epoch != ra->chainEpoch )
+	{
+		stream->readCursor.index	= stream->aheadCursor.index		= 0;
+		stream->readCursor.cluster	= stream->aheadCursor.cluster	= firstCluster;
+		stream->epoch = ra->chainEpoch;
+	}
+	else if( stream->readCursor.cluster == 0 )
+	{
+		stream->readCursor.cluster = stream->aheadCursor.cluster = firstCluster;
+	}
+
+	stream->lastUse = ++ra->clock;
+
+	return stream;
+}
+
+/* the index-th cluster of the chain, walked on from cursor when it is not
+   past index; 0 when the chain ends first */
+DWORD get_stream_cluster( FAT_FILESYSTEM* fs, RA_STREAM* stream, RA_CURSOR* cursor, DWORD index )
+{
+	if( cursor->index > index )
+	{
+		cursor->index	= 0;
+		cursor->cluster	= stream->firstCluster;
+	}
+
+	while( cursor->index < index )
+	{
+		if( cursor->cluster < 2 || cursor->cluster >= fs->countOfClusters + 2 )
+			return 0;
+		cursor->cluster = get_fat( fs, cursor->cluster );
+		cursor->index++;
+	}
+
+	if( cursor->cluster < 2 || cursor->cluster >= fs->countOfClusters + 2 )
+		return 0;
+
+	return cursor->cluster;
+}
+
+/* Keep the window ahead of index: once less than half of it is left, grow
+   it and request what it newly covers in one go. */
+void issue_readahead( FAT_FILESYSTEM* fs, FAT_READAHEAD* ra, RA_STREAM* stream, DWORD index, DWORD fileSize )
+{
+	RA_BLOCK*	list[DISK_QUEUE_DEPTH];
+	RA_BLOCK*	block;
+	DWORD		clusters = ( fileSize + ra->clusterSize - 1 ) / ra->clusterSize;
+	DWORD		end, cluster;
+	UINT32		count = 0, limit;
+
+	if( stream->aheadIndex < index )
+		stream->aheadIndex = index;
+
+	if( stream->window && stream->aheadIndex - index > stream->window / 2 )
+		return;
+
+	if( stream->window == 0 )
+		stream->window = ( FAT_READAHEAD_MIN_CLUSTERS < ra->maxWindow ? FAT_READAHEAD_MIN_CLUSTERS : ra->maxWindow );
+	else
+		stream->window = ( stream->window * 2 < ra->maxWindow ? stream->window * 2 : ra->maxWindow );
+	if( stream->window > ra->stats.window )
+		ra->stats.window = stream->window;
+
+	end		= ( index + stream->window < clusters ? index + stream->window : clusters );
+	limit	= ( ra->hasQueue ? DISK_QUEUE_DEPTH - ra->inFlight : DISK_QUEUE_DEPTH );
+
+	for( ; stream->aheadIndex < end && count < limit; stream->aheadIndex++ )
+	{
+		cluster = get_stream_cluster( fs, stream, &stream->aheadCursor, stream->aheadIndex );
+		if( cluster == 0 )
+			break;
+
+		if( find_readahead_block( ra, cluster ) )
+			continue;
+
+		block = alloc_readahead_block( ra, cluster, RA_READING );
+		if( block == NULL )
+			break;
+		list[count++] = block;
+	}
+
+	start_readahead( fs, ra, list, count );
+}
+
+/******************************************************************************/
+/* Public                                                                     */
+/******************************************************************************/
+/* Serve a read shorter than FAT_READ_REQUEST_BYTES from the cache. Returns
+   the length read, or -1 when fat_read should read it itself: the read is
+   not sequential and not all cached, or a cluster could not be loaded. */
+int readahead_read( FAT_NODE* file, DWORD offset, DWORD readEnd, char* buffer )
+{
+	FAT_FILESYSTEM*	fs = file->fs;
+	FAT_READAHEAD*	ra = fs->readahead;
+	RA_STREAM*		stream;
+	RA_BLOCK*		block;
+	RA_BLOCK*		blocks[FAT_READ_REQUEST_BYTES / 512 + 1];
+	DWORD			firstCluster = GET_FIRST_CLUSTER( file->entry );
+	DWORD			index, firstIndex, lastIndex, cluster, start, end;
+	int				sequential;
+
+	if( ra == NULL || firstCluster < 2 || offset >= readEnd || readEnd - offset >= FAT_READ_REQUEST_BYTES )
+		return -1;
+
+	pthread_mutex_lock( &ra->lock );
+
+	if( ra->hasQueue )
+		reap_readahead( ra, 0 );
+
+	stream		= get_readahead_stream( ra, firstCluster );
+	sequential	= ( offset == stream->nextOffset );
+	firstIndex	= offset / ra->clusterSize;
+	lastIndex	= ( readEnd - 1 ) / ra->clusterSize;
+
+	if( sequential )
+		issue_readahead( fs, ra, stream, firstIndex, file->entry.fileSize );
+	else
+		stream->window = 0;
+
+	for( index = firstIndex; index <= lastIndex; index++ )
+	{
+		cluster = get_stream_cluster( fs, stream, &stream->readCursor, index );
+		if( cluster == 0 )
+			break;
+
+		while( ( block = find_readahead_block( ra, cluster ) ) != NULL && block->state == RA_READING )
+		{
+			ra->stats.waits++;
+			reap_readahead( ra, 1 );
+		}
+
+		if( block )
+			ra->stats.hits++;
+		else
+		{
+			ra->stats.misses++;
+
+			// 순차가 아닌 읽기는 cache에 없으면 fat_read가 직접
+			if( !sequential )
+				break;
+
+			block = alloc_readahead_block( ra, cluster, RA_READING );
+			if( block == NULL )
+				break;
+			start_readahead( fs, ra, &block, 1 );
+			while( ( block = find_readahead_block( ra, cluster ) ) != NULL && block->state == RA_READING )
+				reap_readahead( ra, 1 );
+			if( block == NULL )
+				break;
+		}
+
+		blocks[index - firstIndex] = block;
+		// 이번 읽기가 쓸 block이 다음 할당에 밀려나지 않도록
+		unlink_readahead_lru( ra, block );
+		link_readahead_lru( ra, block );
+	}
+
+	if( index <= lastIndex )
+	{
+		pthread_mutex_unlock( &ra->lock );
+		return -1;
+	}
+
+	for( index = firstIndex; index <= lastIndex; index++ )
+	{
+		start	= ( index == firstIndex ? offset : index * ra->clusterSize );
+		end		= ( index == lastIndex ? readEnd : ( index + 1 ) * ra->clusterSize );
+		memcpy( buffer + ( start - offset ), blocks[index - firstIndex]->data + start % ra->clusterSize, end - start );
+	}
+
+	stream->nextOffset = readEnd;
+
+	pthread_mutex_unlock( &ra->lock );
+
+	return readEnd - offset;
+}
+
+/* Forget count clusters from cluster on: written sectors when freed is 0,
+   freed clusters, whose chains may now be different, when it is 1. */
+void readahead_invalidate( FAT_FILESYSTEM* fs, SECTOR cluster, UINT32 count, int freed )
+{
+	FAT_READAHEAD*	ra = fs->readahead;
+	RA_BLOCK*		block;
+	UINT32			i;
+
+	if( ra == NULL )
+		return;
+
+	if( freed )
+		__sync_fetch_and_add( &ra->chainEpoch, 1 );
+
+	if( ra->used == 0 )
+		return;
+
+	pthread_mutex_lock( &ra->lock );
+
+	if( count > ra->blockCount )
+	{
+		for( i = 0; i < ra->blockCount; i++ )
+		{
+			block = &ra->blocks[i];
+			if( block->state && block->cluster >= cluster && block->cluster - cluster < count )
+			{
+				if( block->state == RA_READING )
+					block->stale = 1;
+				else
+					drop_readahead_block( ra, block );
+			}
+		}
+	}
+	else
+	{
+		for( i = 0; i < count; i++ )
+		{
+			block = find_readahead_block( ra, cluster + i );
+			if( block == NULL )
+				continue;
+
+			if( block->state == RA_READING )
+				block->stale = 1;
+			else
+				drop_readahead_block( ra, block );
+		}
+	}
+
+	pthread_mutex_unlock( &ra->lock );
+}
+
+/* wait for the prefetches in flight and let go of the queue before fs->disk
+   changes; the next read makes a new one */
+void readahead_drain( FAT_FILESYSTEM* fs )
+{
+	FAT_READAHEAD*	ra = fs->readahead;
+
+	if( ra == NULL )
+		return;
+
+	pthread_mutex_lock( &ra->lock );
+	drain_readahead_queue( ra );
+	pthread_mutex_unlock( &ra->lock );
+}
+
+int init_readahead( FAT_FILESYSTEM* fs )
+{
+	FAT_READAHEAD*	ra;
+	DWORD			clusterSize = fs->bpb.bytesPerSector * fs->bpb.sectorsPerCluster;
+	UINT32			i;
+
+	fs->readahead = NULL;
+	if( fs->mountFlags & FAT_MOUNT_NO_READAHEAD )
+		return FAT_SUCCESS;
+
+	ra = ( FAT_READAHEAD* )calloc( 1, sizeof( FAT_READAHEAD ) );
+	if( ra == NULL )
+		return FAT_ERROR;
+
+	// 한 읽기가 걸치는 cluster들과 window가 함께 들어갈 만큼
+	ra->clusterSize	= clusterSize;
+	ra->blockCount	= FAT_READAHEAD_BYTES / clusterSize;
+	if( ra->blockCount < 2 * ( FAT_READ_REQUEST_BYTES / clusterSize + 1 ) )
+		ra->blockCount = 2 * ( FAT_READ_REQUEST_BYTES / clusterSize + 1 );
+	ra->maxWindow	= FAT_READAHEAD_MAX_BYTES / clusterSize;
+	if( ra->maxWindow > ra->blockCount / 4 )
+		ra->maxWindow = ra->blockCount / 4;
+	if( ra->maxWindow > DISK_QUEUE_DEPTH )
+		ra->maxWindow = DISK_QUEUE_DEPTH;
+	if( ra->maxWindow == 0 )
+		ra->maxWindow = 1;
+
+	ra->blocks	= ( RA_BLOCK* )calloc( ra->blockCount, sizeof( RA_BLOCK ) );
+	ra->buffers	= ( BYTE* )malloc( ra->blockCount * clusterSize );
+	ra->staging	= ( BYTE* )malloc( ra->maxWindow * clusterSize );
+	if( ra->blocks == NULL || ra->buffers == NULL || ra->staging == NULL )
+	{
+		free( ra->blocks );
+		free( ra->buffers );
+		free( ra->staging );
+		free( ra );
+		return FAT_ERROR;
+	}
+
+	for( i = 0; i < ra->blockCount; i++ )
+	{
+		ra->blocks[i].data	= ra->buffers + i * clusterSize;
+		ra->blocks[i].older	= ra->freeBlocks;
+		ra->freeBlocks		= &ra->blocks[i];
+	}
+
+	pthread_mutex_init( &ra->lock, NULL );
+	fs->readahead = ra;
+
+	return FAT_SUCCESS;
+}
+
+void release_readahead( FAT_FILESYSTEM* fs )
+{
+	FAT_READAHEAD*	ra = fs->readahead;
+
+	if( ra == NULL )
+		return;
+
+	drain_readahead_queue( ra );
+	fs->readahead = NULL;
+
+	pthread_mutex_destroy( &ra->lock );
+	free( ra->blocks );
+	free( ra->buffers );
+	free( ra->staging );
+	free( ra );
+}
+
+int fat_readahead_stats( FAT_FILESYSTEM* fs, FAT_READAHEAD_STATS* stats )
+{
+	FAT_READAHEAD*	ra = fs->readahead;
+
+	ZeroMemory( stats, sizeof( FAT_READAHEAD_STATS ) );
+	if( ra == NULL )
+		return FAT_ERROR;
+
+	pthread_mutex_lock( &ra->lock );
+	memcpy( stats, &ra->stats, sizeof( FAT_READAHEAD_STATS ) );
+	stats->cachedClusters = ra->used;
+	pthread_mutex_unlock( &ra->lock );
+
+	return FAT_SUCCESS;
+}
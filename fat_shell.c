@@ -153,12 +153,43 @@ int	fs_write( DISK_OPERATIONS* disk, SHELL_FS_OPERATIONS* fsOprs, const SHELL_EN
 	return fat_write( &FATEntry, offset, length, buffer );
 }
 
+// extendSize가 0이 아니면 파일 크기도 length까지 늘림
+int	fs_fallocate( DISK_OPERATIONS* disk, SHELL_FS_OPERATIONS* fsOprs, const SHELL_ENTRY* parent, SHELL_ENTRY* entry, unsigned long length, int extendSize )
+{
+	FAT_NODE	FATEntry;
+	int			result;
+
+	shell_entry_to_fat_entry( entry, &FATEntry );
+
+	result = fat_fallocate( &FATEntry, length, extendSize ? FAT_FALLOC_EXTEND_SIZE : 0 );
+
+	fat_entry_to_shell_entry( &FATEntry, entry );
+
+	return result;
+}
+
+int	fs_truncate( DISK_OPERATIONS* disk, SHELL_FS_OPERATIONS* fsOprs, const SHELL_ENTRY* parent, SHELL_ENTRY* entry, unsigned long length )
+{
+	FAT_NODE	FATEntry;
+	int			result;
+
+	shell_entry_to_fat_entry( entry, &FATEntry );
+
+	result = fat_truncate( &FATEntry, length );
+
+	fat_entry_to_shell_entry( &FATEntry, entry );
+
+	return result;
+}
+
 static SHELL_FILE_OPERATIONS g_file =
 {
 	fs_create,
 	fs_remove,
 	fs_read,
-	fs_write
+	fs_write,
+	fs_fallocate,
+	fs_truncate
 };
 
 int fs_stat( DISK_OPERATIONS* disk, SHELL_FS_OPERATIONS* fsOprs, unsigned int* totalSectors, unsigned int* usedSectors )
@@ -281,6 +312,133 @@ int fs_lookup( DISK_OPERATIONS* disk, SHELL_FS_OPERATIONS* fsOprs, const SHELL_E
 	return result;
 }
 
+void defrag_progress( void* param, const FAT_NODE* node, UINT32 clusters, UINT32 extentsBefore, UINT32 extentsAfter )
+{
+	SHELL_ENTRY	entry;
+
+	fat_entry_to_shell_entry( node, &entry );
+
+	printf( "%-12s  %8u clusters  %6u -> %u extents%s\n", entry.name, clusters,
+			extentsBefore, extentsAfter, ( extentsAfter > 1 ? "  (no contiguous space)" : "" ) );
+}
+
+// 볼륨 전체 조각 모음 후 결과 출력
+int fs_defrag( DISK_OPERATIONS* disk, SHELL_FS_OPERATIONS* fsOprs, const SHELL_ENTRY* root )
+{
+	FAT_NODE			FATRoot;
+	FAT_DEFRAG_REPORT	report;
+	int					result;
+
+	shell_entry_to_fat_entry( root, &FATRoot );
+
+	result = fat_defrag( &FATRoot, &report, defrag_progress, NULL );
+
+	printf( "\n" );
+	printf( "files and directories  : %u\n", report.files );
+	printf( "fragmented             : %u -> %u (%.2lf%% -> %.2lf%%)\n",
+			report.fragmentedBefore, report.fragmentedAfter,
+			report.files ? report.fragmentedBefore * 100. / report.files : 0.,
+			report.files ? report.fragmentedAfter * 100. / report.files : 0. );
+	printf( "extents                : %u -> %u\n", report.extentsBefore, report.extentsAfter );
+	printf( "clusters moved         : %u\n", report.clustersMoved );
+	printf( "skipped                : %u\n", report.skipped );
+
+	return result;
+}
+
+void check_message( void* param, const char* path, const char* message )
+{
+	if( path[0] )
+		printf( "%s: %s\n", path, message );
+	else
+		printf( "%s\n", message );
+}
+
+// 볼륨 일관성 검사 후 결과 출력
+int fs_check( DISK_OPERATIONS* disk, SHELL_FS_OPERATIONS* fsOprs, const SHELL_ENTRY* root, unsigned int threads )
+{
+	FAT_NODE		FATRoot;
+	FAT_FSCK_REPORT	report;
+	int				result;
+
+	shell_entry_to_fat_entry( root, &FATRoot );
+
+	result = fat_fsck( &FATRoot, threads, &report, check_message, NULL );
+
+	printf( "\n" );
+	printf( "directories            : %u\n", report.directories );
+	printf( "files                  : %u\n", report.files );
+	printf( "used clusters          : %u\n", report.usedClusters );
+	printf( "cross-linked chains    : %u\n", report.crossLinks );
+	printf( "broken chains          : %u\n", report.badChains );
+	printf( "size mismatches        : %u\n", report.sizeMismatches );
+	printf( "bad '.'/'..' entries   : %u\n", report.badDotEntries );
+	printf( "lost chains            : %u (%u clusters)\n", report.lostChains, report.lostClusters );
+
+	return result;
+}
+
+void print_histogram( const char* title, const UINT32* histogram )
+{
+	UINT32	i;
+
+	printf( "%s\n", title );
+	for( i = 0; i < FAT_LAYOUT_BUCKETS; i++ )
+	{
+		if( histogram[i] )
+			printf( "  %10u - %-10u : %u\n", 1u << i, ( i == 31 ? 0xFFFFFFFF : ( 1u << ( i + 1 ) ) - 1 ), histogram[i] );
+	}
+}
+
+// 조각화, 배치 통계 출력
+int fs_layout( DISK_OPERATIONS* disk, SHELL_FS_OPERATIONS* fsOprs, const SHELL_ENTRY* root )
+{
+	FAT_NODE			FATRoot;
+	FAT_LAYOUT_STATS	stats;
+
+	shell_entry_to_fat_entry( root, &FATRoot );
+
+	if( fat_layout_stats( &FATRoot, &stats ) )
+		return -1;
+
+	printf( "clusters               : %u (%u free)\n", stats.totalClusters, stats.freeClusters );
+	printf( "free extents           : %u\n", stats.freeExtents );
+	printf( "largest free run       : %u clusters\n", stats.largestFreeRun );
+	print_histogram( "free extent length histogram (clusters : extents)", stats.freeExtentHistogram );
+
+	printf( "files, directories     : %u, %u\n", stats.files, stats.directories );
+	printf( "fragmented chains      : %u (max %u extents)\n", stats.fragmentedChains, stats.maxExtents );
+	printf( "average extent length  : %.2lf clusters\n",
+			stats.chainExtents ? ( double )stats.chainClusters / stats.chainExtents : 0. );
+	printf( "contiguity             : %.2lf%%\n",
+			stats.links ? stats.contiguousLinks * 100. / stats.links : 100. );
+	print_histogram( "extents per chain histogram (extents : chains)", stats.extentHistogram );
+
+	printf( "directory entries      : %u live, %u deleted (%.2lf%%)\n", stats.liveEntries, stats.tombstones,
+			stats.liveEntries + stats.tombstones ? stats.tombstones * 100. / ( stats.liveEntries + stats.tombstones ) : 0. );
+	printf( "worst directory        : %u%% deleted entries\n", stats.worstTombstonePercent );
+	printf( "sparse directories     : %u\n", stats.sparseDirectories );
+
+	return 0;
+}
+
+// flusher가 아직 쓰지 않은 것까지 모두 기록
+int fs_sync( DISK_OPERATIONS* disk, SHELL_FS_OPERATIONS* fsOprs )
+{
+	FAT_FILESYSTEM*		fs = FSOPRS_TO_FATFS( fsOprs );
+	FAT_FLUSHER_STATS	stats;
+
+	if( fat_sync( fs ) )
+		return -1;
+
+	if( fat_flusher_stats( fs, &stats ) == FAT_SUCCESS )
+		printf( "flusher                : %llu passes, %llu files, %llu checkpoints, %llu mirror copies\n",
+				( unsigned long long )stats.passes, ( unsigned long long )stats.files,
+				( unsigned long long )stats.checkpoints, ( unsigned long long )stats.mirrorSyncs );
+
+	return 0;
+}
+
 static SHELL_FS_OPERATIONS	g_fsOprs =
 {
 	fs_read_dir,
@@ -288,6 +446,10 @@ static SHELL_FS_OPERATIONS	g_fsOprs =
 	fs_mkdir,
 	fs_rmdir,
 	fs_lookup,
+	fs_defrag,
+	fs_check,
+	fs_layout,
+	fs_sync,
 	&g_file,
 	NULL
 };
@@ -349,7 +511,7 @@ void fs_umount( DISK_OPERATIONS* disk, SHELL_FS_OPERATIONS* fsOprs )
 {
 	if( fsOprs && fsOprs->pdata )
 	{
-		// fat_mount가면 free_cluster_list 해제하는 함수 있음
+		// flusher thread를 멈추고 남은 것을 기록한 뒤 free_cluster_list 등을 해제
 		fat_umount( FSOPRS_TO_FATFS( fsOprs ) );
 
 		// FILE_SYSTEM 메모리 영역 해제
@@ -364,18 +526,35 @@ void fs_umount( DISK_OPERATIONS* disk, SHELL_FS_OPERATIONS* fsOprs )
 // formatting 함수인 fat_format()을 호출하는 것
 int fs_format( DISK_OPERATIONS* disk, void* param ) 
 {
-	unsigned char FATType;
+	unsigned char FATType = 0xFF;
+	int		result;
 	char*	FATTypeString[3] = { "FAT12", "FAT16", "FAT32" };
 	char*	paramStr = ( char* )param;
+	char*	token;
+	DWORD	formatFlags = 0;
+	int		autoType = 0;
 	int		i;
 
-	// 파라미터가 있을경우(사용자가 직접적으로 타입을 요청했을 경우)
-	if( param )
+	// 파라미터가 있을경우(사용자가 직접적으로 타입 또는 quick을 요청했을 경우)
+	for( token = ( paramStr ? strtok( paramStr, " " ) : NULL ); token; token = strtok( NULL, " " ) )
 	{
+		if( my_strnicmp( token, "quick", 100 ) == 0 )
+		{
+			formatFlags |= FAT_FORMAT_QUICK;
+			continue;
+		}
+
+		// FAT/directory 변경을 먼저 journal에 기록
+		if( my_strnicmp( token, "journal", 100 ) == 0 )
+		{
+			formatFlags |= FAT_FORMAT_JOURNAL;
+			continue;
+		}
+
 		// FAT타입 문자열 지정해놓은 것과 일치하면 해당 인덱스로
 		for( i = 0; i < 3; i++ )
 		{
-			if( my_strnicmp( paramStr, FATTypeString[i], 100 ) == 0 )
+			if( my_strnicmp( token, FATTypeString[i], 100 ) == 0 )
 			{
 				FATType = i;
 				break;
@@ -389,23 +568,36 @@ int fs_format( DISK_OPERATIONS* disk, void* param )
 			return -1;
 		}
 	}
-	// 파라미터가 없을경우
+
+	// 타입을 지정하지 않은 경우
 	// disksim_init을 통해 얻은 디스크 크기 정보로 타입 결정
-	else
+	if( FATType == 0xFF )
 	{
 		// DISK_OPERATIONS 구조체에 있는 섹터개수 보고 fat타입 자동으로 지정
 		// 섹터의 수는 shell.c에서 매크로로 정의되어 있음
 		// (#define NUMBER_OF_SECTORS	4096)
-		if( disk->numberOfSectors <= 8400 )
+		autoType = 1;
+		// 기준은 512 byte sector의 개수
+		if( ( QWORD )disk->numberOfSectors * ( disk->bytesPerSector / 512 ) <= 8400 )
 			FATType = 0;
-		else if( disk->numberOfSectors <= 66600 )
+		else if( ( QWORD )disk->numberOfSectors * ( disk->bytesPerSector / 512 ) <= 66600 )
 			FATType = 1;
 		else
 			FATType = 2;
 	}
 
-	printf( "formatting as a %s\n", FATTypeString[FATType] );
-	return fat_format( disk, FATType ); // BPB 등 초기화
+	printf( "formatting as a %s%s%s\n", FATTypeString[FATType], ( formatFlags & FAT_FORMAT_QUICK ? " (quick)" : "" ), ( formatFlags & FAT_FORMAT_JOURNAL ? " (journal)" : "" ) );
+	result = fat_format( disk, FATType, formatFlags, 0 ); // BPB 등 초기화, 0 : CPU마다 한 thread
+
+	// 큰 sector에서는 최소 cluster가 커서 그 타입에 필요한 cluster 수가 안 나올 수 있음, 이때는 한 단계 작은 타입으로
+	while( result != FAT_SUCCESS && autoType && FATType > 0 )
+	{
+		FATType--;
+		printf( "formatting as a %s%s%s\n", FATTypeString[FATType], ( formatFlags & FAT_FORMAT_QUICK ? " (quick)" : "" ), ( formatFlags & FAT_FORMAT_JOURNAL ? " (journal)" : "" ) );
+		result = fat_format( disk, FATType, formatFlags, 0 );
+	}
+
+	return result;
 }
 
 // 파일시스템 이름, 마운트, 언마운트, 포맷하는 함수 등록되어있는 구조체
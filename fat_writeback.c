@@ -0,0 +1,686 @@
+/******************************************************************************/
+/*                                                                            */
+/* Project : FAT12/16 File System                                             */
+/* File    : fat_writeback.c                                                  */
+/* Author  : Kyoungmoon Sun(msg2me@msn.com)                                   */
+/* Company : Dankook Univ. Embedded System Lab.                               */
+/* Notes   : Delayed allocation and write-behind for appends                  */
+/* Date    : 2008/7/2                                                         */
+/*                                                                            */
+/******************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "fat.h"
+
+/*
+   An append is copied to a buffer kept for that file, known by the location
+   of its directory entry, and nothing is written. The flush takes every
+   missing cluster at once, after the last one the file has or as the whole
+   chain of an empty file, so the final size decides the run, and writes the data
+   in whole-sector requests per contiguous extent. The FAT and the directory
+   entry are updated once per flush instead of once per append.
+
+   A file is flushed by fat_flush() (its close), before anything else is done
+   to it, when its buffer reaches FAT_WRITEBACK_FILE_BYTES, when all buffers
+   pass FAT_WRITEBACK_BYTES or FAT_WRITEBACK_FILES (oldest first), when its
+   oldest data is FAT_WRITEBACK_AGE_MS old at the next write, and by
+   fat_sync(). The flusher thread flushes them earlier, by age or once the
+   buffers pass FAT_FLUSHER_DIRTY_RATIO percent of the limits. fat_lookup()
+   reports the size with the buffered data; directory listings show what the
+   entry holds.
+
+   Appends are buffered only while the free clusters cover every buffer, and
+   other writers only allocate the clusters no buffer has been promised, so a
+   flush does not run out of space. A flush that fails anyway keeps the
+   buffer, at the head of the list, and reports the error.
+
+   The first cluster of an empty file is set by its first flush, which may
+   run on another thread. A node still without one takes it from the entry
+   on disk once no flush is under way, before it is used for anything but
+   an append.
+*/
+
+// WB_FILE
+// 파일 하나의 아직 쓰지 않은 append
+typedef struct WB_FILE
+{
+	FAT_NODE			node;		// entry의 fileSize는 start, 즉 디스크에 있는 크기
+	DWORD				start;
+	DWORD				length;
+	DWORD				capacity;
+	BYTE*				data;
+	UINT32				clusters;	// flush가 새로 할당할 cluster 수
+	QWORD				dirtySince;	// 처음 buffer에 넣은 때, ms
+	struct WB_FILE*		next;		// 오래된 순서
+} WB_FILE;
+
+typedef struct FAT_WRITEBACK
+{
+	pthread_mutex_t		lock;		// 이하 list와 합계
+	WB_FILE*			files;
+	WB_FILE*			last;
+	UINT32				count;
+	QWORD				bytes;
+	UINT32				clusters;	// 모든 buffer의 flush가 할당할 cluster 수
+
+	pthread_mutex_t		flushLock;	// flush는 한번에 하나, lock보다 먼저 잡음
+	UINT32				held;		// list에 있거나 flush 중인 파일 수, lock 없이 atomic으로 읽음
+
+	FAT_WRITEBACK_STATS	stats;
+} FAT_WRITEBACK;
+
+QWORD writeback_now( void )
+{
+	struct timespec	now;
+
+	clock_gettime( CLOCK_MONOTONIC, &now );
+
+	return ( QWORD )now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+int same_location( const FAT_ENTRY_LOCATION* a, const FAT_ENTRY_LOCATION* b )
+{
+	return a->cluster == b->cluster && a->sector == b->sector && a->number == b->number;
+}
+
+WB_FILE* find_writeback_file( FAT_WRITEBACK* wb, const FAT_ENTRY_LOCATION* location )
+{
+	WB_FILE*	file;
+
+	for( file = wb->files; file; file = file->next )
+	{
+		if( same_location( &file->node.location, location ) )
+			return file;
+	}
+
+	return NULL;
+}
+
+/* take file out of the list; the caller holds wb->lock */
+void unlink_writeback_file( FAT_WRITEBACK* wb, WB_FILE* file )
+{
+	WB_FILE**	link;
+	WB_FILE*	previous = NULL;
+
+	for( link = &wb->files; *link != file; link = &( *link )->next )
+		previous = *link;
+	*link = file->next;
+	if( wb->last == file )
+		wb->last = previous;
+
+	wb->count--;
+	wb->bytes		-= file->length;
+	wb->clusters	-= file->clusters;
+}
+
+/* Put back a file whose flush failed, as the oldest. Appends made during the
+   flush went to a new buffer that continues this one; it is joined to it.
+   The caller holds wb->lock. */
+void requeue_writeback_file( FAT_WRITEBACK* wb, WB_FILE* file )
+{
+	WB_FILE*	later = find_writeback_file( wb, &file->node.location );
+	BYTE*		grown;
+
+	if( later && later->start == file->start + file->length )
+	{
+		grown = ( BYTE* )realloc( file->data, file->length + later->length );
+		if( grown )
+		{
+			unlink_writeback_file( wb, later );
+			memcpy( grown + file->length, later->data, later->length );
+			file->data		= grown;
+			file->capacity	= file->length + later->length;
+			file->length	+= later->length;
+			file->clusters	+= later->clusters;
+			free( later->data );
+			free( later );
+			__atomic_sub_fetch( &wb->held, 1, __ATOMIC_RELEASE );
+		}
+	}
+
+	file->next = wb->files;
+	wb->files = file;
+	if( wb->last == NULL )
+		wb->last = file;
+
+	wb->count++;
+	wb->bytes		+= file->length;
+	wb->clusters	+= file->clusters;
+}
+
+/* the first cluster a flush gave node's file, no flush may be under way */
+void refresh_first_cluster( FAT_NODE* node )
+{
+	BYTE			sector[MAX_SECTOR_SIZE];
+	FAT_DIR_ENTRY*	entry;
+
+	if( GET_FIRST_CLUSTER( node->entry ) != 0 || ( node->entry.attribute & ATTR_DIRECTORY ) )
+		return;
+
+	if( read_entry_sector( node->fs, node->location.cluster, node->location.sector, sector ) == 0 )
+	{
+		entry = &( ( FAT_DIR_ENTRY* )sector )[node->location.number];
+		SET_FIRST_CLUSTER( node->entry, GET_FIRST_CLUSTER( *entry ) );
+	}
+}
+
+/******************************************************************************/
+/* Flush                                                                      */
+/******************************************************************************/
+/* bytes [from, to) of the file, which lie in the extent starting at
+   cluster and at file offset extentOffset */
+int write_writeback_extent( FAT_FILESYSTEM* fs, WB_FILE* file, SECTOR cluster, DWORD extentOffset, DWORD from, DWORD to )
+{
+	BYTE	sector[MAX_SECTOR_SIZE];
+	DWORD	bytesPerSector = fs->bpb.bytesPerSector;
+	SECTOR	first = calc_physical_sector( fs, cluster, 0 );
+	DWORD	count, partial;
+
+	// 앞쪽 sector의 기존 내용은 남김
+	if( from % bytesPerSector )
+	{
+		partial = bytesPerSector - from % bytesPerSector;
+		if( partial > to - from )
+			partial = to - from;
+
+		if( fs->disk->read_sector( fs->disk, first + ( from - extentOffset ) / bytesPerSector, sector ) )
+			return FAT_ERROR;
+		memcpy( sector + from % bytesPerSector, file->data + ( from - file->start ), partial );
+		if( fs->disk->write_sector( fs->disk, first + ( from - extentOffset ) / bytesPerSector, sector ) )
+			return FAT_ERROR;
+		from += partial;
+		fs->writeback->stats.requests++;
+	}
+
+	count = ( to - from ) / bytesPerSector;
+	if( count )
+	{
+		if( disk_write_sectors( fs->disk, first + ( from - extentOffset ) / bytesPerSector, count, file->data + ( from - file->start ) ) )
+			return FAT_ERROR;
+		from += count * bytesPerSector;
+		fs->writeback->stats.requests++;
+	}
+
+	// 파일 끝 뒤는 0으로
+	if( from < to )
+	{
+		ZeroMemory( sector, bytesPerSector );
+		memcpy( sector, file->data + ( from - file->start ), to - from );
+		if( fs->disk->write_sector( fs->disk, first + ( from - extentOffset ) / bytesPerSector, sector ) )
+			return FAT_ERROR;
+		fs->writeback->stats.requests++;
+	}
+
+	return FAT_SUCCESS;
+}
+
+/* Reserve the clusters the buffer needs in one go, write it extent by
+   extent and set the new size. file is out of the list; flushLock is held.
+   When it fails the file goes back to the list with its data. */
+int flush_writeback_file( FAT_FILESYSTEM* fs, WB_FILE* file )
+{
+	SECTOR*	chain;
+	DWORD	clusterSize = fs->bpb.bytesPerSector * fs->bpb.sectorsPerCluster;
+	DWORD	end = file->start + file->length;
+	DWORD	index, runStart, from, to;
+	UINT32	count;
+	int		result;
+
+	journal_begin( fs );
+
+	// 앞선 flush가 첫 cluster를 할당했을 수 있음
+	refresh_first_cluster( &file->node );
+	file->node.entry.fileSize = file->start;
+	result = reserve_file_space( &file->node, end, 0 );
+	if( result == FAT_SUCCESS )
+		result = read_cluster_chain( fs, GET_FIRST_CLUSTER( file->node.entry ), &chain, &count );
+
+	if( result == FAT_SUCCESS )
+	{
+		// 연속된 cluster들은 한 요청으로
+		for( runStart = index = file->start / clusterSize; result == FAT_SUCCESS && index < count && index * clusterSize < end; index++ )
+		{
+			if( index + 1 < count && ( index + 1 ) * clusterSize < end && chain[index + 1] == chain[index] + 1 )
+				continue;
+
+			from	= ( runStart * clusterSize > file->start ? runStart * clusterSize : file->start );
+			to		= ( ( index + 1 ) * clusterSize < end ? ( index + 1 ) * clusterSize : end );
+			result	= write_writeback_extent( fs, file, chain[runStart], runStart * clusterSize, from, to );
+			readahead_invalidate( fs, chain[runStart], index + 1 - runStart, 0 );
+
+			runStart = index + 1;
+		}
+		free( chain );
+
+		if( result == FAT_SUCCESS )
+		{
+			file->node.entry.fileSize = end;
+			result = set_entry( fs, &file->node.location, &file->node.entry );
+		}
+	}
+
+	journal_end( fs );
+
+	if( result )
+	{
+		pthread_mutex_lock( &fs->writeback->lock );
+		requeue_writeback_file( fs->writeback, file );
+		pthread_mutex_unlock( &fs->writeback->lock );
+		return result;
+	}
+
+	pthread_mutex_lock( &fs->writeback->lock );
+	fs->writeback->stats.flushes++;
+	fs->writeback->stats.flushedBytes += file->length;
+	pthread_mutex_unlock( &fs->writeback->lock );
+
+	free( file->data );
+	free( file );
+	__atomic_sub_fetch( &fs->writeback->held, 1, __ATOMIC_RELEASE );
+
+	return result;
+}
+
+/* nothing buffered and no flush under way, seen without a lock; a file
+   being flushed still counts so its readers wait for the flush */
+int writeback_idle( FAT_WRITEBACK* wb )
+{
+	return ( wb == NULL || __atomic_load_n( &wb->held, __ATOMIC_ACQUIRE ) == 0 );
+}
+
+/* flush the oldest files until the buffers are within the limits, or the
+   ones older than FAT_WRITEBACK_AGE_MS when age is set */
+int flush_writeback_over( FAT_FILESYSTEM* fs, int age )
+{
+	FAT_WRITEBACK*	wb = fs->writeback;
+	WB_FILE*		file;
+	QWORD			now = writeback_now( );
+	int				result = FAT_SUCCESS;
+
+	pthread_mutex_lock( &wb->flushLock );
+	for( ;; )
+	{
+		pthread_mutex_lock( &wb->lock );
+		file = wb->files;
+		if( file == NULL ||
+			( age ? now - file->dirtySince < FAT_WRITEBACK_AGE_MS : wb->bytes <= FAT_WRITEBACK_BYTES && wb->count <= FAT_WRITEBACK_FILES ) )
+		{
+			pthread_mutex_unlock( &wb->lock );
+			break;
+		}
+		unlink_writeback_file( wb, file );
+		if( age )
+			wb->stats.ageFlushes++;
+		else
+			wb->stats.pressureFlushes++;
+		pthread_mutex_unlock( &wb->lock );
+
+		// 실패한 파일은 다시 list 앞에 있음
+		if( flush_writeback_file( fs, file ) )
+		{
+			result = FAT_ERROR;
+			break;
+		}
+	}
+	pthread_mutex_unlock( &wb->flushLock );
+
+	return result;
+}
+
+int compare_writeback_files( const void* a, const void* b )
+{
+	DWORD	first = GET_FIRST_CLUSTER( ( *( WB_FILE** )a )->node.entry );
+	DWORD	second = GET_FIRST_CLUSTER( ( *( WB_FILE** )b )->node.entry );
+
+	return ( first < second ? -1 : first > second );
+}
+
+/* The flusher's share: the files buffered for age ms or longer, then the
+   oldest while the buffers hold more than ratio percent of the limits. They
+   go out in first cluster order, so the extents follow each other on disk as
+   far as they can. Returns the number of files flushed, -1 on an error. */
+int writeback_background( FAT_FILESYSTEM* fs, QWORD age, UINT32 ratio )
+{
+	FAT_WRITEBACK*	wb = fs->writeback;
+	WB_FILE**		list;
+	WB_FILE*		file;
+	QWORD			now = writeback_now( );
+	UINT32			count = 0, i;
+	int				result = 0;
+
+	if( writeback_idle( wb ) )
+		return 0;
+
+	pthread_mutex_lock( &wb->flushLock );
+	pthread_mutex_lock( &wb->lock );
+	list = ( WB_FILE** )malloc( ( wb->count + 1 ) * sizeof( WB_FILE* ) );
+	while( list && ( file = wb->files ) != NULL &&
+		   ( now - file->dirtySince >= age || wb->bytes * 100 > ( QWORD )FAT_WRITEBACK_BYTES * ratio || wb->count * 100 > FAT_WRITEBACK_FILES * ratio ) )
+	{
+		unlink_writeback_file( wb, file );
+		if( now - file->dirtySince >= age )
+			wb->stats.ageFlushes++;
+		else
+			wb->stats.pressureFlushes++;
+		list[count++] = file;
+	}
+	pthread_mutex_unlock( &wb->lock );
+
+	if( count > 1 )
+		qsort( list, count, sizeof( WB_FILE* ), compare_writeback_files );
+	for( i = 0; i < count; i++ )
+	{
+		if( flush_writeback_file( fs, list[i] ) )
+			result = -1;
+	}
+	pthread_mutex_unlock( &wb->flushLock );
+	free( list );
+
+	return ( result ? result : ( int )count );
+}
+
+/******************************************************************************/
+/* Public                                                                     */
+/******************************************************************************/
+/* Buffer an append. Returns length, or -1 when fat_write has to write it
+   itself; any buffered data of the file is flushed first then, and -2 when
+   that flush failed. */
+int writeback_write( FAT_NODE* node, DWORD offset, DWORD length, const char* buffer )
+{
+	FAT_FILESYSTEM*	fs = node->fs;
+	FAT_WRITEBACK*	wb = fs->writeback;
+	WB_FILE*		file;
+	BYTE*			grown;
+	DWORD			clusterSize = fs->bpb.bytesPerSector * fs->bpb.sectorsPerCluster;
+	DWORD			end, capacity;
+	UINT32			clusters;
+	int				flush = 0, aged, kick;
+
+	if( wb == NULL || length == 0 || ( fs->mountFlags & FAT_MOUNT_READ_ONLY ) )
+		return -1;
+
+	pthread_mutex_lock( &wb->lock );
+	aged = ( wb->files && writeback_now( ) - wb->files->dirtySince >= FAT_WRITEBACK_AGE_MS );
+	pthread_mutex_unlock( &wb->lock );
+	if( aged )
+		flush_writeback_over( fs, 1 );
+
+	pthread_mutex_lock( &wb->lock );
+
+	file = find_writeback_file( wb, &node->location );
+	if( file == NULL && ( offset != node->entry.fileSize || length >= FAT_WRITEBACK_FILE_BYTES || ( node->entry.attribute & ATTR_DIRECTORY ) ) )
+	{
+		pthread_mutex_unlock( &wb->lock );
+		// fat_write이 쓰기 전에 첫 cluster를 알아야 함
+		if( GET_FIRST_CLUSTER( node->entry ) == 0 )
+			return ( writeback_flush( node ) ? -2 : -1 );
+		return -1;
+	}
+
+	if( file && offset != file->start + file->length )
+	{
+		pthread_mutex_unlock( &wb->lock );
+		return ( writeback_flush( node ) ? -2 : -1 );
+	}
+
+	// 버퍼에 넣은 data가 flush 때 쓸 cluster는 미리 세어둠
+	end			= offset + length;
+	clusters	= ( end + clusterSize - 1 ) / clusterSize - ( offset + clusterSize - 1 ) / clusterSize;
+	if( wb->clusters + clusters > count_free_clusters( fs ) )
+	{
+		pthread_mutex_unlock( &wb->lock );
+		return ( writeback_flush( node ) ? -2 : -1 );
+	}
+
+	if( file == NULL )
+	{
+		file = ( WB_FILE* )calloc( 1, sizeof( WB_FILE ) );
+		if( file == NULL )
+		{
+			pthread_mutex_unlock( &wb->lock );
+			return -1;
+		}
+		file->node			= *node;
+		file->start			= offset;
+		file->dirtySince	= writeback_now( );
+
+		if( wb->last )
+			wb->last->next = file;
+		else
+			wb->files = file;
+		wb->last = file;
+		wb->count++;
+		__atomic_add_fetch( &wb->held, 1, __ATOMIC_RELEASE );
+	}
+
+	if( file->length + length > file->capacity )
+	{
+		capacity = ( file->capacity * 2 > file->length + length ? file->capacity * 2 : file->length + length );
+		grown = ( BYTE* )realloc( file->data, capacity );
+		if( grown == NULL )
+		{
+			pthread_mutex_unlock( &wb->lock );
+			return ( writeback_flush( node ) ? -2 : -1 );
+		}
+		file->data		= grown;
+		file->capacity	= capacity;
+	}
+
+	memcpy( file->data + file->length, buffer, length );
+	file->length	+= length;
+	file->clusters	+= clusters;
+	wb->bytes		+= length;
+	wb->clusters	+= clusters;
+	wb->stats.bufferedWrites++;
+	wb->stats.bufferedBytes += length;
+
+	node->entry.fileSize = end;
+
+	flush = ( file->length >= FAT_WRITEBACK_FILE_BYTES ? 1 : wb->bytes > FAT_WRITEBACK_BYTES || wb->count > FAT_WRITEBACK_FILES ? 2 : 0 );
+	if( flush == 1 )
+		wb->stats.pressureFlushes++;
+	kick = ( wb->bytes * 100 > ( QWORD )FAT_WRITEBACK_BYTES * FAT_FLUSHER_DIRTY_RATIO || wb->count * 100 > FAT_WRITEBACK_FILES * FAT_FLUSHER_DIRTY_RATIO );
+	pthread_mutex_unlock( &wb->lock );
+
+	// 한도에 닿기 전에 flusher가 쓰기 시작하도록
+	if( kick )
+		flusher_kick( fs );
+
+	if( flush == 1 )
+		writeback_flush( node );
+	else if( flush == 2 )
+		flush_writeback_over( fs, 0 );
+
+	return length;
+}
+
+/* write out what is buffered for node's file */
+int writeback_flush( FAT_NODE* node )
+{
+	FAT_WRITEBACK*	wb = node->fs->writeback;
+	WB_FILE*		file;
+	int				result = FAT_SUCCESS;
+
+	if( writeback_idle( wb ) )
+	{
+		if( wb )
+			refresh_first_cluster( node );
+		return FAT_SUCCESS;
+	}
+
+	pthread_mutex_lock( &wb->flushLock );
+	pthread_mutex_lock( &wb->lock );
+	file = find_writeback_file( wb, &node->location );
+	if( file )
+		unlink_writeback_file( wb, file );
+	pthread_mutex_unlock( &wb->lock );
+
+	if( file )
+		result = flush_writeback_file( node->fs, file );
+	if( result == FAT_SUCCESS )
+		refresh_first_cluster( node );
+	pthread_mutex_unlock( &wb->flushLock );
+
+	return result;
+}
+
+/* drop what is buffered for a file being removed */
+void writeback_discard( FAT_NODE* node )
+{
+	FAT_WRITEBACK*	wb = node->fs->writeback;
+	WB_FILE*		file;
+
+	if( writeback_idle( wb ) )
+	{
+		if( wb )
+			refresh_first_cluster( node );
+		return;
+	}
+
+	// 진행 중인 flush가 끝난 뒤에, 이미 쓴 chain은 fat_remove가 해제
+	pthread_mutex_lock( &wb->flushLock );
+	pthread_mutex_lock( &wb->lock );
+	file = find_writeback_file( wb, &node->location );
+	if( file )
+		unlink_writeback_file( wb, file );
+	pthread_mutex_unlock( &wb->lock );
+	refresh_first_cluster( node );
+	pthread_mutex_unlock( &wb->flushLock );
+
+	if( file )
+	{
+		free( file->data );
+		free( file );
+		__atomic_sub_fetch( &wb->held, 1, __ATOMIC_RELEASE );
+	}
+}
+
+int writeback_flush_all( FAT_FILESYSTEM* fs )
+{
+	FAT_WRITEBACK*	wb = fs->writeback;
+	WB_FILE*		file;
+	int				result = FAT_SUCCESS;
+
+	if( wb == NULL )
+		return FAT_SUCCESS;
+
+	pthread_mutex_lock( &wb->flushLock );
+	for( ;; )
+	{
+		pthread_mutex_lock( &wb->lock );
+		file = wb->files;
+		if( file )
+			unlink_writeback_file( wb, file );
+		pthread_mutex_unlock( &wb->lock );
+
+		if( file == NULL )
+			break;
+		if( flush_writeback_file( fs, file ) )
+		{
+			result = FAT_ERROR;
+			break;
+		}
+	}
+	pthread_mutex_unlock( &wb->flushLock );
+
+	return result;
+}
+
+/* the size of a looked up file with its buffered appends */
+void writeback_patch_size( FAT_NODE* node )
+{
+	FAT_WRITEBACK*	wb = node->fs->writeback;
+	WB_FILE*		file;
+
+	if( writeback_idle( wb ) )
+		return;
+
+	pthread_mutex_lock( &wb->lock );
+	file = find_writeback_file( wb, &node->location );
+	if( file )
+		node->entry.fileSize = file->start + file->length;
+	pthread_mutex_unlock( &wb->lock );
+}
+
+int init_writeback( FAT_FILESYSTEM* fs )
+{
+	FAT_WRITEBACK*	wb;
+
+	fs->writeback = NULL;
+	if( fs->mountFlags & ( FAT_MOUNT_NO_WRITE_BEHIND | FAT_MOUNT_READ_ONLY ) )
+		return FAT_SUCCESS;
+
+	wb = ( FAT_WRITEBACK* )calloc( 1, sizeof( FAT_WRITEBACK ) );
+	if( wb == NULL )
+		return FAT_ERROR;
+
+	pthread_mutex_init( &wb->lock, NULL );
+	pthread_mutex_init( &wb->flushLock, NULL );
+	fs->writeback = wb;
+
+	return FAT_SUCCESS;
+}
+
+/* after fat_sync, so nothing is left to write */
+void release_writeback( FAT_FILESYSTEM* fs )
+{
+	FAT_WRITEBACK*	wb = fs->writeback;
+	WB_FILE*		file;
+
+	if( wb == NULL )
+		return;
+
+	// 쓰지 못한 append는 더 이상 쓸 곳이 없음
+	writeback_flush_all( fs );
+	while( ( file = wb->files ) != NULL )
+	{
+		wb->files = file->next;
+		free( file->data );
+		free( file );
+	}
+	fs->writeback = NULL;
+
+	pthread_mutex_destroy( &wb->lock );
+	pthread_mutex_destroy( &wb->flushLock );
+	free( wb );
+}
+
+/* clusters the buffered appends will take when they are flushed */
+UINT32 writeback_reserved( FAT_FILESYSTEM* fs )
+{
+	FAT_WRITEBACK*	wb = fs->writeback;
+	UINT32			clusters;
+
+	if( wb == NULL )
+		return 0;
+
+	pthread_mutex_lock( &wb->lock );
+	clusters = wb->clusters;
+	pthread_mutex_unlock( &wb->lock );
+
+	return clusters;
+}
+
+int fat_flush( FAT_NODE* file )
+{
+	return writeback_flush( file );
+}
+
+int fat_writeback_stats( FAT_FILESYSTEM* fs, FAT_WRITEBACK_STATS* stats )
+{
+	FAT_WRITEBACK*	wb = fs->writeback;
+
+	ZeroMemory( stats, sizeof( FAT_WRITEBACK_STATS ) );
+	if( wb == NULL )
+		return FAT_ERROR;
+
+	pthread_mutex_lock( &wb->lock );
+	memcpy( stats, &wb->stats, sizeof( FAT_WRITEBACK_STATS ) );
+	stats->dirtyFiles	= wb->count;
+	stats->dirtyBytes	= wb->bytes;
+	pthread_mutex_unlock( &wb->lock );
+
+	return FAT_SUCCESS;
+}
@@ -14,6 +14,9 @@
 #include <memory.h>
 #include "shell.h"
 #include "disksim.h"
+#include "diskimg.h"
+#include "disksparse.h"
+#include "diskflash.h"
 
 #define SECTOR_SIZE				512
 #define NUMBER_OF_SECTORS		4096
@@ -48,6 +51,13 @@ int shell_cmd_mkdir( int argc, char* argv[] );
 int shell_cmd_rmdir( int argc, char* argv[] );
 int shell_cmd_mkdirst( int argc, char* argv[] );
 int shell_cmd_cat( int argc, char* argv[] );
+int shell_cmd_fallocate( int argc, char* argv[] );
+int shell_cmd_truncate( int argc, char* argv[] );
+int shell_cmd_defrag( int argc, char* argv[] );
+int shell_cmd_fsck( int argc, char* argv[] );
+int shell_cmd_layout( int argc, char* argv[] );
+int shell_cmd_iostat( int argc, char* argv[] );
+int shell_cmd_sync( int argc, char* argv[] );
 
 static COMMAND g_commands[] =
 {
@@ -66,7 +76,14 @@ static COMMAND g_commands[] =
 	{ "mkdir",	shell_cmd_mkdir,	COND_MOUNT	},
 	{ "rmdir",	shell_cmd_rmdir,	COND_MOUNT	},
 	{ "mkdirst",shell_cmd_mkdirst,	COND_MOUNT	},
-	{ "cat",	shell_cmd_cat,		COND_MOUNT	}
+	{ "cat",	shell_cmd_cat,		COND_MOUNT	},
+	{ "fallocate",	shell_cmd_fallocate,	COND_MOUNT	},
+	{ "truncate",	shell_cmd_truncate,	COND_MOUNT	},
+	{ "defrag",	shell_cmd_defrag,	COND_MOUNT	},
+	{ "fsck",	shell_cmd_fsck,		COND_MOUNT	},
+	{ "layout",	shell_cmd_layout,	COND_MOUNT	},
+	{ "sync",	shell_cmd_sync,		COND_MOUNT	},
+	{ "iostat",	shell_cmd_iostat,	0			}
 };
 
 static SHELL_FILESYSTEM		g_fs;
@@ -74,6 +91,12 @@ static SHELL_FS_OPERATIONS	g_fsOprs;
 static SHELL_ENTRY			g_rootDir;
 static SHELL_ENTRY			g_currentDir;
 static DISK_OPERATIONS		g_disk;
+static const char*			g_imagePath;	// NULL이면 메모리 디스크
+static int					g_sparse;		// 쓴 chunk만 메모리를 쓰는 디스크
+static const DISKSIM_TIMING*	g_timing;		// 메모리 디스크의 timing model, NULL이면 즉시 완료
+static const DISKFLASH_GEOMETRY*	g_flash;	// NAND flash 디스크의 배치
+static SHELL_ENTRY			g_path[256];	// cd 경로 stack
+static int					g_pathTop;		// stack의 top
 
 
 // COMMAND구조체 배열의 크기 / COMMAND 구조체 크기 -> 명령어 개수
@@ -83,12 +106,62 @@ int g_isMounted;
 // main함수
 int main( int argc, char* argv[] )
 {
+	SECTOR			numberOfSectors = NUMBER_OF_SECTORS;
+	unsigned int	bytesPerSector = SECTOR_SIZE;
+
+	// shell [number of sectors] [bytes per sector] [image file | hdd | ssd | sparse | emmc | sd]
+	// 큰 디스크, 큰 sector, 실제 파일, 장치의 시간 모델, thin provisioning, 또는 flash FTL을 시험할 때
+	if( argc > 1 )
+		numberOfSectors = ( SECTOR )strtoul( argv[1], NULL, 0 );
+	if( argc > 2 )
+		bytesPerSector = ( unsigned int )strtoul( argv[2], NULL, 0 );
+	if( argc > 3 && strcmp( argv[3], "hdd" ) == 0 )
+		g_timing = &DISKSIM_HDD;
+	else if( argc > 3 && strcmp( argv[3], "ssd" ) == 0 )
+		g_timing = &DISKSIM_SSD;
+	else if( argc > 3 && strcmp( argv[3], "sparse" ) == 0 )
+		g_sparse = 1;
+	else if( argc > 3 && strcmp( argv[3], "emmc" ) == 0 )
+		g_flash = &DISKFLASH_EMMC;
+	else if( argc > 3 && strcmp( argv[3], "sd" ) == 0 )
+		g_flash = &DISKFLASH_SD;
+	else if( argc > 3 )
+		g_imagePath = argv[3];
+
+	if( g_imagePath )
+	{
+		// io_uring을 쓸 수 없으면 thread pool로 비동기 요청을 처리
+		if( numberOfSectors == 0 || diskimg_init( g_imagePath, numberOfSectors, bytesPerSector, &g_disk ) < 0 ||
+			disk_async_init( &g_disk, 0 ) < 0 )
+		{
+			printf( "disk image %s can't be opened\n", g_imagePath );
+			return -1;
+		}
+	}
+	else if( g_sparse )
+	{
+		if( numberOfSectors == 0 || disksparse_init( numberOfSectors, bytesPerSector, &g_disk ) < 0 )
+		{
+			printf( "sparse disk initialization has been failed\n" );
+			return -1;
+		}
+	}
+	else if( g_flash )
+	{
+		if( numberOfSectors == 0 || diskflash_init( numberOfSectors, bytesPerSector, g_flash, &g_disk ) < 0 )
+		{
+			printf( "flash disk initialization has been failed\n" );
+			return -1;
+		}
+	}
 	// disksim_init(4096, 512, disk_operations구조체) -> 리턴 : 
-	if( disksim_init( NUMBER_OF_SECTORS, SECTOR_SIZE, &g_disk ) < 0 ) //disksim 초기화
+	else if( numberOfSectors == 0 || disksim_init( numberOfSectors, bytesPerSector, &g_disk ) < 0 ) //disksim 초기화
 	{
 		printf( "disk simulator initialization has been failed\n" );
 		return -1;
 	}
+	else if( g_timing )
+		disksim_set_timing( &g_disk, g_timing );
 
 	// 파일시스템 이름, 마운트, 언마운트, 포맷함수 등록됨
 	shell_register_filesystem( &g_fs ); 
@@ -201,8 +274,7 @@ int shell_cmd_cd( int argc, char* argv[] )
 {
 	SHELL_ENTRY	newEntry;
 	int			result;
-	static SHELL_ENTRY	path[256]; // 경로 stack
-	static int			pathTop = 0; // stack의 top
+	SHELL_ENTRY*	path = g_path; // 경로 stack
 
 	path[0] = g_rootDir; // 경로stack의 젤 처음, root directory
 
@@ -213,7 +285,7 @@ int shell_cmd_cd( int argc, char* argv[] )
 	}
 
 	if( argc == 1 ) // cd만 하면 루트디렉터리로
-		pathTop = 0;
+		g_pathTop = 0;
 	else
 	{
 		// 현재디렉터리면 끝
@@ -221,8 +293,8 @@ int shell_cmd_cd( int argc, char* argv[] )
 			return 0;
 
 		// 부모디렉터리로 가야하면, (pathtop이 0이면 부모없음)
-		else if( strcmp( argv[1], ".." ) == 0 && pathTop > 0 )
-			pathTop--; // (pop)
+		else if( strcmp( argv[1], ".." ) == 0 && g_pathTop > 0 )
+			g_pathTop--; // (pop)
 
 		// 다른 디렉터리 -> lookup -> newEntry에 찾은 엔트리	
 		else
@@ -240,12 +312,12 @@ int shell_cmd_cd( int argc, char* argv[] )
 				return -1;
 			}
 			// path stack에 push
-			path[++pathTop] = newEntry; 
+			path[++g_pathTop] = newEntry; 
 		}
 	}
 
 	// 현재디렉터리 변경
-	g_currentDir = path[pathTop]; 
+	g_currentDir = path[g_pathTop]; 
 
 	return 0;
 }
@@ -253,8 +325,20 @@ int shell_cmd_cd( int argc, char* argv[] )
 
 int shell_cmd_exit( int argc, char* argv[] )
 {
+	// image 파일에는 FAT mirror 등이 남아있지 않도록 umount 후 닫음
+	if( g_isMounted && g_fs.umount )
+		g_fs.umount( &g_disk, &g_fsOprs );
+
 	// 동적 할당받은 disk->pdata (시뮬레이션을 위한 공간)해제
-	disksim_uninit( &g_disk );
+	disk_async_release( &g_disk );
+	if( g_imagePath )
+		diskimg_uninit( &g_disk );
+	else if( g_sparse )
+		disksparse_uninit( &g_disk );
+	else if( g_flash )
+		diskflash_uninit( &g_disk );
+	else
+		disksim_uninit( &g_disk );
 	_exit( 0 );
 
 	return 0;
@@ -280,6 +364,7 @@ int shell_cmd_mount( int argc, char* argv[] )
 	
 	// 마운트 하고나면 현재 디렉터리는 루트디렉터리임
 	g_currentDir = g_rootDir; // 현재디렉터리 = 루트디렉터리
+	g_pathTop = 0;
 
 	if( result < 0 )
 	{
@@ -369,6 +454,232 @@ int shell_cmd_fill( int argc, char* argv[] )
 	return 0;
 }
 
+// 파일의 공간을 미리 예약(없으면 생성), extend를 주면 파일 크기도 변경
+int shell_cmd_fallocate( int argc, char* argv[] )
+{
+	SHELL_ENTRY	entry;
+	int			size;
+	int			extendSize = 0;
+	int			result;
+
+	if( argc < 3 || argc > 4 || ( argc == 4 && strcmp( argv[3], "extend" ) && strcmp( argv[3], "keep" ) ) )
+	{
+		printf( "usage : fallocate [file] [size] [keep|extend]\n" );
+		return 0;
+	}
+
+	if( sscanf( argv[2], "%d", &size ) != 1 || size <= 0 )
+	{
+		printf( "size must be a number greater than 0\n" );
+		return -1;
+	}
+	if( argc == 4 && strcmp( argv[3], "extend" ) == 0 )
+		extendSize = 1;
+
+	if( g_fsOprs.lookup( &g_disk, &g_fsOprs, &g_currentDir, &entry, argv[1] ) )
+	{
+		result = g_fsOprs.fileOprs->create( &g_disk, &g_fsOprs, &g_currentDir, argv[1], &entry );
+		if( result )
+		{
+			printf( "create failed\n" );
+			return -1;
+		}
+	}
+
+	if( g_fsOprs.fileOprs->fallocate == NULL ||
+		g_fsOprs.fileOprs->fallocate( &g_disk, &g_fsOprs, &g_currentDir, &entry, size, extendSize ) )
+	{
+		printf( "cannot allocate space\n" );
+		return -1;
+	}
+
+	return 0;
+}
+
+// 파일 크기를 size로 변경, 줄어든 부분의 cluster는 반환
+int shell_cmd_truncate( int argc, char* argv[] )
+{
+	SHELL_ENTRY	entry;
+	int			size;
+
+	if( argc != 3 )
+	{
+		printf( "usage : truncate [file] [size]\n" );
+		return 0;
+	}
+
+	// 음수는 unsigned long으로 넘어가면 볼륨이 찰 때까지 늘어남
+	if( sscanf( argv[2], "%d", &size ) != 1 || size < 0 )
+	{
+		printf( "size must be a number of 0 or more\n" );
+		return -1;
+	}
+
+	if( g_fsOprs.lookup( &g_disk, &g_fsOprs, &g_currentDir, &entry, argv[1] ) )
+	{
+		printf( "%s lookup failed\n", argv[1] );
+		return -1;
+	}
+
+	if( g_fsOprs.fileOprs->truncate == NULL ||
+		g_fsOprs.fileOprs->truncate( &g_disk, &g_fsOprs, &g_currentDir, &entry, size ) )
+	{
+		printf( "cannot truncate file\n" );
+		return -1;
+	}
+
+	return 0;
+}
+
+// 볼륨 전체 조각 모음
+int shell_cmd_defrag( int argc, char* argv[] )
+{
+	int	result;
+
+	if( g_fsOprs.defrag == NULL )
+	{
+		printf( "defragmentation is not supported\n" );
+		return -1;
+	}
+
+	result = g_fsOprs.defrag( &g_disk, &g_fsOprs, &g_rootDir );
+
+	// 디렉터리가 옮겨졌을 수 있으므로 root에서 다시 시작
+	g_currentDir = g_rootDir;
+	g_pathTop = 0;
+
+	if( result )
+	{
+		printf( "defragmentation failed\n" );
+		return -1;
+	}
+
+	return 0;
+}
+
+// 볼륨 일관성 검사, 인자는 worker thread 수(생략하면 CPU 수)
+int shell_cmd_fsck( int argc, char* argv[] )
+{
+	unsigned int	threads = 0;
+
+	if( g_fsOprs.check == NULL )
+	{
+		printf( "consistency check is not supported\n" );
+		return -1;
+	}
+
+	if( argc > 2 )
+	{
+		printf( "usage : %s [threads]\n", argv[0] );
+		return -1;
+	}
+
+	if( argc == 2 )
+		threads = atoi( argv[1] );
+
+	if( g_fsOprs.check( &g_disk, &g_fsOprs, &g_rootDir, threads ) )
+	{
+		printf( "consistency check failed\n" );
+		return -1;
+	}
+
+	return 0;
+}
+
+// 조각화, 배치 통계 출력
+int shell_cmd_layout( int argc, char* argv[] )
+{
+	if( g_fsOprs.layout == NULL )
+	{
+		printf( "layout statistics are not supported\n" );
+		return -1;
+	}
+
+	if( g_fsOprs.layout( &g_disk, &g_fsOprs, &g_rootDir ) )
+	{
+		printf( "cannot collect layout statistics\n" );
+		return -1;
+	}
+
+	return 0;
+}
+
+// 모아둔 data와 metadata를 모두 디스크에 기록
+int shell_cmd_sync( int argc, char* argv[] )
+{
+	if( g_fsOprs.sync == NULL )
+	{
+		printf( "sync is not supported\n" );
+		return -1;
+	}
+
+	if( g_fsOprs.sync( &g_disk, &g_fsOprs ) )
+	{
+		printf( "sync failed\n" );
+		return -1;
+	}
+
+	return 0;
+}
+
+// flash 디스크의 FTL 통계
+int flash_iostat( int argc, char* argv[] )
+{
+	DISKFLASH_STATS	stats;
+
+	if( argc > 1 && strcmp( argv[1], "reset" ) == 0 )
+	{
+		diskflash_reset_stats( &g_disk );
+		return 0;
+	}
+
+	diskflash_get_stats( &g_disk, &stats );
+
+	printf( "NAND time              : %.3lf ms\n", stats.timeNs / 1000000.0 );
+	printf( "host written           : %llu bytes\n", ( unsigned long long )stats.hostBytesWritten );
+	printf( "pages programmed       : %llu (%llu read-modify-write)\n", ( unsigned long long )stats.pagesProgrammed, ( unsigned long long )stats.partialWrites );
+	if( stats.hostBytesWritten )
+		printf( "write amplification    : %.2lf\n", ( double )stats.pagesProgrammed * g_flash->pageSize / stats.hostBytesWritten );
+	printf( "GC runs                : %llu (%llu pages copied)\n", ( unsigned long long )stats.gcRuns, ( unsigned long long )stats.gcPagesCopied );
+	printf( "erases                 : %llu (per block %u..%u)\n", ( unsigned long long )stats.erases, stats.minEraseCount, stats.maxEraseCount );
+	printf( "discarded pages        : %llu\n", ( unsigned long long )stats.discardedPages );
+	printf( "GC stalls              : %llu (%.3lf ms)\n", ( unsigned long long )stats.stalls, stats.stallNs / 1000000.0 );
+
+	return 0;
+}
+
+// 시간 모델을 켠 메모리 디스크의 virtual time, "iostat reset"은 0부터 다시
+int shell_cmd_iostat( int argc, char* argv[] )
+{
+	DISKSIM_STATS	stats;
+
+	if( g_flash )
+		return flash_iostat( argc, argv );
+
+	if( g_timing == NULL )
+	{
+		printf( "the disk has no timing model (shell [sectors] [bytes per sector] hdd|ssd|emmc|sd)\n" );
+		return -1;
+	}
+
+	if( argc > 1 && strcmp( argv[1], "reset" ) == 0 )
+	{
+		disksim_reset_stats( &g_disk );
+		return 0;
+	}
+
+	disksim_get_stats( &g_disk, &stats );
+
+	printf( "virtual time           : %.3lf ms\n", stats.timeNs / 1000000.0 );
+	printf( "  seek and rotation    : %.3lf ms\n", stats.seekNs / 1000000.0 );
+	printf( "  transfer             : %.3lf ms\n", stats.transferNs / 1000000.0 );
+	printf( "reads                  : %llu (%llu sectors)\n", ( unsigned long long )stats.reads, ( unsigned long long )stats.sectorsRead );
+	printf( "writes                 : %llu (%llu sectors)\n", ( unsigned long long )stats.writes, ( unsigned long long )stats.sectorsWritten );
+	printf( "seeks                  : %llu\n", ( unsigned long long )stats.seeks );
+
+	return 0;
+}
+
 int shell_cmd_rm( int argc, char* argv[] )
 {
 	int i;
@@ -424,11 +735,18 @@ int shell_cmd_ls( int argc, char* argv[] )
 // 포맷
 int shell_cmd_format( int argc, char* argv[] )
 {
-	int		result;
+	int		result, i;
 	char*	param = NULL;
+	char	buffer[256] = { 0, };
 
-	if( argc >= 2 )
-		param = argv[1];
+	// format [FAT12|FAT16|FAT32] [quick] [journal] : 나머지 인자를 공백으로 이어서 넘김
+	for( i = 1; i < argc && strlen( buffer ) + strlen( argv[i] ) + 2 < sizeof( buffer ); i++ )
+	{
+		if( i > 1 )
+			strcat( buffer, " " );
+		strcat( buffer, argv[i] );
+		param = buffer;
+	}
 
 	// DISK_OPERATIONS 구조체와 입력받은 파라미터(타입)을 넘겨줌
 	result = g_fs.format( &g_disk, param );
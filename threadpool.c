@@ -0,0 +1,142 @@
+/******************************************************************************/
+/*                                                                            */
+/* Project : FAT12/16 File System                                             */
+/* File    : threadpool.c                                                     */
+/* Author  : Kyoungmoon Sun(msg2me@msn.com)                                   */
+/* Company : Dankook Univ. Embedded System Lab.                               */
+/* Notes   : Worker thread pool                                               */
+/* Date    : 2008/7/2                                                         */
+/*                                                                            */
+/******************************************************************************/
+
+#include <unistd.h>
+#include "threadpool.h"
+
+UINT32 thread_pool_cpu_count( void )
+{
+	long	count = sysconf( _SC_NPROCESSORS_ONLN );
+
+	return ( count > 0 ? ( UINT32 )count : 1 );
+}
+
+void* thread_pool_worker( void* param )
+{
+	THREAD_POOL*		pool = ( THREAD_POOL* )param;
+	THREAD_POOL_TASK*	task;
+
+	pthread_mutex_lock( &pool->lock );
+	for( ;; )
+	{
+		while( pool->first == NULL && !pool->stop )
+			pthread_cond_wait( &pool->queued, &pool->lock );
+
+		if( pool->first == NULL )
+			break;
+
+		task = pool->first;
+		pool->first = task->next;
+		if( pool->first == NULL )
+			pool->last = NULL;
+
+		pthread_mutex_unlock( &pool->lock );
+		task->job( task->param );
+		free( task );
+		pthread_mutex_lock( &pool->lock );
+
+		if( --pool->pending == 0 )
+			pthread_cond_broadcast( &pool->idle );
+	}
+	pthread_mutex_unlock( &pool->lock );
+
+	return NULL;
+}
+
+/* threads == 0 starts one worker per online CPU */
+int thread_pool_init( THREAD_POOL* pool, UINT32 threads )
+{
+	UINT32	i;
+
+	ZeroMemory( pool, sizeof( THREAD_POOL ) );
+
+	if( threads == 0 )
+		threads = thread_pool_cpu_count( );
+
+	pool->threads = ( pthread_t* )malloc( threads * sizeof( pthread_t ) );
+	if( pool->threads == NULL )
+		return FAT_ERROR;
+
+	pthread_mutex_init( &pool->lock, NULL );
+	pthread_cond_init( &pool->queued, NULL );
+	pthread_cond_init( &pool->idle, NULL );
+
+	for( i = 0; i < threads; i++ )
+	{
+		if( pthread_create( &pool->threads[i], NULL, thread_pool_worker, pool ) )
+			break;
+		pool->threadCount++;
+	}
+
+	if( pool->threadCount == 0 )
+	{
+		thread_pool_release( pool );
+		return FAT_ERROR;
+	}
+
+	return FAT_SUCCESS;
+}
+
+int thread_pool_submit( THREAD_POOL* pool, THREAD_POOL_JOB job, void* param )
+{
+	THREAD_POOL_TASK*	task;
+
+	task = ( THREAD_POOL_TASK* )malloc( sizeof( THREAD_POOL_TASK ) );
+	if( task == NULL )
+		return FAT_ERROR;
+
+	task->job	= job;
+	task->param	= param;
+	task->next	= NULL;
+
+	pthread_mutex_lock( &pool->lock );
+	if( pool->last )
+		pool->last->next = task;
+	else
+		pool->first = task;
+	pool->last = task;
+	pool->pending++;
+	pthread_cond_signal( &pool->queued );
+	pthread_mutex_unlock( &pool->lock );
+
+	return FAT_SUCCESS;
+}
+
+/* returns when every submitted task, including tasks submitted by tasks, has run */
+void thread_pool_wait( THREAD_POOL* pool )
+{
+	pthread_mutex_lock( &pool->lock );
+	while( pool->pending )
+		pthread_cond_wait( &pool->idle, &pool->lock );
+	pthread_mutex_unlock( &pool->lock );
+}
+
+/* queued tasks are finished before the workers exit */
+void thread_pool_release( THREAD_POOL* pool )
+{
+	UINT32	i;
+
+	pthread_mutex_lock( &pool->lock );
+	pool->stop = 1;
+	pthread_cond_broadcast( &pool->queued );
+	pthread_mutex_unlock( &pool->lock );
+
+	for( i = 0; i < pool->threadCount; i++ )
+		pthread_join( pool->threads[i], NULL );
+
+	pthread_cond_destroy( &pool->idle );
+	pthread_cond_destroy( &pool->queued );
+	pthread_mutex_destroy( &pool->lock );
+	free( pool->threads );
+
+	pool->threads		= NULL;
+	pool->threadCount	= 0;
+}
@@ -0,0 +1,48 @@
+/******************************************************************************/
+/*                                                                            */
+/* Project : FAT12/16 File System                                             */
+/* File    : threadpool.h                                                     */
+/* Author  : Kyoungmoon Sun(msg2me@msn.com)                                   */
+/* Company : Dankook Univ. Embedded System Lab.                               */
+/* Notes   : Worker thread pool header                                        */
+/* Date    : 2008/7/2                                                         */
+/*                                                                            */
+/******************************************************************************/
+
+#ifndef _THREADPOOL_H_
+#define _THREADPOOL_H_
+
+#include <pthread.h>
+#include "common.h"
+
+typedef void ( *THREAD_POOL_JOB )( void* param );
+
+typedef struct THREAD_POOL_TASK
+{
+	THREAD_POOL_JOB				job;
+	void*						param;
+	struct THREAD_POOL_TASK*	next;
+} THREAD_POOL_TASK;
+
+// THREAD_POOL
+// FIFO 작업 큐를 worker thread들이 나누어 처리, 작업 안에서 새 작업을 넣을 수 있음
+typedef struct
+{
+	pthread_mutex_t		lock;
+	pthread_cond_t		queued;		// 작업이 들어왔거나 종료 요청
+	pthread_cond_t		idle;		// 남은 작업이 0이 됨
+	THREAD_POOL_TASK*	first;
+	THREAD_POOL_TASK*	last;
+	UINT32				pending;	// 큐에 있거나 실행 중인 작업 수
+	UINT32				threadCount;
+	pthread_t*			threads;
+	int					stop;
+} THREAD_POOL;
+
+UINT32 thread_pool_cpu_count( void );
+int thread_pool_init( THREAD_POOL* pool, UINT32 threads );
+int thread_pool_submit( THREAD_POOL* pool, THREAD_POOL_JOB job, void* param );
+void thread_pool_wait( THREAD_POOL* pool );
+void thread_pool_release( THREAD_POOL* pool );
+
+#endif